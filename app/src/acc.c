@@ -3,126 +3,261 @@
  */
 
 #include <zephyr/devicetree.h>
-#include <zephyr/drivers/gpio.h>
-#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/rtio/rtio.h>
 
+#include "bruxism.h"
+#include "motion.h"
+#include "power_budget.h"
+#include "profiling.h"
+#include "sample_clock.h"
 #include "tgm_service.h"
 #include "acc.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(acc, CONFIG_APP_LOG_LEVEL);
 
-static struct gpio_callback acc_int_cb;
-static struct k_work read_acc_data_work;
+PROFILING_STAT_DEFINE(acc_read_stat, "acc read");
+PROFILING_STAT_DEFINE(acc_notify_stat, "acc notify");
+PROFILING_STAT_DEFINE(acc_latency_stat, "acc latency");
 
 #if CONFIG_LIS2DTW12
 #include <app/drivers/lis2dtw12.h>
 
 #define LIS2DTW12_NODE DT_NODELABEL(lis2dtw12)
-static struct gpio_dt_spec acc_int = GPIO_DT_SPEC_GET(LIS2DTW12_NODE, int_gpios);
+static const struct device *const acc_dev = DEVICE_DT_GET(LIS2DTW12_NODE);
 
-static struct i2c_dt_spec i2c = I2C_DT_SPEC_GET(LIS2DTW12_NODE);
+// Largest buffer the driver requests for one frame
+#define ACC_BUF_SIZE (sizeof(struct lis2dtw12_encoded_data) + LIS2DTW12_FIFO_DEPTH * LIS2DTW12_SAMPLE_SIZE)
+#define ACC_BUF_BLOCK_SIZE 32
 #else
 // Give a build error
 #error "No valid accelerometer sensor driver enabled"
 #endif
 
-/**
- * @brief Callback function for the accelerometer sensor interrupt
- *
- * @param dev Pointer to the gpio port that triggered the callback
- * @param cb Pointer to the callback data that was used to set up the callback
- * @param pins Bitmask of pins that triggered the callback
- * @return int
- */
-static void acc_int_handler(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
+// Stream a frame on every FIFO threshold interrupt
+SENSOR_DT_STREAM_IODEV(acc_stream, LIS2DTW12_NODE, {SENSOR_TRIG_FIFO_WATERMARK, SENSOR_STREAM_DATA_INCLUDE});
+
+// Room for three frames, so the driver can fill one while the previous ones are decoded and sent
+RTIO_DEFINE_WITH_MEMPOOL(acc_rtio, 4, 4, 3 * DIV_ROUND_UP(ACC_BUF_SIZE, ACC_BUF_BLOCK_SIZE), ACC_BUF_BLOCK_SIZE,
+                         sizeof(void *));
+
+static rtio_sqe_handle_t acc_stream_handle;
+
+#if defined(CONFIG_APP_BRUXISM)
+// Episodes that wait for a client, the oldest is dropped when it is full
+#define ACC_BRUXISM_QUEUE_SIZE 8
+
+static atomic_t acc_bruxism_reset = ATOMIC_INIT(true);
+static struct bruxism_detector acc_bruxism;
+static struct tgm_service_bruxism_data_t acc_bruxism_queue[ACC_BRUXISM_QUEUE_SIZE];
+// Oldest queued episode and number of queued episodes
+static uint8_t acc_bruxism_tail;
+static uint8_t acc_bruxism_count;
+
+static void acc_bruxism_queue_episode(const struct bruxism_episode *episode)
 {
-    if (pins & BIT(acc_int.pin))
+    struct tgm_service_bruxism_data_t data = {
+        .start_ms = episode->start_ms,
+        .duration = (uint16_t)MIN(episode->duration_ms / 100, UINT16_MAX),
+        .intensity = episode->intensity,
+        .peak = episode->peak,
+        .type = episode->type,
+        .bursts = episode->bursts,
+        .rhythm = episode->rhythm,
+    };
+
+#if defined(CONFIG_APP_BRUXISM_HR)
+    if (bruxism_hr_delta(episode, &data.hr_delta) == 0)
     {
-        // Read the accelerometer data outside of the ISR
-        k_work_submit(&read_acc_data_work);
+        data.flags |= TGM_SERVICE_BRUXISM_HR_KNOWN;
+        if (data.hr_delta >= CONFIG_APP_BRUXISM_HR_RISE)
+        {
+            data.flags |= TGM_SERVICE_BRUXISM_HR_RISE;
+        }
     }
+#endif
 
-    return;
+    LOG_INF("Bruxism episode: %s, %u.%u s, %u bursts at %u.%u Hz, %u mg, HR %+d bpm%s",
+            bruxism_type_name(data.type), data.duration / 10, data.duration % 10, data.bursts, data.rhythm / 10,
+            data.rhythm % 10, data.intensity, data.hr_delta,
+            (data.flags & TGM_SERVICE_BRUXISM_HR_KNOWN) ? "" : " (unknown)");
+
+    if (acc_bruxism_count == ACC_BRUXISM_QUEUE_SIZE)
+    {
+        LOG_WRN("Bruxism episode queue full, dropping the oldest");
+        acc_bruxism_tail = (acc_bruxism_tail + 1) % ACC_BRUXISM_QUEUE_SIZE;
+        acc_bruxism_count--;
+    }
+    acc_bruxism_queue[(acc_bruxism_tail + acc_bruxism_count) % ACC_BRUXISM_QUEUE_SIZE] = data;
+    acc_bruxism_count++;
 }
 
-static void acc_read_data(struct k_work *work)
+static void acc_bruxism_update(const struct acc_sample *samples, uint8_t count, uint64_t timestamp, uint32_t period_ns)
 {
-    struct acc_sample acc_data[CONFIG_ACC_SAMPLES_PER_FRAME];
-    uint8_t sample_count;
+    struct bruxism_episode episode;
 
-    // Get the accelerometer data
-    int err = acc_sensor_get_data(&i2c, acc_data, &sample_count);
-    if (err)
+    if (atomic_clear(&acc_bruxism_reset))
+    {
+        bruxism_init(&acc_bruxism, period_ns);
+    }
+
+    if (bruxism_process(&acc_bruxism, samples, count, timestamp, &episode))
+    {
+        acc_bruxism_queue_episode(&episode);
+    }
+
+    // Queued episodes go out as soon as a client listens
+    while (acc_bruxism_count > 0)
+    {
+        int err = tgm_service_send_bruxism_notify(&acc_bruxism_queue[acc_bruxism_tail]);
+        if (err)
+        {
+            if (err != -EACCES)
+            {
+                LOG_DBG("Failed to send bruxism notification");
+            }
+            break;
+        }
+        acc_bruxism_tail = (acc_bruxism_tail + 1) % ACC_BRUXISM_QUEUE_SIZE;
+        acc_bruxism_count--;
+    }
+}
+#endif /* CONFIG_APP_BRUXISM */
+
+static uint8_t acc_fill(struct acc_sample *acc_data, uint8_t max_samples, void *user_data)
+{
+    // Decode the accelerometer data straight into the notification
+    uint64_t start = profiling_start();
+    uint8_t sample_count = lis2dtw12_decode_encoded(user_data, acc_data, max_samples);
+    profiling_stop(&acc_read_stat, start);
+
+    return sample_count;
+}
+
+// Set by acc_start(), only used by the stream thread otherwise
+static atomic_t acc_clock_reset = ATOMIC_INIT(true);
+static struct sample_clock acc_clock;
+
+static void acc_process(int result, uint8_t *buf, uint32_t buf_len, void *userdata)
+{
+    const struct lis2dtw12_encoded_data *edata = (const struct lis2dtw12_encoded_data *)buf;
+
+    if (result < 0)
     {
         LOG_ERR("Failed to read accelerometer data");
         return;
     }
 
+    profiling_record(&acc_latency_stat, (uint32_t)(k_ticks_to_ns_floor64(k_uptime_ticks()) - edata->timestamp));
+    power_budget_record(POWER_BUDGET_ACC_FIFO, edata->sample_count * LIS2DTW12_SAMPLE_SIZE);
+
+    // Times of the samples on the device clock, corrected for the drift of the accelerometer oscillator
+    struct sample_clock_frame time;
+    if (atomic_clear(&acc_clock_reset))
+    {
+        sample_clock_reset(&acc_clock, edata->period_ns);
+    }
+    if (sample_clock_update(&acc_clock, edata->sample_count, edata->timestamp, &time))
+    {
+        LOG_INF("acc sample clock locked: %u ns per sample, %d ppm", time.period_ns, sample_clock_ppm(&acc_clock));
+    }
+
+#if defined(CONFIG_APP_MOTION_CANCEL) || defined(CONFIG_APP_BRUXISM)
+    // Decoded once for everything that runs on the device
+    struct acc_sample samples[CONFIG_ACC_SAMPLES_PER_FRAME];
+    uint8_t count = lis2dtw12_decode_encoded(buf, samples, ARRAY_SIZE(samples));
+#endif
+
+#if defined(CONFIG_APP_MOTION_CANCEL)
+    // Reference for the PPG stream, which resamples it at the times of its own samples
+    motion_reference_put(samples, count, time.last_ns, time.period_ns);
+#endif
+
+#if defined(CONFIG_APP_BRUXISM)
+    acc_bruxism_update(samples, count, time.last_ns, time.period_ns);
+#endif
+
     // Notify the client of the accelerometer data
-    err = tgm_service_send_acc_notify(acc_data, sample_count);
+    uint64_t start = profiling_start();
+    int err = tgm_service_send_acc_notify(acc_fill, buf, time.time_ns, time.period_ns);
+    profiling_stop(&acc_notify_stat, start);
     if (err)
     {
         LOG_DBG("Failed to send accelerometer data notification");
-        return;
     }
-
-    return;
 }
 
-int acc_init(void)
+static void acc_stream_thread(void *p1, void *p2, void *p3)
 {
-    int err;
-
-    // Initialize the I2C bus
-    if (!i2c_is_ready_dt(&i2c))
+    while (true)
     {
-        LOG_ERR("I2C device not ready during initialization of accelerometer sensor");
-        return -ENODEV;
+        // Blocks until the driver completes a frame, the buffer is released after the callback
+        sensor_processing_with_callback(&acc_rtio, acc_process);
     }
+}
+
+K_THREAD_DEFINE(acc_stream_tid, CONFIG_APP_SENSOR_THREAD_STACK_SIZE, acc_stream_thread, NULL, NULL, NULL,
+                CONFIG_APP_SENSOR_THREAD_PRIORITY, 0, 0);
 
-    // Initialize the GPIO port
-    if (!gpio_is_ready_dt(&acc_int))
+int acc_init(void)
+{
+    if (!device_is_ready(acc_dev))
     {
-        LOG_ERR("GPIO device not ready during initialization of accelerometer sensor");
+        LOG_ERR("Accelerometer sensor not ready");
         return -ENODEV;
     }
 
-    // Intialize the int pin as input
-    err = gpio_pin_configure_dt(&acc_int, GPIO_INPUT);
+    // The stream stays queued in the driver, starting and stopping the sensor only gates the interrupts
+    int err = sensor_stream(&acc_stream, &acc_rtio, NULL, &acc_stream_handle);
     if (err)
     {
-        LOG_ERR("Failed to configure accelerometer sensor int pin as input");
+        LOG_ERR("Failed to start accelerometer stream");
         return err;
     }
 
-    // Initialize the interrupt callback
-    gpio_init_callback(&acc_int_cb, acc_int_handler, BIT(acc_int.pin));
-    err = gpio_add_callback(acc_int.port, &acc_int_cb);
+    return 0;
+}
+
+int acc_configure(uint32_t rate_mhz, uint8_t power_mode, uint8_t frame_samples)
+{
+    const struct sensor_value rate = {.val1 = rate_mhz / 1000, .val2 = (rate_mhz % 1000) * 1000};
+    const struct sensor_value mode = {.val1 = power_mode};
+    const struct sensor_value frame = {.val1 = frame_samples};
+
+    // Taken by the next start
+    int err = sensor_attr_set(acc_dev, SENSOR_CHAN_ACCEL_XYZ, SENSOR_ATTR_SAMPLING_FREQUENCY, &rate);
+    err = err ? err
+              : sensor_attr_set(acc_dev, SENSOR_CHAN_ACCEL_XYZ, (enum sensor_attribute)LIS2DTW12_ATTR_POWER_MODE, &mode);
+    err = err ? err
+              : sensor_attr_set(acc_dev, SENSOR_CHAN_ACCEL_XYZ, (enum sensor_attribute)LIS2DTW12_ATTR_FRAME_SAMPLES,
+                                &frame);
     if (err)
     {
-        LOG_ERR("Failed to add callback to accelerometer sensor int pin");
+        LOG_ERR("Failed to configure accelerometer for %u mHz, power mode %u, %u samples per frame", rate_mhz,
+                power_mode, frame_samples);
         return err;
     }
 
-    // Initialize the work item
-    k_work_init(&read_acc_data_work, acc_read_data);
-
     return 0;
 }
 
 int acc_start(void)
 {
-    // Enable the interrupt
-    int err = gpio_pin_interrupt_configure_dt(&acc_int, GPIO_INT_EDGE_TO_ACTIVE);
-    if (err)
-    {
-        LOG_ERR("Failed to configure accelerometer sensor int pin interrupt");
-        return err;
-    }
+    // The sample numbering starts again, and the rate may have changed
+    atomic_set(&acc_clock_reset, true);
+
+#if defined(CONFIG_APP_MOTION_CANCEL)
+    // Samples from before the stop would be interpolated across the gap
+    motion_reference_reset();
+#endif
+#if defined(CONFIG_APP_BRUXISM)
+    // The rate may have changed, and an episode does not span a stop
+    atomic_set(&acc_bruxism_reset, true);
+#endif
 
     // Start the accelerometer sensor
-    err = acc_sensor_start(&i2c);
+    int err = acc_sensor_start(acc_dev);
     if (err)
     {
         LOG_ERR("Failed to start accelerometer sensor");
@@ -135,20 +270,60 @@ int acc_start(void)
 int acc_stop(void)
 {
     // Stop the accelerometer sensor
-    int err = acc_sensor_stop(&i2c);
+    int err = acc_sensor_stop(acc_dev);
     if (err)
     {
         LOG_ERR("Failed to stop accelerometer sensor");
         return err;
     }
 
-    // Disable the interrupt
-    err = gpio_pin_interrupt_configure_dt(&acc_int, GPIO_INT_DISABLE);
-    if (err)
+    return 0;
+}
+
+#if defined(CONFIG_APP_BRUXISM_SCENARIO)
+#include <zephyr/drivers/emul.h>
+#include <zephyr/init.h>
+
+#include <app/drivers/lis2dtw12_emul.h>
+
+// Jaw movement of 0.1g at 6Hz
+#define ACC_SCENARIO_AMPLITUDE 1638
+#define ACC_SCENARIO_HZ 6
+
+// Four short bursts of grinding and one long clench, over while the power budget scenario has the device worn
+static const struct emul *const scenario_acc = EMUL_DT_GET(LIS2DTW12_NODE);
+static const struct
+{
+    // Time since the previous step
+    uint16_t delay_ms;
+    bool vibrate;
+} scenario_steps[] = {
+    {5000, true}, {1000, false}, {1000, true}, {1000, false}, {1000, true},
+    {1000, false}, {1000, true}, {1000, false}, {5000, true}, {3000, false},
+};
+
+static struct k_work_delayable scenario_work;
+static uint8_t scenario_step;
+
+static void scenario_work_handler(struct k_work *work)
+{
+    lis2dtw12_emul_set_vibration(scenario_acc, scenario_steps[scenario_step].vibrate ? ACC_SCENARIO_AMPLITUDE : 0,
+                                 ACC_SCENARIO_HZ);
+
+    scenario_step++;
+    if (scenario_step < ARRAY_SIZE(scenario_steps))
     {
-        LOG_ERR("Failed to disable accelerometer sensor int pin interrupt");
-        return err;
+        k_work_reschedule(&scenario_work, K_MSEC(scenario_steps[scenario_step].delay_ms));
     }
+}
+
+static int scenario_init(void)
+{
+    k_work_init_delayable(&scenario_work, scenario_work_handler);
+    k_work_reschedule(&scenario_work, K_MSEC(scenario_steps[0].delay_ms));
 
     return 0;
 }
+
+SYS_INIT(scenario_init, APPLICATION, 0);
+#endif /* CONFIG_APP_BRUXISM_SCENARIO */
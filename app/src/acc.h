@@ -15,7 +15,17 @@
 int acc_init(void);
 
 /**
- * @brief Start the accelerometer sensor with default configuration
+ * @brief Set the output data rate, power mode and frame size, applied by the next start
+ *
+ * @param[in] rate_mhz Output data rate in mHz, 12.5Hz up to 1600Hz in powers of two
+ * @param[in] power_mode One of lis2dtw12_power_mode, the low power modes run at 200Hz at most
+ * @param[in] frame_samples Samples per FIFO frame, up to CONFIG_ACC_SAMPLES_PER_FRAME
+ * @return int 0 on success, negative error code on failure
+ */
+int acc_configure(uint32_t rate_mhz, uint8_t power_mode, uint8_t frame_samples);
+
+/**
+ * @brief Start the accelerometer sensor with the configuration set by acc_configure()
  *
  * @return int 0 on success, negative error code on failure
  */
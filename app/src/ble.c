@@ -20,6 +20,63 @@ static const struct bt_data ad[] = {
 static const struct bt_data sd[] = {}; // Can hold data for a scan response if applicable
 
 static struct k_work adv_work;
+static struct k_work_delayable conn_policy_work;
+
+// Connection that the policy is applied to, only one connection is supported
+static struct bt_conn *current_conn;
+static bool streaming;
+static bool bulk_transfer;
+
+// Delay before the first update after connecting, gives the central time to finish its service discovery
+#define CONN_POLICY_CONNECT_DELAY K_SECONDS(2)
+// CCC writes come in bursts when a client subscribes to several characteristics, only apply the final state
+#define CONN_POLICY_DEBOUNCE K_MSEC(200)
+
+// Interval min and max in 1.25 ms units, peripheral latency and supervision timeout in 10 ms units of every policy
+#define STREAMING_CONN_PARAM 12, 24, 0, 400 // 15-30 ms, no latency, 4 s timeout
+#define BULK_CONN_PARAM 6, 12, 0, 400       // 7.5-15 ms, no latency, 4 s timeout
+#define IDLE_CONN_PARAM 400, 480, 4, 800    // 500-600 ms, 4 events latency, 8 s timeout
+
+#define CONN_PARAM_INIT(...) BT_LE_CONN_PARAM_INIT(__VA_ARGS__)
+
+// The central rejects a supervision timeout that is not longer than (1 + latency) * interval max * 2, in units of
+// 10 ms and 1.25 ms that is timeout * 4 > (1 + latency) * interval max
+#define CONN_PARAM_TIMEOUT_VALID(...) CONN_PARAM_TIMEOUT_VALID_(__VA_ARGS__)
+#define CONN_PARAM_TIMEOUT_VALID_(interval_min, interval_max, latency, timeout) \
+    ((timeout) * 4 > (1 + (latency)) * (interval_max))
+
+BUILD_ASSERT(CONN_PARAM_TIMEOUT_VALID(STREAMING_CONN_PARAM), "Streaming supervision timeout too short");
+BUILD_ASSERT(CONN_PARAM_TIMEOUT_VALID(BULK_CONN_PARAM), "Bulk transfer supervision timeout too short");
+BUILD_ASSERT(CONN_PARAM_TIMEOUT_VALID(IDLE_CONN_PARAM), "Idle supervision timeout too short");
+
+/** @brief Connection parameters and PHY for one traffic level. */
+struct conn_policy_t
+{
+    const char *name;
+    struct bt_le_conn_param param;
+    struct bt_conn_le_phy_param phy;
+};
+
+// Raw sensor streams: short interval so every FIFO frame goes out right away, 2M PHY for short radio events
+static const struct conn_policy_t streaming_policy = {
+    .name = "streaming",
+    .param = CONN_PARAM_INIT(STREAMING_CONN_PARAM),
+    .phy = {.options = BT_CONN_LE_PHY_OPT_NONE, .pref_tx_phy = BT_GAP_LE_PHY_2M, .pref_rx_phy = BT_GAP_LE_PHY_2M},
+};
+
+// Flash log offload: the shortest interval and the 2M PHY, the transfer ends sooner than any saving of a longer one
+static const struct conn_policy_t bulk_policy = {
+    .name = "bulk transfer",
+    .param = CONN_PARAM_INIT(BULK_CONN_PARAM),
+    .phy = {.options = BT_CONN_LE_PHY_OPT_NONE, .pref_tx_phy = BT_GAP_LE_PHY_2M, .pref_rx_phy = BT_GAP_LE_PHY_2M},
+};
+
+// Only battery and temperature: long interval, and the peripheral may skip events while it has nothing to send
+static const struct conn_policy_t idle_policy = {
+    .name = "idle",
+    .param = CONN_PARAM_INIT(IDLE_CONN_PARAM),
+    .phy = {.options = BT_CONN_LE_PHY_OPT_NONE, .pref_tx_phy = BT_GAP_LE_PHY_1M, .pref_rx_phy = BT_GAP_LE_PHY_1M},
+};
 
 void mtu_exchange_cb(
     struct bt_conn *conn, uint8_t att_err,
@@ -63,10 +120,51 @@ static void request_data_len_update(struct bt_conn *conn)
         return;
     }
 
-    LOG_INF("Data length updated to %d", CONFIG_BT_CTLR_DATA_LENGTH_MAX);
+    LOG_INF("Data length updated to %d", BT_GAP_DATA_LEN_MAX);
     request_mtu_exchange(conn);
 }
 
+static void conn_policy_process(struct k_work *work)
+{
+    const struct conn_policy_t *policy = bulk_transfer ? &bulk_policy : streaming ? &streaming_policy : &idle_policy;
+    int err;
+
+    if (!current_conn)
+    {
+        return;
+    }
+
+    LOG_INF("Requesting %s connection parameters", policy->name);
+
+    err = bt_conn_le_param_update(current_conn, &policy->param);
+    if (err && err != -EALREADY)
+    {
+        LOG_ERR("Connection parameter update request failed: %d", err);
+    }
+
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+    struct bt_conn_info info;
+
+    err = bt_conn_get_info(current_conn, &info);
+    if (err)
+    {
+        LOG_ERR("bt_conn_get_info() returned %d", err);
+        return;
+    }
+
+    if (info.le.phy->tx_phy == policy->phy.pref_tx_phy && info.le.phy->rx_phy == policy->phy.pref_rx_phy)
+    {
+        return;
+    }
+
+    err = bt_conn_le_phy_update(current_conn, &policy->phy);
+    if (err)
+    {
+        LOG_ERR("PHY update request failed: %d", err);
+    }
+#endif
+}
+
 void on_connected(struct bt_conn *conn, uint8_t err)
 {
     if (err)
@@ -92,12 +190,23 @@ void on_connected(struct bt_conn *conn, uint8_t err)
     LOG_INF("Connection parameters: interval %.2f ms, latency %d intervals, timeout %d ms", connection_interval, info.le.interval, supervision_timeout);
 
     request_data_len_update(conn);
+
+    current_conn = bt_conn_ref(conn);
+    k_work_reschedule(&conn_policy_work, CONN_POLICY_CONNECT_DELAY);
 }
 
 void on_disconnected(struct bt_conn *conn, uint8_t reason)
 {
     LOG_INF("Disconnected, reason %d", reason);
 
+    k_work_cancel_delayable(&conn_policy_work);
+    bulk_transfer = false;
+    if (current_conn)
+    {
+        bt_conn_unref(current_conn);
+        current_conn = NULL;
+    }
+
     // Restart advertising
     k_work_submit(&adv_work);
 }
@@ -109,10 +218,20 @@ void on_le_param_updated(struct bt_conn *conn, uint16_t interval, uint16_t laten
     LOG_INF("Connection parameters updated: interval %.2f ms, latency %d intervals, timeout %d ms", connection_interval, latency, supervision_timeout);
 }
 
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+void on_le_phy_updated(struct bt_conn *conn, struct bt_conn_le_phy_info *param)
+{
+    LOG_INF("PHY updated: tx %d, rx %d", param->tx_phy, param->rx_phy);
+}
+#endif
+
 struct bt_conn_cb connection_callbacks = {
     .connected = on_connected,
     .disconnected = on_disconnected,
     .le_param_updated = on_le_param_updated,
+#if defined(CONFIG_BT_USER_PHY_UPDATE)
+    .le_phy_updated = on_le_phy_updated,
+#endif
 };
 
 static void advertising_process(struct k_work *work)
@@ -153,6 +272,7 @@ int ble_init(void)
 
     // Initialize advertising work
     k_work_init(&adv_work, advertising_process);
+    k_work_init_delayable(&conn_policy_work, conn_policy_process);
 
     int err = bt_enable(NULL);
     if (err)
@@ -176,4 +296,37 @@ int ble_adv_start(void)
 {
     k_work_submit(&adv_work);
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Adapt the connection to the sensor data streams
+ *
+ * Requests a short connection interval and the 2M PHY while sensor data is streamed, and a long interval with
+ * peripheral latency on the 1M PHY otherwise. Can be called from any context.
+ *
+ * @param[in] streaming_new true when the client is subscribed to a raw sensor stream and the sensors are streaming
+ */
+void ble_set_streaming(bool streaming_new)
+{
+    streaming = streaming_new;
+    k_work_reschedule(&conn_policy_work, CONN_POLICY_DEBOUNCE);
+}
+
+/**
+ * @brief Adapt the connection to a bulk transfer
+ *
+ * Requests the shortest connection interval and the 2M PHY while the flash log is offloaded, on top of the policy of
+ * the sensor streams. Ends with the connection. Can be called from any context.
+ *
+ * @param[in] active true while a transfer runs
+ */
+void ble_set_bulk_transfer(bool active)
+{
+    if (bulk_transfer == active)
+    {
+        return;
+    }
+
+    bulk_transfer = active;
+    k_work_reschedule(&conn_policy_work, K_NO_WAIT);
+}
@@ -11,11 +11,15 @@
  * @brief API for interacting with the BLE functionality
  */
 
+#include <stdbool.h>
+
 #define DEVICE_NAME CONFIG_BT_DEVICE_NAME
 #define DEVICE_NAME_LEN (sizeof(DEVICE_NAME) - 1)
 
 int ble_init(void);
 int ble_adv_start(void);
+void ble_set_streaming(bool streaming);
+void ble_set_bulk_transfer(bool active);
 
 /**
  * @}
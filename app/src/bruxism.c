@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include "bruxism.h"
+
+// 1 g in accelerometer counts
+#define BRUXISM_COUNTS_PER_G 16384
+// Burst threshold in accelerometer counts
+#define BRUXISM_THRESHOLD (CONFIG_APP_BRUXISM_THRESHOLD_MG * BRUXISM_COUNTS_PER_G / 1000)
+#define BRUXISM_ON_POWER ((int64_t)BRUXISM_THRESHOLD * BRUXISM_THRESHOLD)
+#define BRUXISM_OFF_POWER (BRUXISM_ON_POWER / 2)
+#define BRUXISM_DEAD_BAND (BRUXISM_THRESHOLD / 4)
+
+void bruxism_init(struct bruxism_detector *det, uint32_t period_ns)
+{
+    uint32_t rate_hz = NSEC_PER_SEC / MAX(period_ns, 1);
+    uint8_t log2_rate = find_msb_set(MAX(rate_hz, 1)) - 1;
+
+    memset(det, 0, sizeof(*det));
+    det->period_ns = MAX(period_ns, 1);
+    // First order high-pass of about 0.5Hz
+    det->hp_shift = MAX(log2_rate, 2) - 1;
+    // First order low-pass of about 10Hz, a pass-through up to 100Hz
+    det->lp_shift = MAX(log2_rate, 6) - 6;
+    // Envelope over about 160ms
+    det->env_shift = MAX(log2_rate, 3) - 2;
+}
+
+static uint16_t bruxism_mg(float counts)
+{
+    return (uint16_t)MIN(lroundf(counts * 1000 / BRUXISM_COUNTS_PER_G), UINT16_MAX);
+}
+
+// Returns the power of the band-limited sample, in counts squared
+static int64_t bruxism_filter(struct bruxism_detector *det, const struct acc_sample *sample)
+{
+    const int16_t values[3] = {sample->x, sample->y, sample->z};
+    int64_t power = 0;
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        struct bruxism_axis *axis = &det->axis[i];
+        int32_t a = (int32_t)values[i] << 8;
+
+        if (det->count == 0)
+        {
+            axis->hp = a;
+        }
+        axis->hp += (a - axis->hp) >> det->hp_shift;
+        axis->lp += ((a - axis->hp) - axis->lp) >> det->lp_shift;
+
+        int32_t band = axis->lp >> 8;
+        int8_t side = (band > BRUXISM_DEAD_BAND) ? 1 : (band < -BRUXISM_DEAD_BAND) ? -1 : axis->side;
+
+        if (side != axis->side && axis->side != 0 && axis->crossings < UINT16_MAX)
+        {
+            axis->crossings++;
+        }
+        axis->side = side;
+
+        if (det->in_burst)
+        {
+            axis->energy += (int64_t)band * band;
+        }
+        power += (int64_t)band * band;
+    }
+
+    return power;
+}
+
+static void bruxism_burst_start(struct bruxism_detector *det, uint32_t now_ms)
+{
+    det->in_burst = true;
+    det->burst_start_ms = now_ms;
+    det->burst_samples = 0;
+    det->burst_peak = 0;
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        det->axis[i].crossings = 0;
+        det->axis[i].energy = 0;
+    }
+}
+
+static void bruxism_burst_end(struct bruxism_detector *det, uint32_t now_ms)
+{
+    uint32_t duration_ms = now_ms - det->burst_start_ms;
+    const struct bruxism_axis *strongest = &det->axis[0];
+    int64_t energy = 0;
+
+    det->in_burst = false;
+
+    if (duration_ms < BRUXISM_MIN_BURST_MS || det->bursts == UINT8_MAX)
+    {
+        return;
+    }
+
+    for (uint8_t i = 0; i < 3; i++)
+    {
+        energy += det->axis[i].energy;
+        if (det->axis[i].energy > strongest->energy)
+        {
+            strongest = &det->axis[i];
+        }
+    }
+
+    // Two crossings per period, in 0.1Hz
+    uint32_t rhythm = (uint32_t)strongest->crossings * 5000 / duration_ms;
+    if (rhythm < BRUXISM_MIN_RHYTHM || rhythm > BRUXISM_MAX_RHYTHM)
+    {
+        return;
+    }
+
+    if (det->bursts == 0)
+    {
+        det->start_ms = det->burst_start_ms;
+        det->phasic = 0;
+        det->tonic = 0;
+        det->energy = 0;
+        det->samples = 0;
+        det->peak = 0;
+        det->rhythm_sum = 0;
+    }
+
+    det->bursts++;
+    if (duration_ms > BRUXISM_TONIC_MS)
+    {
+        det->tonic++;
+    }
+    else
+    {
+        det->phasic++;
+    }
+    det->end_ms = now_ms;
+    det->energy += energy;
+    det->samples += det->burst_samples;
+    det->peak = MAX(det->peak, det->burst_peak);
+    det->rhythm_sum += rhythm;
+}
+
+// Returns true when the bursts since the last episode make one
+static bool bruxism_episode_end(struct bruxism_detector *det, struct bruxism_episode *episode)
+{
+    uint8_t type = det->tonic ? (det->phasic ? BRUXISM_TYPE_MIXED : BRUXISM_TYPE_TONIC)
+                              : (det->phasic >= BRUXISM_MIN_PHASIC_BURSTS ? BRUXISM_TYPE_PHASIC : 0);
+
+    det->bursts = 0;
+
+    if (type == 0)
+    {
+        return false;
+    }
+
+    episode->start_ms = det->start_ms;
+    episode->duration_ms = det->end_ms - det->start_ms;
+    episode->intensity = bruxism_mg(sqrtf((float)det->energy / MAX(det->samples, 1)));
+    episode->peak = bruxism_mg(sqrtf((float)det->peak));
+    episode->type = type;
+    episode->bursts = det->phasic + det->tonic;
+    episode->rhythm = (uint8_t)MIN(det->rhythm_sum / (det->phasic + det->tonic), UINT8_MAX);
+
+    return true;
+}
+
+bool bruxism_process(struct bruxism_detector *det, const struct acc_sample *samples, uint8_t count,
+                     uint64_t timestamp, struct bruxism_episode *episode)
+{
+    bool ended = false;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint32_t now_ms = (uint32_t)((timestamp - (uint64_t)(count - 1 - i) * det->period_ns) / NSEC_PER_MSEC);
+        int64_t power = bruxism_filter(det, &samples[i]);
+
+        det->envelope += (power - det->envelope) >> det->env_shift;
+        det->count++;
+
+        if (!det->in_burst && det->envelope > BRUXISM_ON_POWER)
+        {
+            bruxism_burst_start(det, now_ms);
+        }
+
+        if (det->in_burst)
+        {
+            det->burst_samples++;
+            det->burst_peak = MAX(det->burst_peak, det->envelope);
+
+            if (det->envelope < BRUXISM_OFF_POWER)
+            {
+                bruxism_burst_end(det, now_ms);
+            }
+        }
+        else if (det->bursts && now_ms - det->end_ms >= BRUXISM_GAP_MS)
+        {
+            ended |= bruxism_episode_end(det, episode);
+        }
+    }
+
+    return ended;
+}
+
+const char *bruxism_type_name(uint8_t type)
+{
+    switch (type)
+    {
+    case BRUXISM_TYPE_PHASIC:
+        return "phasic";
+    case BRUXISM_TYPE_TONIC:
+        return "tonic";
+    case BRUXISM_TYPE_MIXED:
+        return "mixed";
+    default:
+        return "none";
+    }
+}
+
+static struct k_spinlock bruxism_hr_lock;
+static struct
+{
+    uint32_t time_ms;
+    uint8_t bpm;
+} bruxism_hr_history[BRUXISM_HR_HISTORY_SIZE];
+// Next slot to write and number of valid slots
+static uint8_t bruxism_hr_head;
+static uint8_t bruxism_hr_count;
+
+void bruxism_hr_put(uint32_t time_ms, uint8_t bpm)
+{
+    // An unknown heart rate is left out, it would only pull the baseline down
+    if (bpm == 0)
+    {
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&bruxism_hr_lock);
+    bruxism_hr_history[bruxism_hr_head].time_ms = time_ms;
+    bruxism_hr_history[bruxism_hr_head].bpm = bpm;
+    bruxism_hr_head = (bruxism_hr_head + 1) % BRUXISM_HR_HISTORY_SIZE;
+    bruxism_hr_count = MIN(bruxism_hr_count + 1, BRUXISM_HR_HISTORY_SIZE);
+    k_spin_unlock(&bruxism_hr_lock, key);
+}
+
+int bruxism_hr_delta(const struct bruxism_episode *episode, int8_t *delta)
+{
+    uint32_t baseline_sum = 0;
+    uint32_t baseline_count = 0;
+    uint8_t highest = 0;
+
+    k_spinlock_key_t key = k_spin_lock(&bruxism_hr_lock);
+
+    for (uint8_t i = 0; i < bruxism_hr_count; i++)
+    {
+        uint8_t slot = (bruxism_hr_head + BRUXISM_HR_HISTORY_SIZE - 1 - i) % BRUXISM_HR_HISTORY_SIZE;
+        // Relative to the start, the uptime wraps after 49 days
+        int32_t offset = (int32_t)(bruxism_hr_history[slot].time_ms - episode->start_ms);
+
+        if (offset < 0 && offset >= -BRUXISM_HR_BASELINE_MS)
+        {
+            baseline_sum += bruxism_hr_history[slot].bpm;
+            baseline_count++;
+        }
+        else if (offset >= 0 && offset <= (int32_t)(episode->duration_ms + BRUXISM_GAP_MS))
+        {
+            highest = MAX(highest, bruxism_hr_history[slot].bpm);
+        }
+    }
+
+    k_spin_unlock(&bruxism_hr_lock, key);
+
+    if (baseline_count == 0 || highest == 0)
+    {
+        return -ENODATA;
+    }
+
+    *delta = (int8_t)CLAMP((int32_t)highest - (int32_t)((baseline_sum + baseline_count / 2) / baseline_count),
+                           INT8_MIN, INT8_MAX);
+
+    return 0;
+}
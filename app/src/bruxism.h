@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef BRUXISM_H_
+#define BRUXISM_H_
+
+#include <zephyr/kernel.h>
+#include <app/drivers/lis2dtw12.h>
+
+/**@file
+ * @defgroup bruxism Bruxism episodes
+ * @{
+ * @brief Streaming detector of bruxism episodes on the accelerometer, scored after the rules for masseter EMG.
+ *
+ * Every axis goes through a first order high-pass of about 0.5Hz, which takes out gravity and the head position, and a
+ * first order low-pass of about 10Hz, which only matters at rates over 100Hz. The power of the three band-limited axes
+ * is smoothed over about 160ms into an envelope. A burst starts when the envelope RMS goes over
+ * CONFIG_APP_BRUXISM_THRESHOLD_MG and ends when it drops below half that power. The band-limited axes also count their
+ * zero crossings, outside a dead band of a quarter of the threshold, which gives the rhythm of the jaw movement.
+ *
+ * A burst counts when it lasts at least BRUXISM_MIN_BURST_MS and the rhythm of its strongest axis lies between
+ * BRUXISM_MIN_RHYTHM and BRUXISM_MAX_RHYTHM, which leaves out a turn of the head and knocks against the device. A
+ * burst of over BRUXISM_TONIC_MS is tonic, a shorter one phasic. An episode starts with the first burst that counts and
+ * ends BRUXISM_GAP_MS after the last one:
+ *
+ * - BRUXISM_TYPE_PHASIC: at least BRUXISM_MIN_PHASIC_BURSTS phasic bursts, rhythmic grinding.
+ * - BRUXISM_TYPE_TONIC: tonic bursts only, sustained clenching.
+ * - BRUXISM_TYPE_MIXED: both.
+ *
+ * A shorter run of phasic bursts is no episode. The heart rate is not needed for the detection. With
+ * CONFIG_APP_BRUXISM_HR the PPG stream keeps a history of it, so every episode gets the rise of the heart rate over the
+ * seconds before it, which usually goes with the micro-arousal of a real episode.
+ */
+
+/** @brief Shortest burst. */
+#define BRUXISM_MIN_BURST_MS 250
+/** @brief Longest phasic burst, a longer one is tonic. */
+#define BRUXISM_TONIC_MS 2000
+/** @brief Quiet time that ends an episode. */
+#define BRUXISM_GAP_MS 3000
+/** @brief Phasic bursts an episode without tonic bursts needs. */
+#define BRUXISM_MIN_PHASIC_BURSTS 3
+/** @brief Rhythm range of a burst, in 0.1Hz. */
+#define BRUXISM_MIN_RHYTHM 5
+#define BRUXISM_MAX_RHYTHM 150
+/** @brief Heart rate values the history holds, one per heart rate summary. */
+#define BRUXISM_HR_HISTORY_SIZE 64
+/** @brief Time before an episode the heart rate baseline is taken over. */
+#define BRUXISM_HR_BASELINE_MS 10000
+
+/** @brief Episode types. */
+enum bruxism_type
+{
+    BRUXISM_TYPE_PHASIC = 1,
+    BRUXISM_TYPE_TONIC = 2,
+    BRUXISM_TYPE_MIXED = 3,
+};
+
+/** @brief A finished episode. */
+struct bruxism_episode
+{
+    /** Uptime in ms of the start of the first burst. */
+    uint32_t start_ms;
+    /** Time from the start of the first burst to the end of the last one, in ms. */
+    uint32_t duration_ms;
+    /** RMS acceleration over the bursts in mg. */
+    uint16_t intensity;
+    /** Highest envelope RMS in mg. */
+    uint16_t peak;
+    /** One of bruxism_type. */
+    uint8_t type;
+    /** Bursts in the episode. */
+    uint8_t bursts;
+    /** Mean rhythm of the bursts in 0.1Hz. */
+    uint8_t rhythm;
+};
+
+/** @brief Filter state and burst sums of one axis. */
+struct bruxism_axis
+{
+    /** High-pass and low-pass filter states, in 1/256 counts. */
+    int32_t hp;
+    int32_t lp;
+    /** Side of the dead band the axis was last on, -1, 0 at the start or 1. */
+    int8_t side;
+    /** Zero crossings and sum of the squares in the current burst. */
+    uint16_t crossings;
+    int64_t energy;
+};
+
+/** @brief Detector state. */
+struct bruxism_detector
+{
+    uint32_t period_ns;
+    uint8_t hp_shift;
+    uint8_t lp_shift;
+    uint8_t env_shift;
+    /** Samples processed. */
+    uint32_t count;
+    /** Smoothed power of the band-limited axes, in counts squared. */
+    int64_t envelope;
+    struct bruxism_axis axis[3];
+
+    /** Current burst, valid while in_burst. */
+    bool in_burst;
+    uint32_t burst_start_ms;
+    uint32_t burst_samples;
+    int64_t burst_peak;
+
+    /** Current episode, valid while bursts is not 0. */
+    uint32_t start_ms;
+    uint32_t end_ms;
+    uint8_t bursts;
+    uint8_t phasic;
+    uint8_t tonic;
+    int64_t energy;
+    uint32_t samples;
+    int64_t peak;
+    uint32_t rhythm_sum;
+};
+
+/**
+ * @brief Initialize a detector
+ *
+ * @param[out] det Detector state
+ * @param[in] period_ns Accelerometer sample period in ns
+ */
+void bruxism_init(struct bruxism_detector *det, uint32_t period_ns);
+
+/**
+ * @brief Run a frame of accelerometer samples through the detector
+ *
+ * An episode ends at least BRUXISM_GAP_MS after the previous one, so a frame ends at most one.
+ *
+ * @param[in,out] det Detector state
+ * @param[in] samples Samples, oldest first
+ * @param[in] count Number of samples
+ * @param[in] timestamp Time of the last sample in ns
+ * @param[out] episode The episode that ended in this frame
+ * @return true If an episode ended in this frame
+ */
+bool bruxism_process(struct bruxism_detector *det, const struct acc_sample *samples, uint8_t count,
+                     uint64_t timestamp, struct bruxism_episode *episode);
+
+/**
+ * @brief Get the name of an episode type
+ *
+ * @param[in] type One of bruxism_type
+ * @return const char* Name, for the log
+ */
+const char *bruxism_type_name(uint8_t type);
+
+/**
+ * @brief Add a heart rate to the history, called from the PPG stream
+ *
+ * @param[in] time_ms Uptime in ms
+ * @param[in] bpm Heart rate in bpm, 0 when unknown
+ */
+void bruxism_hr_put(uint32_t time_ms, uint8_t bpm);
+
+/**
+ * @brief Get the rise of the heart rate during an episode
+ *
+ * The rise is the highest heart rate from the start of the episode until it closed, BRUXISM_GAP_MS after its last
+ * burst, less the mean heart rate over the BRUXISM_HR_BASELINE_MS before it.
+ *
+ * @param[in] episode Episode
+ * @param[out] delta Rise in bpm, clamped to int8_t
+ * @return int 0 on success, -ENODATA if the history has no heart rate before or during the episode
+ */
+int bruxism_hr_delta(const struct bruxism_episode *episode, int8_t *delta);
+
+/**
+ * @}
+ */
+
+#endif /* BRUXISM_H_ */
@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+
+#include <zephyr/kernel.h>
+
+#include "clock_sync.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(clock_sync, CONFIG_APP_LOG_LEVEL);
+
+// The line, the readers copy it under the lock and map outside of it
+struct clock_sync_line
+{
+    // Wall clock at origin_us and the slope less one
+    uint64_t origin_us;
+    uint64_t origin_wall_us;
+    double skew;
+    uint32_t rms_us;
+    uint8_t points;
+};
+
+static struct k_spinlock clock_sync_lock;
+static struct clock_sync_line clock_sync_line;
+
+// Serializes the requests, which own everything below and fit the line outside of the spinlock
+static K_MUTEX_DEFINE(clock_sync_mutex);
+static struct
+{
+    // Request that waits for its round trip
+    bool pending;
+    uint8_t pending_seq;
+    uint64_t pending_host_us;
+    uint64_t pending_device_us;
+
+    // Points of the fit, oldest at tail
+    uint64_t device_us[CLOCK_SYNC_POINTS];
+    uint64_t wall_us[CLOCK_SYNC_POINTS];
+    uint32_t rtt_us[CLOCK_SYNC_POINTS];
+    uint8_t tail;
+    uint8_t points;
+
+    // Newest line, published to clock_sync_line
+    struct clock_sync_line line;
+} clock_sync;
+
+static uint64_t clock_sync_map(const struct clock_sync_line *line, uint64_t device_us)
+{
+    int64_t dx = (int64_t)(device_us - line->origin_us);
+
+    return line->origin_wall_us + dx + (int64_t)llround(line->skew * dx);
+}
+
+// Least squares line through the points, relative to the newest one, the double keeps the us over days. A point
+// counts with the inverse square of its round trip, the error of half the round trip grows with it.
+static void clock_sync_fit(struct clock_sync_line *line)
+{
+    const uint8_t newest = (clock_sync.tail + clock_sync.points - 1) % CLOCK_SYNC_POINTS;
+    const uint64_t device0 = clock_sync.device_us[newest];
+    const uint64_t wall0 = clock_sync.wall_us[newest];
+    double n = 0;
+    double sx = 0;
+    double sy = 0;
+    double sxx = 0;
+    double sxy = 0;
+
+    for (uint8_t i = 0; i < clock_sync.points; i++)
+    {
+        uint8_t slot = (clock_sync.tail + i) % CLOCK_SYNC_POINTS;
+        double x = (double)(int64_t)(clock_sync.device_us[slot] - device0);
+        double y = (double)(int64_t)(clock_sync.wall_us[slot] - wall0) - x;
+        double w = 1.0 / ((double)clock_sync.rtt_us[slot] * clock_sync.rtt_us[slot]);
+
+        n += w;
+        sx += w * x;
+        sy += w * y;
+        sxx += w * x * x;
+        sxy += w * x * y;
+    }
+
+    double den = n * sxx - sx * sx;
+    double span = (double)(int64_t)(device0 - clock_sync.device_us[clock_sync.tail]);
+
+    // The slope of a short span is mostly the jitter of the link
+    if (span >= CLOCK_SYNC_MIN_SPAN_S * (double)USEC_PER_SEC && den > 0)
+    {
+        line->skew = CLAMP((n * sxy - sx * sy) / den, -CLOCK_SYNC_MAX_SKEW_PPM * 1e-6, CLOCK_SYNC_MAX_SKEW_PPM * 1e-6);
+    }
+
+    double offset = (sy - line->skew * sx) / n;
+    double sum_sq = 0;
+
+    for (uint8_t i = 0; i < clock_sync.points; i++)
+    {
+        uint8_t slot = (clock_sync.tail + i) % CLOCK_SYNC_POINTS;
+        double x = (double)(int64_t)(clock_sync.device_us[slot] - device0);
+        double residual = (double)(int64_t)(clock_sync.wall_us[slot] - wall0) - x - offset - line->skew * x;
+        double w = 1.0 / ((double)clock_sync.rtt_us[slot] * clock_sync.rtt_us[slot]);
+
+        sum_sq += w * residual * residual;
+    }
+
+    line->origin_us = device0;
+    line->origin_wall_us = wall0 + (int64_t)llround(offset);
+    line->rms_us = (uint32_t)MIN(lround(sqrt(sum_sq / n)), UINT32_MAX);
+    line->points = clock_sync.points;
+}
+
+static void clock_sync_add_point(uint64_t device_us, uint64_t wall_us, uint32_t rtt_us)
+{
+    if (clock_sync.points > 0)
+    {
+        int64_t error = (int64_t)(wall_us - clock_sync_map(&clock_sync.line, device_us));
+
+        if (error > CLOCK_SYNC_STEP_US || error < -CLOCK_SYNC_STEP_US)
+        {
+            LOG_INF("Host clock stepped by %lld ms, clock sync starts over", error / USEC_PER_MSEC);
+            clock_sync.tail = 0;
+            clock_sync.points = 0;
+        }
+    }
+
+    if (clock_sync.points == CLOCK_SYNC_POINTS)
+    {
+        clock_sync.tail = (clock_sync.tail + 1) % CLOCK_SYNC_POINTS;
+        clock_sync.points--;
+    }
+
+    uint8_t slot = (clock_sync.tail + clock_sync.points) % CLOCK_SYNC_POINTS;
+    clock_sync.device_us[slot] = device_us;
+    clock_sync.wall_us[slot] = wall_us;
+    clock_sync.rtt_us[slot] = rtt_us;
+    clock_sync.points++;
+
+    clock_sync_fit(&clock_sync.line);
+
+    k_spinlock_key_t key = k_spin_lock(&clock_sync_lock);
+    clock_sync_line = clock_sync.line;
+    k_spin_unlock(&clock_sync_lock, key);
+}
+
+void clock_sync_request(uint8_t seq, uint64_t host_us, uint32_t rtt_us, uint64_t device_us)
+{
+    k_mutex_lock(&clock_sync_mutex, K_FOREVER);
+
+    if (clock_sync.pending && clock_sync.pending_seq == (uint8_t)(seq - 1) && rtt_us > 0 &&
+        rtt_us <= CONFIG_APP_CLOCK_SYNC_MAX_RTT_MS * USEC_PER_MSEC)
+    {
+        // The request arrived about half the round trip after the host wrote it
+        clock_sync_add_point(clock_sync.pending_device_us, clock_sync.pending_host_us + rtt_us / 2, rtt_us);
+    }
+
+    clock_sync.pending = true;
+    clock_sync.pending_seq = seq;
+    clock_sync.pending_host_us = host_us;
+    clock_sync.pending_device_us = device_us;
+
+    k_mutex_unlock(&clock_sync_mutex);
+}
+
+static void clock_sync_get_line(struct clock_sync_line *line)
+{
+    k_spinlock_key_t key = k_spin_lock(&clock_sync_lock);
+    *line = clock_sync_line;
+    k_spin_unlock(&clock_sync_lock, key);
+}
+
+void clock_sync_get_status(uint64_t device_us, struct clock_sync_status *status)
+{
+    struct clock_sync_line line;
+
+    clock_sync_get_line(&line);
+
+    status->device_us = device_us;
+    status->wall_us = line.points ? clock_sync_map(&line, device_us) : 0;
+    status->skew_ppb = (int32_t)lround(line.skew * 1e9);
+    status->rms_us = line.rms_us;
+    status->points = line.points;
+}
+
+int clock_sync_to_wall(uint64_t device_us, uint64_t *wall_us)
+{
+    struct clock_sync_line line;
+
+    clock_sync_get_line(&line);
+
+    if (!line.points)
+    {
+        return -ENODATA;
+    }
+
+    *wall_us = clock_sync_map(&line, device_us);
+
+    return 0;
+}
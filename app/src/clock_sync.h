@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef CLOCK_SYNC_H_
+#define CLOCK_SYNC_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup clock_sync Clock synchronization
+ * @{
+ * @brief Mapping of the device uptime to the wall clock of the host.
+ *
+ * The host writes its wall clock in every request, the device takes its uptime when the request arrives. The host
+ * measures the round trip from its write to the response and sends it along with the next request, so the device
+ * puts the previous request at half its round trip after the host wrote it. Requests with a round trip over
+ * CONFIG_APP_CLOCK_SYNC_MAX_RTT_MS are left out, the link delays are least symmetric in those.
+ *
+ * The last CLOCK_SYNC_POINTS points go through a least squares line of the wall clock over the uptime, weighted by the
+ * inverse square of their round trip. Its slope is the rate of the device crystal against the host clock, which is
+ * only fitted once the points span CLOCK_SYNC_MIN_SPAN_S, before that the offset alone is. A point more than CLOCK_SYNC_STEP_US off the line means the
+ * host clock was set, the line starts over from that point and keeps its slope.
+ *
+ * The points live in RAM, not in the connection, so the mapping keeps running over disconnects, and the next request
+ * after a reconnect only refines it.
+ *
+ * The requests fit the line under a mutex, the readers only copy the line under a spinlock and map outside of it, so
+ * they may run from any context.
+ */
+
+/** @brief Points the fit runs over. */
+#define CLOCK_SYNC_POINTS 32
+/** @brief Time the points must span before the slope is fitted. */
+#define CLOCK_SYNC_MIN_SPAN_S 60
+/** @brief Largest rate difference of the clocks, in ppm. */
+#define CLOCK_SYNC_MAX_SKEW_PPM 500
+/** @brief Distance from the line that restarts it, in us. */
+#define CLOCK_SYNC_STEP_US ((int64_t)2 * USEC_PER_SEC)
+
+/** @brief State of the mapping at a device time. */
+struct clock_sync_status
+{
+    /** Device uptime in us. */
+    uint64_t device_us;
+    /** Wall clock in us since the Unix epoch at device_us, 0 before the first point. */
+    uint64_t wall_us;
+    /** Rate of the device clock against the host clock in ppb, positive when the device runs slow. */
+    int32_t skew_ppb;
+    /** RMS distance of the points from the line in us. */
+    uint32_t rms_us;
+    /** Points in the fit. */
+    uint8_t points;
+};
+
+/**
+ * @brief Process a request of the host
+ *
+ * @param[in] seq Sequence number of the request, the host increments it with every request
+ * @param[in] host_us Wall clock of the host in us since the Unix epoch when it wrote the request
+ * @param[in] rtt_us Round trip of request seq - 1 in us as the host measured it, 0 when unknown
+ * @param[in] device_us Device uptime in us when the request arrived
+ */
+void clock_sync_request(uint8_t seq, uint64_t host_us, uint32_t rtt_us, uint64_t device_us);
+
+/**
+ * @brief Get the state of the mapping
+ *
+ * @param[in] device_us Device uptime in us
+ * @param[out] status Wall clock at device_us and the quality of the fit
+ */
+void clock_sync_get_status(uint64_t device_us, struct clock_sync_status *status);
+
+/**
+ * @brief Map a device time to the wall clock
+ *
+ * @param[in] device_us Device uptime in us
+ * @param[out] wall_us Wall clock in us since the Unix epoch
+ * @return int 0 on success, -ENODATA before the first point
+ */
+int clock_sync_to_wall(uint64_t device_us, uint64_t *wall_us);
+
+/**
+ * @}
+ */
+
+#endif /* CLOCK_SYNC_H_ */
@@ -0,0 +1,578 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/fs/fcb.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "flash_log.h"
+#include "clock_sync.h"
+#include "tgm_service.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(flash_log, CONFIG_APP_LOG_LEVEL);
+
+#define FLASH_LOG_PARTITION_ID FIXED_PARTITION_ID(storage_partition)
+#define FLASH_LOG_MAGIC 0x4c4d4754
+#define FLASH_LOG_VERSION 1
+// Most sectors the partition can have
+#define FLASH_LOG_MAX_SECTORS 32
+
+BUILD_ASSERT(CONFIG_APP_FLASH_LOG_SECTORS <= FLASH_LOG_MAX_SECTORS, "CONFIG_APP_FLASH_LOG_SECTORS too large");
+
+/** @brief Summaries of the records of an epoch. */
+struct flash_log_epoch
+{
+    bool open;
+    uint32_t start_ms;
+    uint32_t hr_sum;
+    uint16_t hr_count;
+    uint8_t hr_min;
+    uint8_t hr_max;
+    uint32_t spo2_sum;
+    uint16_t spo2_count;
+    uint16_t spo2_min;
+    uint16_t rmssd;
+    uint32_t activity_sum;
+    uint16_t frames;
+    uint16_t moved;
+};
+
+/** @brief Record that waits in the queue for the work item. */
+struct flash_log_record
+{
+    uint8_t type;
+    uint8_t len;
+    union
+    {
+        struct tgm_service_hr_data_t hr;
+        struct tgm_service_spo2_data_t spo2;
+        struct tgm_service_hrv_data_t hrv;
+        struct tgm_service_motion_data_t motion;
+        struct tgm_service_bruxism_data_t bruxism;
+    } data;
+};
+
+static void flash_log_work_handler(struct k_work *work);
+
+// The stream threads only queue the records, the flash is written from the system work queue
+K_MSGQ_DEFINE(flash_log_queue, sizeof(struct flash_log_record), CONFIG_APP_FLASH_LOG_QUEUE_SIZE, 1);
+static K_WORK_DEFINE(flash_log_work, flash_log_work_handler);
+
+static K_MUTEX_DEFINE(flash_log_lock);
+static struct flash_sector flash_log_sectors[FLASH_LOG_MAX_SECTORS];
+static struct fcb flash_log_fcb;
+static bool flash_log_ready;
+
+// Number of the next page, and of the first page of this boot
+static uint32_t flash_log_next_seq;
+static uint32_t flash_log_boot_seq;
+
+// Page that is being filled, padded to the write block size of the flash
+static uint8_t flash_log_page[ROUND_UP(FLASH_LOG_PAGE_SIZE, 16)];
+static uint16_t flash_log_page_len;
+
+static struct flash_log_epoch flash_log_epoch;
+
+// Entry of the last page that was read, so a client reading on does not walk the log from the start every time
+static struct fcb_entry flash_log_cursor;
+static uint32_t flash_log_cursor_seq;
+static bool flash_log_cursor_valid;
+
+static int flash_log_read_header(struct fcb_entry *loc, struct flash_log_page_header *header)
+{
+    if (loc->fe_data_len < sizeof(*header))
+    {
+        return -EBADMSG;
+    }
+
+    return flash_area_read(flash_log_fcb.fap, FCB_ENTRY_FA_DATA_OFF((*loc)), header, sizeof(*header));
+}
+
+static int flash_log_rotate(void)
+{
+    flash_log_cursor_valid = false;
+
+    return fcb_rotate(&flash_log_fcb);
+}
+
+static int flash_log_write_page(void)
+{
+    struct flash_log_page_header header = {
+        .seq = flash_log_next_seq,
+        .uptime_us = k_ticks_to_us_floor64(k_uptime_ticks()),
+    };
+    struct fcb_entry loc;
+    uint64_t wall_us;
+
+    if (clock_sync_to_wall(header.uptime_us, &wall_us) == 0)
+    {
+        header.wall_us = wall_us;
+    }
+    memcpy(flash_log_page, &header, sizeof(header));
+
+    int err = fcb_append(&flash_log_fcb, flash_log_page_len, &loc);
+    if (err == -ENOSPC)
+    {
+        // The log is full, the oldest sector makes room
+        err = flash_log_rotate();
+        if (!err)
+        {
+            err = fcb_append(&flash_log_fcb, flash_log_page_len, &loc);
+        }
+    }
+
+    if (!err)
+    {
+        err = flash_area_write(flash_log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), flash_log_page,
+                               ROUND_UP(flash_log_page_len, flash_log_fcb.f_align));
+    }
+
+    if (!err)
+    {
+        err = fcb_append_finish(&flash_log_fcb, &loc);
+    }
+
+    if (err)
+    {
+        LOG_ERR("Failed to write log page %u (err %d)", header.seq, err);
+        return err;
+    }
+
+    LOG_DBG("Log page %u written, %u bytes", header.seq, flash_log_page_len);
+    flash_log_next_seq++;
+    flash_log_page_len = 0;
+
+    return 0;
+}
+
+static int flash_log_append(uint8_t type, const void *data, uint16_t len)
+{
+    const struct tgm_service_record_header_t record = {.type = type, .len = len};
+    const uint16_t record_size = sizeof(record) + len;
+    int err = 0;
+
+    if (sizeof(struct flash_log_page_header) + record_size > FLASH_LOG_PAGE_SIZE)
+    {
+        return -EMSGSIZE;
+    }
+
+    if (flash_log_page_len + record_size > FLASH_LOG_PAGE_SIZE)
+    {
+        err = flash_log_write_page();
+        // A page that cannot be written is dropped, the next one may fit after a rotation
+        flash_log_page_len = 0;
+    }
+
+    if (flash_log_page_len == 0)
+    {
+        // The header is filled in when the page is written
+        memset(flash_log_page, 0, sizeof(flash_log_page));
+        flash_log_page_len = sizeof(struct flash_log_page_header);
+    }
+
+    memcpy(&flash_log_page[flash_log_page_len], &record, sizeof(record));
+    memcpy(&flash_log_page[flash_log_page_len + sizeof(record)], data, len);
+    flash_log_page_len += record_size;
+
+    return err;
+}
+
+static int flash_log_close_epoch(void)
+{
+    struct flash_log_epoch *epoch = &flash_log_epoch;
+    struct tgm_service_epoch_data_t data = {
+        .time_ms = epoch->start_ms,
+        .hr_min = epoch->hr_min,
+        .hr_max = epoch->hr_max,
+    };
+
+    if (!epoch->open)
+    {
+        return 0;
+    }
+
+    if (epoch->hr_count)
+    {
+        data.hr_mean = (epoch->hr_sum + epoch->hr_count / 2) / epoch->hr_count;
+    }
+    if (epoch->spo2_count)
+    {
+        // In 0.5% steps, from the 0.1% of the estimates
+        data.spo2_mean = (epoch->spo2_sum / epoch->spo2_count + 2) / 5;
+        data.spo2_min = (epoch->spo2_min + 2) / 5;
+    }
+    data.rmssd = epoch->rmssd;
+    if (epoch->frames)
+    {
+        data.activity = MIN(epoch->activity_sum / epoch->frames, UINT8_MAX);
+        data.motion = epoch->moved * 100 / epoch->frames;
+    }
+
+    LOG_INF("Logged epoch: heart rate %u bpm, SpO2 %u.%u%%, activity %u mg", data.hr_mean, data.spo2_mean / 2,
+            (data.spo2_mean % 2) * 5, data.activity);
+
+    memset(epoch, 0, sizeof(*epoch));
+
+    return flash_log_append(TGM_SERVICE_RECORD_EPOCH, &data, sizeof(data));
+}
+
+static void flash_log_epoch_add(uint8_t type, const void *data)
+{
+    struct flash_log_epoch *epoch = &flash_log_epoch;
+
+    if (!epoch->open)
+    {
+        epoch->open = true;
+        epoch->start_ms = k_uptime_get_32();
+    }
+
+    switch (type)
+    {
+    case TGM_SERVICE_RECORD_HR:
+    {
+        const struct tgm_service_hr_data_t *hr = data;
+
+        if (hr->heart_rate)
+        {
+            epoch->hr_min = epoch->hr_count ? MIN(epoch->hr_min, hr->heart_rate) : hr->heart_rate;
+            epoch->hr_max = MAX(epoch->hr_max, hr->heart_rate);
+            epoch->hr_sum += hr->heart_rate;
+            epoch->hr_count++;
+        }
+        break;
+    }
+    case TGM_SERVICE_RECORD_SPO2:
+    {
+        const struct tgm_service_spo2_data_t *spo2 = data;
+
+        if (spo2->spo2)
+        {
+            epoch->spo2_min = epoch->spo2_count ? MIN(epoch->spo2_min, spo2->spo2) : spo2->spo2;
+            epoch->spo2_sum += spo2->spo2;
+            epoch->spo2_count++;
+        }
+        break;
+    }
+    case TGM_SERVICE_RECORD_HRV:
+    {
+        const struct tgm_service_hrv_data_t *hrv = data;
+
+        if (hrv->flags & TGM_SERVICE_HRV_EPOCH_END)
+        {
+            epoch->rmssd = hrv->rmssd;
+        }
+        break;
+    }
+    case TGM_SERVICE_RECORD_MOTION:
+    {
+        const struct tgm_service_motion_data_t *motion = data;
+
+        epoch->activity_sum += motion->activity;
+        epoch->moved += (motion->flags & BIT(0)) ? 1 : 0;
+        epoch->frames++;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Close the epoch when it is over and add a record to it, or to the page
+static int flash_log_store(const struct flash_log_record *record)
+{
+    int err = 0;
+
+    if (flash_log_epoch.open &&
+        k_uptime_get_32() - flash_log_epoch.start_ms >= CONFIG_APP_FLASH_LOG_EPOCH_S * MSEC_PER_SEC)
+    {
+        err = flash_log_close_epoch();
+    }
+
+    if (record->type == TGM_SERVICE_RECORD_BRUXISM)
+    {
+        // Episodes are rare, they are kept whole
+        int append_err = flash_log_append(record->type, &record->data, record->len);
+        err = err ? err : append_err;
+    }
+    else
+    {
+        flash_log_epoch_add(record->type, &record->data);
+    }
+
+    return err;
+}
+
+// Store the queued records, with flash_log_lock held
+static void flash_log_drain(void)
+{
+    struct flash_log_record record;
+
+    while (k_msgq_get(&flash_log_queue, &record, K_NO_WAIT) == 0)
+    {
+        int err = flash_log_store(&record);
+        if (err)
+        {
+            LOG_DBG("Failed to log record type %u (err %d)", record.type, err);
+        }
+    }
+}
+
+static void flash_log_work_handler(struct k_work *work)
+{
+    ARG_UNUSED(work);
+
+    k_mutex_lock(&flash_log_lock, K_FOREVER);
+    flash_log_drain();
+    k_mutex_unlock(&flash_log_lock);
+}
+
+int flash_log_put(uint8_t type, const void *data, uint16_t len)
+{
+    struct flash_log_record record = {.type = type, .len = len};
+
+    if (type != TGM_SERVICE_RECORD_HR && type != TGM_SERVICE_RECORD_SPO2 && type != TGM_SERVICE_RECORD_HRV &&
+        type != TGM_SERVICE_RECORD_MOTION && type != TGM_SERVICE_RECORD_BRUXISM)
+    {
+        return -ENOTSUP;
+    }
+
+    if (!flash_log_ready)
+    {
+        return -ENODEV;
+    }
+
+    if (len > sizeof(record.data))
+    {
+        return -EMSGSIZE;
+    }
+
+    memcpy(&record.data, data, len);
+
+    // The work item falls behind when the flash is slow, the caller keeps what it cannot drop
+    int err = k_msgq_put(&flash_log_queue, &record, K_NO_WAIT);
+    if (err)
+    {
+        return -ENOBUFS;
+    }
+
+    k_work_submit(&flash_log_work);
+
+    return 0;
+}
+
+int flash_log_flush(void)
+{
+    int err = 0;
+
+    if (!flash_log_ready)
+    {
+        return 0;
+    }
+
+    k_mutex_lock(&flash_log_lock, K_FOREVER);
+
+    // The queued records belong to the epoch and the page
+    flash_log_drain();
+    err = flash_log_close_epoch();
+    if (flash_log_page_len > sizeof(struct flash_log_page_header))
+    {
+        int write_err = flash_log_write_page();
+        err = err ? err : write_err;
+    }
+
+    k_mutex_unlock(&flash_log_lock);
+
+    return err;
+}
+
+int flash_log_read(uint32_t *seq, void *page)
+{
+    struct flash_log_page_header header;
+    struct fcb_entry loc = {0};
+    int err = -ENOENT;
+
+    if (!flash_log_ready)
+    {
+        return -ENOENT;
+    }
+
+    k_mutex_lock(&flash_log_lock, K_FOREVER);
+
+    if (flash_log_cursor_valid && flash_log_cursor_seq < *seq)
+    {
+        loc = flash_log_cursor;
+    }
+
+    while (fcb_getnext(&flash_log_fcb, &loc) == 0)
+    {
+        if (flash_log_read_header(&loc, &header) || header.seq < *seq)
+        {
+            continue;
+        }
+
+        err = flash_area_read(flash_log_fcb.fap, FCB_ENTRY_FA_DATA_OFF(loc), page,
+                              MIN(loc.fe_data_len, FLASH_LOG_PAGE_SIZE));
+        if (err)
+        {
+            break;
+        }
+
+        // Pages of this boot from before the first clock sync can still be mapped
+        uint64_t wall_us;
+
+        if (header.wall_us == 0 && header.seq >= flash_log_boot_seq &&
+            clock_sync_to_wall(header.uptime_us, &wall_us) == 0)
+        {
+            header.wall_us = wall_us;
+            memcpy(page, &header, sizeof(header));
+        }
+
+        flash_log_cursor = loc;
+        flash_log_cursor_seq = header.seq;
+        flash_log_cursor_valid = true;
+        *seq = header.seq;
+        err = MIN(loc.fe_data_len, FLASH_LOG_PAGE_SIZE);
+        break;
+    }
+
+    k_mutex_unlock(&flash_log_lock);
+
+    return err;
+}
+
+// Number of the last page in a sector, false when it holds none
+static bool flash_log_sector_last_seq(struct flash_sector *sector, uint32_t *seq)
+{
+    struct flash_log_page_header header;
+    struct fcb_entry loc = {.fe_sector = sector, .fe_elem_off = 0};
+    bool found = false;
+
+    while (fcb_getnext(&flash_log_fcb, &loc) == 0 && loc.fe_sector == sector)
+    {
+        if (flash_log_read_header(&loc, &header) == 0)
+        {
+            *seq = header.seq;
+            found = true;
+        }
+    }
+
+    return found;
+}
+
+int flash_log_release(uint32_t seq)
+{
+    int err = 0;
+
+    if (!flash_log_ready)
+    {
+        return 0;
+    }
+
+    k_mutex_lock(&flash_log_lock, K_FOREVER);
+
+    while (flash_log_fcb.f_oldest != flash_log_fcb.f_active.fe_sector)
+    {
+        uint32_t last_seq;
+
+        if (flash_log_sector_last_seq(flash_log_fcb.f_oldest, &last_seq) && last_seq > seq)
+        {
+            break;
+        }
+
+        err = flash_log_rotate();
+        if (err)
+        {
+            LOG_ERR("Failed to erase log sector (err %d)", err);
+            break;
+        }
+    }
+
+    k_mutex_unlock(&flash_log_lock);
+
+    return err;
+}
+
+static int flash_log_erase(void)
+{
+    const struct flash_area *fa;
+
+    int err = flash_area_open(FLASH_LOG_PARTITION_ID, &fa);
+    if (err)
+    {
+        return err;
+    }
+
+    for (uint8_t i = 0; i < flash_log_fcb.f_sector_cnt && !err; i++)
+    {
+        err = flash_area_erase(fa, flash_log_fcb.f_sectors[i].fs_off, flash_log_fcb.f_sectors[i].fs_size);
+    }
+
+    flash_area_close(fa);
+
+    return err;
+}
+
+int flash_log_init(void)
+{
+    struct flash_log_page_header header;
+    struct fcb_entry loc = {0};
+    uint32_t count = ARRAY_SIZE(flash_log_sectors);
+    uint32_t pages = 0;
+
+    int err = flash_area_get_sectors(FLASH_LOG_PARTITION_ID, &count, flash_log_sectors);
+    if (err)
+    {
+        LOG_ERR("Failed to get the storage partition sectors (err %d)", err);
+        return err;
+    }
+
+    if (count < CONFIG_APP_FLASH_LOG_SECTORS)
+    {
+        LOG_ERR("Storage partition has only %u sectors", count);
+        return -ENOSPC;
+    }
+
+    // The log takes the last sectors, the first ones stay free for the settings
+    flash_log_fcb.f_magic = FLASH_LOG_MAGIC;
+    flash_log_fcb.f_version = FLASH_LOG_VERSION;
+    flash_log_fcb.f_sector_cnt = CONFIG_APP_FLASH_LOG_SECTORS;
+    flash_log_fcb.f_scratch_cnt = 0;
+    flash_log_fcb.f_sectors = &flash_log_sectors[count - CONFIG_APP_FLASH_LOG_SECTORS];
+
+    err = fcb_init(FLASH_LOG_PARTITION_ID, &flash_log_fcb);
+    if (err)
+    {
+        // Sectors of another layout, start with an empty log
+        LOG_WRN("Flash log not found (err %d), erasing it", err);
+        err = flash_log_erase();
+        if (!err)
+        {
+            err = fcb_init(FLASH_LOG_PARTITION_ID, &flash_log_fcb);
+        }
+        if (err)
+        {
+            LOG_ERR("Failed to set up the flash log (err %d)", err);
+            return err;
+        }
+    }
+
+    // Page numbers go on from the newest page
+    while (fcb_getnext(&flash_log_fcb, &loc) == 0)
+    {
+        if (flash_log_read_header(&loc, &header) == 0)
+        {
+            flash_log_next_seq = header.seq + 1;
+            pages++;
+        }
+    }
+    flash_log_boot_seq = flash_log_next_seq;
+    flash_log_ready = true;
+
+    LOG_INF("Flash log ready: %u pages, next page %u", pages, flash_log_next_seq);
+
+    return 0;
+}
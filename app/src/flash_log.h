@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef FLASH_LOG_H_
+#define FLASH_LOG_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup flash_log Flash log
+ * @{
+ * @brief Circular log on the storage partition of the records no client listens to.
+ *
+ * While nobody listens, the heart rate, SpO2, HRV and motion summaries are reduced to one
+ * tgm_service_epoch_data_t per CONFIG_APP_FLASH_LOG_EPOCH_S, bruxism episodes are kept whole. The records are
+ * collected in a page of FLASH_LOG_PAGE_SIZE bytes in RAM, with the layout of the multiplexed stream after a
+ * flash_log_page_header, and a full page is written as one entry of a flash circular buffer (FCB) on the last
+ * CONFIG_APP_FLASH_LOG_SECTORS sectors of the storage partition. The FCB writes the sectors in turn and erases the
+ * oldest one when it runs out of room, which spreads the wear, and checks every entry with a CRC.
+ *
+ * flash_log_put() only queues a record, a work item on the system work queue reduces and writes it, so the streams
+ * never wait on the flash. Pages are numbered on, also over reboots. A client reads them from the oldest with flash_log_read(), and releases
+ * them with flash_log_release() once it has them, which frees their sectors.
+ */
+
+/** @brief Size of a page, it fits a notification at the ATT MTU the device asks for. */
+#define FLASH_LOG_PAGE_SIZE 240
+
+/** @brief Header of every page, the records follow it. */
+struct flash_log_page_header
+{
+    /** Page number, it increments with every page. */
+    uint32_t seq;
+    /** Device uptime in us when the page was written. */
+    uint64_t uptime_us;
+    /** Wall clock at uptime_us in us since the Unix epoch, 0 when the clock was not synchronized. */
+    uint64_t wall_us;
+} __packed;
+
+#if defined(CONFIG_APP_FLASH_LOG)
+
+/**
+ * @brief Mount the log and find the number of the next page
+ *
+ * @return int 0 on success, negative error code on failure
+ */
+int flash_log_init(void);
+
+/**
+ * @brief Log a record that no client listened to
+ *
+ * @param[in] type Record type, one of tgm_service_record_type_t
+ * @param[in] data Record
+ * @param[in] len Length of the record
+ * @retval 0 If the record was queued for the log.
+ * @retval -ENOTSUP If records of this type are not logged.
+ * @retval -ENOBUFS If the queue is full.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int flash_log_put(uint8_t type, const void *data, uint16_t len);
+
+/**
+ * @brief Write the queued records, the page that is being filled and the epoch so far to flash
+ *
+ * @return int 0 on success or when there was nothing to write, negative error code on failure
+ */
+int flash_log_flush(void);
+
+/**
+ * @brief Read the oldest page from a page number on
+ *
+ * Pages of the current boot that were written before the clock was synchronized get the wall clock of the current
+ * mapping.
+ *
+ * @param[in,out] seq First page number that is wanted, the number of the page that was read
+ * @param[out] page Buffer of at least FLASH_LOG_PAGE_SIZE bytes
+ * @retval Length of the page in bytes.
+ * @retval -ENOENT If there is no page from seq on.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int flash_log_read(uint32_t *seq, void *page);
+
+/**
+ * @brief Release the pages up to a page number
+ *
+ * The sectors that only hold released pages are erased. The sector that is being written is kept.
+ *
+ * @param[in] seq Number of the last page the client has
+ * @return int 0 on success, negative error code on failure
+ */
+int flash_log_release(uint32_t seq);
+
+#else
+
+static inline int flash_log_init(void)
+{
+    return 0;
+}
+
+static inline int flash_log_put(uint8_t type, const void *data, uint16_t len)
+{
+    ARG_UNUSED(type);
+    ARG_UNUSED(data);
+    ARG_UNUSED(len);
+    return -ENOTSUP;
+}
+
+static inline int flash_log_flush(void)
+{
+    return 0;
+}
+
+static inline int flash_log_read(uint32_t *seq, void *page)
+{
+    ARG_UNUSED(seq);
+    ARG_UNUSED(page);
+    return -ENOENT;
+}
+
+static inline int flash_log_release(uint32_t seq)
+{
+    ARG_UNUSED(seq);
+    return 0;
+}
+
+#endif /* CONFIG_APP_FLASH_LOG */
+
+/**
+ * @}
+ */
+
+#endif /* FLASH_LOG_H_ */
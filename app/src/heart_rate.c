@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include "heart_rate.h"
+
+// Run of rejected peaks that restarts the interval tracking, a rejected peak counts 2 and a beat takes 1 off
+#define HEART_RATE_REJECT_LIMIT 6
+
+static uint32_t heart_rate_samples(const struct heart_rate_detector *det, uint32_t ms)
+{
+    return ms * det->rate_hz / 1000;
+}
+
+static uint8_t heart_rate_match(int64_t value, int64_t reference, uint8_t weight)
+{
+    if (reference <= 0)
+    {
+        return 50;
+    }
+
+    return 100 - (uint8_t)MIN(llabs(value - reference) * 100 * weight / reference, 100);
+}
+
+void heart_rate_init(struct heart_rate_detector *det, uint16_t rate_hz)
+{
+    uint8_t log2_rate = find_msb_set(MAX(rate_hz, 1)) - 1;
+
+    memset(det, 0, sizeof(*det));
+    det->rate_hz = MAX(rate_hz, 1);
+    // A second order high-pass of about 0.5Hz, a low-pass of about 4Hz and a threshold decay of about 1.3s
+    det->dc_shift = MAX(log2_rate, 2) - 1;
+    det->threshold_shift = log2_rate + 1;
+    det->lp_shift = MAX(log2_rate, 5) - 4;
+    det->threshold = HEART_RATE_MIN_AMPLITUDE << 8;
+}
+
+// Vertex of the parabola through the candidate and its neighbours, in 1/256 samples
+static int16_t heart_rate_fraction(const struct heart_rate_detector *det)
+{
+    int64_t curvature = (int64_t)det->candidate_prev - 2 * (int64_t)det->candidate + det->candidate_next;
+
+    if (curvature >= 0)
+    {
+        return 0;
+    }
+
+    return (int16_t)CLAMP(128 * ((int64_t)det->candidate_prev - det->candidate_next) / curvature, -128, 128);
+}
+
+// Decide on the peak of a run that just ended
+static bool heart_rate_peak(struct heart_rate_detector *det, struct heart_rate_beat *beat)
+{
+    int32_t peak = det->candidate;
+    uint32_t interval = 0;
+
+    if (det->beats > 0)
+    {
+        interval = det->candidate_sample - det->last_beat;
+        if (interval < heart_rate_samples(det, HEART_RATE_REFRACTORY_MS))
+        {
+            return false;
+        }
+
+        if (interval > heart_rate_samples(det, HEART_RATE_MAX_INTERVAL_MS))
+        {
+            // Beats were missed, the interval to this one means nothing
+            det->interval = 0;
+            interval = 0;
+        }
+        else if (det->interval && (interval << 4) < det->interval * 5 / 8)
+        {
+            det->rejected += 2;
+            if (det->rejected < HEART_RATE_REJECT_LIMIT)
+            {
+                return false;
+            }
+
+            det->interval = 0;
+        }
+    }
+
+    uint8_t confidence = heart_rate_match(peak, det->level, 1) *
+                         heart_rate_match(interval << 4, interval ? det->interval : 0, 2) / 100;
+
+    det->level = det->level ? det->level + ((peak - det->level) >> 2) : peak;
+    det->threshold = MAX(det->level / 2, HEART_RATE_MIN_AMPLITUDE << 8);
+    if (interval)
+    {
+        det->interval = det->interval ? det->interval + ((int32_t)(interval << 4) - (int32_t)det->interval) / 4
+                                      : interval << 4;
+    }
+    det->confidence = det->beats ? det->confidence + (confidence - det->confidence) / 4 : confidence;
+    det->rejected = det->rejected ? det->rejected - 1 : 0;
+    det->last_beat = det->candidate_sample;
+    det->beats++;
+
+    beat->sample = det->candidate_sample;
+    beat->fraction = heart_rate_fraction(det);
+    beat->confidence = confidence;
+
+    return true;
+}
+
+uint8_t heart_rate_process(struct heart_rate_detector *det, const uint32_t *values, uint8_t count,
+                           struct heart_rate_beat *beats, uint8_t max_beats)
+{
+    uint8_t found = 0;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        int32_t x = (int32_t)(values[i] << 8);
+        uint32_t n = det->count++;
+
+        if (n == 0)
+        {
+            det->dc[0] = x;
+        }
+        det->dc[0] += (x - det->dc[0]) >> det->dc_shift;
+        x -= det->dc[0];
+        det->dc[1] += (x - det->dc[1]) >> det->dc_shift;
+        x -= det->dc[1];
+        det->lp += (x - det->lp) >> det->lp_shift;
+
+        // Less light comes back during systole
+        int32_t s = -det->lp;
+        int32_t prev = det->prev;
+        det->prev = s;
+
+        // Let the high-pass settle for a second
+        if (n < det->rate_hz)
+        {
+            continue;
+        }
+
+        if (det->candidate > 0 && n == det->candidate_sample + 1)
+        {
+            det->candidate_next = s;
+        }
+
+        if (s > det->threshold)
+        {
+            if (s > det->candidate)
+            {
+                det->candidate = s;
+                det->candidate_prev = prev;
+                det->candidate_sample = n;
+            }
+        }
+        else if (det->candidate > 0)
+        {
+            struct heart_rate_beat beat;
+
+            if (heart_rate_peak(det, &beat) && found < max_beats)
+            {
+                beats[found++] = beat;
+            }
+            det->candidate = 0;
+        }
+
+        det->threshold = MAX(det->threshold - (det->threshold >> det->threshold_shift), HEART_RATE_MIN_AMPLITUDE << 8);
+    }
+
+    return found;
+}
+
+uint8_t heart_rate_bpm(const struct heart_rate_detector *det)
+{
+    if (det->beats == 0 || det->interval == 0 ||
+        det->count - det->last_beat > heart_rate_samples(det, HEART_RATE_TIMEOUT_MS))
+    {
+        return 0;
+    }
+
+    return (uint8_t)MIN((60u * 16 * det->rate_hz + det->interval / 2) / det->interval, UINT8_MAX);
+}
+
+uint8_t heart_rate_confidence(const struct heart_rate_detector *det)
+{
+    return heart_rate_bpm(det) ? det->confidence : 0;
+}
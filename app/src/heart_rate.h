@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef HEART_RATE_H_
+#define HEART_RATE_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup heart_rate Heart rate
+ * @{
+ * @brief Streaming beat detector on one PPG channel.
+ *
+ * The samples go through a second order high-pass of about 0.5Hz, which takes out the DC level and most of the
+ * breathing baseline wander, and a first order low-pass of about 4Hz. They are inverted, so the systolic dip in the
+ * reflected light becomes a peak. A beat is the maximum of a run of samples above an adaptive threshold:
+ *
+ * - The threshold is set to half the running beat amplitude after every beat and decays with a time constant of
+ *   about a second, so a weaker pulse is picked up again. It never drops below HEART_RATE_MIN_AMPLITUDE.
+ * - A peak within HEART_RATE_REFRACTORY_MS of the previous beat (over 240bpm) is ignored, as is a peak at less than
+ *   5/8 of the running beat interval, which is most likely a dicrotic notch or motion. A run of such peaks restarts
+ *   the interval tracking, so a real jump in heart rate is followed.
+ *
+ * The time of a beat is refined to a fraction of a sample by a parabola through the peak sample and its neighbours, so
+ * the beat intervals are good to a few ms at 50Hz.
+ *
+ * The confidence of a beat is the product of how close its amplitude is to the running amplitude and how close its
+ * interval is to the running interval, in percent.
+ */
+
+/** @brief Smallest beat amplitude in ADC counts. */
+#define HEART_RATE_MIN_AMPLITUDE 32
+/** @brief Shortest beat interval, 240bpm. */
+#define HEART_RATE_REFRACTORY_MS 250
+/** @brief Longest beat interval, 30bpm, a longer gap restarts the interval tracking. */
+#define HEART_RATE_MAX_INTERVAL_MS 2000
+/** @brief The heart rate is unknown after this long without a beat. */
+#define HEART_RATE_TIMEOUT_MS 3000
+
+/** @brief A detected beat. */
+struct heart_rate_beat
+{
+    /** Index of the peak sample since heart_rate_init(). */
+    uint32_t sample;
+    /** Position of the interpolated peak relative to sample, in 1/256 samples, -128 to 128. */
+    int16_t fraction;
+    /** Confidence in percent. */
+    uint8_t confidence;
+};
+
+/** @brief Detector state of one channel. */
+struct heart_rate_detector
+{
+    uint16_t rate_hz;
+    uint8_t dc_shift;
+    uint8_t lp_shift;
+    uint8_t threshold_shift;
+    /** Samples processed. */
+    uint32_t count;
+    /** High-pass and low-pass filter states, in 1/256 counts. */
+    int32_t dc[2];
+    int32_t lp;
+    /** Running beat amplitude and detection threshold, in 1/256 counts. */
+    int32_t level;
+    int32_t threshold;
+    /** Previous filtered sample, for the neighbours of the candidate. */
+    int32_t prev;
+    /** Largest sample of the current run above the threshold, 0 outside a run, with the samples around it. */
+    int32_t candidate;
+    int32_t candidate_prev;
+    int32_t candidate_next;
+    uint32_t candidate_sample;
+    /** Last beat, valid when beats is not 0. */
+    uint32_t last_beat;
+    uint32_t beats;
+    /** Running beat interval in 1/16 samples, 0 when unknown. */
+    uint32_t interval;
+    /** Peaks rejected in a row for their interval. */
+    uint8_t rejected;
+    /** Running beat confidence in percent. */
+    uint8_t confidence;
+};
+
+/**
+ * @brief Initialize a detector
+ *
+ * @param[out] det Detector state
+ * @param[in] rate_hz Sample rate in Hz
+ */
+void heart_rate_init(struct heart_rate_detector *det, uint16_t rate_hz);
+
+/**
+ * @brief Run a block of samples through the detector
+ *
+ * Beats are found about half a beat after their peak, they can belong to an earlier block.
+ *
+ * @param[in,out] det Detector state
+ * @param[in] values Samples, 19-bit
+ * @param[in] count Number of samples
+ * @param[out] beats Beats found in this block
+ * @param[in] max_beats Size of beats, further beats are counted but not returned
+ * @return uint8_t Number of beats written to beats
+ */
+uint8_t heart_rate_process(struct heart_rate_detector *det, const uint32_t *values, uint8_t count,
+                           struct heart_rate_beat *beats, uint8_t max_beats);
+
+/**
+ * @brief Get the heart rate from the running beat interval
+ *
+ * @param[in] det Detector state
+ * @return uint8_t Heart rate in bpm, 0 when unknown
+ */
+uint8_t heart_rate_bpm(const struct heart_rate_detector *det);
+
+/**
+ * @brief Get the running confidence of the beats
+ *
+ * @param[in] det Detector state
+ * @return uint8_t Confidence in percent, 0 when the heart rate is unknown
+ */
+uint8_t heart_rate_confidence(const struct heart_rate_detector *det);
+
+/**
+ * @}
+ */
+
+#endif /* HEART_RATE_H_ */
@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include "hrv.h"
+
+BUILD_ASSERT(HRV_RING_SIZE <= 64, "One run start bit per ring slot");
+BUILD_ASSERT(HEART_RATE_MAX_INTERVAL_MS < HRV_INTERVAL_ARTIFACT, "Intervals and the artifact flag share 16 bits");
+
+void hrv_init(struct hrv_tracker *hrv)
+{
+    memset(hrv, 0, sizeof(*hrv));
+}
+
+void hrv_consume(struct hrv_tracker *hrv, uint8_t count)
+{
+    for (; count > 0 && hrv->count > 0; count--)
+    {
+        hrv->tail_ms += HRV_INTERVAL_MS(hrv->ring[hrv->tail]);
+        hrv->tail = (hrv->tail + 1) % HRV_RING_SIZE;
+        hrv->count--;
+
+        if (hrv->count > 0 && (hrv->run_starts & BIT64(hrv->tail)))
+        {
+            hrv->tail_ms = hrv->run_ms[0];
+            hrv->runs--;
+            memmove(&hrv->run_ms[0], &hrv->run_ms[1], hrv->runs * sizeof(hrv->run_ms[0]));
+        }
+    }
+}
+
+static void hrv_push(struct hrv_tracker *hrv, uint16_t entry, uint32_t start_ms, bool run_start)
+{
+    if (hrv->count == HRV_RING_SIZE)
+    {
+        hrv_consume(hrv, 1);
+        hrv->dropped++;
+    }
+
+    if (hrv->count == 0)
+    {
+        hrv->tail_ms = start_ms;
+    }
+    else if (run_start)
+    {
+        // Make room by dropping the oldest run
+        while (hrv->runs == HRV_MAX_RUNS)
+        {
+            hrv_consume(hrv, 1);
+            hrv->dropped++;
+        }
+        hrv->run_ms[hrv->runs++] = start_ms;
+    }
+
+    uint8_t slot = (hrv->tail + hrv->count) % HRV_RING_SIZE;
+
+    hrv->ring[slot] = entry;
+    if (run_start)
+    {
+        hrv->run_starts |= BIT64(slot);
+    }
+    else
+    {
+        hrv->run_starts &= ~BIT64(slot);
+    }
+    hrv->count++;
+}
+
+bool hrv_add_beat(struct hrv_tracker *hrv, uint64_t beat_us)
+{
+    uint32_t beat_ms = (uint32_t)((beat_us + USEC_PER_MSEC / 2) / USEC_PER_MSEC);
+    uint32_t interval = beat_ms - hrv->last_beat_ms;
+    bool had_beat = hrv->have_beat;
+
+    hrv->last_beat_ms = beat_ms;
+    hrv->have_beat = true;
+
+    if (!had_beat || interval > HEART_RATE_MAX_INTERVAL_MS)
+    {
+        hrv->new_run = true;
+        hrv->reference = 0;
+        hrv->last_nn = 0;
+        hrv->artifact_run = 0;
+        return false;
+    }
+
+    uint16_t entry = (uint16_t)interval;
+    bool artifact = hrv->reference && (uint32_t)abs((int32_t)interval - hrv->reference) * 100 >
+                                          (uint32_t)CONFIG_APP_HRV_MAX_CHANGE * hrv->reference;
+
+    if (artifact && ++hrv->artifact_run < HRV_ARTIFACT_LIMIT)
+    {
+        entry |= HRV_INTERVAL_ARTIFACT;
+        hrv->artifacts++;
+        hrv->last_nn = 0;
+    }
+    else
+    {
+        hrv->artifact_run = 0;
+        hrv->reference = interval;
+        hrv->nn_count++;
+        hrv->nn_sum += interval;
+        hrv->nn_sum2 += interval * interval;
+        if (hrv->last_nn)
+        {
+            int32_t diff = (int32_t)interval - hrv->last_nn;
+
+            hrv->diff_count++;
+            hrv->diff_sum2 += (uint64_t)(diff * diff);
+        }
+        hrv->last_nn = interval;
+    }
+
+    hrv_push(hrv, entry, beat_ms - interval, hrv->new_run);
+    hrv->new_run = false;
+
+    return true;
+}
+
+uint8_t hrv_count(const struct hrv_tracker *hrv)
+{
+    return hrv->count;
+}
+
+uint8_t hrv_peek(const struct hrv_tracker *hrv, uint16_t *intervals, uint8_t max, uint32_t *start_ms,
+                 bool *run_start)
+{
+    uint8_t count = 0;
+
+    *start_ms = hrv->tail_ms;
+    *run_start = hrv->count > 0 && (hrv->run_starts & BIT64(hrv->tail));
+
+    while (count < max && count < hrv->count)
+    {
+        uint8_t slot = (hrv->tail + count) % HRV_RING_SIZE;
+
+        if (count > 0 && (hrv->run_starts & BIT64(slot)))
+        {
+            break;
+        }
+        intervals[count++] = hrv->ring[slot];
+    }
+
+    return count;
+}
+
+void hrv_epoch_stats(const struct hrv_tracker *hrv, struct hrv_stats *stats)
+{
+    const uint64_t n = hrv->nn_count;
+
+    memset(stats, 0, sizeof(*stats));
+    stats->nn_count = (uint16_t)MIN(n, UINT16_MAX);
+    stats->artifacts = hrv->artifacts;
+
+    if (n > 0)
+    {
+        stats->mean_nn = (uint16_t)((hrv->nn_sum + n / 2) / n);
+    }
+    if (n > 1)
+    {
+        // Sample variance times n (n - 1), exact in integers
+        uint64_t scaled = n * hrv->nn_sum2 - (uint64_t)hrv->nn_sum * hrv->nn_sum;
+
+        stats->sdnn = (uint16_t)MIN(lroundf(10 * sqrtf((float)scaled / (float)(n * (n - 1)))), UINT16_MAX);
+    }
+    if (hrv->diff_count > 0)
+    {
+        stats->rmssd =
+            (uint16_t)MIN(lroundf(10 * sqrtf((float)hrv->diff_sum2 / (float)hrv->diff_count)), UINT16_MAX);
+    }
+}
+
+void hrv_epoch_reset(struct hrv_tracker *hrv)
+{
+    hrv->nn_count = 0;
+    hrv->nn_sum = 0;
+    hrv->nn_sum2 = 0;
+    hrv->diff_count = 0;
+    hrv->diff_sum2 = 0;
+    hrv->artifacts = 0;
+}
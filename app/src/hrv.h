@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef HRV_H_
+#define HRV_H_
+
+#include <zephyr/kernel.h>
+
+#include "heart_rate.h"
+
+/**@file
+ * @defgroup hrv Heart rate variability
+ * @{
+ * @brief Beat to beat intervals and their RMSSD and SDNN per epoch.
+ *
+ * The beat times come from the interpolated peaks of the detector. They are rounded to a ms before they are
+ * subtracted, so the intervals of a run add up to the time between its first and last beat without drift. A run
+ * starts again after a gap of over HEART_RATE_MAX_INTERVAL_MS.
+ *
+ * An interval that differs more than CONFIG_APP_HRV_MAX_CHANGE percent from the last normal one is most likely a
+ * missed or extra beat and gets HRV_INTERVAL_ARTIFACT set, unless HRV_ARTIFACT_LIMIT of them come in a row and the
+ * heart rate really changed. Only normal to normal (NN) intervals count for the statistics, and RMSSD only counts the
+ * differences between two successive NN intervals.
+ *
+ * The intervals wait in a ring of HRV_RING_SIZE 16-bit values until they are sent. When the ring is full the oldest
+ * interval is dropped.
+ */
+
+/** @brief Intervals the ring holds. */
+#define HRV_RING_SIZE 64
+/** @brief Runs after the oldest one the ring can hold, the oldest run is dropped for another. */
+#define HRV_MAX_RUNS 4
+/** @brief Artifacts in a row after which the interval is taken as the new normal one. */
+#define HRV_ARTIFACT_LIMIT 3
+/** @brief Set in an interval that is not normal to normal. */
+#define HRV_INTERVAL_ARTIFACT BIT(15)
+/** @brief The interval in ms of a ring entry. */
+#define HRV_INTERVAL_MS(entry) ((uint16_t)((entry) & ~HRV_INTERVAL_ARTIFACT))
+
+/** @brief Statistics of the NN intervals of an epoch. */
+struct hrv_stats
+{
+    /** Number of NN intervals. */
+    uint16_t nn_count;
+    /** Mean NN interval in ms, 0 without intervals. */
+    uint16_t mean_nn;
+    /** Standard deviation of the NN intervals in 0.1 ms, 0 with less than 2 intervals. */
+    uint16_t sdnn;
+    /** Root mean square of the successive NN differences in 0.1 ms, 0 without differences. */
+    uint16_t rmssd;
+    /** Number of intervals marked as artifact. */
+    uint16_t artifacts;
+};
+
+/** @brief Interval extraction, ring and epoch sums. */
+struct hrv_tracker
+{
+    /** Uptime in ms of the last beat, valid when have_beat. */
+    uint32_t last_beat_ms;
+    bool have_beat;
+    /** The next interval is the first of a run. */
+    bool new_run;
+    /** Last interval that was not an artifact, 0 at the start of a run. */
+    uint16_t reference;
+    /** Last NN interval, 0 when the last interval was no NN interval. */
+    uint16_t last_nn;
+    /** Artifacts in a row. */
+    uint8_t artifact_run;
+
+    /** Intervals waiting to be sent, the oldest at tail. */
+    uint16_t ring[HRV_RING_SIZE];
+    uint8_t tail;
+    uint8_t count;
+    /** Bit per ring slot, set when the interval in the slot is the first of a run. */
+    uint64_t run_starts;
+    /** Uptime in ms of the beat that starts the oldest interval. */
+    uint32_t tail_ms;
+    /** Uptime in ms of the first beat of the later runs in the ring, oldest first. */
+    uint32_t run_ms[HRV_MAX_RUNS];
+    uint8_t runs;
+    /** Intervals dropped because the ring was full. */
+    uint32_t dropped;
+
+    /** Sums of the current epoch. */
+    uint32_t nn_count;
+    uint32_t nn_sum;
+    uint64_t nn_sum2;
+    uint32_t diff_count;
+    uint64_t diff_sum2;
+    uint16_t artifacts;
+};
+
+/**
+ * @brief Initialize a tracker
+ *
+ * @param[out] hrv Tracker state
+ */
+void hrv_init(struct hrv_tracker *hrv);
+
+/**
+ * @brief Add a beat
+ *
+ * @param[in,out] hrv Tracker state
+ * @param[in] beat_us Uptime of the beat in us
+ * @return true If the beat ended an interval, which went into the ring
+ */
+bool hrv_add_beat(struct hrv_tracker *hrv, uint64_t beat_us);
+
+/**
+ * @brief Get the number of intervals in the ring
+ *
+ * @param[in] hrv Tracker state
+ * @return uint8_t Number of intervals
+ */
+uint8_t hrv_count(const struct hrv_tracker *hrv);
+
+/**
+ * @brief Copy the oldest intervals out of the ring, up to the end of their run
+ *
+ * Intervals of different runs are never copied together, the gap between the runs is unknown.
+ *
+ * @param[in] hrv Tracker state
+ * @param[out] intervals Intervals in ms, HRV_INTERVAL_ARTIFACT set for artifacts
+ * @param[in] max Size of intervals
+ * @param[out] start_ms Uptime in ms of the beat that starts the first interval
+ * @param[out] run_start The first interval is the first of a run
+ * @return uint8_t Number of intervals copied
+ */
+uint8_t hrv_peek(const struct hrv_tracker *hrv, uint16_t *intervals, uint8_t max, uint32_t *start_ms,
+                 bool *run_start);
+
+/**
+ * @brief Drop the oldest intervals from the ring, once they were sent
+ *
+ * @param[in,out] hrv Tracker state
+ * @param[in] count Number of intervals
+ */
+void hrv_consume(struct hrv_tracker *hrv, uint8_t count);
+
+/**
+ * @brief Get the statistics of the current epoch
+ *
+ * @param[in] hrv Tracker state
+ * @param[out] stats Statistics
+ */
+void hrv_epoch_stats(const struct hrv_tracker *hrv, struct hrv_stats *stats);
+
+/**
+ * @brief Start a new epoch, the ring and the current run are kept
+ *
+ * @param[in,out] hrv Tracker state
+ */
+void hrv_epoch_reset(struct hrv_tracker *hrv);
+
+/**
+ * @}
+ */
+
+#endif /* HRV_H_ */
@@ -0,0 +1,232 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <zephyr/bluetooth/bluetooth.h>
+#include <zephyr/bluetooth/conn.h>
+#include <zephyr/bluetooth/l2cap.h>
+#include <zephyr/net/buf.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "tgm_service.h"
+#include "l2cap_stream.h"
+#include "power_budget.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(l2cap_stream, CONFIG_APP_LOG_LEVEL);
+
+#define SDU_SIZE CONFIG_APP_L2CAP_STREAM_SDU_SIZE
+
+// One SDU is filled while the others wait for credits
+NET_BUF_POOL_FIXED_DEFINE(l2cap_stream_pool, CONFIG_APP_L2CAP_STREAM_SDU_COUNT, BT_L2CAP_SDU_BUF_SIZE(SDU_SIZE),
+                          CONFIG_BT_CONN_TX_USER_DATA_SIZE, NULL);
+
+static struct bt_l2cap_le_chan stream_chan;
+static l2cap_stream_state_cb_t stream_state_cb;
+static atomic_t stream_connected;
+
+/** @brief SDU that is being filled with records. */
+static struct
+{
+    /** Serializes the sensor threads and the flush work. */
+    struct k_mutex lock;
+    /** Sends a partly filled SDU after CONFIG_APP_MUX_FLUSH_TIMEOUT_MS. */
+    struct k_work_delayable flush_work;
+    /** SDU counter, sent in front of the records. */
+    uint32_t sdu_counter;
+    /** SDU being filled, NULL when empty. */
+    struct net_buf *buf;
+    /** Size of the SDU being filled, limited by the SDU size of the client. */
+    uint16_t sdu_size;
+    /** Frames added to an SDU. */
+    uint32_t queued;
+    /** SDUs the stack reported as sent. */
+    uint32_t sent;
+    /** Frames dropped for lack of a buffer, or in an SDU that could not be sent. */
+    uint32_t dropped;
+} stream;
+
+static void l2cap_stream_flush(void)
+{
+    struct net_buf *buf = stream.buf;
+
+    if (!buf)
+    {
+        return;
+    }
+
+    k_work_cancel_delayable(&stream.flush_work);
+    stream.buf = NULL;
+
+    // The counter was reserved when the SDU was started
+    sys_put_le32(stream.sdu_counter++, buf->data);
+
+    uint16_t len = buf->len;
+    int err = bt_l2cap_chan_send(&stream_chan.chan, buf);
+    if (err < 0)
+    {
+        LOG_DBG("Failed to send SDU (err %d)", err);
+        stream.dropped++;
+        net_buf_unref(buf);
+        return;
+    }
+
+    power_budget_record(POWER_BUDGET_BLE_TX, len);
+}
+
+static void l2cap_stream_flush_work_handler(struct k_work *work)
+{
+    k_mutex_lock(&stream.lock, K_FOREVER);
+    l2cap_stream_flush();
+    k_mutex_unlock(&stream.lock);
+}
+
+int l2cap_stream_send(uint8_t type, const void *data, uint16_t len)
+{
+    const struct tgm_service_record_header_t header = {.type = type, .len = len};
+    int err = 0;
+
+    if (!atomic_get(&stream_connected))
+    {
+        return -ENOTCONN;
+    }
+
+    // Records never span SDUs
+    if (len > UINT8_MAX || TGM_SERVICE_MUX_HEADER_SIZE + sizeof(header) + len > stream.sdu_size)
+    {
+        return -EMSGSIZE;
+    }
+
+    k_mutex_lock(&stream.lock, K_FOREVER);
+
+    if (stream.buf && stream.buf->len + sizeof(header) + len > stream.sdu_size)
+    {
+        l2cap_stream_flush();
+    }
+
+    if (!stream.buf)
+    {
+        stream.buf = net_buf_alloc(&l2cap_stream_pool, K_NO_WAIT);
+        if (!stream.buf)
+        {
+            stream.dropped++;
+            err = -ENOBUFS;
+            goto unlock;
+        }
+
+        net_buf_reserve(stream.buf, BT_L2CAP_SDU_CHAN_SEND_RESERVE);
+        net_buf_add(stream.buf, TGM_SERVICE_MUX_HEADER_SIZE);
+        k_work_schedule(&stream.flush_work, K_MSEC(CONFIG_APP_MUX_FLUSH_TIMEOUT_MS));
+    }
+
+    net_buf_add_mem(stream.buf, &header, sizeof(header));
+    net_buf_add_mem(stream.buf, data, len);
+    stream.queued++;
+
+unlock:
+    k_mutex_unlock(&stream.lock);
+
+    return err;
+}
+
+bool l2cap_stream_is_connected(void)
+{
+    return atomic_get(&stream_connected);
+}
+
+static void l2cap_stream_connected(struct bt_l2cap_chan *chan)
+{
+    struct bt_l2cap_le_chan *le_chan = BT_L2CAP_LE_CHAN(chan);
+
+    k_mutex_lock(&stream.lock, K_FOREVER);
+    // Never send SDUs larger than the client accepts
+    stream.sdu_size = MIN(le_chan->tx.mtu, SDU_SIZE);
+    k_mutex_unlock(&stream.lock);
+
+    LOG_INF("L2CAP stream connected, SDU size %u, MPS %u", stream.sdu_size, le_chan->tx.mps);
+
+    atomic_set(&stream_connected, true);
+    if (stream_state_cb)
+    {
+        stream_state_cb();
+    }
+}
+
+static void l2cap_stream_disconnected(struct bt_l2cap_chan *chan)
+{
+    atomic_set(&stream_connected, false);
+
+    k_mutex_lock(&stream.lock, K_FOREVER);
+    k_work_cancel_delayable(&stream.flush_work);
+    if (stream.buf)
+    {
+        net_buf_unref(stream.buf);
+        stream.buf = NULL;
+    }
+    k_mutex_unlock(&stream.lock);
+
+    LOG_INF("L2CAP stream disconnected: queued %u frames, sent %u SDUs, dropped %u", stream.queued, stream.sent,
+            stream.dropped);
+
+    if (stream_state_cb)
+    {
+        stream_state_cb();
+    }
+}
+
+static void l2cap_stream_sent(struct bt_l2cap_chan *chan)
+{
+    stream.sent++;
+}
+
+static int l2cap_stream_recv(struct bt_l2cap_chan *chan, struct net_buf *buf)
+{
+    // Nothing is expected from the client
+    return 0;
+}
+
+static const struct bt_l2cap_chan_ops stream_ops = {
+    .connected = l2cap_stream_connected,
+    .disconnected = l2cap_stream_disconnected,
+    .sent = l2cap_stream_sent,
+    .recv = l2cap_stream_recv,
+};
+
+static int l2cap_stream_accept(struct bt_conn *conn, struct bt_l2cap_server *server, struct bt_l2cap_chan **chan)
+{
+    if (stream_chan.chan.conn)
+    {
+        LOG_WRN("L2CAP stream already in use");
+        return -ENOMEM;
+    }
+
+    memset(&stream_chan, 0, sizeof(stream_chan));
+    stream_chan.chan.ops = &stream_ops;
+    *chan = &stream_chan.chan;
+
+    return 0;
+}
+
+static struct bt_l2cap_server stream_server = {
+    .psm = CONFIG_APP_L2CAP_STREAM_PSM,
+    .sec_level = BT_SECURITY_L1,
+    .accept = l2cap_stream_accept,
+};
+
+int l2cap_stream_init(l2cap_stream_state_cb_t state_cb)
+{
+    stream_state_cb = state_cb;
+    k_mutex_init(&stream.lock);
+    k_work_init_delayable(&stream.flush_work, l2cap_stream_flush_work_handler);
+
+    int err = bt_l2cap_server_register(&stream_server);
+    if (err)
+    {
+        LOG_ERR("Failed to register L2CAP server (err %d)", err);
+        return err;
+    }
+
+    LOG_INF("L2CAP stream server on PSM 0x%04x", stream_server.psm);
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef L2CAP_STREAM_H_
+#define L2CAP_STREAM_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup l2cap_stream L2CAP sensor stream
+ * @{
+ * @brief Streams the sensor frames over an L2CAP connection-oriented channel.
+ *
+ * A client that connects to PSM CONFIG_APP_L2CAP_STREAM_PSM receives the PPG, accelerometer and temperature frames
+ * as typed records in large SDUs, with the layout of the multiplexed stream notifications, instead of as GATT
+ * notifications. Clients that do not open the channel keep getting the GATT notifications.
+ */
+
+/** @brief Callback type for when the channel is connected or disconnected. */
+typedef void (*l2cap_stream_state_cb_t)(void);
+
+#if defined(CONFIG_APP_L2CAP_STREAM)
+
+/**
+ * @brief Register the L2CAP server
+ *
+ * @param[in] state_cb Called when the channel is connected or disconnected
+ * @return int 0 on success, negative error code on failure
+ */
+int l2cap_stream_init(l2cap_stream_state_cb_t state_cb);
+
+/**
+ * @brief Check whether a client has the channel open
+ *
+ * @return bool true when frames go over the channel
+ */
+bool l2cap_stream_is_connected(void);
+
+/**
+ * @brief Add a sensor frame to the SDU that is being filled
+ *
+ * The SDU is sent when the next record does not fit, or CONFIG_APP_MUX_FLUSH_TIMEOUT_MS after its first record.
+ *
+ * @param[in] type Record type, one of tgm_service_record_type_t
+ * @param[in] data Frame
+ * @param[in] len Length of the frame
+ * @retval 0 If the frame was added.
+ * @retval -ENOTCONN If the channel is not connected.
+ * @retval -ENOBUFS If no SDU buffer was free, the frame is dropped.
+ */
+int l2cap_stream_send(uint8_t type, const void *data, uint16_t len);
+
+#else
+
+static inline int l2cap_stream_init(l2cap_stream_state_cb_t state_cb)
+{
+    ARG_UNUSED(state_cb);
+    return 0;
+}
+
+static inline bool l2cap_stream_is_connected(void)
+{
+    return false;
+}
+
+static inline int l2cap_stream_send(uint8_t type, const void *data, uint16_t len)
+{
+    ARG_UNUSED(type);
+    ARG_UNUSED(data);
+    ARG_UNUSED(len);
+    return -ENOTCONN;
+}
+
+#endif /* CONFIG_APP_L2CAP_STREAM */
+
+/**
+ * @}
+ */
+
+#endif /* L2CAP_STREAM_H_ */
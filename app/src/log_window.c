@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include "log_window.h"
+
+void log_window_start(struct log_window *window, uint32_t seq, uint8_t size)
+{
+    // The pages before seq stay where they are until the client acknowledges them
+    window->base_seq = seq;
+    window->next_seq = seq;
+    window->size = MAX(size, 1);
+}
+
+int log_window_ack(struct log_window *window, uint32_t seq)
+{
+    const uint32_t acked_seq = seq + 1;
+
+    if ((int32_t)(acked_seq - window->next_seq) > 0)
+    {
+        return -ERANGE;
+    }
+
+    if ((int32_t)(acked_seq - window->base_seq) > 0)
+    {
+        window->base_seq = acked_seq;
+    }
+    if (window->acked_seq == 0 || (int32_t)(acked_seq - window->acked_seq) > 0)
+    {
+        window->acked_seq = acked_seq;
+    }
+
+    return 0;
+}
+
+void log_window_sent(struct log_window *window, uint32_t seq)
+{
+    window->next_seq = seq + 1;
+}
+
+bool log_window_open(const struct log_window *window)
+{
+    return (int32_t)(window->next_seq - window->base_seq) < window->size;
+}
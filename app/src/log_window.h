@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef LOG_WINDOW_H_
+#define LOG_WINDOW_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup log_window Flash log offload window
+ * @{
+ * @brief Flow control of a flash log offload, see tgm_service_log_cmd_t.
+ *
+ * A transfer starts at the page the client asks for, and at most size pages go out ahead of the first page the
+ * client did not acknowledge. The client only acknowledges pages it received, so an acknowledgement past the last
+ * page that went out is rejected. Only the acknowledgements release pages for erasing, the start of a transfer does
+ * not, as the client may ask for any page on.
+ *
+ * Page numbers wrap, the window is compared with the differences of the numbers. The caller serializes the calls.
+ */
+
+/** @brief State of a transfer. */
+struct log_window
+{
+    /** First page of the transfer the client did not acknowledge. */
+    uint32_t base_seq;
+    /** Page after the last page that went out completely. */
+    uint32_t next_seq;
+    /** Pages before it were acknowledged, over all transfers, 0 before the first acknowledgement. */
+    uint32_t acked_seq;
+    /** Most pages out ahead of base_seq. */
+    uint8_t size;
+};
+
+/**
+ * @brief Start a transfer
+ *
+ * @param[in,out] window Window
+ * @param[in] seq First page the client wants
+ * @param[in] size Most pages out ahead of the acknowledged ones, at least 1
+ */
+void log_window_start(struct log_window *window, uint32_t seq, uint8_t size);
+
+/**
+ * @brief Take an acknowledgement of the client
+ *
+ * @param[in,out] window Window
+ * @param[in] seq Last page the client has
+ * @retval 0 If the acknowledgement was taken, or is older than the last one.
+ * @retval -ERANGE If the page did not go out yet.
+ */
+int log_window_ack(struct log_window *window, uint32_t seq);
+
+/**
+ * @brief Record that a page went out completely
+ *
+ * @param[in,out] window Window
+ * @param[in] seq Page number, pages that are gone from the log are skipped
+ */
+void log_window_sent(struct log_window *window, uint32_t seq);
+
+/**
+ * @brief Check whether the next page may go out
+ *
+ * @param[in] window Window
+ * @return bool True when fewer than size pages are out without acknowledgement
+ */
+bool log_window_open(const struct log_window *window);
+
+/**
+ * @}
+ */
+
+#endif /* LOG_WINDOW_H_ */
@@ -14,6 +14,10 @@
 #include "acc.h"
 #include "battery.h"
 #include "tgm_service.h"
+#include "power_budget.h"
+#include "sensor_profile.h"
+#include "flash_log.h"
+#include "sensor_config.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(main, CONFIG_APP_LOG_LEVEL);
@@ -21,10 +25,18 @@ LOG_MODULE_REGISTER(main, CONFIG_APP_LOG_LEVEL);
 #define GPIO_NODE DT_NODELABEL(gpio0)
 #define SENS_ENABLE_PIN 8
 
-// Device temperature thresholds, with hysteresis
+// Device temperature thresholds, with hysteresis, used to confirm the skin contact
 #define DEVICE_WORN_TEMPERATURE_THRESHOLD 3050
 #define DEVICE_NOT_WORN_TEMPERATURE_THRESHOLD 2950
 
+// Time the sensors need after SENS_ENABLE goes high
+#define SENS_POWER_UP_DELAY_MS 100
+
+// LED pulse amplitudes, each count = 0.12mA with LED range set to 31mA
+#define PPG_LED_PA_INDICATOR 32
+#define PPG_LED_PA_RED 32
+#define PPG_LED_PA_IR 128
+
 enum device_state_t
 {
 	DEVICE_STATE_NOT_WORN_NOT_CHARGING,
@@ -33,6 +45,16 @@ enum device_state_t
 	DEVICE_STATE_INIT,
 };
 
+// Sensor pipelines as driven by the device state
+enum sensor_mode_t
+{
+	SENSOR_MODE_OFF,	   // SENS_ENABLE low, nothing powered
+	SENSOR_MODE_IDLE,	   // Powered, both sensors shut down
+	SENSOR_MODE_INDICATOR, // Green LED pulsing in PPG standby, accelerometer powered down
+	SENSOR_MODE_PROXIMITY, // PPG waiting for skin contact in proximity mode, accelerometer powered down
+	SENSOR_MODE_STREAMING, // Both FIFOs streamed to the client
+};
+
 static volatile bool charging = false;
 static volatile bool worn = false;
 
@@ -43,130 +65,249 @@ static const struct gpio_dt_spec chrsts_gpio = GPIO_DT_SPEC_GET_BY_IDX(DT_PATH(z
 static struct gpio_callback chrsts_cb;
 
 static struct k_work_delayable temperature_work;
+static struct k_work_delayable sensor_mode_work;
 static struct charging_work_t
 {
 	struct k_work work;
 	bool charging_new_state;
 } charging_work;
+static struct contact_work_t
+{
+	struct k_work work;
+	bool contact_new_state;
+} contact_work;
 
 static enum device_state_t device_state = DEVICE_STATE_INIT;
+// Only touched from the system work queue, after main() powered the sensors
+static enum sensor_mode_t sensor_mode = SENSOR_MODE_IDLE;
+static bool client_streaming;
+// Profile the sensors stream with, a different selected profile restarts them
+static enum sensor_profile_id streaming_profile;
+
+// Skin contact as reported by the PPG sensor, the die temperature only confirms it
+static bool skin_contact;
+static int64_t contact_since_ms;
+static bool contact_confirmed;
+// Set when a contact stayed cold for too long, proximity mode is then off until the temperature rises
+static bool contact_vetoed;
+
+// Steady load of every sensor mode, for the power budget
+static const struct power_budget_load sensor_mode_load[] = {
+	[SENSOR_MODE_OFF] = {.sensors_powered = false},
+	[SENSOR_MODE_IDLE] = {.sensors_powered = true},
+	[SENSOR_MODE_INDICATOR] = {.sensors_powered = true,
+							   .ppg_rate_hz = 25,
+							   .ppg_exposures = 1,
+							   .led_pa_sum = PPG_LED_PA_INDICATOR},
+	[SENSOR_MODE_PROXIMITY] = {.sensors_powered = true,
+							   .ppg_rate_hz = 8,
+							   .ppg_exposures = 1,
+							   .led_pa_sum = CONFIG_APP_WEAR_PILOT_PA},
+	// The sample rates come from the sensor profile
+	[SENSOR_MODE_STREAMING] = {.sensors_powered = true,
+							   .ppg_exposures = 3,
+							   .led_pa_sum = PPG_LED_PA_RED + PPG_LED_PA_IR},
+};
 
-static int update_state(bool charging_new_state, bool worn_new_state)
+static enum sensor_mode_t sensor_mode_for_state(enum device_state_t state)
 {
-	int err;
+	switch (state)
+	{
+	case DEVICE_STATE_WORN:
+		return SENSOR_MODE_STREAMING;
+	case DEVICE_STATE_NOT_WORN_CHARGING:
+		return SENSOR_MODE_INDICATOR;
+	case DEVICE_STATE_NOT_WORN_NOT_CHARGING:
+		return contact_vetoed ? SENSOR_MODE_OFF : SENSOR_MODE_PROXIMITY;
+	default:
+		return SENSOR_MODE_IDLE;
+	}
+}
+
+// The fast connection parameters are only worth their current while there is sensor data to send
+static void streaming_changed(bool streaming)
+{
+	client_streaming = streaming;
+	ble_set_streaming(client_streaming && sensor_mode == SENSOR_MODE_STREAMING);
+}
+
+static int sensor_mode_enter(enum sensor_mode_t mode)
+{
+	int err = 0;
 
-	if (charging_new_state == charging && worn_new_state == worn)
+	switch (mode)
 	{
-		// No change, do nothing
-		return 0;
+	case SENSOR_MODE_OFF:
+		// Both sensors are shut down, so nothing drives the bus or the interrupt lines when the supply drops
+		err = gpio_pin_set(gpio, SENS_ENABLE_PIN, 0);
+		break;
+
+	case SENSOR_MODE_IDLE:
+		break;
+
+	case SENSOR_MODE_INDICATOR:
+		err = ppg_standby();
+		err = err ? err : ppg_set_led_pa(PPG_LED_GREEN, PPG_LED_PA_INDICATOR);
+		break;
+
+	case SENSOR_MODE_PROXIMITY:
+		err = ppg_proximity();
+		break;
+
+	case SENSOR_MODE_STREAMING:
+	{
+		const struct sensor_profile *profile = sensor_profile_get(streaming_profile);
+
+		err = ppg_configure(profile->ppg_rate_hz, profile->ppg_average, profile->ppg_frame_samples,
+				    profile->ppg_filter);
+		err = err ? err : acc_configure(profile->acc_rate_mhz, profile->acc_power_mode, profile->acc_frame_samples);
+		// Starting resets the LED pulse amplitudes, so set them afterwards, LEDs with a kept drive keep it
+		err = err ? err : ppg_start();
+		err = err ? err : ppg_set_led_pa(PPG_LED_RED, PPG_LED_PA_RED);
+		err = err ? err : ppg_set_led_pa(PPG_LED_IR, PPG_LED_PA_IR);
+		err = err ? err : acc_start();
+		break;
+	}
 	}
 
-	if (charging_new_state != charging)
+	return err;
+}
+
+static void sensor_mode_leave(enum sensor_mode_t mode)
+{
+	switch (mode)
 	{
-		// Charging state changed
-		charging = charging_new_state;
-		// Check if charging started or stopped
-		if (charging)
-		{
-			// Enable the green LED
-			err = ppg_set_led_pa(PPG_LED_GREEN, 32);
-			if (err)
-			{
-				LOG_ERR("Failed to set PPG LED PA for LED %d", PPG_LED_GREEN);
-				return err;
-			}
-
-			// Charging started
-			device_state = DEVICE_STATE_NOT_WORN_CHARGING;
-		}
-		else
-		{
-			// Disable the green LED
-			err = ppg_set_led_pa(PPG_LED_GREEN, 0);
-			if (err)
-			{
-				LOG_ERR("Failed to disable PPG LED PA for LED %d", PPG_LED_GREEN);
-				return err;
-			}
-
-			if (worn)
-			{
-				// Charging stopped while worn	
-				device_state = DEVICE_STATE_WORN;
-			}
-			else
-			{
-				// Charging stopped while not worn
-				device_state = DEVICE_STATE_NOT_WORN_NOT_CHARGING;
-			}
-		}
+	case SENSOR_MODE_OFF:
+		(void)gpio_pin_set(gpio, SENS_ENABLE_PIN, 1);
+		break;
+
+	case SENSOR_MODE_IDLE:
+		break;
+
+	case SENSOR_MODE_INDICATOR:
+	case SENSOR_MODE_PROXIMITY:
+		(void)ppg_stop();
+		break;
+
+	case SENSOR_MODE_STREAMING:
+		// The streams stay queued in the drivers, stopping only gates the interrupts and the work they submit
+		(void)acc_stop();
+		(void)ppg_stop();
+		break;
 	}
+}
 
-	if (worn_new_state != worn)
+static void sensor_mode_work_handler(struct k_work *work)
+{
+	enum sensor_mode_t target = sensor_mode_for_state(device_state);
+	enum sensor_profile_id profile = sensor_profile_current();
+
+	if (target == sensor_mode && (target != SENSOR_MODE_STREAMING || profile == streaming_profile))
 	{
-		// Worn state changed
-		worn = worn_new_state;
-		// Check if worn started or stopped
-		if (worn)
-		{
-			// Enable the Red and IR LEDs
-			err = ppg_set_led_pa(PPG_LED_RED, 32);
-			if (err)
-			{
-				LOG_ERR("Failed to set PPG LED PA for LED %d", PPG_LED_RED);
-				return err;
-			}
-
-			err = ppg_set_led_pa(PPG_LED_IR, 128);
-			if (err)
-			{
-				LOG_ERR("Failed to set PPG LED PA for LED %d", PPG_LED_IR);
-				return err;
-			}
-
-			// Worn started
-			device_state = DEVICE_STATE_WORN;
-		}
-		else
-		{
-			// Disable the Red and IR LEDs
-			err = ppg_set_led_pa(PPG_LED_RED, 0);
-			if (err)
-			{
-				LOG_ERR("Failed to disable PPG LED PA for LED %d", PPG_LED_RED);
-				return err;
-			}
-
-			err = ppg_set_led_pa(PPG_LED_IR, 0);
-			if (err)
-			{
-				LOG_ERR("Failed to disable PPG LED PA for LED %d", PPG_LED_IR);
-				return err;
-			}
-			
-			if (charging)
-			{
-				// Worn stopped while charging
-				device_state = DEVICE_STATE_NOT_WORN_CHARGING;
-			}
-			else
-			{
-				// Worn stopped while not charging
-				device_state = DEVICE_STATE_NOT_WORN_NOT_CHARGING;
-			}
-		}
+		return;
+	}
+
+	// Every transition goes through idle, so each mode only has to undo itself
+	sensor_mode_leave(sensor_mode);
+	if (sensor_mode == SENSOR_MODE_OFF)
+	{
+		// Give the sensors time to power up before they are configured
+		sensor_mode = SENSOR_MODE_IDLE;
+		k_work_reschedule(&sensor_mode_work, K_MSEC(SENS_POWER_UP_DELAY_MS));
+		return;
+	}
+
+	streaming_profile = profile;
+	int err = sensor_mode_enter(target);
+	if (err)
+	{
+		LOG_ERR("Failed to enter sensor mode %d with error %d", target, err);
+	}
+
+	sensor_mode = target;
+	LOG_INF("Sensor mode changed to %d", sensor_mode);
+
+	struct power_budget_load load = sensor_mode_load[sensor_mode];
+	if (sensor_mode == SENSOR_MODE_STREAMING)
+	{
+		load.ppg_rate_hz = sensor_profile_get(streaming_profile)->ppg_rate_hz;
+		load.acc_rate_hz = sensor_profile_get(streaming_profile)->acc_rate_mhz / 1000;
+	}
+	power_budget_set_state(device_state, &load);
+	ble_set_streaming(client_streaming && sensor_mode == SENSOR_MODE_STREAMING);
+}
+
+static void profile_changed(enum sensor_profile_id id)
+{
+	// Called from the Bluetooth RX thread, the sensor mode switch restarts a streaming device with the new profile
+	k_work_reschedule(&sensor_mode_work, K_NO_WAIT);
+}
+
+static void update_state(bool charging_new_state, bool contact_new_state)
+{
+	if (contact_new_state && !skin_contact)
+	{
+		// The temperature gets CONFIG_APP_WEAR_CONFIRM_TIMEOUT to confirm a new contact
+		contact_since_ms = k_uptime_get();
+		contact_confirmed = false;
+	}
+	skin_contact = contact_new_state;
+
+	bool worn_new_state = skin_contact;
+	if (charging_new_state == charging && worn_new_state == worn && device_state != DEVICE_STATE_INIT)
+	{
+		// No change, do nothing
+		return;
+	}
+
+	charging = charging_new_state;
+	worn = worn_new_state;
+
+	// A device on the charger is not worn, whatever its temperature or contact
+	if (charging)
+	{
+		device_state = DEVICE_STATE_NOT_WORN_CHARGING;
+	}
+	else if (worn)
+	{
+		device_state = DEVICE_STATE_WORN;
+	}
+	else
+	{
+		device_state = DEVICE_STATE_NOT_WORN_NOT_CHARGING;
 	}
 
 	LOG_INF("Device state changed to %d", device_state);
 
-	return 0;
+	// All callers run on the system work queue, so does the sensor mode switch
+	k_work_reschedule(&sensor_mode_work, K_NO_WAIT);
 }
 
 static void charging_work_handler(struct k_work *work)
 {
 	struct charging_work_t *charging_work = CONTAINER_OF(work, struct charging_work_t, work);
 
-	update_state(charging_work->charging_new_state, worn);
+	// Contact is detected again once the device is off the charger
+	if (charging_work->charging_new_state)
+	{
+		contact_vetoed = false;
+	}
+
+	update_state(charging_work->charging_new_state, skin_contact && !charging_work->charging_new_state);
+}
+
+static void contact_work_handler(struct k_work *work)
+{
+	struct contact_work_t *contact_work = CONTAINER_OF(work, struct contact_work_t, work);
+
+	update_state(charging, contact_work->contact_new_state);
+}
+
+static void contact_changed(bool contact)
+{
+	// Called from the system work queue or the PPG stream thread
+	contact_work.contact_new_state = contact;
+	k_work_submit(&contact_work.work);
 }
 
 static void temperature_work_handler(struct k_work *work)
@@ -194,13 +335,29 @@ static void temperature_work_handler(struct k_work *work)
 	centitemp = temp_value.val1 * 100 + temp_value.val2 / 10000;
 	LOG_INF("Temperature: %d.%02d C", centitemp / 100, centitemp % 100);
 
-	// Check if the device is worn (temperature > 30C)
+	// The temperature confirms a skin contact, or vetoes one that stays cold (> 30C when worn)
 	if (centitemp > DEVICE_WORN_TEMPERATURE_THRESHOLD)
 	{
-		update_state(charging, true);
+		contact_confirmed = skin_contact;
+		if (contact_vetoed)
+		{
+			// Warm after all, stream and let the PPG level tell whether the skin is there
+			LOG_INF("Skin contact confirmed by the temperature");
+			contact_vetoed = false;
+			update_state(charging, true);
+		}
 	}
-	else if (centitemp < DEVICE_NOT_WORN_TEMPERATURE_THRESHOLD)
+	else if (skin_contact && !contact_confirmed && centitemp < DEVICE_NOT_WORN_TEMPERATURE_THRESHOLD &&
+			 k_uptime_get() - contact_since_ms > CONFIG_APP_WEAR_CONFIRM_TIMEOUT * MSEC_PER_SEC)
 	{
+		LOG_INF("Skin contact not confirmed by the temperature");
+		contact_vetoed = true;
+		update_state(charging, false);
+	}
+
+	if (device_state == DEVICE_STATE_INIT)
+	{
+		// Wait for skin contact in proximity mode
 		update_state(charging, false);
 	}
 
@@ -252,6 +409,8 @@ static void chrsts_callback(const struct device *dev, struct gpio_callback *cb,
 
 struct tgm_service_cb tgm_service_callbacks = {
 	.bat_cb = battery_voltage_read,
+	.streaming_cb = streaming_changed,
+	.bulk_transfer_cb = ble_set_bulk_transfer,
 };
 
 int main(void)
@@ -274,14 +433,36 @@ int main(void)
 	if (err)
 	{
 		LOG_ERR("ble_init() returned %d", err);
-		return err;
+		// native_sim only has a controller when started with --bt-dev, keep the sensors running without one
+		if (!IS_ENABLED(CONFIG_BOARD_NATIVE_SIM))
+		{
+			return err;
+		}
 	}
 
 	tgm_service_init(&tgm_service_callbacks);
 
+	// Summaries nobody listens to are logged from the first sensor frame on
+	err = flash_log_init();
+	if (err)
+	{
+		LOG_ERR("flash_log_init() returned %d", err);
+	}
+
+	// The kept sensor configuration, before the sensor profile restores its part of it
+	err = sensor_config_init();
+	if (err)
+	{
+		LOG_ERR("sensor_config_init() returned %d", err);
+	}
+
 	// Initialize the temperature monitoring
 	k_work_init_delayable(&temperature_work, temperature_work_handler);
 
+	// The sensors are started by the first state update, once the charging and worn state are known
+	k_work_init_delayable(&sensor_mode_work, sensor_mode_work_handler);
+	sensor_profile_init(profile_changed);
+
 	ble_adv_start();
 
 	err = battery_init(NULL);
@@ -306,9 +487,11 @@ int main(void)
 	}
 
 	// Wait for the sensor to power up
-	k_sleep(K_MSEC(100));
+	k_sleep(K_MSEC(SENS_POWER_UP_DELAY_MS));
 
-	err = ppg_init();
+	k_work_init(&contact_work.work, contact_work_handler);
+
+	err = ppg_init(contact_changed);
 	if (err)
 	{
 		LOG_ERR("ppg_init() returned %d", err);
@@ -347,19 +530,6 @@ int main(void)
 		return err;
 	}
 
-	// Start the sensors
-	err = ppg_start();
-	if (err)
-	{
-		LOG_ERR("Failed to start the PPG sensor with error %d", err);
-	}
-
-	err = acc_start();
-	if (err)
-	{
-		LOG_ERR("Failed to start the accelerometer sensor with error %d", err);
-	}
-
 	// Start the temperature monitoring
 	k_work_reschedule(&temperature_work, K_NO_WAIT);
 
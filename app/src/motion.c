@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include "motion.h"
+
+// Regularization of the NLMS normalization, a delay line at a tenth of the motion threshold
+#define MOTION_EPS ((int64_t)MOTION_WEIGHTS * MOTION_THRESHOLD * MOTION_THRESHOLD / 100 + 1)
+// Motion threshold in accelerometer counts
+#define MOTION_THRESHOLD (CONFIG_APP_MOTION_THRESHOLD_MG * MOTION_COUNTS_PER_G / 1000)
+
+static struct k_spinlock motion_ref_lock;
+static struct
+{
+    uint64_t time;
+    struct acc_sample sample;
+} motion_ref[MOTION_REFERENCE_SIZE];
+// Next slot to write and number of valid slots
+static uint8_t motion_ref_head;
+static uint8_t motion_ref_count;
+
+void motion_reference_reset(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&motion_ref_lock);
+    motion_ref_count = 0;
+    k_spin_unlock(&motion_ref_lock, key);
+}
+
+void motion_reference_put(const struct acc_sample *samples, uint8_t count, uint64_t timestamp, uint32_t period_ns)
+{
+    k_spinlock_key_t key = k_spin_lock(&motion_ref_lock);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        motion_ref[motion_ref_head].time = timestamp - (uint64_t)(count - 1 - i) * period_ns;
+        motion_ref[motion_ref_head].sample = samples[i];
+        motion_ref_head = (motion_ref_head + 1) % MOTION_REFERENCE_SIZE;
+        motion_ref_count = MIN(motion_ref_count + 1, MOTION_REFERENCE_SIZE);
+    }
+
+    k_spin_unlock(&motion_ref_lock, key);
+}
+
+static int16_t motion_interpolate(int16_t a, int16_t b, uint32_t frac)
+{
+    return (int16_t)(a + (((int32_t)b - a) * (int32_t)frac >> 16));
+}
+
+int motion_reference_resample(uint64_t timestamp, uint32_t period_ns, uint8_t count, struct acc_sample *ref)
+{
+    k_spinlock_key_t key = k_spin_lock(&motion_ref_lock);
+
+    if (motion_ref_count == 0)
+    {
+        k_spin_unlock(&motion_ref_lock, key);
+        return -ENODATA;
+    }
+
+    uint8_t oldest = (motion_ref_head + MOTION_REFERENCE_SIZE - motion_ref_count) % MOTION_REFERENCE_SIZE;
+    uint8_t newest = (motion_ref_head + MOTION_REFERENCE_SIZE - 1) % MOTION_REFERENCE_SIZE;
+    uint8_t covered = 0;
+    // Index from the oldest of the ring sample at or before the PPG sample, the PPG times only go up
+    uint8_t n = 0;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint64_t t = timestamp - (uint64_t)(count - 1 - i) * period_ns;
+
+        if (t <= motion_ref[oldest].time)
+        {
+            ref[i] = motion_ref[oldest].sample;
+            covered = i + 1;
+            continue;
+        }
+        if (t >= motion_ref[newest].time)
+        {
+            ref[i] = motion_ref[newest].sample;
+            if (t == motion_ref[newest].time)
+            {
+                covered = i + 1;
+            }
+            continue;
+        }
+
+        while (motion_ref[(oldest + n + 1) % MOTION_REFERENCE_SIZE].time <= t)
+        {
+            n++;
+        }
+
+        const typeof(motion_ref[0]) *a = &motion_ref[(oldest + n) % MOTION_REFERENCE_SIZE];
+        const typeof(motion_ref[0]) *b = &motion_ref[(oldest + n + 1) % MOTION_REFERENCE_SIZE];
+        uint32_t frac = (uint32_t)(((t - a->time) << 16) / (b->time - a->time));
+
+        ref[i].x = motion_interpolate(a->sample.x, b->sample.x, frac);
+        ref[i].y = motion_interpolate(a->sample.y, b->sample.y, frac);
+        ref[i].z = motion_interpolate(a->sample.z, b->sample.z, frac);
+        covered = i + 1;
+    }
+
+    k_spin_unlock(&motion_ref_lock, key);
+
+    return covered;
+}
+
+void motion_init(struct motion_canceller *mc, uint16_t rate_hz)
+{
+    uint8_t log2_rate = find_msb_set(MAX(rate_hz, 1)) - 1;
+
+    memset(mc, 0, sizeof(*mc));
+    // First order high-pass of about 0.1Hz, its phase shift at the motion frequencies is small enough for a few taps
+    mc->hp_shift = log2_rate + 1;
+    // NLMS step size of 1/rate, the weights follow changes in about a second but average the pulse out
+    mc->mu = (uint16_t)(32768 / MAX(rate_hz, 1));
+}
+
+// High-pass the acceleration and shift it into the delay line, returns the power of the new sample
+static int64_t motion_reference_shift(struct motion_canceller *mc, const struct acc_sample *ref)
+{
+    const int16_t axes[3] = {ref->x, ref->y, ref->z};
+    int64_t power = 0;
+
+    for (uint8_t axis = 0; axis < 3; axis++)
+    {
+        int32_t a = (int32_t)axes[axis] << 8;
+        int16_t *line = &mc->x[axis * MOTION_TAPS];
+
+        if (mc->count == 0)
+        {
+            mc->lp[axis] = a;
+        }
+        mc->lp[axis] += (a - mc->lp[axis]) >> mc->hp_shift;
+
+        int16_t x = (int16_t)CLAMP((a - mc->lp[axis]) >> 8, INT16_MIN, INT16_MAX);
+
+        mc->norm -= (int32_t)line[MOTION_TAPS - 1] * line[MOTION_TAPS - 1];
+        memmove(&line[1], &line[0], (MOTION_TAPS - 1) * sizeof(line[0]));
+        line[0] = x;
+        mc->norm += (int32_t)x * x;
+        power += (int32_t)x * x;
+    }
+
+    return power;
+}
+
+// Returns the high-passed sample and sets the sample to the cleaned value, err to the high-passed cleaned value
+static int32_t motion_channel_run(struct motion_canceller *mc, struct motion_channel *ch, uint32_t *value,
+                                  bool adapt, int32_t *err)
+{
+    int32_t s = (int32_t)(*value << 8);
+
+    if (mc->count == 0)
+    {
+        ch->hp = s;
+    }
+    ch->hp += (s - ch->hp) >> mc->hp_shift;
+
+    int32_t d = (s - ch->hp) >> 8;
+    int64_t acc = 0;
+
+    for (uint8_t k = 0; k < MOTION_WEIGHTS; k++)
+    {
+        acc += (int64_t)ch->w[k] * mc->x[k];
+    }
+
+    int32_t y = (int32_t)(acc >> 16);
+    int32_t e = d - y;
+
+    if (adapt)
+    {
+        int64_t g = ((int64_t)e * mc->mu << 16) / (mc->norm + MOTION_EPS);
+
+        for (uint8_t k = 0; k < MOTION_WEIGHTS; k++)
+        {
+            ch->w[k] += (int32_t)((g * mc->x[k]) >> 15);
+        }
+    }
+
+    *value = (uint32_t)CLAMP((int32_t)*value - y, 0, (int32_t)MAXM86161_FIFO_DATA_MASK);
+    *err = e;
+
+    return d;
+}
+
+void motion_process(struct motion_canceller *mc, struct ppg_sample *samples, const struct acc_sample *ref,
+                    uint8_t count, struct motion_frame *frame)
+{
+    int64_t sum_power = 0;
+    int64_t sum_d2 = 0;
+    int64_t sum_e2 = 0;
+
+    memset(frame, 0, sizeof(*frame));
+
+    if (ref == NULL)
+    {
+        frame->flags = MOTION_FLAG_NO_REFERENCE;
+        return;
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        int64_t power = motion_reference_shift(mc, &ref[i]);
+        int32_t d;
+        int32_t e;
+
+        sum_power += power;
+        mc->energy += (power - mc->energy) >> 3;
+        // Let the high-pass and the delay line settle before adapting
+        bool adapt = mc->count >= MOTION_TAPS && mc->energy > (int64_t)MOTION_THRESHOLD * MOTION_THRESHOLD;
+
+        if (adapt)
+        {
+            frame->flags |= MOTION_FLAG_MOVING;
+        }
+
+        (void)motion_channel_run(mc, &mc->channel[0], &samples[i].red, adapt, &e);
+        d = motion_channel_run(mc, &mc->channel[1], &samples[i].ir, adapt, &e);
+        sum_d2 += (int64_t)d * d;
+        sum_e2 += (int64_t)e * e;
+        (void)motion_channel_run(mc, &mc->channel[2], &samples[i].green, adapt, &e);
+
+        mc->count++;
+    }
+
+    if (count > 0)
+    {
+        float rms = sqrtf((float)sum_power / count);
+
+        frame->activity = (uint16_t)MIN(lroundf(rms * 1000 / MOTION_COUNTS_PER_G), UINT16_MAX);
+    }
+    if (sum_e2 > 0 && sum_d2 > sum_e2)
+    {
+        frame->reduction = (uint8_t)MIN(lroundf(10 * log10f((float)sum_d2 / (float)sum_e2)), UINT8_MAX);
+    }
+}
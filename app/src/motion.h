@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef MOTION_H_
+#define MOTION_H_
+
+#include <zephyr/kernel.h>
+#include <app/drivers/lis2dtw12.h>
+#include <app/drivers/maxm86161.h>
+
+/**@file
+ * @defgroup motion Motion artifact cancellation
+ * @{
+ * @brief Adaptive noise canceller for the PPG channels with the accelerometer as reference.
+ *
+ * The accelerometer stream puts its samples with their times in a reference ring. The PPG stream resamples the ring
+ * at the times of its own samples, by linear interpolation, so the two sensors do not have to share a rate or a frame
+ * length.
+ *
+ * Per PPG sample, the three axes go through a first order high-pass of about 0.1Hz that takes out gravity, and into a
+ * delay line of MOTION_TAPS samples per axis. Every PPG channel goes through the same high-pass and has its own
+ * normalized LMS filter over the delay line that estimates the artifact in it. The estimate is subtracted from the
+ * sample. The weights only adapt while the device moves, so the ballistocardiogram in a still accelerometer signal can
+ * not teach the filter to cancel the pulse itself.
+ *
+ * Everything runs in fixed point. The work per sample is fixed by MOTION_TAPS: two multiply-accumulates per weight and
+ * channel and one division per channel.
+ */
+
+/** @brief Delay line length per axis. */
+#define MOTION_TAPS CONFIG_APP_MOTION_CANCEL_TAPS
+/** @brief Weights per PPG channel. */
+#define MOTION_WEIGHTS (3 * MOTION_TAPS)
+/** @brief Accelerometer samples the reference ring holds. */
+#define MOTION_REFERENCE_SIZE 64
+/** @brief 1 g in accelerometer counts. */
+#define MOTION_COUNTS_PER_G 16384
+
+/** @brief Flags of a processed frame. */
+enum motion_flags
+{
+    /** The high-passed acceleration was over CONFIG_APP_MOTION_THRESHOLD_MG, the filters adapted. */
+    MOTION_FLAG_MOVING = BIT(0),
+    /** There was no accelerometer data for the frame, the samples were not changed. */
+    MOTION_FLAG_NO_REFERENCE = BIT(1),
+};
+
+/** @brief Summary of a processed frame. */
+struct motion_frame
+{
+    /** RMS of the high-passed acceleration in mg. */
+    uint16_t activity;
+    /** Artifact power taken out of the high-passed IR channel in dB, 0 when nothing was taken out. */
+    uint8_t reduction;
+    /** Combination of motion_flags. */
+    uint8_t flags;
+};
+
+/** @brief Filter of one PPG channel. */
+struct motion_channel
+{
+    /** High-pass filter state, in 1/256 counts. */
+    int32_t hp;
+    /** Weights in 1/65536 counts per accelerometer count. */
+    int32_t w[MOTION_WEIGHTS];
+};
+
+/** @brief Canceller state of the three PPG channels. */
+struct motion_canceller
+{
+    uint8_t hp_shift;
+    /** NLMS step size in 1/32768. */
+    uint16_t mu;
+    /** Accelerometer high-pass states, in 1/256 counts. */
+    int32_t lp[3];
+    /** Delay line, MOTION_TAPS samples per axis, newest first. */
+    int16_t x[MOTION_WEIGHTS];
+    /** Sum of the squares of the delay line. */
+    int64_t norm;
+    /** Running power of the high-passed acceleration, in counts squared. */
+    int64_t energy;
+    /** Samples processed. */
+    uint32_t count;
+    /** Red, IR and green. */
+    struct motion_channel channel[3];
+};
+
+/**
+ * @brief Drop all accelerometer samples, e.g. when the accelerometer restarts
+ */
+void motion_reference_reset(void);
+
+/**
+ * @brief Add accelerometer samples to the reference ring, called from the accelerometer stream
+ *
+ * @param[in] samples Samples, oldest first
+ * @param[in] count Number of samples
+ * @param[in] timestamp Time of the last sample in ns
+ * @param[in] period_ns Sample period in ns
+ */
+void motion_reference_put(const struct acc_sample *samples, uint8_t count, uint64_t timestamp, uint32_t period_ns);
+
+/**
+ * @brief Resample the reference ring at the times of a PPG frame
+ *
+ * Samples after the newest accelerometer sample get the newest one, samples before the oldest the oldest.
+ *
+ * @param[in] timestamp Time of the last PPG sample in ns
+ * @param[in] period_ns PPG sample period in ns
+ * @param[in] count Number of PPG samples
+ * @param[out] ref Acceleration at every PPG sample
+ * @return int Number of PPG samples, from the first, that lie within the ring,
+ *         -ENODATA if the ring is empty
+ */
+int motion_reference_resample(uint64_t timestamp, uint32_t period_ns, uint8_t count, struct acc_sample *ref);
+
+/**
+ * @brief Initialize a canceller
+ *
+ * @param[out] mc Canceller state
+ * @param[in] rate_hz PPG sample rate in Hz
+ */
+void motion_init(struct motion_canceller *mc, uint16_t rate_hz);
+
+/**
+ * @brief Take the motion artifacts out of a PPG frame
+ *
+ * @param[in,out] mc Canceller state
+ * @param[in,out] samples PPG samples, 19-bit
+ * @param[in] ref Acceleration at every PPG sample, NULL when there is none
+ * @param[in] count Number of samples
+ * @param[out] frame Summary of the frame
+ */
+void motion_process(struct motion_canceller *mc, struct ppg_sample *samples, const struct acc_sample *ref,
+                    uint8_t count, struct motion_frame *frame);
+
+/**
+ * @}
+ */
+
+#endif /* MOTION_H_ */
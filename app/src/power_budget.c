@@ -0,0 +1,212 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <zephyr/kernel.h>
+
+#include "power_budget.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(power_budget, CONFIG_APP_LOG_LEVEL);
+
+// Typical figures from the nRF52832, MAXM86161 and LIS2DTW12 datasheets, currents in nA and charges in nC
+
+// System ON idle with the RTC running
+#define SYSTEM_IDLE_NA 3000
+// MAXM86161 in shutdown
+#define MAXM86161_SHUTDOWN_NA 1600
+// MAXM86161 PPG ADC conversion of one exposure
+#define MAXM86161_EXPOSURE_NC 60
+// LED charge of one exposure per pulse amplitude count in pC, 0.12mA for 117.3us at the 31mA range
+#define MAXM86161_LED_PC_PER_PA 14080
+// LIS2DTW12 in power-down
+#define LIS2DTW12_POWER_DOWN_NA 50
+// LIS2DTW12 in low power mode 4 with low noise, per sample
+#define LIS2DTW12_SAMPLE_NC 80
+// CPU wake-up to serve a FIFO interrupt, 2mA for 125us
+#define FIFO_DRAIN_NC 250
+// TWIM at 400kHz with the HF clock running, per byte
+#define I2C_BYTE_NC 25
+// Radio ramp-up and packet overhead of a notification at 0dBm
+#define BLE_PACKET_NC 600
+// Radio at 0dBm on the 2M PHY, per byte
+#define BLE_BYTE_NC 24
+
+static struct
+{
+    struct k_spinlock lock;
+    struct k_work_delayable report_work;
+    // Device state and steady current of the current window
+    uint8_t state;
+    uint32_t steady_na;
+    // Start of the current window and activity counted in it
+    int64_t start_ms;
+    uint64_t activity_nc;
+    uint32_t drains;
+    uint32_t packets;
+    bool started;
+} budget;
+
+static uint32_t power_budget_steady_na(const struct power_budget_load *load)
+{
+    uint32_t na = SYSTEM_IDLE_NA;
+
+    if (!load->sensors_powered)
+    {
+        return na;
+    }
+
+    // A charge per sample times samples per second is a current
+    if (load->ppg_rate_hz)
+    {
+        na += load->ppg_rate_hz * load->ppg_exposures * MAXM86161_EXPOSURE_NC;
+        na += (uint32_t)((uint64_t)load->ppg_rate_hz * load->led_pa_sum * MAXM86161_LED_PC_PER_PA / 1000);
+    }
+    else
+    {
+        na += MAXM86161_SHUTDOWN_NA;
+    }
+
+    na += load->acc_rate_hz ? load->acc_rate_hz * LIS2DTW12_SAMPLE_NC : LIS2DTW12_POWER_DOWN_NA;
+
+    return na;
+}
+
+// Log the average current of the current window and start a new one, with the load of the given state
+static void power_budget_report(uint8_t state, const struct power_budget_load *load)
+{
+    k_spinlock_key_t key = k_spin_lock(&budget.lock);
+    int64_t now_ms = k_uptime_get();
+    int64_t elapsed_ms = now_ms - budget.start_ms;
+    uint8_t prev_state = budget.state;
+    uint32_t steady_na = budget.steady_na;
+    uint64_t activity_nc = budget.activity_nc;
+    uint32_t drains = budget.drains;
+    uint32_t packets = budget.packets;
+    bool started = budget.started;
+
+    budget.start_ms = now_ms;
+    budget.activity_nc = 0;
+    budget.drains = 0;
+    budget.packets = 0;
+    if (load)
+    {
+        budget.state = state;
+        budget.steady_na = power_budget_steady_na(load);
+        budget.started = true;
+    }
+    k_spin_unlock(&budget.lock, key);
+
+    if (started && elapsed_ms > 0)
+    {
+        // nC per ms is uA
+        uint32_t activity_na = (uint32_t)(activity_nc * 1000 / elapsed_ms);
+
+        LOG_INF("power budget: state %u for %u s, %u uA (steady %u uA, activity %u uA, %u drains, %u packets)",
+                prev_state, (uint32_t)(elapsed_ms / 1000), (steady_na + activity_na) / 1000, steady_na / 1000,
+                activity_na / 1000, drains, packets);
+    }
+}
+
+static void power_budget_report_work_handler(struct k_work *work)
+{
+    power_budget_report(0, NULL);
+
+    k_work_reschedule(&budget.report_work, K_SECONDS(CONFIG_APP_POWER_BUDGET_REPORT_INTERVAL));
+}
+
+void power_budget_set_state(uint8_t state, const struct power_budget_load *load)
+{
+    if (!budget.started)
+    {
+        k_work_init_delayable(&budget.report_work, power_budget_report_work_handler);
+    }
+
+    power_budget_report(state, load);
+
+    k_work_reschedule(&budget.report_work, K_SECONDS(CONFIG_APP_POWER_BUDGET_REPORT_INTERVAL));
+}
+
+void power_budget_record(enum power_budget_event event, uint32_t bytes)
+{
+    k_spinlock_key_t key = k_spin_lock(&budget.lock);
+
+    switch (event)
+    {
+    case POWER_BUDGET_PPG_FIFO:
+    case POWER_BUDGET_ACC_FIFO:
+        budget.activity_nc += FIFO_DRAIN_NC + bytes * I2C_BYTE_NC;
+        budget.drains++;
+        break;
+
+    case POWER_BUDGET_BLE_TX:
+        budget.activity_nc += BLE_PACKET_NC + bytes * BLE_BYTE_NC;
+        budget.packets++;
+        break;
+    }
+
+    k_spin_unlock(&budget.lock, key);
+}
+
+#if defined(CONFIG_APP_POWER_BUDGET_SCENARIO)
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/init.h>
+
+#include <app/drivers/die_temp_emul.h>
+#include <app/drivers/maxm86161_emul.h>
+
+// Walk the emulated device through every state, so each one gets a budget
+static const struct device *const scenario_temp = DEVICE_DT_GET(DT_NODELABEL(temp));
+static const struct emul *const scenario_ppg = EMUL_DT_GET(DT_NODELABEL(maxm86161));
+static const struct gpio_dt_spec scenario_chrsts = GPIO_DT_SPEC_GET_BY_IDX(DT_PATH(zephyr_user), chrsts_gpios, 0);
+
+static const struct
+{
+    const char *name;
+    int16_t centitemp;
+    bool skin_contact;
+    // Physical level of the active low charger status pin
+    int chrsts_level;
+} scenario_steps[] = {
+    {"worn", 3400, true, 1},
+    {"not worn", 2500, false, 1},
+    {"charging", 2500, false, 0},
+    {"worn again", 3400, true, 1},
+};
+
+static struct k_work_delayable scenario_work;
+static uint8_t scenario_step;
+
+static void scenario_apply(void)
+{
+    LOG_INF("power budget scenario: %s", scenario_steps[scenario_step].name);
+    die_temp_emul_set(scenario_temp, scenario_steps[scenario_step].centitemp);
+    maxm86161_emul_set_skin_contact(scenario_ppg, scenario_steps[scenario_step].skin_contact);
+    (void)gpio_emul_input_set(scenario_chrsts.port, scenario_chrsts.pin, scenario_steps[scenario_step].chrsts_level);
+}
+
+static void scenario_work_handler(struct k_work *work)
+{
+    scenario_step++;
+    scenario_apply();
+
+    if (scenario_step < ARRAY_SIZE(scenario_steps) - 1)
+    {
+        k_work_reschedule(&scenario_work, K_SECONDS(CONFIG_APP_POWER_BUDGET_SCENARIO_DWELL));
+    }
+}
+
+static int scenario_init(void)
+{
+    k_work_init_delayable(&scenario_work, scenario_work_handler);
+    scenario_apply();
+    k_work_reschedule(&scenario_work, K_SECONDS(CONFIG_APP_POWER_BUDGET_SCENARIO_DWELL));
+
+    return 0;
+}
+
+SYS_INIT(scenario_init, APPLICATION, 0);
+#endif /* CONFIG_APP_POWER_BUDGET_SCENARIO */
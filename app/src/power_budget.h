@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef POWER_BUDGET_H_
+#define POWER_BUDGET_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup power_budget Per-state current budget
+ * @{
+ * @brief Estimate of the average current drawn in every device state.
+ *
+ * The steady load of a state (sensor modes, sample rates and LED pulse amplitudes) and the activity that is counted
+ * while in it (FIFO drains, I2C bytes and radio packets) are turned into charge with typical datasheet figures. A
+ * summary is logged when a state is left and every CONFIG_APP_POWER_BUDGET_REPORT_INTERVAL seconds. On native_sim
+ * the counted activity is the one of the emulated sensors. Without CONFIG_APP_POWER_BUDGET all calls compile away.
+ */
+
+/** @brief Activity that is counted while in a state. */
+enum power_budget_event
+{
+    /** PPG FIFO drain, with the number of bytes read. */
+    POWER_BUDGET_PPG_FIFO,
+    /** Accelerometer FIFO drain, with the number of bytes read. */
+    POWER_BUDGET_ACC_FIFO,
+    /** Notification or SDU handed to the radio, with the number of bytes sent. */
+    POWER_BUDGET_BLE_TX,
+};
+
+/** @brief Steady load of a device state. */
+struct power_budget_load
+{
+    /** Set when SENS_ENABLE powers the sensors. */
+    bool sensors_powered;
+    /** PPG samples per second, 0 when the PPG sensor is shut down. */
+    uint16_t ppg_rate_hz;
+    /** LED exposures per PPG sample. */
+    uint8_t ppg_exposures;
+    /** Sum of the pulse amplitudes of the LEDs in the sequence. */
+    uint16_t led_pa_sum;
+    /** Accelerometer samples per second, 0 when the accelerometer is powered down. */
+    uint16_t acc_rate_hz;
+};
+
+#if defined(CONFIG_APP_POWER_BUDGET)
+
+/**
+ * @brief Close the budget of the current state and start the one of a new state
+ *
+ * @param[in] state Device state, used as index in the report
+ * @param[in] load Steady load of the new state
+ */
+void power_budget_set_state(uint8_t state, const struct power_budget_load *load);
+
+/**
+ * @brief Count activity in the current state
+ *
+ * @param[in] event Kind of activity
+ * @param[in] bytes Number of bytes transferred
+ */
+void power_budget_record(enum power_budget_event event, uint32_t bytes);
+
+#else
+
+static inline void power_budget_set_state(uint8_t state, const struct power_budget_load *load)
+{
+    ARG_UNUSED(state);
+    ARG_UNUSED(load);
+}
+
+static inline void power_budget_record(enum power_budget_event event, uint32_t bytes)
+{
+    ARG_UNUSED(event);
+    ARG_UNUSED(bytes);
+}
+
+#endif /* CONFIG_APP_POWER_BUDGET */
+
+/**
+ * @}
+ */
+
+#endif /* POWER_BUDGET_H_ */
@@ -2,246 +2,1094 @@
  * Copyright (c) 2024 WeeGee bv
  */
 
+#include <string.h>
+
 #include <zephyr/devicetree.h>
-#include <zephyr/drivers/gpio.h>
-#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/rtio/rtio.h>
 
+#include "bruxism.h"
+#include "heart_rate.h"
+#include "hrv.h"
+#include "motion.h"
+#include "power_budget.h"
+#include "ppg_agc.h"
+#include "ppg_filter.h"
+#include "profiling.h"
+#include "sample_clock.h"
+#include "sensor_config.h"
+#include "spo2.h"
 #include "tgm_service.h"
 #include "ppg.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(ppg, CONFIG_APP_LOG_LEVEL);
 
-static struct gpio_callback ppg_int_cb;
-static struct k_work read_ppg_data_work;
-
-struct ppg_reg_work_t
-{
-    struct k_work reg_work;
-    uint8_t reg;
-    uint8_t data;
-    bool read;
-};
-
-static void ppg_reg_work_handler(struct k_work *work);
-
-static struct ppg_reg_work_t ppg_reg_work;
+PROFILING_STAT_DEFINE(ppg_read_stat, "ppg read");
+PROFILING_STAT_DEFINE(ppg_notify_stat, "ppg notify");
+PROFILING_STAT_DEFINE(ppg_latency_stat, "ppg latency");
 
 #if CONFIG_MAXM86161
 #include <app/drivers/maxm86161.h>
 
 #define MAXM86161_NODE DT_NODELABEL(maxm86161)
-static struct gpio_dt_spec ppg_int = GPIO_DT_SPEC_GET(MAXM86161_NODE, int_gpios);
+static const struct device *const ppg_dev = DEVICE_DT_GET(MAXM86161_NODE);
 
-static struct i2c_dt_spec i2c = I2C_DT_SPEC_GET(MAXM86161_NODE);
+// Largest buffer the driver requests for one frame
+#define PPG_BUF_SIZE                                                                                                   \
+    (sizeof(struct maxm86161_encoded_data) + MAXM86161_CARRY_SIZE + 2 + MAXM86161_FIFO_DEPTH * MAXM86161_FIFO_WORD_SIZE)
+#define PPG_BUF_BLOCK_SIZE 32
 #else
 // Give a build error
 #error "No valid PPG sensor driver enabled"
 #endif
 
-/**
- * @brief Callback function for the PPG sensor interrupt
- *
- * @param dev Pointer to the gpio port that triggered the callback
- * @param cb Pointer to the callback data that was used to set up the callback
- * @param pins Bitmask of pins that triggered the callback
- * @return int
- */
-static void ppg_int_handler(const struct device *dev, struct gpio_callback *cb, uint32_t pins)
+// Stream a frame on every FIFO watermark interrupt
+SENSOR_DT_STREAM_IODEV(ppg_stream, MAXM86161_NODE, {SENSOR_TRIG_FIFO_WATERMARK, SENSOR_STREAM_DATA_INCLUDE});
+
+// Room for three frames, so the driver can fill one while the previous ones are decoded and sent
+RTIO_DEFINE_WITH_MEMPOOL(ppg_rtio, 4, 4, 3 * DIV_ROUND_UP(PPG_BUF_SIZE, PPG_BUF_BLOCK_SIZE), PPG_BUF_BLOCK_SIZE,
+                         sizeof(void *));
+
+static rtio_sqe_handle_t ppg_stream_handle;
+
+// Frames in a row with the IR level below the proximity threshold before the skin counts as gone
+#define PPG_CONTACT_LOST_FRAMES 5
+#define PPG_CONTACT_IR_THRESHOLD ((uint32_t)CONFIG_APP_WEAR_PROX_THRESHOLD << 11)
+
+// Start registers: the client registers that are kept, plus the pulse amplitudes and LED range of a restored AGC
+#define PPG_START_REGS (SENSOR_CONFIG_MAX_PPG_REGS + 4)
+BUILD_ASSERT(PPG_START_REGS <= MAXM86161_MAX_START_REGS);
+
+// Reset bit of SYSTEM_CONTROL, a client that writes it forgets the kept registers and AGC drives
+#define PPG_SYSTEM_CONTROL_RESET BIT(0)
+
+// LEDs whose drive ppg_start() restored, ppg_set_led_pa() leaves them alone until the sensor leaves streaming
+static uint8_t ppg_led_restored;
+
+static const struct sensor_trigger ppg_prox_trigger = {.type = SENSOR_TRIG_NEAR_FAR, .chan = SENSOR_CHAN_PROX};
+static ppg_contact_cb_t ppg_contact_cb;
+// Set while streaming, until the IR level says the skin is gone
+static bool ppg_contact;
+static uint8_t ppg_contact_lost_frames;
+
+#if defined(CONFIG_APP_PPG_AGC)
+// Drives are computed in the stream thread and written from the system work queue, in order with ppg_start()
+static struct ppg_agc ppg_agc;
+static struct k_spinlock ppg_agc_lock;
+static struct k_work ppg_agc_work;
+// Set by ppg_start(), cleared when the sensor stops streaming or the LEDs are set by hand
+static bool ppg_agc_enabled;
+// LEDs whose new drive still has to be written
+static uint8_t ppg_agc_pending;
+
+static void ppg_agc_hold(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&ppg_agc_lock);
+    ppg_agc_enabled = false;
+    ppg_agc_pending = 0;
+    k_spin_unlock(&ppg_agc_lock, key);
+}
+
+static uint8_t ppg_agc_update(const struct ppg_sample *samples, uint8_t count)
 {
-    if (pins & BIT(ppg_int.pin))
+    k_spinlock_key_t key = k_spin_lock(&ppg_agc_lock);
+    uint8_t changed = ppg_agc_enabled ? ppg_agc_process(&ppg_agc, samples, count) : 0;
+    ppg_agc_pending |= changed;
+    k_spin_unlock(&ppg_agc_lock, key);
+
+    if (changed)
     {
-        // Read the PPG data outside of the ISR
-        k_work_submit(&read_ppg_data_work);
+        k_work_submit(&ppg_agc_work);
     }
 
-    return;
+    return changed;
 }
 
-static void ppg_read_data(struct k_work *work)
+static void ppg_agc_work_handler(struct k_work *work)
 {
-    struct ppg_sample ppg_data[CONFIG_PPG_SAMPLES_PER_FRAME];
-    uint8_t sample_count;
+    static const enum sensor_channel led_chan[] = {
+        [PPG_LED_GREEN] = SENSOR_CHAN_GREEN,
+        [PPG_LED_IR] = SENSOR_CHAN_IR,
+        [PPG_LED_RED] = SENSOR_CHAN_RED,
+    };
+    uint8_t pa[ARRAY_SIZE(led_chan)];
+    uint8_t range[ARRAY_SIZE(led_chan)];
 
-    // Get the PPG data
-    int err = ppg_sensor_get_data(&i2c, ppg_data, &sample_count);
-    if (err)
+    k_spinlock_key_t key = k_spin_lock(&ppg_agc_lock);
+    uint8_t pending = ppg_agc_pending;
+    ppg_agc_pending = 0;
+    for (int led = 0; led < ARRAY_SIZE(led_chan); led++)
+    {
+        ppg_agc_get(&ppg_agc, led, &pa[led], &range[led]);
+    }
+    k_spin_unlock(&ppg_agc_lock, key);
+
+    if (!pending)
     {
-        LOG_ERR("Failed to read PPG data");
         return;
     }
 
+    for (int led = 0; led < ARRAY_SIZE(led_chan); led++)
+    {
+        if (!(pending & BIT(led)))
+        {
+            continue;
+        }
+
+        const struct sensor_value range_val = {.val1 = range[led]};
+        const struct sensor_value pa_val = {.val1 = pa[led]};
+
+        LOG_DBG("AGC LED %d: PA %u, range %u", led, pa[led], range[led]);
+        if (sensor_attr_set(ppg_dev, led_chan[led], (enum sensor_attribute)MAXM86161_ATTR_LED_RANGE, &range_val) ||
+            sensor_attr_set(ppg_dev, led_chan[led], (enum sensor_attribute)MAXM86161_ATTR_LED_PA, &pa_val))
+        {
+            LOG_ERR("Failed to set PPG LED drive for LED %d", led);
+        }
+    }
+
+    // Kept for the next start, also over a reboot, the save waits so the settling does not wear the flash
+    struct sensor_config_led leds[ARRAY_SIZE(led_chan)];
+    for (int led = 0; led < ARRAY_SIZE(led_chan); led++)
+    {
+        leds[led].pa = pa[led];
+        leds[led].range = range[led];
+    }
+    sensor_config_set_agc(leds, false);
+}
+
+// Save the drives the AGC streamed with, right away as the sensor stops
+static void ppg_agc_save(void)
+{
+    struct sensor_config_led leds[3];
+
+    k_spinlock_key_t key = k_spin_lock(&ppg_agc_lock);
+    bool enabled = ppg_agc_enabled;
+    for (int led = 0; led < ARRAY_SIZE(leds); led++)
+    {
+        ppg_agc_get(&ppg_agc, led, &leds[led].pa, &leds[led].range);
+    }
+    k_spin_unlock(&ppg_agc_lock, key);
+
+    if (enabled)
+    {
+        sensor_config_set_agc(leds, true);
+    }
+}
+#else
+static inline void ppg_agc_hold(void)
+{
+}
+
+static inline void ppg_agc_save(void)
+{
+}
+#endif /* CONFIG_APP_PPG_AGC */
+
+static bool ppg_reg_is_led(uint8_t reg)
+{
+    return (reg >= MAXM86161_REG_LED1_PA && reg <= MAXM86161_REG_LED3_PA) || reg == MAXM86161_REG_LED_RANGE1;
+}
+
+// Registers a client tunes that are kept over reboots. The profile owns PPG_CONFIG2, ppg_sensor_start() the FIFO and
+// interrupt registers.
+static bool ppg_reg_is_kept(uint8_t reg)
+{
+    return reg >= MAXM86161_REG_PPG_SYNC_CTRL && reg <= MAXM86161_REG_LED_RANGE2 && reg != MAXM86161_REG_PPG_CONFIG2;
+}
+
+static void ppg_reg_keep(uint8_t reg, uint8_t data)
+{
+    if (reg == MAXM86161_REG_SYSTEM_CONTROL && (data & PPG_SYSTEM_CONTROL_RESET))
+    {
+        LOG_INF("PPG sensor reset by the client, kept registers cleared");
+        sensor_config_clear_ppg();
+    }
+    else if (ppg_reg_is_kept(reg) && sensor_config_set_ppg_reg(reg, data) == -ENOMEM)
+    {
+        LOG_WRN("PPG register 0x%02X not kept, %u registers are", reg, SENSOR_CONFIG_MAX_PPG_REGS);
+    }
+}
+
+// Insert a register into the start registers, which are in increasing order of address
+static __maybe_unused void ppg_start_reg_insert(struct maxm86161_reg_value *regs, uint8_t *count, uint8_t reg,
+                                                uint8_t value)
+{
+    uint8_t i = *count;
+
+    while (i > 0 && regs[i - 1].reg > reg)
+    {
+        regs[i] = regs[i - 1];
+        i--;
+    }
+
+    regs[i].reg = reg;
+    regs[i].value = value;
+    (*count)++;
+}
+
+#if defined(CONFIG_APP_PPG_FILTER)
+// Designed by ppg_configure(), taken by the stream thread at the first frame after a start
+static struct ppg_filter_coeffs ppg_filter_coeffs;
+static bool ppg_filter_configured;
+static struct k_spinlock ppg_filter_lock;
+static struct ppg_filter ppg_filter;
+static bool ppg_filter_enabled;
+static atomic_t ppg_filter_reset;
+
+static uint8_t ppg_filter_apply(struct ppg_sample *samples, uint8_t count)
+{
+    if (atomic_clear(&ppg_filter_reset))
+    {
+        k_spinlock_key_t key = k_spin_lock(&ppg_filter_lock);
+        ppg_filter_enabled = ppg_filter_configured;
+        ppg_filter_init(&ppg_filter, &ppg_filter_coeffs);
+        k_spin_unlock(&ppg_filter_lock, key);
+    }
+
+    if (ppg_filter_enabled)
+    {
+        ppg_filter_process(&ppg_filter, samples, count);
+    }
+
+    return count;
+}
+#else
+static inline uint8_t ppg_filter_apply(struct ppg_sample *samples, uint8_t count)
+{
+    return count;
+}
+#endif /* CONFIG_APP_PPG_FILTER */
+
+#if defined(CONFIG_APP_HEART_RATE)
+// Output rate set by ppg_configure(), the detector restarts at the first frame after a start
+static uint16_t ppg_hr_rate_hz = 50;
+static atomic_t ppg_hr_reset = ATOMIC_INIT(true);
+// Only used by the stream thread
+static struct heart_rate_detector ppg_hr;
+static struct tgm_service_hr_data_t ppg_hr_summary;
+static uint32_t ppg_hr_summary_ms;
+static bool ppg_hr_found;
+
+static void ppg_hr_send(uint32_t now_ms)
+{
+    ppg_hr_summary.heart_rate = heart_rate_bpm(&ppg_hr);
+    ppg_hr_summary.confidence = heart_rate_confidence(&ppg_hr);
+    if (ppg_hr_summary.beat_count == 0)
+    {
+        ppg_hr_summary.time_ms = now_ms;
+    }
+
+    if ((ppg_hr_summary.heart_rate != 0) != ppg_hr_found)
+    {
+        ppg_hr_found = !ppg_hr_found;
+        if (ppg_hr_found)
+        {
+            LOG_INF("Heart rate found: %u bpm", ppg_hr_summary.heart_rate);
+        }
+        else
+        {
+            LOG_INF("Heart rate lost");
+        }
+    }
+
+#if defined(CONFIG_APP_BRUXISM_HR)
+    // History for the heart rate rise of the bruxism episodes
+    bruxism_hr_put(now_ms, ppg_hr_summary.heart_rate);
+#endif
+
+    int err = tgm_service_send_hr_notify(&ppg_hr_summary);
+    if (err && err != -EACCES)
+    {
+        LOG_DBG("Failed to send heart rate notification");
+    }
+
+    ppg_hr_summary.beat_count = 0;
+    ppg_hr_summary_ms = now_ms;
+}
+
+#if defined(CONFIG_APP_HRV)
+static struct hrv_tracker ppg_hrv;
+static uint32_t ppg_hrv_epoch_ms;
+
+// Send the oldest intervals of the ring, the last batch of an epoch also when it is empty. Returns true when another
+// batch is ready.
+static bool ppg_hrv_send(bool epoch_end)
+{
+    struct tgm_service_hrv_data_t data;
+    struct hrv_stats stats;
+    bool run_start;
+    uint8_t pending = hrv_count(&ppg_hrv);
+    uint8_t count = hrv_peek(&ppg_hrv, data.intervals, ARRAY_SIZE(data.intervals), &data.time_ms, &run_start);
+
+    // A batch goes out when it is full or its run ended, or at the end of the epoch
+    bool more = count < pending;
+    if (count < ARRAY_SIZE(data.intervals) && !more && !epoch_end)
+    {
+        return false;
+    }
+
+    hrv_epoch_stats(&ppg_hrv, &stats);
+    data.mean_nn = stats.mean_nn;
+    data.sdnn = stats.sdnn;
+    data.rmssd = stats.rmssd;
+    data.nn_count = stats.nn_count;
+    data.artifacts = stats.artifacts;
+    data.flags = (run_start ? TGM_SERVICE_HRV_RUN_START : 0) |
+                 ((epoch_end && !more) ? TGM_SERVICE_HRV_EPOCH_END : 0);
+    data.count = count;
+
+    int err = tgm_service_send_hrv_notify(&data);
+    if (err && err != -EACCES)
+    {
+        // Kept in the ring for the next frame
+        LOG_DBG("Failed to send HRV notification");
+        return false;
+    }
+
+    hrv_consume(&ppg_hrv, count);
+
+    return more;
+}
+
+static void ppg_hrv_update(const struct heart_rate_beat *beats, uint8_t found, uint64_t timestamp)
+{
+    uint32_t now_ms = (uint32_t)(timestamp / NSEC_PER_MSEC);
+    bool epoch_end = now_ms - ppg_hrv_epoch_ms >= CONFIG_APP_HRV_EPOCH_S * MSEC_PER_SEC;
+
+    for (uint8_t i = 0; i < found; i++)
+    {
+        // Sub-sample beat time, the last sample of the frame was taken at the FIFO interrupt
+        int64_t back = ((int64_t)(ppg_hr.count - 1 - beats[i].sample) * 256 - beats[i].fraction) * USEC_PER_SEC /
+                       (ppg_hr.rate_hz * 256);
+
+        hrv_add_beat(&ppg_hrv, timestamp / NSEC_PER_USEC - back);
+    }
+
+    while (ppg_hrv_send(epoch_end))
+    {
+    }
+
+    if (epoch_end)
+    {
+        struct hrv_stats stats;
+
+        hrv_epoch_stats(&ppg_hrv, &stats);
+        LOG_INF("HRV epoch: %u NN, mean %u ms, SDNN %u.%u ms, RMSSD %u.%u ms, %u artifacts", stats.nn_count,
+                stats.mean_nn, stats.sdnn / 10, stats.sdnn % 10, stats.rmssd / 10, stats.rmssd % 10, stats.artifacts);
+
+        hrv_epoch_reset(&ppg_hrv);
+        ppg_hrv_epoch_ms = now_ms;
+    }
+}
+#endif /* CONFIG_APP_HRV */
+
+static void ppg_hr_update(const struct ppg_sample *samples, uint8_t count, uint64_t timestamp)
+{
+    uint32_t values[CONFIG_PPG_SAMPLES_PER_FRAME];
+    struct heart_rate_beat beats[TGM_SERVICE_HR_MAX_BEATS];
+    uint32_t now_ms = (uint32_t)(timestamp / NSEC_PER_MSEC);
+
+    if (atomic_clear(&ppg_hr_reset))
+    {
+        heart_rate_init(&ppg_hr, ppg_hr_rate_hz);
+        ppg_hr_summary.beat_count = 0;
+        ppg_hr_summary_ms = now_ms;
+#if defined(CONFIG_APP_HRV)
+        hrv_init(&ppg_hrv);
+        ppg_hrv_epoch_ms = now_ms;
+#endif
+    }
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        values[i] = IS_ENABLED(CONFIG_APP_HEART_RATE_CHANNEL_GREEN) ? samples[i].green : samples[i].ir;
+    }
+
+    uint8_t found = heart_rate_process(&ppg_hr, values, count, beats, ARRAY_SIZE(beats));
+    for (uint8_t i = 0; i < found; i++)
+    {
+        // The last sample of the frame was taken at the FIFO interrupt
+        uint32_t beat_ms = now_ms - (ppg_hr.count - 1 - beats[i].sample) * MSEC_PER_SEC / ppg_hr.rate_hz;
+
+        if (ppg_hr_summary.beat_count == TGM_SERVICE_HR_MAX_BEATS)
+        {
+            ppg_hr_send(now_ms);
+        }
+
+        if (ppg_hr_summary.beat_count == 0)
+        {
+            ppg_hr_summary.time_ms = beat_ms;
+        }
+
+        struct tgm_service_hr_beat_t *beat = &ppg_hr_summary.beats[ppg_hr_summary.beat_count++];
+        beat->offset_ms = (uint16_t)(beat_ms - ppg_hr_summary.time_ms);
+        beat->confidence = beats[i].confidence;
+    }
+
+    if (now_ms - ppg_hr_summary_ms >= CONFIG_APP_HEART_RATE_INTERVAL_MS)
+    {
+        ppg_hr_send(now_ms);
+    }
+
+#if defined(CONFIG_APP_HRV)
+    ppg_hrv_update(beats, found, timestamp);
+#endif
+}
+#endif /* CONFIG_APP_HEART_RATE */
+
+#if defined(CONFIG_APP_SPO2)
+// Set by ppg_configure(), taken by the stream thread at the first frame after a start
+static uint16_t ppg_spo2_rate_hz = 50;
+static atomic_t ppg_spo2_reset = ATOMIC_INIT(true);
+
+static struct spo2_estimator ppg_spo2;
+static bool ppg_spo2_found;
+
+static void ppg_spo2_update(const struct ppg_sample *samples, uint8_t count, uint64_t timestamp, bool led_changed)
+{
+    struct spo2_result result;
+
+    if (atomic_clear(&ppg_spo2_reset))
+    {
+        spo2_init(&ppg_spo2, ppg_spo2_rate_hz, CONFIG_APP_SPO2_WINDOW_S);
+    }
+
+    bool ended = spo2_process(&ppg_spo2, samples, count, &result);
+
+    // A new LED current steps the DC level of the window that just started
+    if (led_changed)
+    {
+        spo2_discard_window(&ppg_spo2);
+    }
+
+    if (!ended)
+    {
+        return;
+    }
+
+    LOG_DBG("SpO2 %u.%u%%, R %u, PI %u, correlation %u%%, quality 0x%02x", result.spo2 / 10, result.spo2 % 10,
+            result.ratio, result.perfusion, result.correlation, result.quality);
+
+    if ((result.spo2 != 0) != ppg_spo2_found)
+    {
+        ppg_spo2_found = !ppg_spo2_found;
+        if (ppg_spo2_found)
+        {
+            LOG_INF("SpO2 found: %u.%u%%", result.spo2 / 10, result.spo2 % 10);
+        }
+        else
+        {
+            LOG_INF("SpO2 lost, quality 0x%02x", result.quality);
+        }
+    }
+
+    struct tgm_service_spo2_data_t data = {
+        .time_ms = (uint32_t)(timestamp / NSEC_PER_MSEC),
+        .spo2 = result.spo2,
+        .ratio = result.ratio,
+        .perfusion = result.perfusion,
+        .correlation = result.correlation,
+        .quality = result.quality,
+    };
+
+    if (tgm_service_send_spo2_notify(&data))
+    {
+        LOG_DBG("Failed to send SpO2 notification");
+    }
+}
+#endif /* CONFIG_APP_SPO2 */
+
+static void ppg_prox_handler(const struct device *dev, const struct sensor_trigger *trig)
+{
+    LOG_INF("Skin contact detected");
+
+    if (ppg_contact_cb)
+    {
+        ppg_contact_cb(true);
+    }
+}
+
+static void ppg_check_contact(const uint8_t *buf)
+{
+    struct ppg_sample sample;
+
+    // The first sample of every frame is enough to notice the skin is gone
+    if (!ppg_contact || maxm86161_decode_encoded(buf, &sample, 1) == 0)
+    {
+        return;
+    }
+
+    if (sample.ir >= PPG_CONTACT_IR_THRESHOLD)
+    {
+        ppg_contact_lost_frames = 0;
+        return;
+    }
+
+    if (++ppg_contact_lost_frames < PPG_CONTACT_LOST_FRAMES)
+    {
+        return;
+    }
+
+    ppg_contact = false;
+    LOG_INF("Skin contact lost");
+
+    if (ppg_contact_cb)
+    {
+        ppg_contact_cb(false);
+    }
+}
+
+static __maybe_unused uint8_t ppg_fill(struct ppg_sample *ppg_data, uint8_t max_samples, void *user_data)
+{
+    // Decode the PPG data straight into the notification
+    uint64_t start = profiling_start();
+    uint8_t sample_count = ppg_filter_apply(ppg_data, maxm86161_decode_encoded(user_data, ppg_data, max_samples));
+    profiling_stop(&ppg_read_stat, start);
+
+    return sample_count;
+}
+
+static void ppg_send(tgm_service_ppg_fill_t fill, void *user_data, const struct sample_clock_frame *time)
+{
     // Notify the client of the PPG data
-    err = tgm_service_send_ppg_notify(ppg_data, sample_count);
+    uint64_t start = profiling_start();
+    int err = tgm_service_send_ppg_notify(fill, user_data, time->time_ns, time->period_ns);
+    profiling_stop(&ppg_notify_stat, start);
     if (err)
     {
         LOG_DBG("Failed to send PPG data notification");
+    }
+#if defined(CONFIG_APP_PPG_FILTER)
+    // Frames nobody listens to are not decoded, so the filter restarts from the next one that is sent
+    if (err == -EACCES)
+    {
+        atomic_set(&ppg_filter_reset, true);
+    }
+#endif
+}
+
+// Processing on the device that takes the samples after the motion artifacts are taken out
+static __maybe_unused void ppg_measure(const struct ppg_sample *samples, uint8_t count, uint64_t timestamp,
+                                       bool led_changed)
+{
+#if defined(CONFIG_APP_HEART_RATE)
+    ppg_hr_update(samples, count, timestamp);
+#endif
+
+#if defined(CONFIG_APP_SPO2)
+    ppg_spo2_update(samples, count, timestamp, led_changed);
+#endif
+}
+
+#if defined(CONFIG_APP_MOTION_CANCEL)
+// PPG frames that wait until the accelerometer frames cover them
+#define PPG_MOTION_QUEUE_SIZE 3
+
+struct ppg_motion_frame
+{
+    struct ppg_sample raw[CONFIG_PPG_SAMPLES_PER_FRAME];
+    struct sample_clock_frame time;
+    uint8_t count;
+    bool led_changed;
+};
+
+// Set by ppg_configure(), the canceller restarts at the first frame after a start
+static uint16_t ppg_motion_rate_hz = 50;
+static bool ppg_motion_send_clean;
+static atomic_t ppg_motion_reset = ATOMIC_INIT(true);
+// Only used by the stream thread
+static struct motion_canceller ppg_motion;
+static struct ppg_motion_frame ppg_motion_queue[PPG_MOTION_QUEUE_SIZE];
+static uint8_t ppg_motion_tail;
+static uint8_t ppg_motion_count;
+static struct ppg_sample ppg_motion_clean[CONFIG_PPG_SAMPLES_PER_FRAME];
+
+static uint8_t ppg_motion_fill(struct ppg_sample *ppg_data, uint8_t max_samples, void *user_data)
+{
+    const struct ppg_motion_frame *frame = user_data;
+    uint8_t sample_count = MIN(frame->count, max_samples);
+
+    uint64_t start = profiling_start();
+    memcpy(ppg_data, ppg_motion_clean, sample_count * sizeof(ppg_data[0]));
+    sample_count = ppg_filter_apply(ppg_data, sample_count);
+    profiling_stop(&ppg_read_stat, start);
+
+    return sample_count;
+}
+
+static void ppg_motion_run(struct ppg_motion_frame *frame, const struct acc_sample *ref)
+{
+    struct motion_frame result;
+
+    memcpy(ppg_motion_clean, frame->raw, frame->count * sizeof(frame->raw[0]));
+    motion_process(&ppg_motion, ppg_motion_clean, ref, frame->count, &result);
+    LOG_DBG("Motion %u mg, %u dB down, flags 0x%02x", result.activity, result.reduction, result.flags);
+
+    ppg_measure(ppg_motion_clean, frame->count, frame->time.last_ns, frame->led_changed);
+
+    struct tgm_service_motion_data_t data = {
+        .time_ms = (uint32_t)(frame->time.last_ns / NSEC_PER_MSEC),
+        .activity = result.activity,
+        .flags = result.flags,
+        .reduction = result.reduction,
+    };
+
+    int err = tgm_service_send_motion_notify(&data);
+    if (err && err != -EACCES)
+    {
+        LOG_DBG("Failed to send motion notification");
+    }
+
+    if (ppg_motion_send_clean)
+    {
+        ppg_send(ppg_motion_fill, frame, &frame->time);
+    }
+}
+
+static void ppg_motion_update(const struct ppg_sample *samples, uint8_t count, const struct sample_clock_frame *time,
+                              bool led_changed)
+{
+    if (atomic_clear(&ppg_motion_reset))
+    {
+        motion_init(&ppg_motion, ppg_motion_rate_hz);
+        ppg_motion_count = 0;
+    }
+
+    struct ppg_motion_frame *frame =
+        &ppg_motion_queue[(ppg_motion_tail + ppg_motion_count++) % PPG_MOTION_QUEUE_SIZE];
+
+    memcpy(frame->raw, samples, count * sizeof(samples[0]));
+    frame->time = *time;
+    frame->count = count;
+    frame->led_changed = led_changed;
+
+    while (ppg_motion_count > 0)
+    {
+        struct acc_sample ref[CONFIG_PPG_SAMPLES_PER_FRAME];
+
+        frame = &ppg_motion_queue[ppg_motion_tail];
+        int covered = motion_reference_resample(frame->time.last_ns, frame->time.period_ns, frame->count, ref);
+
+        // Wait for the accelerometer frame with the last sample, unless the accelerometer does not stream or the queue
+        // is full, then the newest acceleration stands in for the rest
+        if (covered >= 0 && covered < frame->count && ppg_motion_count < PPG_MOTION_QUEUE_SIZE)
+        {
+            break;
+        }
+
+        ppg_motion_run(frame, covered > 0 ? ref : NULL);
+        ppg_motion_tail = (ppg_motion_tail + 1) % PPG_MOTION_QUEUE_SIZE;
+        ppg_motion_count--;
+    }
+}
+#endif /* CONFIG_APP_MOTION_CANCEL */
+
+// Set by ppg_start(), only used by the stream thread otherwise
+static atomic_t ppg_clock_reset = ATOMIC_INIT(true);
+static struct sample_clock ppg_clock;
+
+static void ppg_process(int result, uint8_t *buf, uint32_t buf_len, void *userdata)
+{
+    const struct maxm86161_encoded_data *edata = (const struct maxm86161_encoded_data *)buf;
+
+    if (result < 0)
+    {
+        LOG_ERR("Failed to read PPG data");
         return;
     }
 
-    return;
+    profiling_record(&ppg_latency_stat, (uint32_t)(k_ticks_to_ns_floor64(k_uptime_ticks()) - edata->timestamp));
+    power_budget_record(POWER_BUDGET_PPG_FIFO, edata->word_count * MAXM86161_FIFO_WORD_SIZE);
+    ppg_check_contact(buf);
+
+    // Decoded once for the sample clock and the processing on the device, the notification decodes again only when
+    // someone listens
+    struct ppg_sample samples[CONFIG_PPG_SAMPLES_PER_FRAME];
+    uint8_t count = maxm86161_decode_encoded(buf, samples, ARRAY_SIZE(samples));
+
+    // Times of the samples on the device clock, corrected for the drift of the PPG oscillator
+    struct sample_clock_frame time;
+    if (atomic_clear(&ppg_clock_reset))
+    {
+        sample_clock_reset(&ppg_clock, edata->period_ns);
+    }
+    if (sample_clock_update(&ppg_clock, count, edata->timestamp, &time))
+    {
+        LOG_INF("ppg sample clock locked: %u ns per sample, %d ppm", time.period_ns, sample_clock_ppm(&ppg_clock));
+    }
+
+    __maybe_unused uint8_t led_changed = 0;
+#if defined(CONFIG_APP_PPG_AGC)
+    // Do not chase the level up while the IR level says the skin is gone
+    if (ppg_contact_lost_frames == 0)
+    {
+        led_changed = ppg_agc_update(samples, count);
+    }
+#endif
+
+#if defined(CONFIG_APP_MOTION_CANCEL)
+    // Raw samples go out right away, and are only decoded again when someone listens
+    if (!ppg_motion_send_clean)
+    {
+        ppg_send(ppg_fill, buf, &time);
+    }
+
+    // The AGC above runs on the raw samples right away, the rest once the artifacts are out
+    ppg_motion_update(samples, count, &time, led_changed != 0);
+#else
+#if defined(CONFIG_APP_HEART_RATE) || defined(CONFIG_APP_SPO2)
+    ppg_measure(samples, count, time.last_ns, led_changed != 0);
+#endif
+
+    ppg_send(ppg_fill, buf, &time);
+#endif /* CONFIG_APP_MOTION_CANCEL */
 }
 
-int ppg_init(void)
+static void ppg_stream_thread(void *p1, void *p2, void *p3)
 {
-    // Initialize the I2C bus
-    if (!i2c_is_ready_dt(&i2c))
+    while (true)
     {
-        LOG_ERR("I2C device not ready during initialization of PPG sensor");
-        return -ENODEV;
+        // Blocks until the driver completes a frame, the buffer is released after the callback
+        sensor_processing_with_callback(&ppg_rtio, ppg_process);
     }
+}
+
+K_THREAD_DEFINE(ppg_stream_tid, CONFIG_APP_SENSOR_THREAD_STACK_SIZE, ppg_stream_thread, NULL, NULL, NULL,
+                CONFIG_APP_SENSOR_THREAD_PRIORITY, 0, 0);
 
-    // Initialize the GPIO port
-    if (!gpio_is_ready_dt(&ppg_int))
+int ppg_init(ppg_contact_cb_t contact_cb)
+{
+    if (!device_is_ready(ppg_dev))
     {
-        LOG_ERR("GPIO device not ready during initialization of PPG sensor");
+        LOG_ERR("PPG sensor not ready");
         return -ENODEV;
     }
 
-    // Intialize the int pin as input
-    int err = gpio_pin_configure_dt(&ppg_int, GPIO_INPUT);
+    ppg_contact_cb = contact_cb;
+    int err = sensor_trigger_set(ppg_dev, &ppg_prox_trigger, ppg_prox_handler);
+    if (err)
+    {
+        LOG_ERR("Failed to set PPG proximity trigger");
+        return err;
+    }
+
+#if defined(CONFIG_APP_PPG_AGC)
+    k_work_init(&ppg_agc_work, ppg_agc_work_handler);
+#endif
+
+    // The stream stays queued in the driver, starting and stopping the sensor only gates the interrupts
+    err = sensor_stream(&ppg_stream, &ppg_rtio, NULL, &ppg_stream_handle);
     if (err)
     {
-        LOG_ERR("Failed to configure PPG sensor int pin as input");
+        LOG_ERR("Failed to start PPG stream");
         return err;
     }
 
-    // Initialize the interrupt callback
-    gpio_init_callback(&ppg_int_cb, ppg_int_handler, BIT(ppg_int.pin));
-    err = gpio_add_callback(ppg_int.port, &ppg_int_cb);
+    return 0;
+}
+
+int ppg_configure(uint16_t rate_hz, uint8_t average, uint8_t frame_samples, bool filter)
+{
+    const struct sensor_value rate = {.val1 = rate_hz};
+    const struct sensor_value oversampling = {.val1 = average};
+    const struct sensor_value frame = {.val1 = frame_samples};
+
+    // Taken by the next start
+    int err = sensor_attr_set(ppg_dev, SENSOR_CHAN_ALL, SENSOR_ATTR_SAMPLING_FREQUENCY, &rate);
+    err = err ? err : sensor_attr_set(ppg_dev, SENSOR_CHAN_ALL, SENSOR_ATTR_OVERSAMPLING, &oversampling);
+    err = err ? err
+              : sensor_attr_set(ppg_dev, SENSOR_CHAN_ALL, (enum sensor_attribute)MAXM86161_ATTR_FRAME_SAMPLES, &frame);
     if (err)
     {
-        LOG_ERR("Failed to add callback to PPG sensor int pin");
+        LOG_ERR("Failed to configure PPG sensor for %u Hz, %u averaged, %u samples per frame", rate_hz, average,
+                frame_samples);
         return err;
     }
 
-    // Initialize the work item
-    k_work_init(&read_ppg_data_work, ppg_read_data);
-    k_work_init(&ppg_reg_work.reg_work, ppg_reg_work_handler);
+#if defined(CONFIG_APP_HEART_RATE)
+    ppg_hr_rate_hz = rate_hz / average;
+#endif
+#if defined(CONFIG_APP_SPO2)
+    ppg_spo2_rate_hz = rate_hz / average;
+#endif
+#if defined(CONFIG_APP_MOTION_CANCEL)
+    ppg_motion_rate_hz = rate_hz / average;
+    // Legacy clients expect the raw samples, the cleaned ones are only sent when asked for
+    ppg_motion_send_clean = IS_ENABLED(CONFIG_APP_MOTION_CANCEL_SEND) && filter;
+#endif
+
+#if defined(CONFIG_APP_PPG_FILTER)
+    // The filter runs at the output rate
+    struct ppg_filter_coeffs coeffs;
+    ppg_filter_design(&coeffs, rate_hz / average, CONFIG_APP_PPG_FILTER_LOW_CUTOFF, CONFIG_APP_PPG_FILTER_HIGH_CUTOFF,
+                      NULL);
+
+    k_spinlock_key_t key = k_spin_lock(&ppg_filter_lock);
+    ppg_filter_coeffs = coeffs;
+    ppg_filter_configured = filter;
+    k_spin_unlock(&ppg_filter_lock, key);
+#endif
 
     return 0;
 }
 
 int ppg_start(void)
 {
-    // Enable the interrupt
-    int err = gpio_pin_interrupt_configure_dt(&ppg_int, GPIO_INT_EDGE_TO_ACTIVE);
+    // Watch the IR level for as long as the sensor streams
+    ppg_contact_lost_frames = 0;
+    ppg_contact = true;
+    // The sample numbering starts again, and the rate may have changed
+    atomic_set(&ppg_clock_reset, true);
+#if defined(CONFIG_APP_PPG_FILTER)
+    atomic_set(&ppg_filter_reset, true);
+#endif
+#if defined(CONFIG_APP_HEART_RATE)
+    atomic_set(&ppg_hr_reset, true);
+#endif
+#if defined(CONFIG_APP_SPO2)
+    atomic_set(&ppg_spo2_reset, true);
+#endif
+#if defined(CONFIG_APP_MOTION_CANCEL)
+    atomic_set(&ppg_motion_reset, true);
+#endif
+
+    // The kept client registers go out with the start, an LED register among them keeps the AGC off like it did
+    // when it was written
+    struct maxm86161_reg_value regs[PPG_START_REGS];
+    uint8_t count = sensor_config_get_ppg_regs(regs, SENSOR_CONFIG_MAX_PPG_REGS);
+    uint8_t kept = count;
+    bool manual = false;
+
+    ppg_led_restored = 0;
+    for (uint8_t i = 0; i < count; i++)
+    {
+        if (ppg_reg_is_led(regs[i].reg))
+        {
+            manual = true;
+        }
+        if (regs[i].reg >= MAXM86161_REG_LED1_PA && regs[i].reg <= MAXM86161_REG_LED3_PA && regs[i].value)
+        {
+            // LED1 is green, LED2 IR and LED3 red, in the order of enum ppg_led_t
+            ppg_led_restored |= BIT(regs[i].reg - MAXM86161_REG_LED1_PA);
+        }
+    }
+
+#if defined(CONFIG_APP_PPG_AGC)
+    // Otherwise the AGC goes on from the drives it left, instead of settling again from the defaults
+    struct sensor_config_led leds[3];
+    bool restore = !manual && sensor_config_get_agc(leds) == 0;
+    if (restore)
+    {
+        uint8_t led_range = 0;
+
+        for (int led = 0; led < ARRAY_SIZE(leds); led++)
+        {
+            ppg_start_reg_insert(regs, &count, MAXM86161_REG_LED1_PA + led, leds[led].pa);
+            led_range |= (leds[led].range & 0x3) << (2 * led);
+            ppg_led_restored |= leds[led].pa ? BIT(led) : 0;
+        }
+        ppg_start_reg_insert(regs, &count, MAXM86161_REG_LED_RANGE1, led_range);
+    }
+#endif
+
+    int err = ppg_sensor_set_start_regs(ppg_dev, regs, count);
     if (err)
     {
-        LOG_ERR("Failed to configure PPG sensor int pin interrupt");
-        return err;
+        LOG_ERR("Failed to set PPG start registers");
+        ppg_led_restored = 0;
+        count = 0;
     }
 
     // Start the PPG sensor
-    err = ppg_sensor_start(&i2c);
+    err = ppg_sensor_start(ppg_dev);
     if (err)
     {
         LOG_ERR("Failed to start PPG sensor");
         return err;
     }
 
+    if (count)
+    {
+        LOG_INF("PPG sensor started with %u kept registers, LEDs 0x%x restored", kept, ppg_led_restored);
+    }
+
+#if defined(CONFIG_APP_PPG_AGC)
+    // The sensor starts with the LEDs off or at the restored drives, ppg_set_led_pa() hands the others to the AGC
+    k_spinlock_key_t key = k_spin_lock(&ppg_agc_lock);
+    memset(&ppg_agc, 0, sizeof(ppg_agc));
+    for (int led = 0; restore && count && led < ARRAY_SIZE(leds); led++)
+    {
+        ppg_agc_set(&ppg_agc, led, leds[led].pa, leds[led].range);
+    }
+    ppg_agc_enabled = !manual;
+    ppg_agc_pending = 0;
+    k_spin_unlock(&ppg_agc_lock, key);
+#endif
+
     return 0;
 }
 
 int ppg_stop(void)
 {
+    ppg_contact = false;
+    ppg_led_restored = 0;
+    ppg_agc_save();
+    ppg_agc_hold();
+
     // Stop the PPG sensor
-    int err = ppg_sensor_stop(&i2c);
+    int err = ppg_sensor_stop(ppg_dev);
     if (err)
     {
         LOG_ERR("Failed to stop PPG sensor");
         return err;
     }
 
-    // Disable the interrupt
-    err = gpio_pin_interrupt_configure_dt(&ppg_int, GPIO_INT_DISABLE);
+    return 0;
+}
+
+int ppg_standby(void)
+{
+    ppg_contact = false;
+    ppg_led_restored = 0;
+    ppg_agc_hold();
+
+    // Keep only the green LED pulsing
+    int err = ppg_sensor_standby(ppg_dev);
     if (err)
     {
-        LOG_ERR("Failed to disable PPG sensor int pin interrupt");
+        LOG_ERR("Failed to put PPG sensor in standby");
         return err;
     }
 
     return 0;
 }
 
-int ppg_read_reg(uint8_t reg)
+int ppg_proximity(void)
 {
-    uint8_t data;
-    int err = ppg_sensor_read_reg(&i2c, reg, &data);
+    const struct sensor_value threshold = {.val1 = CONFIG_APP_WEAR_PROX_THRESHOLD};
+    const struct sensor_value pilot_pa = {.val1 = CONFIG_APP_WEAR_PILOT_PA};
+
+    ppg_contact = false;
+    ppg_led_restored = 0;
+    ppg_agc_hold();
+
+    // Both are lost when the sensor power is cut, so set them every time
+    int err = sensor_attr_set(ppg_dev, SENSOR_CHAN_PROX, SENSOR_ATTR_UPPER_THRESH, &threshold);
     if (err)
     {
-        LOG_ERR("Failed to read PPG sensor register 0x%02X", reg);
+        LOG_ERR("Failed to set PPG proximity threshold");
+        return err;
+    }
+
+    err = sensor_attr_set(ppg_dev, SENSOR_CHAN_PROX, (enum sensor_attribute)MAXM86161_ATTR_LED_PA, &pilot_pa);
+    if (err)
+    {
+        LOG_ERR("Failed to set PPG pilot LED PA");
+        return err;
+    }
+
+    err = ppg_sensor_proximity(ppg_dev);
+    if (err)
+    {
+        LOG_ERR("Failed to put PPG sensor in proximity mode");
         return err;
     }
 
     return 0;
 }
 
-int ppg_write_reg(uint8_t reg, uint8_t data)
+int ppg_read_reg(uint8_t reg)
 {
-    int err = ppg_sensor_write_reg(&i2c, reg, data);
+    uint8_t data;
+    int err = ppg_sensor_read_reg(ppg_dev, reg, &data);
     if (err)
     {
-        LOG_ERR("Failed to write PPG sensor register 0x%02X", reg);
+        LOG_ERR("Failed to read PPG sensor register 0x%02X", reg);
         return err;
     }
 
+    err = tgm_service_send_read_ppg_reg_notify(data);
+    if (err && err != -EACCES)
+    {
+        LOG_ERR("Failed to send PPG register value notification");
+    }
+
     return 0;
 }
 
-static void ppg_reg_work_handler(struct k_work *work)
+int ppg_write_reg(uint8_t reg, uint8_t data)
 {
-    int err;
-    struct ppg_reg_work_t *ppg_reg_work = CONTAINER_OF(work, struct ppg_reg_work_t, reg_work);
-
-    uint8_t final_reg_data;
-    if (ppg_reg_work->read)
+    // A client that sets the LEDs by hand takes over from the AGC, also after the next start while the register is kept
+    if (ppg_reg_is_led(reg))
     {
-        err = ppg_sensor_read_reg(&i2c, ppg_reg_work->reg, &final_reg_data);
-        if (err)
+        if (IS_ENABLED(CONFIG_APP_PPG_AGC))
         {
-            LOG_ERR("Failed to read PPG sensor register 0x%02X", ppg_reg_work->reg);
-            return;
+            LOG_INF("PPG LED drive set by the client, AGC off");
         }
-
-        err = tgm_service_send_read_ppg_reg_notify(final_reg_data);
+        ppg_agc_hold();
     }
-    else
-    {
-        err = ppg_sensor_write_reg(&i2c, ppg_reg_work->reg, ppg_reg_work->data);
-        if (err)
-        {
-            LOG_ERR("Failed to write PPG sensor register 0x%02X", ppg_reg_work->reg);
-            return;
-        }
-        err = ppg_sensor_read_reg(&i2c, ppg_reg_work->reg, &final_reg_data);
-        if (err)
-        {
-            LOG_ERR("Failed to read PPG sensor register 0x%02X after writing", ppg_reg_work->reg);
-            // Allow to continue since the write was successful
-        }
 
-        err = tgm_service_send_write_ppg_reg_notify(final_reg_data);
+    int err = ppg_sensor_write_reg(ppg_dev, reg, data);
+    if (err)
+    {
+        LOG_ERR("Failed to write PPG sensor register 0x%02X", reg);
+        return err;
     }
 
+    ppg_reg_keep(reg, data);
+
+    // Report the value the register took, the sensor ignores reserved bits
+    uint8_t final_data;
+    err = ppg_sensor_read_reg(ppg_dev, reg, &final_data);
     if (err)
+    {
+        LOG_ERR("Failed to read PPG sensor register 0x%02X after writing", reg);
+        // The write itself went through
+        return 0;
+    }
+
+    err = tgm_service_send_write_ppg_reg_notify(final_data);
+    if (err && err != -EACCES)
     {
         LOG_ERR("Failed to send PPG register value notification");
-        return;
     }
 
-    return;
+    return 0;
 }
 
 int ppg_set_led_pa(enum ppg_led_t led, uint8_t pa)
 {
+    static const enum sensor_channel led_chan[] = {
+        [PPG_LED_GREEN] = SENSOR_CHAN_GREEN,
+        [PPG_LED_IR] = SENSOR_CHAN_IR,
+        [PPG_LED_RED] = SENSOR_CHAN_RED,
+    };
+    const struct sensor_value val = {.val1 = pa};
     int err;
 
-    err = ppg_write_reg(MAXM86161_REG_LED1_PA + led, pa);
+    // A drive restored by ppg_start() wins over the default of the caller
+    if (ppg_led_restored & BIT(led))
+    {
+        return 0;
+    }
+
+    err = sensor_attr_set(ppg_dev, led_chan[led], (enum sensor_attribute)MAXM86161_ATTR_LED_PA, &val);
     if (err)
     {
         LOG_ERR("Failed to set PPG LED PA for LED %d", led);
+        return err;
     }
 
+#if defined(CONFIG_APP_PPG_AGC)
+    // Take over from the given amplitude, in the range the AGC last set
+    uint8_t agc_pa;
+    uint8_t agc_range;
+    k_spinlock_key_t key = k_spin_lock(&ppg_agc_lock);
+    ppg_agc_get(&ppg_agc, led, &agc_pa, &agc_range);
+    ppg_agc_set(&ppg_agc, led, pa, agc_range);
+    k_spin_unlock(&ppg_agc_lock, key);
+#endif
+
     return 0;
 }
@@ -14,15 +14,38 @@ enum ppg_led_t
     PPG_LED_RED,
 };
 
+/**
+ * @brief Callback type for skin contact changes
+ *
+ * Contact is reported from the system work queue when proximity mode detects skin, and the loss of contact from the
+ * PPG stream thread when the IR level of the streamed samples drops below the proximity threshold.
+ */
+typedef void (*ppg_contact_cb_t)(bool contact);
+
 /**
  * @brief Initialize the PPG sensor
  *
+ * @param[in] contact_cb Called when skin contact is detected or lost, can be NULL
+ * @return int 0 on success, negative error code on failure
+ */
+int ppg_init(ppg_contact_cb_t contact_cb);
+
+/**
+ * @brief Set the sample rate, on-chip averaging, frame size and filtering, applied by the next start
+ *
+ * @param[in] rate_hz ADC sample rate in Hz
+ * @param[in] average Samples averaged into one output sample, a power of two up to 128
+ * @param[in] frame_samples Output samples per FIFO frame, up to CONFIG_PPG_SAMPLES_PER_FRAME
+ * @param[in] filter Send band-pass filtered samples with the motion artifacts taken out, false sends the raw samples
  * @return int 0 on success, negative error code on failure
  */
-int ppg_init(void);
+int ppg_configure(uint16_t rate_hz, uint8_t average, uint8_t frame_samples, bool filter);
 
 /**
- * @brief Start the PPG sensor with default configuration
+ * @brief Start the PPG sensor with the configuration set by ppg_configure()
+ *
+ * The registers a client tuned and the LED drives the AGC left, as kept by sensor_config.h, are written along with the
+ * start. A kept LED register keeps the AGC off.
  *
  * @return int 0 on success, negative error code on failure
  */
@@ -35,6 +58,22 @@ int ppg_start(void);
  */
 int ppg_stop(void);
 
+/**
+ * @brief Put the PPG sensor in standby, with only the green LED pulsing at a low rate and no data streamed
+ *
+ * @return int 0 on success, negative error code on failure
+ */
+int ppg_standby(void);
+
+/**
+ * @brief Put the PPG sensor in proximity mode, to detect skin contact without streaming
+ *
+ * The contact callback is called once skin is detected, the sensor must then be started to stream.
+ *
+ * @return int 0 on success, negative error code on failure
+ */
+int ppg_proximity(void);
+
 /**
  * @brief Read a register from the PPG sensor and report over BLE
  *
@@ -46,6 +85,9 @@ int ppg_read_reg(uint8_t reg);
 /**
  * @brief Write a register to the PPG sensor and report over BLE
  *
+ * The value is kept over reboots for the configuration registers from PPG_SYNC_CTRL to LED_RANGE2, except PPG_CONFIG2
+ * which the sensor profile sets. Writing the reset bit of SYSTEM_CONTROL forgets the kept registers.
+ *
  * @param[in] reg Register address
  * @param[in] data Data to write
  * @return int 0 on success, negative error code on failure
@@ -55,6 +97,8 @@ int ppg_write_reg(uint8_t reg, uint8_t data);
 /**
  * @brief Set the pulse amplitude of a specific LED
  *
+ * An LED whose drive the last ppg_start() restored keeps it.
+ *
  * @param[in] led LED to set the pulse amplitude for
  * @param[in] pa Pulse amplitude
  * @return int 0 on success, negative error code on failure
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <zephyr/kernel.h>
+
+#include "ppg_agc.h"
+
+// DC window and the level the drive is scaled to when the DC level falls outside it
+#define PPG_AGC_LOW ((uint32_t)((uint64_t)MAXM86161_FIFO_DATA_MASK * CONFIG_APP_PPG_AGC_LOW / 100))
+#define PPG_AGC_HIGH ((uint32_t)((uint64_t)MAXM86161_FIFO_DATA_MASK * CONFIG_APP_PPG_AGC_HIGH / 100))
+#define PPG_AGC_TARGET (PPG_AGC_LOW + (PPG_AGC_HIGH - PPG_AGC_LOW) / 8)
+// Largest factor the drive is scaled by in one step, the DC level is not linear in the drive near the rails
+#define PPG_AGC_MAX_SCALE 4
+
+static uint32_t ppg_agc_value(const struct ppg_sample *sample, enum ppg_led_t led)
+{
+    switch (led)
+    {
+    case PPG_LED_GREEN:
+        return sample->green;
+    case PPG_LED_IR:
+        return sample->ir;
+    case PPG_LED_RED:
+    default:
+        return sample->red;
+    }
+}
+
+// Next drive for a channel with the given DC level, peak and peak-to-peak swing
+static uint32_t ppg_agc_next_drive(uint32_t drive, uint32_t dc, uint32_t max, uint32_t ac)
+{
+    uint32_t next = drive;
+
+    if (max >= PPG_AGC_SATURATION)
+    {
+        next = drive / 2;
+    }
+    else if (dc < PPG_AGC_LOW || dc > PPG_AGC_HIGH)
+    {
+        // The DC level is close to proportional to the drive, minus the ambient light
+        next = dc ? (uint32_t)((uint64_t)drive * PPG_AGC_TARGET / dc) : drive * PPG_AGC_MAX_SCALE;
+        next = CLAMP(next, drive / PPG_AGC_MAX_SCALE, drive * PPG_AGC_MAX_SCALE);
+    }
+    else if (ac < CONFIG_APP_PPG_AGC_MIN_AC)
+    {
+        next = drive + MAX(drive / 8, 1);
+    }
+    else if (ac > 2 * CONFIG_APP_PPG_AGC_MIN_AC && dc - dc / 8 >= PPG_AGC_LOW)
+    {
+        // Enough perfusion signal, try a lower current as long as the level stays in the window
+        next = drive - MAX(drive / 8, 1);
+    }
+
+    return CLAMP(next, 1, PPG_AGC_DRIVE_MAX);
+}
+
+void ppg_agc_set(struct ppg_agc *agc, enum ppg_led_t led, uint8_t pa, uint8_t range)
+{
+    agc->channel[led].drive = pa * (range + 1);
+    agc->channel[led].settle = PPG_AGC_SETTLE_FRAMES;
+}
+
+uint8_t ppg_agc_process(struct ppg_agc *agc, const struct ppg_sample *samples, uint8_t count)
+{
+    uint8_t changed = 0;
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    for (int led = 0; led < ARRAY_SIZE(agc->channel); led++)
+    {
+        struct ppg_agc_channel *channel = &agc->channel[led];
+
+        if (channel->drive == 0)
+        {
+            continue;
+        }
+
+        if (channel->settle)
+        {
+            channel->settle--;
+            continue;
+        }
+
+        uint64_t sum = 0;
+        uint32_t min = UINT32_MAX;
+        uint32_t max = 0;
+
+        for (int i = 0; i < count; i++)
+        {
+            uint32_t value = ppg_agc_value(&samples[i], led);
+
+            sum += value;
+            min = MIN(min, value);
+            max = MAX(max, value);
+        }
+
+        uint32_t next = ppg_agc_next_drive(channel->drive, (uint32_t)(sum / count), max, max - min);
+        if (next != channel->drive)
+        {
+            channel->drive = next;
+            channel->settle = PPG_AGC_SETTLE_FRAMES;
+            changed |= BIT(led);
+        }
+    }
+
+    return changed;
+}
+
+void ppg_agc_get(const struct ppg_agc *agc, enum ppg_led_t led, uint8_t *pa, uint8_t *range)
+{
+    uint16_t drive = agc->channel[led].drive;
+
+    *range = drive ? (drive - 1) / UINT8_MAX : 0;
+    *pa = drive / (*range + 1);
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef PPG_AGC_H_
+#define PPG_AGC_H_
+
+#include <zephyr/kernel.h>
+#include <app/drivers/maxm86161.h>
+
+#include "ppg.h"
+
+/**@file
+ * @defgroup ppg_agc PPG LED current control
+ * @{
+ * @brief Closed-loop control of the LED currents from the DC level of the decoded PPG samples.
+ *
+ * The drive of an LED is its pulse amplitude times the LED range step, in units of 0.12mA, so it runs from 1 to
+ * PPG_AGC_DRIVE_MAX over the four LED ranges. Per frame, every enabled channel is checked in this order:
+ *
+ * - A sample at or above PPG_AGC_SATURATION halves the drive.
+ * - A DC level outside CONFIG_APP_PPG_AGC_LOW..CONFIG_APP_PPG_AGC_HIGH percent of full scale scales the drive to bring
+ *   the level to the low end of the window plus an eighth of its width.
+ * - Inside the window, a peak-to-peak swing below CONFIG_APP_PPG_AGC_MIN_AC counts raises the drive by an eighth, and a
+ *   swing of more than twice that lowers it by an eighth, as long as the level stays in the window.
+ *
+ * So every channel settles at the lowest current that keeps it in the window with enough perfusion signal. After a
+ * change the channel is left alone for PPG_AGC_SETTLE_FRAMES frames, the frame that straddles the change does not
+ * reflect the new current.
+ */
+
+/** @brief Largest drive, pulse amplitude 255 in the 124mA range. */
+#define PPG_AGC_DRIVE_MAX (255 * 4)
+/** @brief Samples at this level are taken for saturated. */
+#define PPG_AGC_SATURATION (MAXM86161_FIFO_DATA_MASK - MAXM86161_FIFO_DATA_MASK / 32)
+/** @brief Frames to skip after a change of the drive. */
+#define PPG_AGC_SETTLE_FRAMES 2
+
+/** @brief Control state of one LED. */
+struct ppg_agc_channel
+{
+    /** Current drive, 0 when the LED is off and not controlled. */
+    uint16_t drive;
+    /** Frames left before the channel is controlled again. */
+    uint8_t settle;
+};
+
+/** @brief Control state of all LEDs, indexed by enum ppg_led_t. */
+struct ppg_agc
+{
+    struct ppg_agc_channel channel[3];
+};
+
+/**
+ * @brief Set the drive of an LED, from the pulse amplitude and LED range it was programmed with
+ *
+ * An LED programmed with a pulse amplitude of 0 is not controlled.
+ *
+ * @param[in] agc Control state
+ * @param[in] led LED
+ * @param[in] pa Pulse amplitude
+ * @param[in] range LED range, 0 for 31mA up to 3 for 124mA
+ */
+void ppg_agc_set(struct ppg_agc *agc, enum ppg_led_t led, uint8_t pa, uint8_t range);
+
+/**
+ * @brief Update the drives from a frame of samples
+ *
+ * @param[in] agc Control state
+ * @param[in] samples Decoded samples
+ * @param[in] count Number of samples
+ * @return uint8_t Bit mask of the LEDs, BIT(enum ppg_led_t), whose drive changed
+ */
+uint8_t ppg_agc_process(struct ppg_agc *agc, const struct ppg_sample *samples, uint8_t count);
+
+/**
+ * @brief Get the pulse amplitude and LED range that give the drive of an LED
+ *
+ * The smallest range that can reach the drive is used, for the finest steps.
+ *
+ * @param[in] agc Control state
+ * @param[in] led LED
+ * @param[out] pa Pulse amplitude
+ * @param[out] range LED range
+ */
+void ppg_agc_get(const struct ppg_agc *agc, enum ppg_led_t led, uint8_t *pa, uint8_t *range);
+
+/**
+ * @}
+ */
+
+#endif /* PPG_AGC_H_ */
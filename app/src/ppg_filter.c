@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#if defined(CONFIG_CMSIS_DSP)
+#include <arm_math.h>
+#endif
+
+#include "ppg_filter.h"
+
+// Butterworth quality factor, 1/sqrt(2)
+#define PPG_FILTER_Q 0.70710678118654752
+
+static const double pi = 3.14159265358979323846;
+
+// One RBJ cookbook biquad, normalized and in the CMSIS-DSP sign convention for the feedback coefficients
+static void ppg_filter_design_stage(double ideal[5], double w0, bool high_pass)
+{
+    double cos_w0 = cos(w0);
+    double alpha = sin(w0) / (2 * PPG_FILTER_Q);
+    double a0 = 1 + alpha;
+    double b = (high_pass ? (1 + cos_w0) : (1 - cos_w0)) / 2;
+
+    ideal[0] = b / a0;
+    ideal[1] = (high_pass ? -2 * b : 2 * b) / a0;
+    ideal[2] = b / a0;
+    ideal[3] = 2 * cos_w0 / a0;
+    ideal[4] = -(1 - alpha) / a0;
+}
+
+void ppg_filter_design(struct ppg_filter_coeffs *coeffs, uint16_t rate_hz, uint16_t low_chz, uint16_t high_chz,
+                       double ideal[5 * PPG_FILTER_STAGES])
+{
+    double stages[5 * PPG_FILTER_STAGES];
+    double high_hz = MIN(high_chz / 100.0, 0.45 * rate_hz);
+
+    ppg_filter_design_stage(&stages[0], 2 * pi * (low_chz / 100.0) / rate_hz, true);
+    ppg_filter_design_stage(&stages[5], 2 * pi * high_hz / rate_hz, false);
+
+    for (int i = 0; i < ARRAY_SIZE(stages); i++)
+    {
+        coeffs->coeffs[i] = (int32_t)lround(stages[i] * (1 << (31 - PPG_FILTER_POST_SHIFT)));
+    }
+
+    // Keep the high-pass free of DC whatever the rounding, and the low-pass at unity gain
+    coeffs->coeffs[1] = -2 * coeffs->coeffs[0];
+    coeffs->coeffs[6] = 2 * coeffs->coeffs[5];
+
+    if (ideal)
+    {
+        memcpy(ideal, stages, sizeof(stages));
+    }
+}
+
+void ppg_filter_init(struct ppg_filter *filter, const struct ppg_filter_coeffs *coeffs)
+{
+    filter->coeffs = *coeffs;
+    memset(filter->state, 0, sizeof(filter->state));
+    filter->primed = false;
+}
+
+#if !defined(CONFIG_CMSIS_DSP)
+// 64 x 32 bit product of the feedback path, as mult32x64() in CMSIS-DSP
+static inline int64_t ppg_filter_mult32x64(int64_t x, int32_t y)
+{
+    return (((int64_t)(x & 0xffffffff) * y) >> 32) + ((x >> 32) * y);
+}
+
+// C version of arm_biquad_cas_df1_32x64_q31()
+static void ppg_filter_biquad(const int32_t *coeffs, int64_t *state, int32_t *data, uint8_t count)
+{
+    const uint32_t shift = PPG_FILTER_POST_SHIFT + 1;
+
+    for (int stage = 0; stage < PPG_FILTER_STAGES; stage++, coeffs += 5, state += 4)
+    {
+        int32_t xn1 = (int32_t)state[0];
+        int32_t xn2 = (int32_t)state[1];
+        int64_t yn1 = state[2];
+        int64_t yn2 = state[3];
+
+        for (uint8_t i = 0; i < count; i++)
+        {
+            int32_t xn = data[i];
+            int64_t acc = (int64_t)xn * coeffs[0] + (int64_t)xn1 * coeffs[1] + (int64_t)xn2 * coeffs[2];
+
+            acc += ppg_filter_mult32x64(yn1, coeffs[3]);
+            acc += ppg_filter_mult32x64(yn2, coeffs[4]);
+
+            xn2 = xn1;
+            xn1 = xn;
+            yn2 = yn1;
+            yn1 = (int64_t)((uint64_t)acc << shift);
+            data[i] = (int32_t)(acc >> (32 - shift));
+        }
+
+        state[0] = xn1;
+        state[1] = xn2;
+        state[2] = yn1;
+        state[3] = yn2;
+    }
+}
+#endif /* !CONFIG_CMSIS_DSP */
+
+void ppg_filter_run_q31(struct ppg_filter *filter, uint8_t channel, int32_t *data, uint8_t count)
+{
+    int64_t *state = filter->state[channel];
+
+    if (count == 0)
+    {
+        return;
+    }
+
+#if defined(CONFIG_CMSIS_DSP)
+    // The instance only points at the state, so it is set up per call instead of through the init function that
+    // clears the state
+    arm_biquad_cas_df1_32x64_ins_q31 instance = {
+        .numStages = PPG_FILTER_STAGES,
+        .pState = state,
+        .pCoeffs = filter->coeffs.coeffs,
+        .postShift = PPG_FILTER_POST_SHIFT,
+    };
+
+    arm_biquad_cas_df1_32x64_q31(&instance, data, data, count);
+#else
+    ppg_filter_biquad(filter->coeffs.coeffs, state, data, count);
+#endif
+}
+
+// Samples filtered at a time, per channel
+#define PPG_FILTER_BLOCK 32
+
+static void ppg_filter_process_block(struct ppg_filter *filter, struct ppg_sample *samples, uint8_t count)
+{
+    int32_t data[PPG_FILTER_BLOCK];
+
+    for (uint8_t channel = 0; channel < 3; channel++)
+    {
+        // Channel after channel, so each one is a contiguous block for the biquad
+        for (uint8_t i = 0; i < count; i++)
+        {
+            uint32_t value = (channel == 0) ? samples[i].red : (channel == 1) ? samples[i].ir : samples[i].green;
+
+            data[i] = (int32_t)((value & MAXM86161_FIFO_DATA_MASK) << PPG_FILTER_INPUT_SHIFT);
+        }
+
+        ppg_filter_run_q31(filter, channel, data, count);
+
+        for (uint8_t i = 0; i < count; i++)
+        {
+            int64_t value = (((int64_t)data[i] + BIT(PPG_FILTER_INPUT_SHIFT - 1)) >> PPG_FILTER_INPUT_SHIFT) +
+                            PPG_FILTER_OFFSET;
+            uint32_t out = (uint32_t)CLAMP(value, 0, MAXM86161_FIFO_DATA_MASK);
+
+            if (channel == 0)
+            {
+                samples[i].red = out;
+            }
+            else if (channel == 1)
+            {
+                samples[i].ir = out;
+            }
+            else
+            {
+                samples[i].green = out;
+            }
+        }
+    }
+}
+
+void ppg_filter_process(struct ppg_filter *filter, struct ppg_sample *samples, uint8_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+
+    if (!filter->primed)
+    {
+        // As if the first sample had always been there, the high-pass then starts from 0
+        filter->state[0][0] = filter->state[0][1] = (int32_t)(samples[0].red << PPG_FILTER_INPUT_SHIFT);
+        filter->state[1][0] = filter->state[1][1] = (int32_t)(samples[0].ir << PPG_FILTER_INPUT_SHIFT);
+        filter->state[2][0] = filter->state[2][1] = (int32_t)(samples[0].green << PPG_FILTER_INPUT_SHIFT);
+        filter->primed = true;
+    }
+
+    for (uint8_t i = 0; i < count; i += PPG_FILTER_BLOCK)
+    {
+        ppg_filter_process_block(filter, &samples[i], MIN(count - i, PPG_FILTER_BLOCK));
+    }
+}
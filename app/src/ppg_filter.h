@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef PPG_FILTER_H_
+#define PPG_FILTER_H_
+
+#include <zephyr/kernel.h>
+#include <app/drivers/maxm86161.h>
+
+/**@file
+ * @defgroup ppg_filter PPG band-pass filter
+ * @{
+ * @brief Per channel band-pass filter of the PPG samples, as a cascade of a second order Butterworth high-pass and
+ * low-pass biquad in Q31.
+ *
+ * The 19-bit samples are scaled to Q31 and run through arm_biquad_cas_df1_32x64_q31() from CMSIS-DSP, whose 64-bit
+ * feedback state keeps the high-pass stable with poles this close to 1. Without CMSIS-DSP (e.g. native_sim) a C
+ * version of the same arithmetic is used. The filtered samples are sent in the same 19-bit unsigned formats, offset by
+ * PPG_FILTER_OFFSET and clamped to the 19-bit range.
+ */
+
+/** @brief Biquad stages: high-pass, then low-pass. */
+#define PPG_FILTER_STAGES 2
+/** @brief Value of a filtered sample without signal. */
+#define PPG_FILTER_OFFSET ((MAXM86161_FIFO_DATA_MASK + 1) / 2)
+/** @brief Shift from the 19-bit samples to Q31. */
+#define PPG_FILTER_INPUT_SHIFT 12
+/** @brief The coefficients are in Q30, so they can reach -2..2. */
+#define PPG_FILTER_POST_SHIFT 1
+
+/** @brief Coefficients of the cascade, b0, b1, b2, a1 and a2 per stage in the CMSIS-DSP order and sign. */
+struct ppg_filter_coeffs
+{
+    int32_t coeffs[5 * PPG_FILTER_STAGES];
+};
+
+/** @brief Filter state of the three channels, x[n-1], x[n-2], y[n-1] and y[n-2] per stage. */
+struct ppg_filter
+{
+    struct ppg_filter_coeffs coeffs;
+    int64_t state[3][4 * PPG_FILTER_STAGES];
+    /** Cleared until the first sample, which primes the high-pass so a constant input gives no transient. */
+    bool primed;
+};
+
+/**
+ * @brief Compute the coefficients of the cascade
+ *
+ * @param[out] coeffs Coefficients
+ * @param[in] rate_hz Output sample rate in Hz
+ * @param[in] low_chz High-pass cutoff in 0.01Hz
+ * @param[in] high_chz Low-pass cutoff in 0.01Hz, lowered to 0.45 times the sample rate
+ * @param[out] ideal Unquantized coefficients in the same order, can be NULL
+ */
+void ppg_filter_design(struct ppg_filter_coeffs *coeffs, uint16_t rate_hz, uint16_t low_chz, uint16_t high_chz,
+                       double ideal[5 * PPG_FILTER_STAGES]);
+
+/**
+ * @brief Initialize the filter state, the next sample primes it
+ *
+ * @param[out] filter Filter state
+ * @param[in] coeffs Coefficients
+ */
+void ppg_filter_init(struct ppg_filter *filter, const struct ppg_filter_coeffs *coeffs);
+
+/**
+ * @brief Filter a block of samples of one channel in Q31, in place
+ *
+ * @param[in,out] filter Filter state
+ * @param[in] channel Channel, 0 to 2
+ * @param[in,out] data Samples
+ * @param[in] count Number of samples
+ */
+void ppg_filter_run_q31(struct ppg_filter *filter, uint8_t channel, int32_t *data, uint8_t count);
+
+/**
+ * @brief Filter decoded samples of all channels, in place
+ *
+ * @param[in,out] filter Filter state
+ * @param[in,out] samples Samples, the filtered values are offset by PPG_FILTER_OFFSET
+ * @param[in] count Number of samples
+ */
+void ppg_filter_process(struct ppg_filter *filter, struct ppg_sample *samples, uint8_t count);
+
+/**
+ * @}
+ */
+
+#endif /* PPG_FILTER_H_ */
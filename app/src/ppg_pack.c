@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include "ppg_pack.h"
+
+static inline uint8_t *ppg_pack_channel(uint64_t *acc, uint8_t *bits, uint32_t value, uint8_t *out)
+{
+    *acc |= (uint64_t)(value & MAXM86161_FIFO_DATA_MASK) << *bits;
+    *bits += PPG_PACK_CHANNEL_BITS;
+
+    // Flush whole bytes, fewer than 8 bits stay behind so the next channel always fits the accumulator
+    while (*bits >= 8)
+    {
+        *out++ = (uint8_t)*acc;
+        *acc >>= 8;
+        *bits -= 8;
+    }
+
+    return out;
+}
+
+size_t ppg_pack(const struct ppg_sample *ppg_data, uint8_t count, uint8_t *out)
+{
+    uint8_t *start = out;
+    uint64_t acc = 0;
+    uint8_t bits = 0;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        out = ppg_pack_channel(&acc, &bits, ppg_data[i].red, out);
+        out = ppg_pack_channel(&acc, &bits, ppg_data[i].ir, out);
+        out = ppg_pack_channel(&acc, &bits, ppg_data[i].green, out);
+    }
+
+    if (bits > 0)
+    {
+        *out++ = (uint8_t)acc;
+    }
+
+    return out - start;
+}
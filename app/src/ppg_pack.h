@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef PPG_PACK_H_
+#define PPG_PACK_H_
+
+#include <zephyr/kernel.h>
+#include <app/drivers/maxm86161.h>
+
+/**@file
+ * @defgroup ppg_pack PPG bit packing
+ * @{
+ * @brief Packing of 19-bit PPG samples into a dense little endian bit stream.
+ *
+ * Every sample takes 57 bits: red in bits 0-18, IR in bits 19-37 and green in bits 38-56, counted from the first bit
+ * of the sample. Samples follow each other without padding, bit 0 of the stream is the LSB of the first byte and
+ * the last byte is padded with zeros.
+ */
+
+/** @brief Number of bits of every channel. */
+#define PPG_PACK_CHANNEL_BITS 19
+/** @brief Number of bits of every red, IR and green triplet. */
+#define PPG_PACK_SAMPLE_BITS (3 * PPG_PACK_CHANNEL_BITS)
+/** @brief Number of bytes taken by _count packed samples. */
+#define PPG_PACK_SIZE(_count) DIV_ROUND_UP((_count) * PPG_PACK_SAMPLE_BITS, 8)
+
+/**
+ * @brief Pack PPG samples into a bit stream
+ *
+ * Bits above the 19 data bits of every channel are ignored.
+ *
+ * @param[in] ppg_data Pointer to the samples
+ * @param[in] count Number of samples
+ * @param[out] out Output buffer of at least PPG_PACK_SIZE(count) bytes
+ * @return size_t Number of bytes written to out
+ */
+size_t ppg_pack(const struct ppg_sample *ppg_data, uint8_t count, uint8_t *out);
+
+/**
+ * @}
+ */
+
+#endif /* PPG_PACK_H_ */
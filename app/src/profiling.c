@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+
+#include "profiling.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(profiling, CONFIG_APP_LOG_LEVEL);
+
+void profiling_record(struct profiling_stat *stat, uint32_t ns)
+{
+    stat->count++;
+    stat->total_ns += ns;
+    stat->min_ns = MIN(stat->min_ns, ns);
+    stat->max_ns = MAX(stat->max_ns, ns);
+
+    if (stat->count < CONFIG_APP_PROFILING_REPORT_COUNT)
+    {
+        return;
+    }
+
+    LOG_INF("%s: n=%u min=%u avg=%u max=%u ns", stat->label, stat->count, stat->min_ns,
+            (uint32_t)(stat->total_ns / stat->count), stat->max_ns);
+
+    stat->count = 0;
+    stat->total_ns = 0;
+    stat->min_ns = UINT32_MAX;
+    stat->max_ns = 0;
+}
+
+void profiling_stop(struct profiling_stat *stat, uint64_t start)
+{
+    uint64_t ns;
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+    timing_t start_time = start;
+    timing_t end_time = timing_counter_get();
+
+    ns = timing_cycles_to_ns(timing_cycles_get(&start_time, &end_time));
+#else
+    ns = k_cyc_to_ns_floor64(k_cycle_get_32() - (uint32_t)start);
+#endif
+
+    profiling_record(stat, (uint32_t)MIN(ns, UINT32_MAX));
+}
+
+#if defined(CONFIG_TIMING_FUNCTIONS)
+static int profiling_init(void)
+{
+    timing_init();
+    timing_start();
+
+    return 0;
+}
+
+SYS_INIT(profiling_init, APPLICATION, CONFIG_APPLICATION_INIT_PRIORITY);
+#endif
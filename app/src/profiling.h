@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef PROFILING_H_
+#define PROFILING_H_
+
+#include <zephyr/kernel.h>
+#if defined(CONFIG_TIMING_FUNCTIONS)
+#include <zephyr/timing/timing.h>
+#endif
+
+/**@file
+ * @defgroup profiling Data path profiling
+ * @{
+ * @brief Lightweight min/avg/max timing of the sensor data path stages.
+ *
+ * Every stage accumulates CONFIG_APP_PROFILING_REPORT_COUNT measurements and then logs a single summary line,
+ * so the hot paths themselves only pay for two counter reads. Without CONFIG_APP_PROFILING all calls compile away.
+ */
+
+/** @brief Accumulated measurements of one data path stage. */
+struct profiling_stat
+{
+    /** Name used in the report. */
+    const char *label;
+    /** Number of measurements since the last report. */
+    uint32_t count;
+    /** Shortest measurement in ns. */
+    uint32_t min_ns;
+    /** Longest measurement in ns. */
+    uint32_t max_ns;
+    /** Sum of all measurements in ns. */
+    uint64_t total_ns;
+};
+
+#define PROFILING_STAT_DEFINE(_name, _label) \
+    static struct profiling_stat _name = {.label = _label, .min_ns = UINT32_MAX}
+
+#if defined(CONFIG_APP_PROFILING)
+
+/**
+ * @brief Take a timestamp at the start of a measured stage
+ *
+ * @return uint64_t Opaque start value to pass to profiling_stop()
+ */
+static inline uint64_t profiling_start(void)
+{
+#if defined(CONFIG_TIMING_FUNCTIONS)
+    return timing_counter_get();
+#else
+    return k_cycle_get_32();
+#endif
+}
+
+/**
+ * @brief Record the time elapsed since profiling_start()
+ *
+ * @param[in] stat Pointer to the stage statistics
+ * @param[in] start Value returned by profiling_start()
+ */
+void profiling_stop(struct profiling_stat *stat, uint64_t start);
+
+/**
+ * @brief Record a duration that was measured elsewhere
+ *
+ * @param[in] stat Pointer to the stage statistics
+ * @param[in] ns Duration in ns
+ */
+void profiling_record(struct profiling_stat *stat, uint32_t ns);
+
+#else
+
+static inline uint64_t profiling_start(void)
+{
+    return 0;
+}
+
+static inline void profiling_stop(struct profiling_stat *stat, uint64_t start)
+{
+    ARG_UNUSED(stat);
+    ARG_UNUSED(start);
+}
+
+static inline void profiling_record(struct profiling_stat *stat, uint32_t ns)
+{
+    ARG_UNUSED(stat);
+    ARG_UNUSED(ns);
+}
+
+#endif /* CONFIG_APP_PROFILING */
+
+/**
+ * @}
+ */
+
+#endif /* PROFILING_H_ */
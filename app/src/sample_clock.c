@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include "sample_clock.h"
+
+void sample_clock_reset(struct sample_clock *clk, uint32_t period_ns)
+{
+    memset(clk, 0, sizeof(*clk));
+    clk->nominal_ns = MAX(period_ns, 1);
+    clk->period_q16 = (uint64_t)clk->nominal_ns << 16;
+}
+
+static uint64_t sample_clock_time(const struct sample_clock *clk, uint32_t index)
+{
+    // Samples of a frame can lie before the origin, the index wraps after years
+    int64_t offset = (int32_t)(index - clk->origin_index);
+
+    return clk->origin_ns + ((offset * (int64_t)clk->period_q16) >> 16);
+}
+
+// Least squares line through the points, relative to the oldest one so the sums fit 64 bits
+static void sample_clock_fit(struct sample_clock *clk)
+{
+    const uint32_t index0 = clk->index[clk->tail];
+    const uint64_t irq0 = clk->irq_ns[clk->tail];
+    const int64_t n = clk->points;
+    int64_t sx = 0;
+    int64_t sy = 0;
+    int64_t sxx = 0;
+    int64_t sxy = 0;
+
+    for (uint8_t i = 0; i < clk->points; i++)
+    {
+        uint8_t slot = (clk->tail + i) % SAMPLE_CLOCK_POINTS;
+        int64_t x = clk->index[slot] - index0;
+        int64_t y = (int64_t)(clk->irq_ns[slot] - irq0);
+
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    int64_t num = n * sxy - sx * sy;
+    int64_t den = n * sxx - sx * sx;
+
+    // A single point, or frames without samples in between, keep the period
+    if (den > 0 && num > 0)
+    {
+        const uint64_t nominal_q16 = (uint64_t)clk->nominal_ns << 16;
+        const uint64_t max_deviation_q16 = nominal_q16 * SAMPLE_CLOCK_MAX_DEVIATION / 100;
+        uint64_t period_q16 = ((uint64_t)(num / den) << 16) + ((uint64_t)(num % den) << 16) / (uint64_t)den;
+
+        clk->period_q16 = CLAMP(period_q16, nominal_q16 - max_deviation_q16, nominal_q16 + max_deviation_q16);
+    }
+
+    // The line goes through the mean of the points
+    clk->origin_index = index0;
+    clk->origin_ns = irq0 + (sy * 65536 - (int64_t)clk->period_q16 * sx) / (n * 65536);
+}
+
+bool sample_clock_update(struct sample_clock *clk, uint8_t count, uint64_t irq_ns, struct sample_clock_frame *frame)
+{
+    if (count == 0)
+    {
+        frame->time_ns = irq_ns;
+        frame->last_ns = irq_ns;
+        frame->period_ns = (uint32_t)((clk->period_q16 + BIT(15)) >> 16);
+        return false;
+    }
+
+    const uint32_t first = clk->samples;
+    const uint32_t last = first + count - 1;
+
+    clk->samples += count;
+
+    if (clk->points > 0)
+    {
+        int64_t error = (int64_t)(irq_ns - sample_clock_time(clk, last));
+        int64_t max_error = (int64_t)SAMPLE_CLOCK_MAX_ERROR_PERIODS * clk->nominal_ns;
+
+        // Lost samples or a restart of the sensor, the numbering no longer matches the old frames
+        if (error > max_error || error < -max_error)
+        {
+            clk->tail = 0;
+            clk->points = 0;
+        }
+    }
+
+    if (clk->points == SAMPLE_CLOCK_POINTS)
+    {
+        clk->tail = (clk->tail + 1) % SAMPLE_CLOCK_POINTS;
+        clk->points--;
+    }
+
+    uint8_t slot = (clk->tail + clk->points) % SAMPLE_CLOCK_POINTS;
+    clk->index[slot] = last;
+    clk->irq_ns[slot] = irq_ns;
+    clk->points++;
+
+    sample_clock_fit(clk);
+
+    frame->time_ns = sample_clock_time(clk, first);
+    frame->last_ns = sample_clock_time(clk, last);
+    frame->period_ns = (uint32_t)((clk->period_q16 + BIT(15)) >> 16);
+
+    if (!clk->locked && clk->points == SAMPLE_CLOCK_POINTS)
+    {
+        clk->locked = true;
+        return true;
+    }
+
+    return false;
+}
+
+int32_t sample_clock_ppm(const struct sample_clock *clk)
+{
+    const int64_t nominal_q16 = (int64_t)clk->nominal_ns << 16;
+
+    return (int32_t)(((int64_t)clk->period_q16 - nominal_q16) * 1000000 / nominal_q16);
+}
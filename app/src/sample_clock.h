@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef SAMPLE_CLOCK_H_
+#define SAMPLE_CLOCK_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup sample_clock Sample clock
+ * @{
+ * @brief Per-sensor estimate of the time of every sample on the uptime of the device.
+ *
+ * The sensors sample on their own oscillators, which run up to a few percent off the nominal rate and drift with the
+ * temperature. The driver takes the uptime in the interrupt handler of every FIFO threshold interrupt, which is the
+ * time of the last sample of the frame plus the interrupt latency. The sample clock numbers the samples since the
+ * start of the sensor and fits a line through the interrupt times of the last SAMPLE_CLOCK_POINTS frames, by least
+ * squares, so the jitter of single interrupts averages out. The slope is the sample period of the sensor oscillator as
+ * the device clock sees it, the line gives the time of every sample.
+ *
+ * An interrupt time that lies more than SAMPLE_CLOCK_MAX_ERROR_PERIODS periods off the line means samples were lost or
+ * the sensor restarted, the fit then starts again from that frame and keeps the period it had.
+ */
+
+/** @brief Frames the fit runs over. */
+#define SAMPLE_CLOCK_POINTS 16
+/** @brief Largest distance of an interrupt time from the line, in sample periods. */
+#define SAMPLE_CLOCK_MAX_ERROR_PERIODS 2
+/** @brief Largest deviation of the period from the nominal one, in percent. */
+#define SAMPLE_CLOCK_MAX_DEVIATION 10
+
+/** @brief Times of the samples of a frame. */
+struct sample_clock_frame
+{
+    /** Time of the first sample in ns. */
+    uint64_t time_ns;
+    /** Time of the last sample in ns. */
+    uint64_t last_ns;
+    /** Estimated sample period in ns. */
+    uint32_t period_ns;
+};
+
+/** @brief Estimator state of one sensor. */
+struct sample_clock
+{
+    /** Period the sensor was configured for, in ns. */
+    uint32_t nominal_ns;
+    /** Index of the last sample and interrupt time of the frames in the fit, oldest at tail. */
+    uint32_t index[SAMPLE_CLOCK_POINTS];
+    uint64_t irq_ns[SAMPLE_CLOCK_POINTS];
+    uint8_t tail;
+    uint8_t points;
+    /** Samples since the start. */
+    uint32_t samples;
+    /** The line: time of sample origin_index in ns and the period in 1/65536 ns. */
+    uint32_t origin_index;
+    uint64_t origin_ns;
+    uint64_t period_q16;
+    /** Set once the fit ran over all SAMPLE_CLOCK_POINTS frames. */
+    bool locked;
+};
+
+/**
+ * @brief Start the estimate of a sensor over
+ *
+ * @param[out] clk Estimator state
+ * @param[in] period_ns Nominal sample period in ns
+ */
+void sample_clock_reset(struct sample_clock *clk, uint32_t period_ns);
+
+/**
+ * @brief Add a frame and get the times of its samples
+ *
+ * @param[in,out] clk Estimator state
+ * @param[in] count Number of samples in the frame, 0 is ignored
+ * @param[in] irq_ns Uptime of the interrupt of the frame in ns
+ * @param[out] frame Times of the samples
+ * @return true If the fit ran over all SAMPLE_CLOCK_POINTS frames for the first time since the reset
+ */
+bool sample_clock_update(struct sample_clock *clk, uint8_t count, uint64_t irq_ns, struct sample_clock_frame *frame);
+
+/**
+ * @brief Get the deviation of the estimated period from the nominal one
+ *
+ * @param[in] clk Estimator state
+ * @return int32_t Deviation in ppm, positive when the sensor runs slow
+ */
+int32_t sample_clock_ppm(const struct sample_clock *clk);
+
+/**
+ * @}
+ */
+
+#endif /* SAMPLE_CLOCK_H_ */
@@ -0,0 +1,326 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/storage/flash_map.h>
+
+#include "sensor_config.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(sensor_config, CONFIG_APP_LOG_LEVEL);
+
+#define SENSOR_CONFIG_PARTITION_ID FIXED_PARTITION_ID(storage_partition)
+// Most sectors the partition can have
+#define SENSOR_CONFIG_MAX_SECTORS 32
+// Sectors at the end of the partition that belong to the flash log
+#define SENSOR_CONFIG_LOG_SECTORS COND_CODE_1(CONFIG_APP_FLASH_LOG, (CONFIG_APP_FLASH_LOG_SECTORS), (0))
+
+// Keys, as bits of the stored and dirty masks
+#define SENSOR_CONFIG_PROFILE BIT(0)
+#define SENSOR_CONFIG_PPG_REGS BIT(1)
+#define SENSOR_CONFIG_AGC BIT(2)
+
+static struct k_spinlock sensor_config_lock;
+static struct
+{
+    // Keys that have a value, and keys whose value still has to be saved
+    uint8_t stored;
+    uint8_t dirty;
+
+    uint8_t profile;
+    struct maxm86161_reg_value ppg_regs[SENSOR_CONFIG_MAX_PPG_REGS];
+    uint8_t ppg_reg_count;
+    struct sensor_config_led agc[3];
+} sensor_config;
+
+// Set once the settings are mounted, nothing is saved before
+static bool sensor_config_ready;
+
+static void sensor_config_save_work_handler(struct k_work *work);
+static K_WORK_DELAYABLE_DEFINE(sensor_config_save_work, sensor_config_save_work_handler);
+
+// Only called while sensor_config_init() loads the settings, before anything else uses the configuration
+static int sensor_config_settings_set(const char *name, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+    const char *next;
+    ssize_t read;
+
+    if (settings_name_steq(name, "profile", &next) && !next)
+    {
+        if (len != sizeof(sensor_config.profile))
+        {
+            return -EINVAL;
+        }
+
+        read = read_cb(cb_arg, &sensor_config.profile, len);
+        sensor_config.stored |= read == (ssize_t)len ? SENSOR_CONFIG_PROFILE : 0;
+        return read < 0 ? read : 0;
+    }
+
+    if (settings_name_steq(name, "ppg_regs", &next) && !next)
+    {
+        if (len > sizeof(sensor_config.ppg_regs) || len % sizeof(sensor_config.ppg_regs[0]))
+        {
+            return -EINVAL;
+        }
+
+        read = read_cb(cb_arg, sensor_config.ppg_regs, len);
+        sensor_config.ppg_reg_count = read == (ssize_t)len ? len / sizeof(sensor_config.ppg_regs[0]) : 0;
+        sensor_config.stored |= sensor_config.ppg_reg_count ? SENSOR_CONFIG_PPG_REGS : 0;
+        return read < 0 ? read : 0;
+    }
+
+    if (settings_name_steq(name, "agc", &next) && !next)
+    {
+        if (len != sizeof(sensor_config.agc))
+        {
+            return -EINVAL;
+        }
+
+        read = read_cb(cb_arg, sensor_config.agc, len);
+        sensor_config.stored |= read == (ssize_t)len ? SENSOR_CONFIG_AGC : 0;
+        return read < 0 ? read : 0;
+    }
+
+    return -ENOENT;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(tgm, "tgm", NULL, sensor_config_settings_set, NULL, NULL);
+
+static void sensor_config_save(const char *name, const void *value, size_t len, bool stored)
+{
+    // NVS skips the write when the value did not change
+    int err = stored ? settings_save_one(name, value, len) : settings_delete(name);
+    if (err)
+    {
+        LOG_ERR("Failed to save %s (err %d)", name, err);
+    }
+}
+
+static void sensor_config_save_work_handler(struct k_work *work)
+{
+    uint8_t profile;
+    struct maxm86161_reg_value ppg_regs[SENSOR_CONFIG_MAX_PPG_REGS];
+    uint8_t ppg_reg_count;
+    struct sensor_config_led agc[3];
+
+    if (!sensor_config_ready)
+    {
+        return;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+    uint8_t stored = sensor_config.stored;
+    uint8_t dirty = sensor_config.dirty;
+    sensor_config.dirty = 0;
+    profile = sensor_config.profile;
+    ppg_reg_count = sensor_config.ppg_reg_count;
+    memcpy(ppg_regs, sensor_config.ppg_regs, sizeof(ppg_regs));
+    memcpy(agc, sensor_config.agc, sizeof(agc));
+    k_spin_unlock(&sensor_config_lock, key);
+
+    if (dirty & SENSOR_CONFIG_PROFILE)
+    {
+        sensor_config_save("tgm/profile", &profile, sizeof(profile), stored & SENSOR_CONFIG_PROFILE);
+    }
+
+    if (dirty & SENSOR_CONFIG_PPG_REGS)
+    {
+        sensor_config_save("tgm/ppg_regs", ppg_regs, ppg_reg_count * sizeof(ppg_regs[0]),
+                           stored & SENSOR_CONFIG_PPG_REGS);
+    }
+
+    if (dirty & SENSOR_CONFIG_AGC)
+    {
+        sensor_config_save("tgm/agc", agc, sizeof(agc), stored & SENSOR_CONFIG_AGC);
+    }
+}
+
+int sensor_config_init(void)
+{
+    struct flash_sector sectors[SENSOR_CONFIG_MAX_SECTORS];
+    uint32_t count = ARRAY_SIZE(sectors);
+
+    // The settings take the first sectors of the partition, they must not run into the flash log
+    int err = flash_area_get_sectors(SENSOR_CONFIG_PARTITION_ID, &count, sectors);
+    if (err)
+    {
+        LOG_ERR("Failed to get the storage partition sectors (err %d)", err);
+        return err;
+    }
+
+    if (count < CONFIG_SETTINGS_NVS_SECTOR_COUNT + SENSOR_CONFIG_LOG_SECTORS)
+    {
+        LOG_ERR("Storage partition has %u sectors, the settings and the flash log need %u", count,
+                CONFIG_SETTINGS_NVS_SECTOR_COUNT + SENSOR_CONFIG_LOG_SECTORS);
+        return -ENOSPC;
+    }
+
+    err = settings_subsys_init();
+    if (err)
+    {
+        LOG_ERR("Failed to mount the settings (err %d)", err);
+        return err;
+    }
+
+    err = settings_load_subtree("tgm");
+    if (err)
+    {
+        LOG_ERR("Failed to load the settings (err %d)", err);
+        return err;
+    }
+
+    sensor_config_ready = true;
+
+    LOG_INF("Sensor config loaded: profile %d, %u PPG registers, AGC drives %s",
+            (sensor_config.stored & SENSOR_CONFIG_PROFILE) ? sensor_config.profile : -1, sensor_config.ppg_reg_count,
+            (sensor_config.stored & SENSOR_CONFIG_AGC) ? "kept" : "none");
+
+    return 0;
+}
+
+int sensor_config_get_profile(uint8_t *id)
+{
+    int err = -ENODATA;
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+
+    if (sensor_config.stored & SENSOR_CONFIG_PROFILE)
+    {
+        *id = sensor_config.profile;
+        err = 0;
+    }
+
+    k_spin_unlock(&sensor_config_lock, key);
+
+    return err;
+}
+
+void sensor_config_set_profile(uint8_t id)
+{
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+    bool changed = !(sensor_config.stored & SENSOR_CONFIG_PROFILE) || sensor_config.profile != id;
+
+    sensor_config.profile = id;
+    sensor_config.stored |= SENSOR_CONFIG_PROFILE;
+    sensor_config.dirty |= changed ? SENSOR_CONFIG_PROFILE : 0;
+    k_spin_unlock(&sensor_config_lock, key);
+
+    if (changed)
+    {
+        k_work_reschedule(&sensor_config_save_work, K_NO_WAIT);
+    }
+}
+
+uint8_t sensor_config_get_ppg_regs(struct maxm86161_reg_value *regs, uint8_t max)
+{
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+    uint8_t count = MIN(sensor_config.ppg_reg_count, max);
+
+    memcpy(regs, sensor_config.ppg_regs, count * sizeof(regs[0]));
+    k_spin_unlock(&sensor_config_lock, key);
+
+    return count;
+}
+
+int sensor_config_set_ppg_reg(uint8_t reg, uint8_t value)
+{
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+    struct maxm86161_reg_value *regs = sensor_config.ppg_regs;
+    uint8_t i = 0;
+
+    // Kept in increasing order of address, as the driver takes them
+    while (i < sensor_config.ppg_reg_count && regs[i].reg < reg)
+    {
+        i++;
+    }
+
+    if (i < sensor_config.ppg_reg_count && regs[i].reg == reg)
+    {
+        if (regs[i].value == value)
+        {
+            k_spin_unlock(&sensor_config_lock, key);
+            return 0;
+        }
+    }
+    else if (sensor_config.ppg_reg_count == SENSOR_CONFIG_MAX_PPG_REGS)
+    {
+        k_spin_unlock(&sensor_config_lock, key);
+        return -ENOMEM;
+    }
+    else
+    {
+        memmove(&regs[i + 1], &regs[i], (sensor_config.ppg_reg_count - i) * sizeof(regs[0]));
+        sensor_config.ppg_reg_count++;
+    }
+
+    regs[i].reg = reg;
+    regs[i].value = value;
+    sensor_config.stored |= SENSOR_CONFIG_PPG_REGS;
+    sensor_config.dirty |= SENSOR_CONFIG_PPG_REGS;
+    k_spin_unlock(&sensor_config_lock, key);
+
+    k_work_reschedule(&sensor_config_save_work, K_NO_WAIT);
+
+    return 0;
+}
+
+int sensor_config_get_agc(struct sensor_config_led leds[3])
+{
+    int err = -ENODATA;
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+
+    if (sensor_config.stored & SENSOR_CONFIG_AGC)
+    {
+        memcpy(leds, sensor_config.agc, sizeof(sensor_config.agc));
+        err = 0;
+    }
+
+    k_spin_unlock(&sensor_config_lock, key);
+
+    return err;
+}
+
+void sensor_config_set_agc(const struct sensor_config_led leds[3], bool now)
+{
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+
+    if (!(sensor_config.stored & SENSOR_CONFIG_AGC) || memcmp(sensor_config.agc, leds, sizeof(sensor_config.agc)))
+    {
+        memcpy(sensor_config.agc, leds, sizeof(sensor_config.agc));
+        sensor_config.stored |= SENSOR_CONFIG_AGC;
+        sensor_config.dirty |= SENSOR_CONFIG_AGC;
+    }
+
+    bool dirty = sensor_config.dirty & SENSOR_CONFIG_AGC;
+    k_spin_unlock(&sensor_config_lock, key);
+
+    if (!dirty)
+    {
+        return;
+    }
+
+    // A save that is already scheduled takes the newest drives along, so the AGC writes at most once per interval
+    if (now)
+    {
+        k_work_reschedule(&sensor_config_save_work, K_NO_WAIT);
+    }
+    else
+    {
+        k_work_schedule(&sensor_config_save_work, K_SECONDS(CONFIG_APP_SENSOR_CONFIG_AGC_SAVE_S));
+    }
+}
+
+void sensor_config_clear_ppg(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&sensor_config_lock);
+    sensor_config.ppg_reg_count = 0;
+    sensor_config.stored &= ~(SENSOR_CONFIG_PPG_REGS | SENSOR_CONFIG_AGC);
+    sensor_config.dirty |= SENSOR_CONFIG_PPG_REGS | SENSOR_CONFIG_AGC;
+    k_spin_unlock(&sensor_config_lock, key);
+
+    k_work_reschedule(&sensor_config_save_work, K_NO_WAIT);
+}
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef SENSOR_CONFIG_H_
+#define SENSOR_CONFIG_H_
+
+#include <zephyr/kernel.h>
+#include <app/drivers/maxm86161.h>
+
+/**@file
+ * @defgroup sensor_config Persistent sensor configuration
+ * @{
+ * @brief Sensor settings that are kept over reboots, in the settings subsystem on the storage partition.
+ *
+ * Three keys are kept under "tgm/": the selected sensor profile, the PPG registers a client tuned, and the last LED
+ * drives of the AGC. sensor_config_init() loads them in one pass at boot into RAM, where the sensor modules take them
+ * from, so a device that restarts during the night streams with its tuned settings before any client connects.
+ *
+ * Changes are saved from the system work queue, the profile and the registers right away and the AGC drives at most
+ * once per CONFIG_APP_SENSOR_CONFIG_AGC_SAVE_S, so the AGC does not wear the flash while it settles. The settings use
+ * NVS on the first CONFIG_SETTINGS_NVS_SECTOR_COUNT sectors of the storage partition, in front of the flash log.
+ */
+
+/** @brief Most PPG registers that are kept. */
+#define SENSOR_CONFIG_MAX_PPG_REGS 16
+
+/** @brief Drive of one LED as the AGC left it. */
+struct sensor_config_led
+{
+    /** Pulse amplitude, 0 when the LED was not controlled. */
+    uint8_t pa;
+    /** LED range, 0 for 31mA up to 3 for 124mA. */
+    uint8_t range;
+};
+
+#if defined(CONFIG_APP_SENSOR_CONFIG)
+
+/**
+ * @brief Mount the settings and load the stored configuration
+ *
+ * @return int 0 on success, negative error code on failure
+ */
+int sensor_config_init(void);
+
+/**
+ * @brief Get the stored sensor profile
+ *
+ * @param[out] id Profile identifier
+ * @return int 0 on success, -ENODATA if no profile was stored
+ */
+int sensor_config_get_profile(uint8_t *id);
+
+/**
+ * @brief Store the selected sensor profile
+ *
+ * @param[in] id Profile identifier
+ */
+void sensor_config_set_profile(uint8_t id);
+
+/**
+ * @brief Get the stored PPG registers
+ *
+ * @param[out] regs Registers in increasing order of address
+ * @param[in] max Room in regs
+ * @return uint8_t Number of registers
+ */
+uint8_t sensor_config_get_ppg_regs(struct maxm86161_reg_value *regs, uint8_t max);
+
+/**
+ * @brief Store the value of a PPG register
+ *
+ * @param[in] reg Register address
+ * @param[in] value Value
+ * @retval 0 If the value was stored.
+ * @retval -ENOMEM If SENSOR_CONFIG_MAX_PPG_REGS other registers are stored.
+ */
+int sensor_config_set_ppg_reg(uint8_t reg, uint8_t value);
+
+/**
+ * @brief Get the stored AGC drives
+ *
+ * @param[out] leds Drives, indexed by enum ppg_led_t
+ * @return int 0 on success, -ENODATA if no drives were stored
+ */
+int sensor_config_get_agc(struct sensor_config_led leds[3]);
+
+/**
+ * @brief Store the AGC drives
+ *
+ * @param[in] leds Drives, indexed by enum ppg_led_t
+ * @param[in] now Save right away, otherwise the save waits up to CONFIG_APP_SENSOR_CONFIG_AGC_SAVE_S
+ */
+void sensor_config_set_agc(const struct sensor_config_led leds[3], bool now);
+
+/**
+ * @brief Forget the stored PPG registers and AGC drives
+ */
+void sensor_config_clear_ppg(void);
+
+#else
+
+static inline int sensor_config_init(void)
+{
+    return 0;
+}
+
+static inline int sensor_config_get_profile(uint8_t *id)
+{
+    ARG_UNUSED(id);
+    return -ENODATA;
+}
+
+static inline void sensor_config_set_profile(uint8_t id)
+{
+    ARG_UNUSED(id);
+}
+
+static inline uint8_t sensor_config_get_ppg_regs(struct maxm86161_reg_value *regs, uint8_t max)
+{
+    ARG_UNUSED(regs);
+    ARG_UNUSED(max);
+    return 0;
+}
+
+static inline int sensor_config_set_ppg_reg(uint8_t reg, uint8_t value)
+{
+    ARG_UNUSED(reg);
+    ARG_UNUSED(value);
+    return 0;
+}
+
+static inline int sensor_config_get_agc(struct sensor_config_led leds[3])
+{
+    ARG_UNUSED(leds);
+    return -ENODATA;
+}
+
+static inline void sensor_config_set_agc(const struct sensor_config_led leds[3], bool now)
+{
+    ARG_UNUSED(leds);
+    ARG_UNUSED(now);
+}
+
+static inline void sensor_config_clear_ppg(void)
+{
+}
+
+#endif /* CONFIG_APP_SENSOR_CONFIG */
+
+/**
+ * @}
+ */
+
+#endif /* SENSOR_CONFIG_H_ */
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <zephyr/kernel.h>
+#include <app/drivers/lis2dtw12.h>
+
+#include "sensor_config.h"
+#include "sensor_profile.h"
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(sensor_profile, CONFIG_APP_LOG_LEVEL);
+
+#define PPG_FRAME(samples) MIN(samples, CONFIG_PPG_SAMPLES_PER_FRAME)
+#define ACC_FRAME(samples) MIN(samples, CONFIG_ACC_SAMPLES_PER_FRAME)
+
+static const struct sensor_profile profiles[SENSOR_PROFILE_COUNT] = {
+    [SENSOR_PROFILE_DEFAULT] = {.name = "default",
+                                .ppg_rate_hz = 50,
+                                .ppg_average = 1,
+                                .ppg_frame_samples = CONFIG_PPG_SAMPLES_PER_FRAME,
+                                .ppg_filter = true,
+                                .acc_rate_mhz = 50000,
+                                .acc_power_mode = LIS2DTW12_LOW_POWER_4,
+                                .acc_frame_samples = CONFIG_ACC_SAMPLES_PER_FRAME},
+    // Breathing and heart rate do not need more than 25Hz, averaging halves the PPG noise power
+    [SENSOR_PROFILE_SLEEP] = {.name = "sleep",
+                              .ppg_rate_hz = 50,
+                              .ppg_average = 2,
+                              .ppg_frame_samples = PPG_FRAME(20),
+                              .ppg_filter = true,
+                              .acc_rate_mhz = 12500,
+                              .acc_power_mode = LIS2DTW12_LOW_POWER_1,
+                              .acc_frame_samples = ACC_FRAME(10)},
+    // Everything the sensors give, frames of 0.2s
+    [SENSOR_PROFILE_RESEARCH_RAW] = {.name = "research-raw",
+                                     .ppg_rate_hz = 100,
+                                     .ppg_average = 1,
+                                     .ppg_frame_samples = PPG_FRAME(20),
+                                     .ppg_filter = false,
+                                     .acc_rate_mhz = 100000,
+                                     .acc_power_mode = LIS2DTW12_HIGH_PERFORMANCE,
+                                     .acc_frame_samples = ACC_FRAME(20)},
+    // Fewest LED exposures and FIFO drains, frames of 0.8s
+    [SENSOR_PROFILE_LOW_POWER] = {.name = "low-power",
+                                  .ppg_rate_hz = 25,
+                                  .ppg_average = 1,
+                                  .ppg_frame_samples = PPG_FRAME(20),
+                                  .ppg_filter = true,
+                                  .acc_rate_mhz = 12500,
+                                  .acc_power_mode = LIS2DTW12_LOW_POWER_1,
+                                  .acc_frame_samples = ACC_FRAME(10)},
+};
+
+static sensor_profile_cb_t profile_cb;
+static atomic_t profile_id = ATOMIC_INIT(SENSOR_PROFILE_DEFAULT);
+
+void sensor_profile_init(sensor_profile_cb_t cb)
+{
+    uint8_t id;
+
+    profile_cb = cb;
+
+    // The profile selected before a reboot stays selected
+    if (sensor_config_get_profile(&id) == 0 && id < SENSOR_PROFILE_COUNT)
+    {
+        atomic_set(&profile_id, id);
+        LOG_INF("Sensor profile %s restored", profiles[id].name);
+    }
+}
+
+int sensor_profile_select(uint8_t id)
+{
+    if (id >= SENSOR_PROFILE_COUNT)
+    {
+        return -EINVAL;
+    }
+
+    if (atomic_set(&profile_id, id) == id)
+    {
+        return 0;
+    }
+
+    LOG_INF("Sensor profile %s selected", profiles[id].name);
+    sensor_config_set_profile(id);
+
+    if (profile_cb)
+    {
+        profile_cb(id);
+    }
+
+    return 0;
+}
+
+enum sensor_profile_id sensor_profile_current(void)
+{
+    return (enum sensor_profile_id)atomic_get(&profile_id);
+}
+
+const struct sensor_profile *sensor_profile_get(enum sensor_profile_id id)
+{
+    return &profiles[id];
+}
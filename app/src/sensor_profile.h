@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef SENSOR_PROFILE_H_
+#define SENSOR_PROFILE_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup sensor_profile Sensor profiles
+ * @{
+ * @brief Named sets of sample rates, on-chip averaging and frame sizes for the PPG sensor and the accelerometer.
+ *
+ * A profile is selected over BLE and applied from the next sensor start, a streaming device restarts its sensors right
+ * away. The frame sizes are capped at CONFIG_PPG_SAMPLES_PER_FRAME and CONFIG_ACC_SAMPLES_PER_FRAME, which size the
+ * notifications, and picked so the PPG and accelerometer frames of a profile span about the same time. All but the
+ * research-raw profile send band-pass filtered PPG samples when CONFIG_APP_PPG_FILTER is enabled, and with the motion
+ * artifacts taken out when CONFIG_APP_MOTION_CANCEL_SEND is enabled. With CONFIG_APP_SENSOR_CONFIG the selected profile
+ * is kept over reboots.
+ */
+
+/** @brief Profile identifiers, as written to the profile characteristic. */
+enum sensor_profile_id
+{
+    /** PPG and accelerometer at 50Hz, the frame sizes from Kconfig. */
+    SENSOR_PROFILE_DEFAULT,
+    /** PPG at 25Hz out of 2 averaged 50Hz samples, accelerometer at 12.5Hz in low power mode 1. */
+    SENSOR_PROFILE_SLEEP,
+    /** PPG at 100Hz without averaging, accelerometer at 100Hz in high performance mode. */
+    SENSOR_PROFILE_RESEARCH_RAW,
+    /** PPG at 25Hz without averaging, accelerometer at 12.5Hz in low power mode 1. */
+    SENSOR_PROFILE_LOW_POWER,
+    SENSOR_PROFILE_COUNT,
+};
+
+/** @brief Sensor settings of a profile. */
+struct sensor_profile
+{
+    /** Name, for the log. */
+    const char *name;
+    /** PPG ADC sample rate in Hz, the output rate is this divided by ppg_average. */
+    uint16_t ppg_rate_hz;
+    /** PPG samples averaged on-chip into one output sample, a power of two. */
+    uint8_t ppg_average;
+    /** PPG output samples per FIFO frame. */
+    uint8_t ppg_frame_samples;
+    /** Send band-pass filtered and motion cancelled PPG samples, as far as those are enabled. */
+    bool ppg_filter;
+    /** Accelerometer output data rate in mHz. */
+    uint32_t acc_rate_mhz;
+    /** Accelerometer power mode, one of lis2dtw12_power_mode. */
+    uint8_t acc_power_mode;
+    /** Accelerometer samples per FIFO frame. */
+    uint8_t acc_frame_samples;
+};
+
+/** @brief Callback type for when a new profile is selected, called from the Bluetooth RX thread. */
+typedef void (*sensor_profile_cb_t)(enum sensor_profile_id id);
+
+/**
+ * @brief Register the callback for profile changes, and restore the profile stored with sensor_config.h
+ *
+ * @param[in] cb Called when a new profile is selected, can be NULL
+ */
+void sensor_profile_init(sensor_profile_cb_t cb);
+
+/**
+ * @brief Select a profile
+ *
+ * @param[in] id Profile identifier
+ * @return int 0 on success, -EINVAL for an unknown profile
+ */
+int sensor_profile_select(uint8_t id);
+
+/**
+ * @brief Get the selected profile
+ *
+ * @return enum sensor_profile_id Profile identifier
+ */
+enum sensor_profile_id sensor_profile_current(void);
+
+/**
+ * @brief Get the settings of a profile
+ *
+ * @param[in] id Profile identifier, must be valid
+ * @return const struct sensor_profile* Settings
+ */
+const struct sensor_profile *sensor_profile_get(enum sensor_profile_id id);
+
+/**
+ * @}
+ */
+
+#endif /* SENSOR_PROFILE_H_ */
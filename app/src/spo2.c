@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include "spo2.h"
+
+// Calibration curve SpO2 = 94.845 + 30.354 R - 45.060 R^2 of the Maxim reference design, clamped at 100%.
+// Replace it with a curve fitted against a reference oximeter for the TGM housing.
+static const struct
+{
+    uint16_t ratio;
+    uint16_t spo2;
+} spo2_calibration[] = {
+    {300, 999}, {400, 998}, {500, 988}, {600, 968}, {700, 940}, {800, 903},
+    {900, 857}, {1000, 801}, {1100, 737}, {1200, 664},
+};
+
+void spo2_init(struct spo2_estimator *est, uint16_t rate_hz, uint8_t window_s)
+{
+    uint8_t log2_rate = find_msb_set(MAX(rate_hz, 1)) - 1;
+
+    memset(est, 0, sizeof(*est));
+    est->rate_hz = MAX(rate_hz, 1);
+    // Second order high-pass of about 0.5Hz, as for the heart rate
+    est->hp_shift = MAX(log2_rate, 2) - 1;
+    est->window = est->rate_hz * MAX(window_s, 1);
+    est->settle = est->rate_hz;
+}
+
+static void spo2_channel_filter(struct spo2_channel *channel, uint8_t shift, uint32_t value, bool first)
+{
+    int32_t x = (int32_t)(value << 8);
+
+    if (first)
+    {
+        channel->hp[0] = x;
+    }
+    channel->hp[0] += (x - channel->hp[0]) >> shift;
+    x -= channel->hp[0];
+    channel->hp[1] += (x - channel->hp[1]) >> shift;
+    channel->ac = x - channel->hp[1];
+}
+
+static void spo2_channel_add(struct spo2_channel *channel, uint32_t value)
+{
+    channel->sum_dc += value;
+    channel->sum_ac2 += (int64_t)channel->ac * channel->ac;
+}
+
+static void spo2_channel_reset(struct spo2_channel *channel)
+{
+    channel->sum_dc = 0;
+    channel->sum_ac2 = 0;
+}
+
+static void spo2_window_reset(struct spo2_estimator *est)
+{
+    spo2_channel_reset(&est->red);
+    spo2_channel_reset(&est->ir);
+    est->sum_cross = 0;
+    est->window_count = 0;
+}
+
+static void spo2_window(struct spo2_estimator *est, struct spo2_result *result)
+{
+    const float n = est->window_count;
+    float dc_red = est->red.sum_dc / n;
+    float dc_ir = est->ir.sum_dc / n;
+    float ac_red = sqrtf(est->red.sum_ac2 / n) / 256;
+    float ac_ir = sqrtf(est->ir.sum_ac2 / n) / 256;
+    float correlation = (est->red.sum_ac2 > 0 && est->ir.sum_ac2 > 0)
+                            ? est->sum_cross / sqrtf((float)est->red.sum_ac2 * (float)est->ir.sum_ac2)
+                            : 0;
+
+    memset(result, 0, sizeof(*result));
+
+    if (dc_red < SPO2_MIN_DC || dc_ir < SPO2_MIN_DC)
+    {
+        result->quality = SPO2_QUALITY_LOW_SIGNAL;
+        return;
+    }
+
+    float perfusion = ac_ir / dc_ir;
+    float ratio = (ac_ir > 0) ? (ac_red / dc_red) / perfusion : 0;
+
+    result->ratio = (uint16_t)MIN(lroundf(ratio * 1000), UINT16_MAX);
+    result->perfusion = (uint16_t)MIN(lroundf(perfusion * 10000), UINT16_MAX);
+    result->correlation = (uint8_t)CLAMP(lroundf(correlation * 100), 0, 100);
+
+    if (result->perfusion < CONFIG_APP_SPO2_MIN_PERFUSION)
+    {
+        result->quality |= SPO2_QUALITY_LOW_PERFUSION;
+    }
+    if (result->correlation < CONFIG_APP_SPO2_MIN_CORRELATION)
+    {
+        result->quality |= SPO2_QUALITY_MOTION;
+    }
+
+    uint16_t spo2 = spo2_from_ratio(result->ratio);
+    if (spo2 == 0)
+    {
+        result->quality |= SPO2_QUALITY_OUT_OF_RANGE;
+    }
+
+    result->spo2 = result->quality ? 0 : spo2;
+}
+
+bool spo2_process(struct spo2_estimator *est, const struct ppg_sample *samples, uint8_t count,
+                  struct spo2_result *result)
+{
+    bool ended = false;
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        uint32_t n = est->count++;
+
+        spo2_channel_filter(&est->red, est->hp_shift, samples[i].red, n == 0);
+        spo2_channel_filter(&est->ir, est->hp_shift, samples[i].ir, n == 0);
+
+        if (est->settle)
+        {
+            est->settle--;
+            continue;
+        }
+
+        spo2_channel_add(&est->red, samples[i].red);
+        spo2_channel_add(&est->ir, samples[i].ir);
+        est->sum_cross += (int64_t)est->red.ac * est->ir.ac;
+
+        if (++est->window_count == est->window)
+        {
+            spo2_window(est, result);
+            spo2_window_reset(est);
+            ended = true;
+        }
+    }
+
+    return ended;
+}
+
+void spo2_discard_window(struct spo2_estimator *est)
+{
+    spo2_window_reset(est);
+    est->settle = est->rate_hz;
+}
+
+uint16_t spo2_from_ratio(uint16_t ratio)
+{
+    if (ratio < spo2_calibration[0].ratio || ratio > spo2_calibration[ARRAY_SIZE(spo2_calibration) - 1].ratio)
+    {
+        return 0;
+    }
+
+    for (size_t i = 1; i < ARRAY_SIZE(spo2_calibration); i++)
+    {
+        if (ratio <= spo2_calibration[i].ratio)
+        {
+            int32_t r0 = spo2_calibration[i - 1].ratio;
+            int32_t r1 = spo2_calibration[i].ratio;
+            int32_t s0 = spo2_calibration[i - 1].spo2;
+            int32_t s1 = spo2_calibration[i].spo2;
+
+            return (uint16_t)(s0 + (s1 - s0) * (ratio - r0) / (r1 - r0));
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef SPO2_H_
+#define SPO2_H_
+
+#include <zephyr/kernel.h>
+#include <app/drivers/maxm86161.h>
+
+/**@file
+ * @defgroup spo2 SpO2
+ * @{
+ * @brief Windowed ratio of ratios SpO2 estimate from the red and IR PPG channels.
+ *
+ * Per window, the DC level of a channel is the mean of its samples and the AC level the RMS of the samples after a
+ * second order high-pass of about 0.5Hz. The ratio R = (AC red / DC red) / (AC IR / DC IR) is mapped to SpO2 through a
+ * piecewise linear calibration table. A window only gives an SpO2 when it passes the signal quality gate:
+ *
+ * - SPO2_QUALITY_LOW_SIGNAL: the IR or red DC level is below SPO2_MIN_DC, there is no skin or the LED is off.
+ * - SPO2_QUALITY_LOW_PERFUSION: the IR AC level is below CONFIG_APP_SPO2_MIN_PERFUSION of its DC level.
+ * - SPO2_QUALITY_MOTION: the red and IR AC signals correlate less than CONFIG_APP_SPO2_MIN_CORRELATION percent, the
+ *   pulse is not what moves them.
+ * - SPO2_QUALITY_OUT_OF_RANGE: R is outside the calibration table.
+ */
+
+/** @brief Smallest DC level in ADC counts, 1/32 of full scale. */
+#define SPO2_MIN_DC ((MAXM86161_FIFO_DATA_MASK + 1) / 32)
+
+/** @brief Reasons a window gives no SpO2. */
+enum spo2_quality
+{
+    SPO2_QUALITY_LOW_SIGNAL = BIT(0),
+    SPO2_QUALITY_LOW_PERFUSION = BIT(1),
+    SPO2_QUALITY_MOTION = BIT(2),
+    SPO2_QUALITY_OUT_OF_RANGE = BIT(3),
+};
+
+/** @brief Result of a window. */
+struct spo2_result
+{
+    /** SpO2 in 0.1%, 0 when the window did not pass the quality gate. */
+    uint16_t spo2;
+    /** Ratio of ratios R in 1/1000. */
+    uint16_t ratio;
+    /** IR perfusion index, RMS AC level over DC level, in 0.01%. */
+    uint16_t perfusion;
+    /** Correlation of the red and IR AC signals in percent, 0 when negative. */
+    uint8_t correlation;
+    /** Failed quality checks, a combination of spo2_quality. */
+    uint8_t quality;
+};
+
+/** @brief Filter state and sums of one channel. */
+struct spo2_channel
+{
+    /** High-pass filter states, in 1/256 counts. */
+    int32_t hp[2];
+    /** Last high-passed sample, in 1/256 counts. */
+    int32_t ac;
+    /** Sum of the samples over the window. */
+    uint64_t sum_dc;
+    /** Sum of the squared high-passed samples over the window. */
+    int64_t sum_ac2;
+};
+
+/** @brief Estimator state, red and IR. */
+struct spo2_estimator
+{
+    uint16_t rate_hz;
+    uint8_t hp_shift;
+    /** Samples per window. */
+    uint32_t window;
+    /** Samples processed since spo2_init(). */
+    uint32_t count;
+    /** Samples left before the next window starts, while the high-pass settles. */
+    uint32_t settle;
+    /** Samples in the current window. */
+    uint32_t window_count;
+    /** Sum of the products of the red and IR high-passed samples over the window. */
+    int64_t sum_cross;
+    struct spo2_channel red;
+    struct spo2_channel ir;
+};
+
+/**
+ * @brief Initialize an estimator
+ *
+ * @param[out] est Estimator state
+ * @param[in] rate_hz Sample rate in Hz
+ * @param[in] window_s Window length in seconds
+ */
+void spo2_init(struct spo2_estimator *est, uint16_t rate_hz, uint8_t window_s);
+
+/**
+ * @brief Run a block of samples through the estimator
+ *
+ * The first second after spo2_init() or spo2_discard_window() lets the high-pass settle and is not part of a window.
+ *
+ * @param[in,out] est Estimator state
+ * @param[in] samples Samples, only red and IR are used
+ * @param[in] count Number of samples
+ * @param[out] result Result of the window that ended in this block
+ * @return true If a window ended in this block, result then holds the last one
+ */
+bool spo2_process(struct spo2_estimator *est, const struct ppg_sample *samples, uint8_t count,
+                  struct spo2_result *result);
+
+/**
+ * @brief Drop the current window, e.g. after the LED currents changed
+ *
+ * @param[in,out] est Estimator state
+ */
+void spo2_discard_window(struct spo2_estimator *est);
+
+/**
+ * @brief Map a ratio of ratios to SpO2 through the calibration table
+ *
+ * @param[in] ratio R in 1/1000
+ * @return uint16_t SpO2 in 0.1%, 0 when R is outside the table
+ */
+uint16_t spo2_from_ratio(uint16_t ratio);
+
+/**
+ * @}
+ */
+
+#endif /* SPO2_H_ */
@@ -0,0 +1,288 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <errno.h>
+
+#include "stream_codec.h"
+
+struct codec_writer
+{
+    uint8_t *out;
+    size_t pos;
+    uint64_t acc;
+    uint8_t bits;
+};
+
+struct codec_reader
+{
+    const uint8_t *in;
+    size_t len;
+    size_t pos;
+    uint64_t acc;
+    uint8_t bits;
+};
+
+static inline uint32_t codec_mask(uint8_t bits)
+{
+    return (uint32_t)((1ull << bits) - 1);
+}
+
+static inline uint32_t codec_zigzag(int32_t delta)
+{
+    return ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+}
+
+static inline int32_t codec_unzigzag(uint32_t zz)
+{
+    return (int32_t)(zz >> 1) ^ -(int32_t)(zz & 1);
+}
+
+static inline void codec_write(struct codec_writer *w, uint32_t value, uint8_t bits)
+{
+    w->acc |= (uint64_t)(value & codec_mask(bits)) << w->bits;
+    w->bits += bits;
+
+    // Fewer than 8 bits stay behind, so any write of up to 32 bits fits the accumulator
+    while (w->bits >= 8)
+    {
+        w->out[w->pos++] = (uint8_t)w->acc;
+        w->acc >>= 8;
+        w->bits -= 8;
+    }
+}
+
+static size_t codec_flush(struct codec_writer *w)
+{
+    if (w->bits > 0)
+    {
+        w->out[w->pos++] = (uint8_t)w->acc;
+        w->acc = 0;
+        w->bits = 0;
+    }
+
+    return w->pos;
+}
+
+static inline uint32_t codec_read(struct codec_reader *r, uint8_t bits)
+{
+    while (r->bits < bits)
+    {
+        // Reading past the end yields zeros, the caller checks pos against len afterwards
+        r->acc |= (uint64_t)(r->pos < r->len ? r->in[r->pos] : 0) << r->bits;
+        r->pos++;
+        r->bits += 8;
+    }
+
+    uint32_t value = (uint32_t)r->acc & codec_mask(bits);
+    r->acc >>= bits;
+    r->bits -= bits;
+
+    return value;
+}
+
+static inline uint32_t codec_rice_cost(uint32_t zz, uint8_t k, uint8_t bits)
+{
+    uint32_t q = zz >> k;
+
+    return (q < STREAM_CODEC_RICE_ESCAPE) ? q + 1 + k : STREAM_CODEC_RICE_ESCAPE + bits + 1;
+}
+
+static inline void codec_rice_write(struct codec_writer *w, uint32_t zz, uint8_t k, uint8_t bits)
+{
+    uint32_t q = zz >> k;
+
+    if (q < STREAM_CODEC_RICE_ESCAPE)
+    {
+        // q ones terminated by a zero, then the remainder
+        codec_write(w, codec_mask(q), q + 1);
+        codec_write(w, zz, k);
+    }
+    else
+    {
+        codec_write(w, codec_mask(STREAM_CODEC_RICE_ESCAPE), STREAM_CODEC_RICE_ESCAPE);
+        codec_write(w, zz, bits + 1);
+    }
+}
+
+static inline uint32_t codec_rice_read(struct codec_reader *r, uint8_t k, uint8_t bits)
+{
+    uint32_t q = 0;
+
+    while (q < STREAM_CODEC_RICE_ESCAPE && codec_read(r, 1))
+    {
+        q++;
+    }
+
+    if (q == STREAM_CODEC_RICE_ESCAPE)
+    {
+        return codec_read(r, bits + 1);
+    }
+
+    return (q << k) | codec_read(r, k);
+}
+
+static inline int32_t codec_sign_extend(uint32_t value, const struct stream_codec_layout *layout)
+{
+    uint8_t shift = 32 - layout->bits;
+
+    return layout->is_signed ? ((int32_t)(value << shift) >> shift) : (int32_t)value;
+}
+
+/**
+ * @brief Pick the Rice parameter of every channel from the mean difference
+ *
+ * k = floor(log2(mean)) is close to optimal for the roughly geometric distribution of zigzag differences.
+ */
+static void codec_rice_params(const struct stream_codec_layout *layout, const int32_t *samples, uint16_t count,
+                              uint8_t *k)
+{
+    const uint8_t channels = layout->channels;
+
+    for (uint8_t c = 0; c < channels; c++)
+    {
+        uint64_t sum = 0;
+
+        for (uint16_t i = 1; i < count; i++)
+        {
+            sum += codec_zigzag(samples[i * channels + c] - samples[(i - 1) * channels + c]);
+        }
+
+        k[c] = 0;
+        while (k[c] < layout->bits && ((uint64_t)(count - 1) << (k[c] + 1)) <= sum)
+        {
+            k[c]++;
+        }
+    }
+}
+
+static uint16_t codec_encode_packed(const struct stream_codec_layout *layout, const int32_t *samples, uint16_t count,
+                                    struct codec_writer *w)
+{
+    for (uint32_t i = 0; i < (uint32_t)count * layout->channels; i++)
+    {
+        codec_write(w, (uint32_t)samples[i], layout->bits);
+    }
+
+    return count;
+}
+
+uint16_t stream_codec_encode(const struct stream_codec_layout *layout, const int32_t *samples, uint16_t count,
+                             uint8_t *out, size_t out_size, size_t *len, uint8_t *format)
+{
+    const uint8_t channels = layout->channels;
+    const uint8_t bits = layout->bits;
+    const size_t capacity = out_size * 8;
+    const uint16_t packed_count = MIN(count, capacity / (channels * bits));
+    struct codec_writer w = {.out = out};
+    uint8_t k[STREAM_CODEC_MAX_CHANNELS];
+    size_t used = channels * (STREAM_CODEC_K_BITS + bits);
+    uint16_t n = 0;
+
+    if (count > 0 && used <= capacity)
+    {
+        codec_rice_params(layout, samples, count, k);
+
+        for (uint8_t c = 0; c < channels; c++)
+        {
+            codec_write(&w, k[c], STREAM_CODEC_K_BITS);
+        }
+        for (uint8_t c = 0; c < channels; c++)
+        {
+            codec_write(&w, (uint32_t)samples[c], bits);
+        }
+
+        for (n = 1; n < count; n++)
+        {
+            const int32_t *sample = &samples[n * channels];
+            uint32_t zz[STREAM_CODEC_MAX_CHANNELS];
+            uint32_t cost = 0;
+
+            for (uint8_t c = 0; c < channels; c++)
+            {
+                zz[c] = codec_zigzag(sample[c] - sample[c - channels]);
+                cost += codec_rice_cost(zz[c], k[c], bits);
+            }
+
+            // Only whole samples go into a block
+            if (used + cost > capacity)
+            {
+                break;
+            }
+
+            used += cost;
+            for (uint8_t c = 0; c < channels; c++)
+            {
+                codec_rice_write(&w, zz[c], k[c], bits);
+            }
+        }
+    }
+
+    // Fall back to plain packing when the differences do not pay off
+    if (n < packed_count || (n == packed_count && DIV_ROUND_UP(used, 8) >= DIV_ROUND_UP((size_t)n * channels * bits, 8)))
+    {
+        w = (struct codec_writer){.out = out};
+        n = codec_encode_packed(layout, samples, packed_count, &w);
+        *format = STREAM_CODEC_FORMAT_PACKED;
+    }
+    else
+    {
+        *format = STREAM_CODEC_FORMAT_DELTA_RICE;
+    }
+
+    *len = codec_flush(&w);
+
+    return n;
+}
+
+int stream_codec_decode(const struct stream_codec_layout *layout, uint8_t format, const uint8_t *in, size_t len,
+                        uint16_t count, int32_t *samples)
+{
+    const uint8_t channels = layout->channels;
+    const uint8_t bits = layout->bits;
+    struct codec_reader r = {.in = in, .len = len};
+    uint8_t k[STREAM_CODEC_MAX_CHANNELS];
+
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    switch (format)
+    {
+    case STREAM_CODEC_FORMAT_PACKED:
+        for (uint32_t i = 0; i < (uint32_t)count * channels; i++)
+        {
+            samples[i] = codec_sign_extend(codec_read(&r, bits), layout);
+        }
+        break;
+
+    case STREAM_CODEC_FORMAT_DELTA_RICE:
+        for (uint8_t c = 0; c < channels; c++)
+        {
+            k[c] = codec_read(&r, STREAM_CODEC_K_BITS);
+            if (k[c] > bits)
+            {
+                return -EINVAL;
+            }
+        }
+        for (uint8_t c = 0; c < channels; c++)
+        {
+            samples[c] = codec_sign_extend(codec_read(&r, bits), layout);
+        }
+
+        for (uint32_t i = channels; i < (uint32_t)count * channels; i += channels)
+        {
+            for (uint8_t c = 0; c < channels; c++)
+            {
+                samples[i + c] = samples[i + c - channels] + codec_unzigzag(codec_rice_read(&r, k[c], bits));
+            }
+        }
+        break;
+
+    default:
+        return -EINVAL;
+    }
+
+    return (r.pos <= len) ? 0 : -EINVAL;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef STREAM_CODEC_H_
+#define STREAM_CODEC_H_
+
+#include <zephyr/kernel.h>
+
+/**@file
+ * @defgroup stream_codec Sensor stream codec
+ * @{
+ * @brief Lossless compression of multi-channel sensor samples into notification sized blocks.
+ *
+ * Samples are passed as interleaved int32_t values, one per channel. A block is a little endian bit stream, bit 0 is
+ * the LSB of the first byte, in one of two formats:
+ *
+ * - STREAM_CODEC_FORMAT_PACKED: every value in layout.bits bits, channel after channel, sample after sample.
+ * - STREAM_CODEC_FORMAT_DELTA_RICE: a 5-bit Rice parameter k per channel, the first sample as in the packed format,
+ *   then for every following sample and channel the zigzag encoded difference with the previous sample. A difference
+ *   z is sent as z >> k one bits, a zero bit and the low k bits of z. When z >> k reaches STREAM_CODEC_RICE_ESCAPE,
+ *   STREAM_CODEC_RICE_ESCAPE one bits are followed by z in layout.bits + 1 bits instead.
+ *
+ * The last byte of a block is padded with zeros. The encoder falls back to the packed format when the differences do
+ * not compress, so a block never holds fewer samples than a packed block of the same size.
+ */
+
+/** @brief Block formats, sent along with every block so the client can decode it. */
+enum stream_codec_format
+{
+    /** Values bit packed without compression. */
+    STREAM_CODEC_FORMAT_PACKED = 1,
+    /** Per channel differences, zigzag and Rice coded. */
+    STREAM_CODEC_FORMAT_DELTA_RICE = 2,
+};
+
+/** @brief Maximum number of channels per sample. */
+#define STREAM_CODEC_MAX_CHANNELS 3
+/** @brief Number of bits of the Rice parameter of every channel. */
+#define STREAM_CODEC_K_BITS 5
+/** @brief Unary length at which a difference is sent as is. */
+#define STREAM_CODEC_RICE_ESCAPE 16u
+
+/** @brief Layout of the samples of one stream. */
+struct stream_codec_layout
+{
+    /** Number of channels per sample, at most STREAM_CODEC_MAX_CHANNELS. */
+    uint8_t channels;
+    /** Number of significant bits of every value, at most 30. */
+    uint8_t bits;
+    /** Set when the values are two's complement, so they are sign extended when decoded. */
+    bool is_signed;
+};
+
+/**
+ * @brief Encode as many samples as fit a block
+ *
+ * @param[in] layout Sample layout
+ * @param[in] samples Interleaved samples, values must fit layout.bits
+ * @param[in] count Number of samples available
+ * @param[out] out Output buffer
+ * @param[in] out_size Size of out in bytes
+ * @param[out] len Number of bytes written to out
+ * @param[out] format Format of the block, one of enum stream_codec_format
+ * @return uint16_t Number of samples encoded, 0 when not even one sample fits
+ */
+uint16_t stream_codec_encode(const struct stream_codec_layout *layout, const int32_t *samples, uint16_t count,
+                             uint8_t *out, size_t out_size, size_t *len, uint8_t *format);
+
+/**
+ * @brief Decode a block
+ *
+ * Reference decoder for the client side, also used to check the encoder.
+ *
+ * @param[in] layout Sample layout
+ * @param[in] format Format of the block
+ * @param[in] in Block data
+ * @param[in] len Size of the block in bytes
+ * @param[in] count Number of samples in the block
+ * @param[out] samples Interleaved decoded samples
+ * @return int 0 on success, -EINVAL when the block is malformed or shorter than count samples
+ */
+int stream_codec_decode(const struct stream_codec_layout *layout, uint8_t format, const uint8_t *in, size_t len,
+                        uint16_t count, int32_t *samples);
+
+/**
+ * @}
+ */
+
+#endif /* STREAM_CODEC_H_ */
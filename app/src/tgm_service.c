@@ -7,23 +7,187 @@
 #include <zephyr/bluetooth/gatt.h>
 #include <zephyr/bluetooth/hci.h>
 #include <zephyr/bluetooth/uuid.h>
+#include <zephyr/drivers/hwinfo.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
 
 #include <app_version.h>
 #include "tgm_service.h"
+#include "stream_codec.h"
+#include "l2cap_stream.h"
+#include "power_budget.h"
 #include "ppg.h"
+#include "sensor_profile.h"
+#include "clock_sync.h"
+#include "flash_log.h"
+#include "log_window.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(tgm_service, CONFIG_APP_LOG_LEVEL);
 
+// Indices of the notified characteristic values in tgm_service_svc.attrs, checked against the UUIDs at init
+enum tgm_service_attr_t
+{
+    TGM_SERVICE_ATTR_BAT = 6,
+    TGM_SERVICE_ATTR_PPG = 9,
+    TGM_SERVICE_ATTR_ACC = 12,
+    TGM_SERVICE_ATTR_TEMP = 15,
+    TGM_SERVICE_ATTR_READ_PPG_REG = 18,
+    TGM_SERVICE_ATTR_WRITE_PPG_REG = 21,
+    TGM_SERVICE_ATTR_MUX = 24,
+    TGM_SERVICE_ATTR_HR = 29,
+    TGM_SERVICE_ATTR_SPO2 = 32,
+    TGM_SERVICE_ATTR_HRV = 35,
+    TGM_SERVICE_ATTR_MOTION = 38,
+    TGM_SERVICE_ATTR_BRUXISM = 41,
+    TGM_SERVICE_ATTR_CLOCK = 44,
+    TGM_SERVICE_ATTR_LOG = 47,
+};
+
 static bool notify_ppg_data;
 static bool notify_acc_data;
 static bool notify_temp_data;
 static bool notify_battery;
 static bool notify_read_ppg_reg;
 static bool notify_write_ppg_reg;
+static bool notify_mux_data;
+static bool notify_hr_data;
+static bool notify_spo2_data;
+static bool notify_hrv_data;
+static bool notify_motion_data;
+static bool notify_bruxism_data;
+static bool notify_clock_sync;
+static bool notify_log;
 
 static uint32_t ppg_frame_counter = 0;
 static uint32_t acc_frame_counter = 0;
+static uint32_t hr_frame_counter = 0;
+static uint32_t spo2_frame_counter = 0;
+static uint32_t hrv_frame_counter = 0;
+static uint32_t motion_frame_counter = 0;
+static uint32_t bruxism_frame_counter = 0;
+
+// Response to the last clock sync request, notified from the system work queue
+static struct tgm_service_clock_sync_data_t clock_sync_data;
+static struct k_work clock_sync_work;
+
+/**
+ * @brief Offload of the flash log, see tgm_service_log_cmd_t
+ *
+ * The commands of the client are taken in the BT RX thread under the lock, the pages are read and sent from the
+ * system work queue.
+ */
+static struct
+{
+    struct k_work_delayable work;
+    struct k_spinlock lock;
+    // Set by the commands, the window also by the work handler
+    bool start;
+    bool active;
+    struct log_window window;
+    // Owned by the work handler
+    bool bulk;
+    bool end_sent;
+    uint32_t released_seq;
+    uint32_t page_seq;
+    uint16_t offset;
+    uint16_t len;
+    uint8_t page[sizeof(struct tgm_service_log_page_t) + FLASH_LOG_PAGE_SIZE];
+    atomic_t in_flight;
+    uint32_t pages;
+    uint32_t bytes;
+    int64_t start_ms;
+} log_offload;
+
+// Ends a transfer without the client, the stack drops the notifications in flight
+static void tgm_service_log_reset(void)
+{
+    k_spinlock_key_t key = k_spin_lock(&log_offload.lock);
+    log_offload.active = false;
+    k_spin_unlock(&log_offload.lock, key);
+
+    atomic_set(&log_offload.in_flight, 0);
+}
+
+/** @brief One notification waiting in a TX queue. */
+struct tgm_service_tx_frame_t
+{
+    uint16_t len;
+    uint8_t data[CONFIG_BT_L2CAP_TX_MTU - 3];
+};
+
+/**
+ * @brief TX queue of a sensor stream
+ *
+ * Frames are queued by the sensor thread and handed to the stack from the system work queue, where buffer
+ * allocation does not block. At most CONFIG_APP_NOTIFY_MAX_IN_FLIGHT notifications are handed over at a time, the
+ * completion callback of each one frees its place and submits the next frames. Without a free TX buffer the queue is
+ * drained again after a short delay.
+ */
+struct tgm_service_tx_t
+{
+    /** Name used in the statistics log. */
+    const char *name;
+    /** Index of the characteristic value in the service. */
+    uint8_t attr_index;
+    /** Drains the queue into the stack. */
+    struct k_work_delayable work;
+    /** Protects head, tail and the statistics. */
+    struct k_spinlock lock;
+    /** Number of frames ever queued, the next frame goes to frames[head % depth]. */
+    uint32_t head;
+    /** Number of frames ever handed to the stack or dropped. */
+    uint32_t tail;
+    /** Notifications handed to the stack that have not completed yet. */
+    atomic_t in_flight;
+    /** Frame counters. */
+    struct tgm_service_tx_stats stats;
+    /** Queued frames. */
+    struct tgm_service_tx_frame_t frames[CONFIG_APP_NOTIFY_QUEUE_DEPTH];
+};
+
+// Packed and compressed frames are checked with their formats
+BUILD_ASSERT(!IS_ENABLED(CONFIG_PPG_FORMAT_LEGACY) ||
+                 sizeof(struct tgm_service_ppg_data_t) <= CONFIG_BT_L2CAP_TX_MTU - 3,
+             "CONFIG_PPG_SAMPLES_PER_FRAME too large for a single notification");
+BUILD_ASSERT(IS_ENABLED(CONFIG_ACC_FORMAT_COMPRESSED) ||
+                 sizeof(struct tgm_service_acc_data_t) <= CONFIG_BT_L2CAP_TX_MTU - 3,
+             "CONFIG_ACC_SAMPLES_PER_FRAME too large for a single notification");
+
+// Every frame also goes out as a record of the multiplexed stream, compressed frames are sized for it at run time. A
+// full legacy PPG frame takes a whole notification, the multiplexed stream leaves it out, see tgm_service_mux_append()
+BUILD_ASSERT(IS_ENABLED(CONFIG_ACC_FORMAT_COMPRESSED) ||
+                 sizeof(struct tgm_service_acc_data_t) <= TGM_SERVICE_MUX_FRAME_MAX,
+             "CONFIG_ACC_SAMPLES_PER_FRAME too large for a multiplexed stream record");
+
+// Streams that each hand up to CONFIG_APP_NOTIFY_MAX_IN_FLIGHT notifications to the stack: PPG, accelerometer,
+// multiplexed stream and the flash log offload
+#define TGM_SERVICE_TX_STREAMS 4
+// ACL TX buffers left for the single notifications of the other characteristics
+#define TGM_SERVICE_TX_RESERVED 2
+#define TGM_SERVICE_TX_BUDGET (TGM_SERVICE_TX_STREAMS * CONFIG_APP_NOTIFY_MAX_IN_FLIGHT + TGM_SERVICE_TX_RESERVED)
+
+BUILD_ASSERT(TGM_SERVICE_TX_BUDGET <= CONFIG_BT_BUF_ACL_TX_COUNT,
+             "Notifications in flight of all streams exceed the ACL TX buffers, lower APP_NOTIFY_MAX_IN_FLIGHT");
+
+static struct tgm_service_tx_t ppg_tx = {.name = "ppg", .attr_index = TGM_SERVICE_ATTR_PPG};
+static struct tgm_service_tx_t acc_tx = {.name = "acc", .attr_index = TGM_SERVICE_ATTR_ACC};
+static struct tgm_service_tx_t mux_tx = {.name = "mux", .attr_index = TGM_SERVICE_ATTR_MUX};
+
+/** @brief Multiplexed stream notification that is being filled with records. */
+static struct
+{
+    /** Serializes the sensor threads and the flush work. */
+    struct k_mutex lock;
+    /** Sends a partly filled notification after CONFIG_APP_MUX_FLUSH_TIMEOUT_MS. */
+    struct k_work_delayable flush_work;
+    /** Frame counter of the multiplexed stream. */
+    uint32_t frame_counter;
+    /** Bytes used in pdu, 0 when empty. */
+    uint16_t len;
+    /** Frame counter followed by the records. */
+    uint8_t pdu[CONFIG_BT_L2CAP_TX_MTU - 3];
+} tgm_service_mux;
 
 static struct tgm_service_ppg_data_t tgm_service_ppg_data;
 static struct tgm_service_acc_data_t tgm_service_acc_data;
@@ -31,18 +195,68 @@ static struct tgm_service_temp_data_t tgm_service_temp_data;
 static uint16_t bat_value;
 static uint64_t uuid_value;
 static char fw_version[15] = APP_VERSION_STRING;
+static const struct tgm_service_format_data_t format_value = {
+    .ppg = IS_ENABLED(CONFIG_PPG_FORMAT_COMPRESSED) ? TGM_SERVICE_STREAM_COMPRESSED
+           : IS_ENABLED(CONFIG_PPG_FORMAT_PACKED)   ? TGM_SERVICE_STREAM_PACKED
+                                                    : TGM_SERVICE_STREAM_LEGACY,
+    .acc = IS_ENABLED(CONFIG_ACC_FORMAT_COMPRESSED) ? TGM_SERVICE_STREAM_COMPRESSED : TGM_SERVICE_STREAM_LEGACY,
+    .flags = IS_ENABLED(CONFIG_APP_FRAME_TIME) ? TGM_SERVICE_FORMAT_FRAME_TIME : 0,
+    .ppg_samples = CONFIG_PPG_SAMPLES_PER_FRAME,
+    .acc_samples = CONFIG_ACC_SAMPLES_PER_FRAME,
+};
 static struct tgm_service_cb *tgm_service_cb = NULL;
 
+static void tgm_service_tx_log_stats(struct tgm_service_tx_t *tx)
+{
+    struct tgm_service_tx_stats stats;
+    k_spinlock_key_t key = k_spin_lock(&tx->lock);
+
+    stats = tx->stats;
+    k_spin_unlock(&tx->lock, key);
+
+    LOG_INF("%s tx: queued %u, sent %u, dropped %u", tx->name, stats.queued, stats.sent, stats.dropped);
+}
+
+// Tell the application when the raw sensor streams start or stop, so it can adapt the connection
+static void tgm_service_update_streaming(void)
+{
+    static bool streaming;
+    bool streaming_new = notify_ppg_data || notify_acc_data || notify_mux_data || l2cap_stream_is_connected();
+
+    if (streaming_new == streaming)
+    {
+        return;
+    }
+
+    streaming = streaming_new;
+    if (tgm_service_cb && tgm_service_cb->streaming_cb)
+    {
+        tgm_service_cb->streaming_cb(streaming);
+    }
+}
+
 static void tgm_service_ccc_ppg_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
 {
     LOG_INF("Enabled notifications for ppg data");
     notify_ppg_data = (value == BT_GATT_CCC_NOTIFY);
+    tgm_service_tx_log_stats(&ppg_tx);
+    tgm_service_update_streaming();
 }
 
 static void tgm_service_ccc_acc_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
 {
     LOG_INF("Enabled notifications for acc data");
     notify_acc_data = (value == BT_GATT_CCC_NOTIFY);
+    tgm_service_tx_log_stats(&acc_tx);
+    tgm_service_update_streaming();
+}
+
+static void tgm_service_ccc_mux_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for multiplexed sensor data");
+    notify_mux_data = (value == BT_GATT_CCC_NOTIFY);
+    tgm_service_tx_log_stats(&mux_tx);
+    tgm_service_update_streaming();
 }
 
 static void tgm_service_ccc_temp_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
@@ -51,6 +265,55 @@ static void tgm_service_ccc_temp_data_cfg_changed(const struct bt_gatt_attr *att
     notify_temp_data = (value == BT_GATT_CCC_NOTIFY);
 }
 
+static void tgm_service_ccc_hr_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for heart rate data");
+    notify_hr_data = (value == BT_GATT_CCC_NOTIFY);
+}
+
+static void tgm_service_ccc_spo2_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for SpO2 data");
+    notify_spo2_data = (value == BT_GATT_CCC_NOTIFY);
+}
+
+static void tgm_service_ccc_hrv_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for HRV data");
+    notify_hrv_data = (value == BT_GATT_CCC_NOTIFY);
+}
+
+static void tgm_service_ccc_motion_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for motion data");
+    notify_motion_data = (value == BT_GATT_CCC_NOTIFY);
+}
+
+static void tgm_service_ccc_bruxism_data_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for bruxism data");
+    notify_bruxism_data = (value == BT_GATT_CCC_NOTIFY);
+}
+
+static void tgm_service_ccc_clock_sync_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for clock sync data");
+    notify_clock_sync = (value == BT_GATT_CCC_NOTIFY);
+}
+
+static void tgm_service_ccc_log_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
+{
+    LOG_INF("Enabled notifications for the flash log");
+    notify_log = (value == BT_GATT_CCC_NOTIFY);
+
+    // A transfer ends with the subscription, the notifications in flight with it
+    if (!notify_log)
+    {
+        tgm_service_log_reset();
+    }
+    k_work_reschedule(&log_offload.work, K_NO_WAIT);
+}
+
 static void tgm_service_ccc_bat_cfg_changed(const struct bt_gatt_attr *attr, uint16_t value)
 {
     LOG_INF("Enabled notifications for battery data");
@@ -94,7 +357,12 @@ static ssize_t get_uuid_value(struct bt_conn *conn, const struct bt_gatt_attr *a
 
     LOG_INF("Reading UUID value");
 
+#if defined(NRF_FICR)
     uuid_value = ((uint64_t)NRF_FICR->DEVICEID[1] << 32) | NRF_FICR->DEVICEID[0];
+#else
+    // No FICR outside of the nRF SoCs (e.g. native_sim)
+    hwinfo_get_device_id((uint8_t *)&uuid_value, sizeof(uuid_value));
+#endif
     return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(*value));
 }
 
@@ -108,6 +376,15 @@ static ssize_t get_fw_version(struct bt_conn *conn, const struct bt_gatt_attr *a
     return bt_gatt_attr_read(conn, attr, buf, len, offset, value, strlen(value));
 }
 
+// Callback function to get the frame layouts when the client reads this value
+static ssize_t get_format(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    const struct tgm_service_format_data_t *value = attr->user_data;
+
+    LOG_INF("Reading stream format");
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, value, sizeof(*value));
+}
+
 // Callback function to read the PPG register when the client writes to this value
 static ssize_t read_ppg_reg(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
 {
@@ -155,6 +432,140 @@ static ssize_t write_ppg_reg(struct bt_conn *conn, const struct bt_gatt_attr *at
     return len;
 }
 
+// Callback function to get the selected sensor profile when the client reads this value
+static ssize_t get_profile(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    uint8_t profile = sensor_profile_current();
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &profile, sizeof(profile));
+}
+
+// Callback function to select a sensor profile when the client writes to this value
+static ssize_t set_profile(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    if (len != 1u)
+    {
+        LOG_DBG("Invalid length for sensor profile");
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    if (offset != 0)
+    {
+        LOG_DBG("Invalid offset for sensor profile");
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    if (sensor_profile_select(*((uint8_t *)buf)))
+    {
+        LOG_DBG("Unknown sensor profile");
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    return len;
+}
+
+static void tgm_service_clock_sync_fill(uint8_t seq, uint64_t device_us)
+{
+    struct clock_sync_status status;
+
+    clock_sync_get_status(device_us, &status);
+
+    clock_sync_data.seq = seq;
+    clock_sync_data.points = status.points;
+    clock_sync_data.device_us = status.device_us;
+    clock_sync_data.wall_us = status.wall_us;
+    clock_sync_data.skew_ppb = status.skew_ppb;
+    clock_sync_data.rms_us = status.rms_us;
+}
+
+// Callback function to get the clock mapping at the current uptime when the client reads this value
+static ssize_t get_clock_sync(struct bt_conn *conn, const struct bt_gatt_attr *attr, void *buf, uint16_t len, uint16_t offset)
+{
+    tgm_service_clock_sync_fill(clock_sync_data.seq, k_ticks_to_us_floor64(k_uptime_ticks()));
+
+    return bt_gatt_attr_read(conn, attr, buf, len, offset, &clock_sync_data, sizeof(clock_sync_data));
+}
+
+// Callback function to take a clock sync request when the client writes to this value
+static ssize_t set_clock_sync(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    // Taken first, everything after it adds to the round trip of the host
+    const uint64_t device_us = k_ticks_to_us_floor64(k_uptime_ticks());
+    struct tgm_service_clock_sync_req_t req;
+
+    if (len != sizeof(req))
+    {
+        LOG_DBG("Invalid length for clock sync request");
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    if (offset != 0)
+    {
+        LOG_DBG("Invalid offset for clock sync request");
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    memcpy(&req, buf, sizeof(req));
+    clock_sync_request(req.seq, req.host_us, req.rtt_us, device_us);
+    tgm_service_clock_sync_fill(req.seq, device_us);
+
+    k_work_submit(&clock_sync_work);
+
+    return len;
+}
+
+// Callback function to take a flash log command when the client writes to this value
+static ssize_t set_log_cmd(struct bt_conn *conn, const struct bt_gatt_attr *attr, const void *buf, uint16_t len, uint16_t offset, uint8_t flags)
+{
+    struct tgm_service_log_cmd_t cmd;
+
+    if (len != sizeof(cmd))
+    {
+        LOG_DBG("Invalid length for flash log command");
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_ATTRIBUTE_LEN);
+    }
+
+    if (offset != 0)
+    {
+        LOG_DBG("Invalid offset for flash log command");
+        return BT_GATT_ERR(BT_ATT_ERR_INVALID_OFFSET);
+    }
+
+    memcpy(&cmd, buf, sizeof(cmd));
+
+    k_spinlock_key_t key = k_spin_lock(&log_offload.lock);
+
+    switch (cmd.op)
+    {
+    case TGM_SERVICE_LOG_START:
+        log_offload.start = true;
+        log_offload.active = true;
+        log_window_start(&log_offload.window, cmd.seq, MIN(cmd.window, CONFIG_APP_FLASH_LOG_WINDOW));
+        break;
+    case TGM_SERVICE_LOG_ACK:
+        if (log_window_ack(&log_offload.window, cmd.seq))
+        {
+            k_spin_unlock(&log_offload.lock, key);
+            LOG_DBG("Flash log page %u acknowledged before it was sent", cmd.seq);
+            return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+        }
+        break;
+    case TGM_SERVICE_LOG_STOP:
+        log_offload.active = false;
+        break;
+    default:
+        k_spin_unlock(&log_offload.lock, key);
+        LOG_DBG("Unknown flash log command %u", cmd.op);
+        return BT_GATT_ERR(BT_ATT_ERR_VALUE_NOT_ALLOWED);
+    }
+
+    k_spin_unlock(&log_offload.lock, key);
+
+    k_work_reschedule(&log_offload.work, K_NO_WAIT);
+
+    return len;
+}
+
 BT_GATT_SERVICE_DEFINE(
     tgm_service_svc,
     BT_GATT_PRIMARY_SERVICE(BT_UUID_TGM),
@@ -211,17 +622,743 @@ BT_GATT_SERVICE_DEFINE(
         BT_GATT_PERM_WRITE,
         NULL, write_ppg_reg,
         NULL),
-    BT_GATT_CCC(tgm_service_ccc_write_ppg_reg_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE), );
+    BT_GATT_CCC(tgm_service_ccc_write_ppg_reg_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_MUX,
+        BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ,
+        NULL, NULL,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_mux_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_PROFILE,
+        BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE,
+        BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+        get_profile, set_profile,
+        NULL),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_HR,
+        BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ,
+        NULL, NULL,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_hr_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_SPO2,
+        BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ,
+        NULL, NULL,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_spo2_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_HRV,
+        BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ,
+        NULL, NULL,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_hrv_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_MOTION,
+        BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ,
+        NULL, NULL,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_motion_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_BRUXISM,
+        BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ,
+        NULL, NULL,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_bruxism_data_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_CLOCK,
+        BT_GATT_CHRC_READ | BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_READ | BT_GATT_PERM_WRITE,
+        get_clock_sync, set_clock_sync,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_clock_sync_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_LOG,
+        BT_GATT_CHRC_WRITE | BT_GATT_CHRC_NOTIFY,
+        BT_GATT_PERM_WRITE,
+        NULL, set_log_cmd,
+        NULL),
+    BT_GATT_CCC(tgm_service_ccc_log_cfg_changed, BT_GATT_PERM_READ | BT_GATT_PERM_WRITE),
+    // Appended after the others, the attribute indices above stay the same
+    BT_GATT_CHARACTERISTIC(
+        BT_UUID_TGM_FORMAT,
+        BT_GATT_CHRC_READ,
+        BT_GATT_PERM_READ,
+        get_format, NULL,
+        (void *)&format_value), );
+
+// Completions are counted per notification, which only holds with a single connection
+BUILD_ASSERT(CONFIG_BT_MAX_CONN == 1, "TX queue flow control assumes a single connection");
+
+static void tgm_service_tx_complete(struct bt_conn *conn, void *user_data)
+{
+    struct tgm_service_tx_t *tx = user_data;
+    atomic_val_t in_flight;
+    k_spinlock_key_t key = k_spin_lock(&tx->lock);
+
+    tx->stats.sent++;
+    k_spin_unlock(&tx->lock, key);
+
+    // A completion after tgm_service_tx_reset() was counted out already
+    do
+    {
+        in_flight = atomic_get(&tx->in_flight);
+    } while (in_flight > 0 && !atomic_cas(&tx->in_flight, in_flight, in_flight - 1));
+
+    k_work_reschedule(&tx->work, K_NO_WAIT);
+}
+
+static void tgm_service_tx_work_handler(struct k_work *work)
+{
+    struct tgm_service_tx_t *tx = CONTAINER_OF(k_work_delayable_from_work(work), struct tgm_service_tx_t, work);
+
+    while (atomic_get(&tx->in_flight) < CONFIG_APP_NOTIFY_MAX_IN_FLIGHT)
+    {
+        k_spinlock_key_t key = k_spin_lock(&tx->lock);
+        if (tx->tail == tx->head)
+        {
+            k_spin_unlock(&tx->lock, key);
+            break;
+        }
+        // The producer does not touch a queued frame, so it can be sent without holding the lock
+        struct tgm_service_tx_frame_t *frame = &tx->frames[tx->tail % CONFIG_APP_NOTIFY_QUEUE_DEPTH];
+        k_spin_unlock(&tx->lock, key);
+
+        struct bt_gatt_notify_params params = {
+            .attr = &tgm_service_svc.attrs[tx->attr_index],
+            .data = frame->data,
+            .len = frame->len,
+            .func = tgm_service_tx_complete,
+            .user_data = tx,
+        };
+
+        atomic_inc(&tx->in_flight);
+        int err = bt_gatt_notify_cb(NULL, &params);
+        if (err)
+        {
+            atomic_dec(&tx->in_flight);
+        }
+        else
+        {
+            power_budget_record(POWER_BUDGET_BLE_TX, frame->len);
+        }
+
+        if (err == -ENOMEM)
+        {
+            // No TX buffer free, the frame stays queued until a completion or the retry
+            k_work_reschedule(&tx->work, K_MSEC(10));
+            break;
+        }
+
+        key = k_spin_lock(&tx->lock);
+        if (err)
+        {
+            LOG_DBG("%s notification dropped (err %d)", tx->name, err);
+            tx->stats.dropped++;
+        }
+        tx->tail++;
+        k_spin_unlock(&tx->lock, key);
+    }
+}
+
+/**
+ * @brief Queue a notification
+ *
+ * @retval 0 If the frame was queued.
+ * @retval -ENOBUFS If the queue is full, the frame is dropped.
+ */
+static int tgm_service_tx_queue(struct tgm_service_tx_t *tx, const void *data, uint16_t len)
+{
+    k_spinlock_key_t key = k_spin_lock(&tx->lock);
+
+    if (tx->head - tx->tail >= CONFIG_APP_NOTIFY_QUEUE_DEPTH)
+    {
+        tx->stats.dropped++;
+        k_spin_unlock(&tx->lock, key);
+        return -ENOBUFS;
+    }
+
+    struct tgm_service_tx_frame_t *frame = &tx->frames[tx->head % CONFIG_APP_NOTIFY_QUEUE_DEPTH];
+    memcpy(frame->data, data, len);
+    frame->len = len;
+    tx->head++;
+    tx->stats.queued++;
+    k_spin_unlock(&tx->lock, key);
+
+    k_work_reschedule(&tx->work, K_NO_WAIT);
+
+    return 0;
+}
+
+static void tgm_service_min_mtu(struct bt_conn *conn, void *user_data)
+{
+    uint16_t *mtu = user_data;
+    struct bt_conn_info info;
+
+    if (bt_conn_get_info(conn, &info) == 0 && info.state == BT_CONN_STATE_CONNECTED)
+    {
+        *mtu = MIN(*mtu, bt_gatt_get_mtu(conn));
+    }
+}
+
+// Largest notification payload that every connected client accepts
+static uint16_t tgm_service_payload_size(void)
+{
+    uint16_t mtu = CONFIG_BT_L2CAP_TX_MTU;
+
+    bt_conn_foreach(BT_CONN_TYPE_LE, tgm_service_min_mtu, &mtu);
+
+    return MIN(mtu - 3, sizeof(tgm_service_mux.pdu));
+}
+
+static void tgm_service_mux_flush(void)
+{
+    if (tgm_service_mux.len == 0)
+    {
+        return;
+    }
+
+    k_work_cancel_delayable(&tgm_service_mux.flush_work);
+    sys_put_le32(tgm_service_mux.frame_counter++, tgm_service_mux.pdu);
+    (void)tgm_service_tx_queue(&mux_tx, tgm_service_mux.pdu, tgm_service_mux.len);
+    tgm_service_mux.len = 0;
+}
+
+static void tgm_service_mux_flush_work_handler(struct k_work *work)
+{
+    k_mutex_lock(&tgm_service_mux.lock, K_FOREVER);
+    tgm_service_mux_flush();
+    k_mutex_unlock(&tgm_service_mux.lock);
+}
+
+/**
+ * @brief Add a record to the multiplexed stream
+ *
+ * The notification is sent when the next record does not fit, or CONFIG_APP_MUX_FLUSH_TIMEOUT_MS after its first
+ * record, whichever comes first.
+ *
+ * @retval 0 If the record was added.
+ * @retval -EMSGSIZE If the record does not fit a notification on its own.
+ */
+static int tgm_service_mux_append(uint8_t type, const void *data, uint16_t len)
+{
+    const struct tgm_service_record_header_t header = {.type = type, .len = len};
+    const uint16_t payload_size = tgm_service_payload_size();
+    const uint16_t record_size = sizeof(header) + len;
+    // Record types that were already reported too large, as a full legacy PPG frame or one a smaller ATT MTU cuts off
+    static atomic_t oversize_types;
+
+    if (len > UINT8_MAX || TGM_SERVICE_MUX_HEADER_SIZE + record_size > payload_size)
+    {
+        if (!atomic_test_and_set_bit(&oversize_types, type))
+        {
+            LOG_WRN("Record of type %u (%u bytes) too large for the multiplexed stream (%u bytes), not sent", type,
+                    len, payload_size);
+        }
+        return -EMSGSIZE;
+    }
+
+    k_mutex_lock(&tgm_service_mux.lock, K_FOREVER);
+
+    if (tgm_service_mux.len + record_size > payload_size)
+    {
+        tgm_service_mux_flush();
+    }
+
+    if (tgm_service_mux.len == 0)
+    {
+        // Room for the frame counter, it is filled in when the notification is sent
+        tgm_service_mux.len = TGM_SERVICE_MUX_HEADER_SIZE;
+        k_work_schedule(&tgm_service_mux.flush_work, K_MSEC(CONFIG_APP_MUX_FLUSH_TIMEOUT_MS));
+    }
+
+    memcpy(&tgm_service_mux.pdu[tgm_service_mux.len], &header, sizeof(header));
+    memcpy(&tgm_service_mux.pdu[tgm_service_mux.len + sizeof(header)], data, len);
+    tgm_service_mux.len += record_size;
+
+    k_mutex_unlock(&tgm_service_mux.lock);
+
+    return 0;
+}
+
+// A sensor frame is only built when it goes out on its own characteristic, the multiplexed stream or over L2CAP
+static bool tgm_service_frame_wanted(bool notify)
+{
+    return notify || notify_mux_data || l2cap_stream_is_connected();
+}
+
+// Overhead of the multiplexed stream on a frame, compressed frames are made smaller by this much to still fit
+static uint16_t tgm_service_mux_overhead(void)
+{
+    return notify_mux_data ? TGM_SERVICE_MUX_HEADER_SIZE + sizeof(struct tgm_service_record_header_t) : 0;
+}
+
+/**
+ * @brief Send a sensor frame on its own characteristic and as a record of the multiplexed stream, or over L2CAP
+ *
+ * @param[in] tx TX queue of the sensor characteristic
+ * @param[in] notify Set when the sensor characteristic is subscribed to
+ * @param[in] type Record type in the multiplexed stream
+ * @param[in] data Frame
+ * @param[in] len Length of the frame
+ * @retval 0 If the frame was queued on all subscribed characteristics.
+ *           Otherwise, the first (negative) error code is returned.
+ */
+static int tgm_service_send_frame(struct tgm_service_tx_t *tx, bool notify, uint8_t type, const void *data,
+                                  uint16_t len)
+{
+    int err = l2cap_stream_send(type, data, len);
+
+    // A client with the L2CAP channel open gets the frames there only, all others fall back to GATT
+    if (err != -ENOTCONN)
+    {
+        return err;
+    }
+    err = 0;
+
+    if (notify)
+    {
+        err = tgm_service_tx_queue(tx, data, len);
+    }
+
+    if (notify_mux_data)
+    {
+        int mux_err = tgm_service_mux_append(type, data, len);
+        err = err ? err : mux_err;
+    }
+
+    return err;
+}
+
+void tgm_service_get_ppg_tx_stats(struct tgm_service_tx_stats *stats)
+{
+    k_spinlock_key_t key = k_spin_lock(&ppg_tx.lock);
+
+    *stats = ppg_tx.stats;
+    k_spin_unlock(&ppg_tx.lock, key);
+}
+
+void tgm_service_get_acc_tx_stats(struct tgm_service_tx_stats *stats)
+{
+    k_spinlock_key_t key = k_spin_lock(&acc_tx.lock);
+
+    *stats = acc_tx.stats;
+    k_spin_unlock(&acc_tx.lock, key);
+}
+
+static void tgm_service_clock_sync_work_handler(struct k_work *work)
+{
+    if (!notify_clock_sync)
+    {
+        return;
+    }
+
+    bt_gatt_notify(NULL, &tgm_service_svc.attrs[TGM_SERVICE_ATTR_CLOCK], &clock_sync_data, sizeof(clock_sync_data));
+}
+
+static void tgm_service_log_sent(struct bt_conn *conn, void *user_data)
+{
+    atomic_val_t in_flight;
+
+    // A completion after tgm_service_log_reset() was counted out already
+    do
+    {
+        in_flight = atomic_get(&log_offload.in_flight);
+    } while (in_flight > 0 && !atomic_cas(&log_offload.in_flight, in_flight, in_flight - 1));
+
+    k_work_reschedule(&log_offload.work, K_NO_WAIT);
+}
+
+static int tgm_service_log_notify(const void *data, uint16_t len)
+{
+    struct bt_gatt_notify_params params = {
+        .attr = &tgm_service_svc.attrs[TGM_SERVICE_ATTR_LOG],
+        .data = data,
+        .len = len,
+        .func = tgm_service_log_sent,
+    };
+
+    atomic_inc(&log_offload.in_flight);
+    int err = bt_gatt_notify_cb(NULL, &params);
+    if (err)
+    {
+        atomic_dec(&log_offload.in_flight);
+        return err;
+    }
+
+    power_budget_record(POWER_BUDGET_BLE_TX, len);
+
+    return 0;
+}
+
+static void tgm_service_log_bulk(bool bulk)
+{
+    if (log_offload.bulk != bulk && tgm_service_cb && tgm_service_cb->bulk_transfer_cb)
+    {
+        tgm_service_cb->bulk_transfer_cb(bulk);
+    }
+    log_offload.bulk = bulk;
+}
+
+// Read the next page from a page number on and put its length and CRC in front of it
+static int tgm_service_log_next_page(uint32_t seq)
+{
+    int len = flash_log_read(&seq, &log_offload.page[sizeof(struct tgm_service_log_page_t)]);
+
+    if (len < 0)
+    {
+        return len;
+    }
+
+    const struct tgm_service_log_page_t header = {
+        .len = len,
+        .crc = crc32_ieee(&log_offload.page[sizeof(header)], len),
+    };
+
+    memcpy(log_offload.page, &header, sizeof(header));
+    log_offload.page_seq = seq;
+    log_offload.offset = 0;
+    log_offload.len = sizeof(header) + len;
+
+    return 0;
+}
+
+static void tgm_service_log_end(uint32_t next_seq)
+{
+    const struct tgm_service_log_chunk_t end = {.seq = next_seq, .offset = TGM_SERVICE_LOG_END};
+
+    if (tgm_service_log_notify(&end, sizeof(end)))
+    {
+        return;
+    }
+
+    uint32_t ms = MAX(k_uptime_get() - log_offload.start_ms, 1);
+
+    LOG_INF("Flash log offload: %u pages, %u bytes in %u ms, %u kB/s", log_offload.pages, log_offload.bytes, ms,
+            log_offload.bytes / ms);
+    log_offload.end_sent = true;
+    tgm_service_log_bulk(false);
+}
+
+static void tgm_service_log_work_handler(struct k_work *work)
+{
+    uint8_t chunk[CONFIG_BT_L2CAP_TX_MTU - 3];
+    k_spinlock_key_t key = k_spin_lock(&log_offload.lock);
+    const bool start = log_offload.start;
+    const bool active = log_offload.active && notify_log;
+    const uint32_t acked_seq = log_offload.window.acked_seq;
+
+    log_offload.start = false;
+    k_spin_unlock(&log_offload.lock, key);
+
+    if (start)
+    {
+        // The page that is being filled goes out too
+        flash_log_flush();
+        log_offload.len = 0;
+        log_offload.end_sent = false;
+        log_offload.pages = 0;
+        log_offload.bytes = 0;
+        log_offload.start_ms = k_uptime_get();
+    }
+
+    // The sectors of the pages the client has can be reused
+    if (acked_seq != log_offload.released_seq && acked_seq > 0)
+    {
+        flash_log_release(acked_seq - 1);
+        log_offload.released_seq = acked_seq;
+    }
+
+    if (!active)
+    {
+        tgm_service_log_bulk(false);
+        return;
+    }
+    if (log_offload.end_sent)
+    {
+        return;
+    }
+    tgm_service_log_bulk(true);
+
+    while (atomic_get(&log_offload.in_flight) < CONFIG_APP_NOTIFY_MAX_IN_FLIGHT)
+    {
+        if (log_offload.len == 0)
+        {
+            key = k_spin_lock(&log_offload.lock);
+            // At most window pages go out before the client acknowledges them
+            const bool open = log_window_open(&log_offload.window);
+            const uint32_t next_seq = log_offload.window.next_seq;
+            k_spin_unlock(&log_offload.lock, key);
+
+            if (!open)
+            {
+                return;
+            }
+
+            int err = tgm_service_log_next_page(next_seq);
+            if (err == -ENOENT)
+            {
+                tgm_service_log_end(next_seq);
+                return;
+            }
+            if (err)
+            {
+                LOG_ERR("Failed to read log page %u (err %d)", next_seq, err);
+                return;
+            }
+        }
+
+        struct tgm_service_log_chunk_t header = {.seq = log_offload.page_seq, .offset = log_offload.offset};
+        uint16_t size = MIN(tgm_service_payload_size() - sizeof(header), log_offload.len - log_offload.offset);
+
+        memcpy(chunk, &header, sizeof(header));
+        memcpy(&chunk[sizeof(header)], &log_offload.page[log_offload.offset], size);
+
+        int err = tgm_service_log_notify(chunk, sizeof(header) + size);
+        if (err == -ENOMEM)
+        {
+            // No TX buffer free, a completion or the retry goes on
+            k_work_reschedule(&log_offload.work, K_MSEC(10));
+            return;
+        }
+        if (err)
+        {
+            LOG_DBG("Flash log offload stopped (err %d)", err);
+            return;
+        }
+
+        log_offload.offset += size;
+        log_offload.bytes += size;
+        if (log_offload.offset == log_offload.len)
+        {
+            key = k_spin_lock(&log_offload.lock);
+            // A start in the meantime begins the window over, the page belongs to the old transfer
+            if (!log_offload.start)
+            {
+                log_window_sent(&log_offload.window, log_offload.page_seq);
+            }
+            k_spin_unlock(&log_offload.lock, key);
+
+            log_offload.len = 0;
+            log_offload.pages++;
+        }
+    }
+}
+
+// The stack drops the notifications in flight with the connection, their completions may never come
+static void tgm_service_tx_reset(struct tgm_service_tx_t *tx)
+{
+    atomic_set(&tx->in_flight, 0);
+}
+
+static void tgm_service_disconnected(struct bt_conn *conn, uint8_t reason)
+{
+    tgm_service_tx_reset(&ppg_tx);
+    tgm_service_tx_reset(&acc_tx);
+    tgm_service_tx_reset(&mux_tx);
+    tgm_service_log_reset();
+    k_work_reschedule(&log_offload.work, K_NO_WAIT);
+}
+
+BT_CONN_CB_DEFINE(tgm_service_conn_callbacks) = {
+    .disconnected = tgm_service_disconnected,
+};
 
 int tgm_service_init(struct tgm_service_cb *callbacks)
 {
+    const struct
+    {
+        uint8_t index;
+        const struct bt_uuid *uuid;
+    } attrs[] = {
+        {TGM_SERVICE_ATTR_BAT, BT_UUID_TGM_BAT},
+        {TGM_SERVICE_ATTR_PPG, BT_UUID_TGM_PPG},
+        {TGM_SERVICE_ATTR_ACC, BT_UUID_TGM_ACC},
+        {TGM_SERVICE_ATTR_TEMP, BT_UUID_TGM_TEMP},
+        {TGM_SERVICE_ATTR_READ_PPG_REG, BT_UUID_TGM_READ_PPG_REG},
+        {TGM_SERVICE_ATTR_WRITE_PPG_REG, BT_UUID_TGM_WRITE_PPG_REG},
+        {TGM_SERVICE_ATTR_MUX, BT_UUID_TGM_MUX},
+        {TGM_SERVICE_ATTR_HR, BT_UUID_TGM_HR},
+        {TGM_SERVICE_ATTR_SPO2, BT_UUID_TGM_SPO2},
+        {TGM_SERVICE_ATTR_HRV, BT_UUID_TGM_HRV},
+        {TGM_SERVICE_ATTR_MOTION, BT_UUID_TGM_MOTION},
+        {TGM_SERVICE_ATTR_BRUXISM, BT_UUID_TGM_BRUXISM},
+        {TGM_SERVICE_ATTR_CLOCK, BT_UUID_TGM_CLOCK},
+        {TGM_SERVICE_ATTR_LOG, BT_UUID_TGM_LOG},
+    };
+
+    // A characteristic added in the middle of the service moves the values behind it
+    for (size_t i = 0; i < ARRAY_SIZE(attrs); i++)
+    {
+        if (bt_uuid_cmp(tgm_service_svc.attrs[attrs[i].index].uuid, attrs[i].uuid))
+        {
+            LOG_ERR("Attribute %u is not the expected characteristic value", attrs[i].index);
+            return -EINVAL;
+        }
+    }
+
+    k_work_init_delayable(&ppg_tx.work, tgm_service_tx_work_handler);
+    k_work_init_delayable(&acc_tx.work, tgm_service_tx_work_handler);
+    k_work_init_delayable(&mux_tx.work, tgm_service_tx_work_handler);
+    k_mutex_init(&tgm_service_mux.lock);
+    k_work_init_delayable(&tgm_service_mux.flush_work, tgm_service_mux_flush_work_handler);
+    k_work_init(&clock_sync_work, tgm_service_clock_sync_work_handler);
+    k_work_init_delayable(&log_offload.work, tgm_service_log_work_handler);
+
+    LOG_INF("Notification budget: %u streams with %u in flight and %u reserved, %u of %u ACL TX buffers",
+            TGM_SERVICE_TX_STREAMS, CONFIG_APP_NOTIFY_MAX_IN_FLIGHT, TGM_SERVICE_TX_RESERVED, TGM_SERVICE_TX_BUDGET,
+            CONFIG_BT_BUF_ACL_TX_COUNT);
+
     if (callbacks)
     {
         tgm_service_cb = callbacks;
     }
 
+    return l2cap_stream_init(tgm_service_update_streaming);
+}
+
+#if defined(CONFIG_APP_FRAME_TIME)
+static void tgm_service_frame_time_set(struct tgm_service_frame_time_t *time, uint64_t time_ns, uint32_t period_ns)
+{
+    // Hosts unwrap the us counter, frames come far more often than every 71 minutes
+    time->time_us = (uint32_t)(time_ns / NSEC_PER_USEC);
+    time->period_ns = period_ns;
+}
+#endif
+
+#if defined(CONFIG_APP_STREAM_CODEC)
+BUILD_ASSERT(TGM_SERVICE_FORMAT_PACKED == STREAM_CODEC_FORMAT_PACKED &&
+             TGM_SERVICE_FORMAT_DELTA_RICE == STREAM_CODEC_FORMAT_DELTA_RICE);
+
+/** @brief Samples of a compressed stream that are waiting to fill a notification. */
+struct tgm_service_stream_t
+{
+    /** Layout of the samples. */
+    const struct stream_codec_layout layout;
+    /** Frame counter of the stream. */
+    uint32_t *frame_counter;
+    /** Interleaved samples that have not been sent yet. */
+    int32_t *pending;
+    /** Capacity of pending in samples. */
+    uint16_t capacity;
+    /** Number of samples in pending. */
+    uint16_t pending_count;
+    /** Uptime in ns of the first pending sample and the period of the newest frame. */
+    uint64_t time_ns;
+    uint32_t period_ns;
+};
+
+// Returns where the next frame of samples goes, the fill callback is limited to the returned number of samples
+static int32_t *tgm_service_stream_tail(struct tgm_service_stream_t *stream, uint8_t *max_samples, uint64_t time_ns,
+                                        uint32_t period_ns)
+{
+    // The samples of consecutive frames follow each other, a notification only needs the time of its first one
+    if (stream->pending_count == 0)
+    {
+        stream->time_ns = time_ns;
+    }
+    stream->period_ns = period_ns;
+
+    *max_samples = MIN(*max_samples, stream->capacity - stream->pending_count);
+
+    return &stream->pending[stream->pending_count * stream->layout.channels];
+}
+
+static int tgm_service_stream_send(struct tgm_service_stream_t *stream, struct tgm_service_tx_t *tx, bool notify,
+                                   uint8_t type, uint8_t frame_samples)
+{
+    const size_t header_size = offsetof(struct tgm_service_compressed_data_t, data);
+    const size_t data_size = tgm_service_payload_size() - tgm_service_mux_overhead() - header_size;
+    struct tgm_service_compressed_data_t frame;
+
+    while (stream->pending_count > 0)
+    {
+        size_t len;
+        uint16_t count = stream_codec_encode(&stream->layout, stream->pending, MIN(stream->pending_count, UINT8_MAX),
+                                             frame.data, data_size, &len, &frame.format);
+
+        if (count == 0)
+        {
+            return -EMSGSIZE;
+        }
+
+        // Hold back a notification that is not full yet, as long as the next frame still fits the pending buffer
+        if (count == stream->pending_count && stream->pending_count + frame_samples <= stream->capacity)
+        {
+            break;
+        }
+
+        frame.frame_counter = (*stream->frame_counter)++;
+        frame.sample_count = count;
+#if defined(CONFIG_APP_FRAME_TIME)
+        tgm_service_frame_time_set(&frame.time, stream->time_ns, stream->period_ns);
+#endif
+        stream->time_ns += (uint64_t)count * stream->period_ns;
+
+        // The samples are consumed whether the notification was queued or not, like the legacy frames
+        stream->pending_count -= count;
+        memmove(stream->pending, &stream->pending[count * stream->layout.channels],
+                stream->pending_count * stream->layout.channels * sizeof(int32_t));
+
+        int err = tgm_service_send_frame(tx, notify, type, &frame, header_size + len);
+        if (err)
+        {
+            return err;
+        }
+    }
+
     return 0;
 }
+#endif /* CONFIG_APP_STREAM_CODEC */
+
+// A summary no client listens to goes to the flash log, the client reads it from the log characteristic later
+static int tgm_service_log(uint8_t type, const void *data, uint16_t len)
+{
+    int err = flash_log_put(type, data, len);
+
+    // Without the log nobody gets the summary, as for any other stream nobody listens to
+    return err == -ENOTSUP ? -EACCES : err;
+}
+
+/**
+ * @brief Send a summary over L2CAP, or on its own characteristic and as a record of the multiplexed stream
+ *
+ * A summary that no client gets goes to the flash log instead.
+ *
+ * @param[in] type Record type in the multiplexed stream and the flash log
+ * @param[in] notify Set when the summary characteristic is subscribed to
+ * @param[in] attr_index Index of the characteristic value in the service
+ * @param[in] data Summary
+ * @param[in] len Length of the summary
+ * @retval 0 If the summary was sent or logged.
+ *           Otherwise, a (negative) error code is returned.
+ */
+static int tgm_service_send_record(uint8_t type, bool notify, uint8_t attr_index, const void *data, uint16_t len)
+{
+    int err = l2cap_stream_send(type, data, len);
+    if (err != -ENOTCONN)
+    {
+        return err;
+    }
+
+    if (notify_mux_data)
+    {
+        tgm_service_mux_append(type, data, len);
+    }
+
+    if (!notify)
+    {
+        return notify_mux_data ? 0 : tgm_service_log(type, data, len);
+    }
+
+    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[attr_index], data, len);
+}
 
 int tgm_service_send_battery_notify(int32_t battery_value)
 {
@@ -230,46 +1367,219 @@ int tgm_service_send_battery_notify(int32_t battery_value)
         return -EACCES;
     }
 
-    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[6], &battery_value, sizeof(battery_value));
+    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[TGM_SERVICE_ATTR_BAT], &battery_value, sizeof(battery_value));
 }
 
-int tgm_service_send_ppg_notify(struct ppg_sample *ppg_data, uint8_t sample_cnt)
+#if defined(CONFIG_PPG_FORMAT_COMPRESSED)
+// Room for a few frames, so notifications can be filled up to the MTU
+static int32_t ppg_pending[MIN(4 * CONFIG_PPG_SAMPLES_PER_FRAME, UINT8_MAX) * 3];
+
+static struct tgm_service_stream_t ppg_stream = {
+    .layout = {.channels = 3, .bits = 19},
+    .frame_counter = &ppg_frame_counter,
+    .pending = ppg_pending,
+    .capacity = ARRAY_SIZE(ppg_pending) / 3,
+};
+
+int tgm_service_send_ppg_notify(tgm_service_ppg_fill_t fill, void *user_data, uint64_t time_ns, uint32_t period_ns)
+{
+    struct ppg_sample ppg_data[CONFIG_PPG_SAMPLES_PER_FRAME];
+    uint8_t max_samples = CONFIG_PPG_SAMPLES_PER_FRAME;
+    if (!tgm_service_frame_wanted(notify_ppg_data))
+    {
+        ppg_stream.pending_count = 0;
+        return -EACCES;
+    }
+
+    // Decode only when someone listens, then queue the samples for the encoder
+    int32_t *pending = tgm_service_stream_tail(&ppg_stream, &max_samples, time_ns, period_ns);
+    uint8_t count = fill(ppg_data, max_samples, user_data);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        pending[i * 3] = ppg_data[i].red;
+        pending[i * 3 + 1] = ppg_data[i].ir;
+        pending[i * 3 + 2] = ppg_data[i].green;
+    }
+    ppg_stream.pending_count += count;
+
+    return tgm_service_stream_send(&ppg_stream, &ppg_tx, notify_ppg_data, TGM_SERVICE_RECORD_PPG,
+                                   CONFIG_PPG_SAMPLES_PER_FRAME);
+}
+#elif defined(CONFIG_PPG_FORMAT_PACKED)
+// The whole frame must fit a single notification at the default ATT MTU, also as a multiplexed stream record
+BUILD_ASSERT(sizeof(struct tgm_service_ppg_packed_data_t) <= CONFIG_BT_L2CAP_TX_MTU - 3 &&
+                 sizeof(struct tgm_service_ppg_packed_data_t) <= TGM_SERVICE_MUX_FRAME_MAX,
+             "CONFIG_PPG_SAMPLES_PER_FRAME too large for a packed PPG notification");
+
+int tgm_service_send_ppg_notify(tgm_service_ppg_fill_t fill, void *user_data, uint64_t time_ns, uint32_t period_ns)
+{
+    struct tgm_service_ppg_packed_data_t ppg_data_notify = {
+        .frame_counter = ppg_frame_counter++,
+        .format = TGM_SERVICE_FORMAT_PACKED};
+    struct ppg_sample ppg_data[CONFIG_PPG_SAMPLES_PER_FRAME];
+    if (!tgm_service_frame_wanted(notify_ppg_data))
+    {
+        return -EACCES;
+    }
+
+#if defined(CONFIG_APP_FRAME_TIME)
+    tgm_service_frame_time_set(&ppg_data_notify.time, time_ns, period_ns);
+#endif
+
+    // Decode only when someone listens, then pack the samples into the notification payload
+    ppg_data_notify.sample_count = fill(ppg_data, CONFIG_PPG_SAMPLES_PER_FRAME, user_data);
+    size_t len = ppg_pack(ppg_data, ppg_data_notify.sample_count, ppg_data_notify.data);
+
+    return tgm_service_send_frame(&ppg_tx, notify_ppg_data, TGM_SERVICE_RECORD_PPG, &ppg_data_notify,
+                                  offsetof(struct tgm_service_ppg_packed_data_t, data) + len);
+}
+#else
+int tgm_service_send_ppg_notify(tgm_service_ppg_fill_t fill, void *user_data, uint64_t time_ns, uint32_t period_ns)
 {
     struct tgm_service_ppg_data_t ppg_data_notify = {
         .frame_counter = ppg_frame_counter++};
-    memcpy(&ppg_data_notify.ppg_data, ppg_data, sizeof(struct ppg_sample) * sample_cnt);
-    if (!notify_ppg_data)
+    if (!tgm_service_frame_wanted(notify_ppg_data))
     {
         return -EACCES;
     }
 
-    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[9], &ppg_data_notify, sizeof(struct tgm_service_ppg_data_t));
+#if defined(CONFIG_APP_FRAME_TIME)
+    tgm_service_frame_time_set(&ppg_data_notify.time, time_ns, period_ns);
+#endif
+
+    // Decode straight into the notification payload, only when someone listens
+    uint8_t count = fill(ppg_data_notify.ppg_data, CONFIG_PPG_SAMPLES_PER_FRAME, user_data);
+
+    // The sensor profile sets the frame size, only the samples of this frame are sent
+    return tgm_service_send_frame(&ppg_tx, notify_ppg_data, TGM_SERVICE_RECORD_PPG, &ppg_data_notify,
+                                  offsetof(struct tgm_service_ppg_data_t, ppg_data) + count * sizeof(struct ppg_sample));
 }
+#endif /* CONFIG_PPG_FORMAT_COMPRESSED */
 
-int tgm_service_send_acc_notify(struct acc_sample *acc_data, uint8_t sample_cnt)
+#if defined(CONFIG_ACC_FORMAT_COMPRESSED)
+// Room for a few frames, so notifications can be filled up to the MTU
+static int32_t acc_pending[MIN(4 * CONFIG_ACC_SAMPLES_PER_FRAME, UINT8_MAX) * 3];
+
+static struct tgm_service_stream_t acc_stream = {
+    .layout = {.channels = 3, .bits = 16, .is_signed = true},
+    .frame_counter = &acc_frame_counter,
+    .pending = acc_pending,
+    .capacity = ARRAY_SIZE(acc_pending) / 3,
+};
+
+int tgm_service_send_acc_notify(tgm_service_acc_fill_t fill, void *user_data, uint64_t time_ns, uint32_t period_ns)
+{
+    struct acc_sample acc_data[CONFIG_ACC_SAMPLES_PER_FRAME];
+    uint8_t max_samples = CONFIG_ACC_SAMPLES_PER_FRAME;
+    if (!tgm_service_frame_wanted(notify_acc_data))
+    {
+        acc_stream.pending_count = 0;
+        return -EACCES;
+    }
+
+    // Decode only when someone listens, then queue the samples for the encoder
+    int32_t *pending = tgm_service_stream_tail(&acc_stream, &max_samples, time_ns, period_ns);
+    uint8_t count = fill(acc_data, max_samples, user_data);
+    for (uint8_t i = 0; i < count; i++)
+    {
+        pending[i * 3] = acc_data[i].x;
+        pending[i * 3 + 1] = acc_data[i].y;
+        pending[i * 3 + 2] = acc_data[i].z;
+    }
+    acc_stream.pending_count += count;
+
+    return tgm_service_stream_send(&acc_stream, &acc_tx, notify_acc_data, TGM_SERVICE_RECORD_ACC,
+                                   CONFIG_ACC_SAMPLES_PER_FRAME);
+}
+#else
+int tgm_service_send_acc_notify(tgm_service_acc_fill_t fill, void *user_data, uint64_t time_ns, uint32_t period_ns)
 {
     struct tgm_service_acc_data_t acc_data_notify = {
         .frame_counter = acc_frame_counter++};
-    memcpy(&acc_data_notify.acc_data, acc_data, sizeof(struct acc_sample) * sample_cnt);
-    if (!notify_acc_data)
+    if (!tgm_service_frame_wanted(notify_acc_data))
     {
         return -EACCES;
     }
 
-    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[12], &acc_data_notify, sizeof(struct tgm_service_acc_data_t));
+#if defined(CONFIG_APP_FRAME_TIME)
+    tgm_service_frame_time_set(&acc_data_notify.time, time_ns, period_ns);
+#endif
+
+    // Decode straight into the notification payload, only when someone listens
+    uint8_t count = fill(acc_data_notify.acc_data, CONFIG_ACC_SAMPLES_PER_FRAME, user_data);
+
+    // The sensor profile sets the frame size, only the samples of this frame are sent
+    return tgm_service_send_frame(&acc_tx, notify_acc_data, TGM_SERVICE_RECORD_ACC, &acc_data_notify,
+                                  offsetof(struct tgm_service_acc_data_t, acc_data) + count * sizeof(struct acc_sample));
 }
+#endif /* CONFIG_ACC_FORMAT_COMPRESSED */
 
 int tgm_service_send_temp_notify(int16_t new_temp)
 {
     tgm_service_temp_data.frame_counter++;
     tgm_service_temp_data.centitemp = new_temp;
 
+    int err = l2cap_stream_send(TGM_SERVICE_RECORD_TEMP, &tgm_service_temp_data, sizeof(tgm_service_temp_data));
+    if (err != -ENOTCONN)
+    {
+        return err;
+    }
+
+    if (notify_mux_data)
+    {
+        tgm_service_mux_append(TGM_SERVICE_RECORD_TEMP, &tgm_service_temp_data, sizeof(tgm_service_temp_data));
+    }
+
     if (!notify_temp_data)
     {
-        return -EACCES;
+        return notify_mux_data ? 0 : -EACCES;
     }
 
-    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[15], &tgm_service_temp_data, sizeof(tgm_service_temp_data));
+    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[TGM_SERVICE_ATTR_TEMP], &tgm_service_temp_data,
+                          sizeof(tgm_service_temp_data));
+}
+
+int tgm_service_send_hr_notify(struct tgm_service_hr_data_t *hr_data)
+{
+    uint16_t len = offsetof(struct tgm_service_hr_data_t, beats) + hr_data->beat_count * sizeof(hr_data->beats[0]);
+
+    hr_data->frame_counter = hr_frame_counter++;
+
+    return tgm_service_send_record(TGM_SERVICE_RECORD_HR, notify_hr_data, TGM_SERVICE_ATTR_HR, hr_data, len);
+}
+
+int tgm_service_send_spo2_notify(struct tgm_service_spo2_data_t *spo2_data)
+{
+    spo2_data->frame_counter = spo2_frame_counter++;
+
+    return tgm_service_send_record(TGM_SERVICE_RECORD_SPO2, notify_spo2_data, TGM_SERVICE_ATTR_SPO2, spo2_data,
+                                   sizeof(*spo2_data));
+}
+
+int tgm_service_send_hrv_notify(struct tgm_service_hrv_data_t *hrv_data)
+{
+    uint16_t len =
+        offsetof(struct tgm_service_hrv_data_t, intervals) + hrv_data->count * sizeof(hrv_data->intervals[0]);
+
+    hrv_data->frame_counter = hrv_frame_counter++;
+
+    return tgm_service_send_record(TGM_SERVICE_RECORD_HRV, notify_hrv_data, TGM_SERVICE_ATTR_HRV, hrv_data, len);
+}
+
+int tgm_service_send_motion_notify(struct tgm_service_motion_data_t *motion_data)
+{
+    motion_data->frame_counter = motion_frame_counter++;
+
+    return tgm_service_send_record(TGM_SERVICE_RECORD_MOTION, notify_motion_data, TGM_SERVICE_ATTR_MOTION,
+                                   motion_data, sizeof(*motion_data));
+}
+
+int tgm_service_send_bruxism_notify(struct tgm_service_bruxism_data_t *bruxism_data)
+{
+    bruxism_data->frame_counter = bruxism_frame_counter++;
+
+    return tgm_service_send_record(TGM_SERVICE_RECORD_BRUXISM, notify_bruxism_data, TGM_SERVICE_ATTR_BRUXISM,
+                                   bruxism_data, sizeof(*bruxism_data));
 }
 
 int tgm_service_send_read_ppg_reg_notify(uint8_t ppg_reg_data)
@@ -279,7 +1589,8 @@ int tgm_service_send_read_ppg_reg_notify(uint8_t ppg_reg_data)
         return -EACCES;
     }
 
-    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[18], &ppg_reg_data, sizeof(ppg_reg_data));
+    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[TGM_SERVICE_ATTR_READ_PPG_REG], &ppg_reg_data,
+                          sizeof(ppg_reg_data));
 }
 
 int tgm_service_send_write_ppg_reg_notify(uint8_t ppg_reg_data)
@@ -289,5 +1600,6 @@ int tgm_service_send_write_ppg_reg_notify(uint8_t ppg_reg_data)
         return -EACCES;
     }
 
-    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[21], &ppg_reg_data, sizeof(ppg_reg_data));
+    return bt_gatt_notify(NULL, &tgm_service_svc.attrs[TGM_SERVICE_ATTR_WRITE_PPG_REG], &ppg_reg_data,
+                          sizeof(ppg_reg_data));
 }
\ No newline at end of file
@@ -7,6 +7,7 @@
 
 #include <app/drivers/maxm86161.h> // For ppg_sample, but fix this later
 #include <app/drivers/lis2dtw12.h> // For acc_sample, but fix this later
+#include "ppg_pack.h"
 
 /**@file
  * @defgroup tgm_service TGM Service implementation
@@ -46,6 +47,36 @@
 #define BT_UUID_TGM_WRITE_PPG_REG_VAL \
     BT_UUID_128_ENCODE(0x3a0ff008, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
 
+#define BT_UUID_TGM_MUX_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff009, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_PROFILE_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff00a, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_HR_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff00b, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_SPO2_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff00c, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_HRV_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff00d, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_MOTION_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff00e, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_BRUXISM_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff00f, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_CLOCK_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff010, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_LOG_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff011, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
+#define BT_UUID_TGM_FORMAT_VAL \
+    BT_UUID_128_ENCODE(0x3a0ff012, 0x98c4, 0x46b2, 0x94af, 0x1aee0fd4c48e)
+
 #define BT_UUID_TGM BT_UUID_DECLARE_128(BT_UUID_TGM_VAL)
 #define BT_UUID_TGM_PPG BT_UUID_DECLARE_128(BT_UUID_TGM_PPG_VAL)
 #define BT_UUID_TGM_ACC BT_UUID_DECLARE_128(BT_UUID_TGM_ACC_VAL)
@@ -55,24 +86,133 @@
 #define BT_UUID_TGM_FW BT_UUID_DECLARE_128(BT_UUID_TGM_FW_VAL)
 #define BT_UUID_TGM_READ_PPG_REG BT_UUID_DECLARE_128(BT_UUID_TGM_READ_PPG_REG_VAL)
 #define BT_UUID_TGM_WRITE_PPG_REG BT_UUID_DECLARE_128(BT_UUID_TGM_WRITE_PPG_REG_VAL)
+#define BT_UUID_TGM_MUX BT_UUID_DECLARE_128(BT_UUID_TGM_MUX_VAL)
+#define BT_UUID_TGM_PROFILE BT_UUID_DECLARE_128(BT_UUID_TGM_PROFILE_VAL)
+#define BT_UUID_TGM_HR BT_UUID_DECLARE_128(BT_UUID_TGM_HR_VAL)
+#define BT_UUID_TGM_SPO2 BT_UUID_DECLARE_128(BT_UUID_TGM_SPO2_VAL)
+#define BT_UUID_TGM_HRV BT_UUID_DECLARE_128(BT_UUID_TGM_HRV_VAL)
+#define BT_UUID_TGM_MOTION BT_UUID_DECLARE_128(BT_UUID_TGM_MOTION_VAL)
+#define BT_UUID_TGM_BRUXISM BT_UUID_DECLARE_128(BT_UUID_TGM_BRUXISM_VAL)
+#define BT_UUID_TGM_CLOCK BT_UUID_DECLARE_128(BT_UUID_TGM_CLOCK_VAL)
+#define BT_UUID_TGM_LOG BT_UUID_DECLARE_128(BT_UUID_TGM_LOG_VAL)
+#define BT_UUID_TGM_FORMAT BT_UUID_DECLARE_128(BT_UUID_TGM_FORMAT_VAL)
 
 #define CONFIG_TEMP_SAMPLES_PER_FRAME 10
 
+/** @brief Time of the samples of a PPG or accelerometer frame, sent with CONFIG_APP_FRAME_TIME. */
+struct tgm_service_frame_time_t
+{
+    /** Uptime in us of the first sample, modulo 2^32. */
+    uint32_t time_us;
+    /** Estimated sample period in ns, sample n of the frame lies n periods after the first. */
+    uint32_t period_ns;
+} __packed;
+
+#if defined(CONFIG_APP_FRAME_TIME)
+#define TGM_SERVICE_FRAME_TIME_SIZE sizeof(struct tgm_service_frame_time_t)
+#else
+#define TGM_SERVICE_FRAME_TIME_SIZE 0
+#endif
+
 /** @brief PPG Data Struct used by the TGM service to inform the client of new PPG data. */
 struct tgm_service_ppg_data_t
 {
     /** Frame counter*/
     uint32_t frame_counter;
-    /** PPG data. */
+#if defined(CONFIG_APP_FRAME_TIME)
+    /** Time of the samples. */
+    struct tgm_service_frame_time_t time;
+#endif
+    /** PPG data, the notification ends after the samples of the frame. */
     struct ppg_sample ppg_data[CONFIG_PPG_SAMPLES_PER_FRAME];
 };
 
+/** @brief Values of the format byte that follows the frame counter in a packed or compressed frame.
+ *
+ * Legacy frames have no format byte, clients read the stream format characteristic to learn which layout the PPG and
+ * accelerometer characteristics use. */
+enum tgm_service_format_t
+{
+    /** Samples bit packed without padding, see ppg_pack.h and stream_codec.h. */
+    TGM_SERVICE_FORMAT_PACKED = 1,
+    /** Samples delta and Rice coded, see stream_codec.h. */
+    TGM_SERVICE_FORMAT_DELTA_RICE = 2,
+};
+
+/** @brief Frame layouts of the PPG and accelerometer characteristics, as read from the stream format characteristic. */
+enum tgm_service_stream_format_t
+{
+    /** tgm_service_ppg_data_t or tgm_service_acc_data_t. */
+    TGM_SERVICE_STREAM_LEGACY = 0,
+    /** tgm_service_ppg_packed_data_t, PPG only. */
+    TGM_SERVICE_STREAM_PACKED = 1,
+    /** tgm_service_compressed_data_t. */
+    TGM_SERVICE_STREAM_COMPRESSED = 2,
+};
+
+/** @brief The frames carry a tgm_service_frame_time_t, bit of tgm_service_format_data_t::flags. */
+#define TGM_SERVICE_FORMAT_FRAME_TIME BIT(0)
+
+/** @brief Stream format Struct, the value of the read only stream format characteristic. */
+struct tgm_service_format_data_t
+{
+    /** Layout of the PPG frames, one of tgm_service_stream_format_t. */
+    uint8_t ppg;
+    /** Layout of the accelerometer frames, one of tgm_service_stream_format_t. */
+    uint8_t acc;
+    /** TGM_SERVICE_FORMAT_* flags. */
+    uint8_t flags;
+    /** Largest number of PPG samples per frame. */
+    uint8_t ppg_samples;
+    /** Largest number of accelerometer samples per frame. */
+    uint8_t acc_samples;
+} __packed;
+
+/** @brief Bit packed PPG Data Struct, used instead of tgm_service_ppg_data_t with CONFIG_PPG_FORMAT_PACKED. */
+struct tgm_service_ppg_packed_data_t
+{
+    /** Frame counter*/
+    uint32_t frame_counter;
+    /** Frame format, TGM_SERVICE_FORMAT_PACKED. */
+    uint8_t format;
+    /** Number of samples in data. */
+    uint8_t sample_count;
+#if defined(CONFIG_APP_FRAME_TIME)
+    /** Time of the samples. */
+    struct tgm_service_frame_time_t time;
+#endif
+    /** Packed PPG data, only the bytes of sample_count samples are sent. */
+    uint8_t data[PPG_PACK_SIZE(CONFIG_PPG_SAMPLES_PER_FRAME)];
+} __packed;
+
+/** @brief Compressed Data Struct, used for the PPG and accelerometer data with CONFIG_PPG_FORMAT_COMPRESSED and
+ * CONFIG_ACC_FORMAT_COMPRESSED. */
+struct tgm_service_compressed_data_t
+{
+    /** Frame counter*/
+    uint32_t frame_counter;
+    /** Frame format, one of tgm_service_format_t. */
+    uint8_t format;
+    /** Number of samples in data. */
+    uint8_t sample_count;
+#if defined(CONFIG_APP_FRAME_TIME)
+    /** Time of the samples. */
+    struct tgm_service_frame_time_t time;
+#endif
+    /** Encoded samples, only the used bytes are sent. */
+    uint8_t data[CONFIG_BT_L2CAP_TX_MTU - 3 - 6 - TGM_SERVICE_FRAME_TIME_SIZE];
+} __packed;
+
 /** @brief Accelerometer Data Struct used by the TGM service to inform the client of new accelerometer data. */
 struct tgm_service_acc_data_t
 {
     /** Frame counter*/
     uint32_t frame_counter;
-    /** ACC data. */
+#if defined(CONFIG_APP_FRAME_TIME)
+    /** Time of the samples. */
+    struct tgm_service_frame_time_t time;
+#endif
+    /** ACC data, the notification ends after the samples of the frame. */
     struct acc_sample acc_data[CONFIG_ACC_SAMPLES_PER_FRAME];
 };
 
@@ -85,6 +225,281 @@ struct tgm_service_temp_data_t
     int16_t centitemp;
 };
 
+/** @brief Most beats in a heart rate summary. */
+#define TGM_SERVICE_HR_MAX_BEATS 8
+
+/** @brief A beat in a heart rate summary. */
+struct tgm_service_hr_beat_t
+{
+    /** Time of the beat in ms after the time of the summary. */
+    uint16_t offset_ms;
+    /** Confidence of the beat in percent. */
+    uint8_t confidence;
+} __packed;
+
+/** @brief Heart rate summary, sent about once per second instead of the raw PPG samples. */
+struct tgm_service_hr_data_t
+{
+    /** Frame counter*/
+    uint32_t frame_counter;
+    /** Uptime in ms of the first beat, or of the summary when it has no beats. */
+    uint32_t time_ms;
+    /** Heart rate in bpm, 0 when unknown. */
+    uint8_t heart_rate;
+    /** Confidence of the heart rate in percent. */
+    uint8_t confidence;
+    /** Number of beats in beats. */
+    uint8_t beat_count;
+    /** Beats since the previous summary, the notification ends after beat_count beats. */
+    struct tgm_service_hr_beat_t beats[TGM_SERVICE_HR_MAX_BEATS];
+} __packed;
+
+/** @brief SpO2 estimate, sent once per window. */
+struct tgm_service_spo2_data_t
+{
+    /** Frame counter*/
+    uint32_t frame_counter;
+    /** Uptime in ms at the end of the window. */
+    uint32_t time_ms;
+    /** SpO2 in 0.1%, 0 when the window did not pass the quality gate. */
+    uint16_t spo2;
+    /** Ratio of ratios in 1/1000. */
+    uint16_t ratio;
+    /** IR perfusion index in 0.01%. */
+    uint16_t perfusion;
+    /** Correlation of the red and IR pulses in percent. */
+    uint8_t correlation;
+    /** Failed quality checks, a bit mask. */
+    uint8_t quality;
+} __packed;
+
+/** @brief Most beat to beat intervals in an HRV batch. */
+#define TGM_SERVICE_HRV_MAX_INTERVALS 16
+/** @brief The first interval of the batch follows a gap in the beats. */
+#define TGM_SERVICE_HRV_RUN_START BIT(0)
+/** @brief Last batch of an epoch, the statistics are final. */
+#define TGM_SERVICE_HRV_EPOCH_END BIT(1)
+
+/** @brief Batch of beat to beat intervals with the HRV statistics of the epoch so far. */
+struct tgm_service_hrv_data_t
+{
+    /** Frame counter*/
+    uint32_t frame_counter;
+    /** Uptime in ms of the beat that starts the first interval. */
+    uint32_t time_ms;
+    /** Mean NN interval in ms. */
+    uint16_t mean_nn;
+    /** SDNN in 0.1 ms. */
+    uint16_t sdnn;
+    /** RMSSD in 0.1 ms. */
+    uint16_t rmssd;
+    /** NN intervals in the epoch so far. */
+    uint16_t nn_count;
+    /** Intervals marked as artifact in the epoch so far. */
+    uint16_t artifacts;
+    /** TGM_SERVICE_HRV_RUN_START and TGM_SERVICE_HRV_EPOCH_END. */
+    uint8_t flags;
+    /** Number of intervals in intervals. */
+    uint8_t count;
+    /** Intervals in ms, bit 15 set for an artifact, the notification ends after count intervals. */
+    uint16_t intervals[TGM_SERVICE_HRV_MAX_INTERVALS];
+} __packed;
+
+/** @brief Motion summary of a PPG frame the artifact canceller ran on. */
+struct tgm_service_motion_data_t
+{
+    /** Frame counter*/
+    uint32_t frame_counter;
+    /** Uptime in ms of the last sample of the PPG frame. */
+    uint32_t time_ms;
+    /** RMS acceleration without gravity in mg. */
+    uint16_t activity;
+    /** Bit 0: the device moved and the filters adapted, bit 1: no accelerometer data for the frame. */
+    uint8_t flags;
+    /** Artifact power taken out of the IR channel in dB. */
+    uint8_t reduction;
+} __packed;
+
+/** @brief The heart rate was known before and during the episode, hr_delta is valid. */
+#define TGM_SERVICE_BRUXISM_HR_KNOWN BIT(0)
+/** @brief The heart rate rose at least CONFIG_APP_BRUXISM_HR_RISE bpm. */
+#define TGM_SERVICE_BRUXISM_HR_RISE BIT(1)
+
+/** @brief Bruxism episode, sent once it ended. */
+struct tgm_service_bruxism_data_t
+{
+    /** Frame counter*/
+    uint32_t frame_counter;
+    /** Uptime in ms of the start of the episode. */
+    uint32_t start_ms;
+    /** Duration in 0.1 s. */
+    uint16_t duration;
+    /** RMS acceleration over the bursts in mg. */
+    uint16_t intensity;
+    /** Highest RMS acceleration in mg. */
+    uint16_t peak;
+    /** 1 for phasic, 2 for tonic, 3 for mixed. */
+    uint8_t type;
+    /** Number of bursts. */
+    uint8_t bursts;
+    /** Mean rhythm of the bursts in 0.1Hz. */
+    uint8_t rhythm;
+    /** Rise of the heart rate over the baseline before the episode, in bpm. */
+    int8_t hr_delta;
+    /** TGM_SERVICE_BRUXISM_HR_KNOWN and TGM_SERVICE_BRUXISM_HR_RISE. */
+    uint8_t flags;
+} __packed;
+
+/** @brief Summary of an epoch of the flash log, written while no client listened. */
+struct tgm_service_epoch_data_t
+{
+    /** Uptime in ms of the start of the epoch. */
+    uint32_t time_ms;
+    /** Lowest heart rate in bpm, 0 when unknown. */
+    uint8_t hr_min;
+    /** Mean heart rate in bpm, 0 when unknown. */
+    uint8_t hr_mean;
+    /** Highest heart rate in bpm, 0 when unknown. */
+    uint8_t hr_max;
+    /** Lowest SpO2 in 0.5%, 0 when unknown. */
+    uint8_t spo2_min;
+    /** Mean SpO2 in 0.5%, 0 when unknown. */
+    uint8_t spo2_mean;
+    /** RMSSD of the last HRV epoch that ended in 0.1 ms, 0 when unknown. */
+    uint16_t rmssd;
+    /** Mean RMS acceleration without gravity in mg, at most 255. */
+    uint8_t activity;
+    /** Share of the PPG frames in which the device moved, in percent. */
+    uint8_t motion;
+} __packed;
+
+/** @brief Commands of the flash log characteristic. */
+enum tgm_service_log_op_t
+{
+    /** Send the pages from seq on, with at most window pages ahead of the acknowledged ones. */
+    TGM_SERVICE_LOG_START = 1,
+    /** The client has all pages up to seq, their sectors may be erased. */
+    TGM_SERVICE_LOG_ACK = 2,
+    /** Stop sending. */
+    TGM_SERVICE_LOG_STOP = 3,
+};
+
+/** @brief Flash log command, written by the client. */
+struct tgm_service_log_cmd_t
+{
+    /** One of tgm_service_log_op_t. */
+    uint8_t op;
+    /** Page number. */
+    uint32_t seq;
+    /** Pages sent ahead of the acknowledged ones for TGM_SERVICE_LOG_START, at most CONFIG_APP_FLASH_LOG_WINDOW. */
+    uint8_t window;
+} __packed;
+
+/** @brief Offset of the notification that ends a transfer, its seq is the number of the next page. */
+#define TGM_SERVICE_LOG_END 0xffff
+
+/** @brief Header of every flash log notification, a part of the page follows it. */
+struct tgm_service_log_chunk_t
+{
+    /** Page number. */
+    uint32_t seq;
+    /** Offset of the part in the page with its tgm_service_log_page_t, or TGM_SERVICE_LOG_END. */
+    uint16_t offset;
+} __packed;
+
+/** @brief Start of a page in a transfer, the page follows it. */
+struct tgm_service_log_page_t
+{
+    /** Length of the page. */
+    uint16_t len;
+    /** CRC-32 (IEEE) of the page. */
+    uint32_t crc;
+} __packed;
+
+/** @brief Clock sync request, written by the host. */
+struct tgm_service_clock_sync_req_t
+{
+    /** Wall clock of the host in us since the Unix epoch when it wrote the request. */
+    uint64_t host_us;
+    /** Round trip of the previous request in us, from its write to its response, 0 when unknown. */
+    uint32_t rtt_us;
+    /** Sequence number, one higher than that of the previous request. */
+    uint8_t seq;
+} __packed;
+
+/** @brief Clock sync response, notified for every request and returned on a read. */
+struct tgm_service_clock_sync_data_t
+{
+    /** Sequence number of the request. */
+    uint8_t seq;
+    /** Points in the fit, 0 until a request with a round trip came in. */
+    uint8_t points;
+    /** Device uptime in us when the request arrived, or of the read. */
+    uint64_t device_us;
+    /** Wall clock at device_us in us since the Unix epoch, 0 without points. */
+    uint64_t wall_us;
+    /** Rate of the device clock against the host clock in ppb, positive when the device runs slow. */
+    int32_t skew_ppb;
+    /** RMS distance of the points from the fitted line in us. */
+    uint32_t rms_us;
+} __packed;
+
+/** @brief Record types of the multiplexed sensor stream. */
+enum tgm_service_record_type_t
+{
+    /** PPG frame, as sent on the PPG characteristic. */
+    TGM_SERVICE_RECORD_PPG = 1,
+    /** Accelerometer frame, as sent on the accelerometer characteristic. */
+    TGM_SERVICE_RECORD_ACC = 2,
+    /** Temperature frame, as tgm_service_temp_data_t. */
+    TGM_SERVICE_RECORD_TEMP = 3,
+    /** Heart rate summary, as sent on the heart rate characteristic. */
+    TGM_SERVICE_RECORD_HR = 4,
+    /** SpO2 estimate, as tgm_service_spo2_data_t. */
+    TGM_SERVICE_RECORD_SPO2 = 5,
+    /** HRV batch, as sent on the HRV characteristic. */
+    TGM_SERVICE_RECORD_HRV = 6,
+    /** Motion summary, as tgm_service_motion_data_t. */
+    TGM_SERVICE_RECORD_MOTION = 7,
+    /** Bruxism episode, as tgm_service_bruxism_data_t. */
+    TGM_SERVICE_RECORD_BRUXISM = 8,
+    /** Epoch summary, as tgm_service_epoch_data_t, only in pages of the flash log. */
+    TGM_SERVICE_RECORD_EPOCH = 9,
+};
+
+/** @brief Header of every record in a multiplexed stream notification, the frame follows it. */
+struct tgm_service_record_header_t
+{
+    /** Record type, one of tgm_service_record_type_t. */
+    uint8_t type;
+    /** Length of the frame that follows. */
+    uint8_t len;
+} __packed;
+
+/** @brief Size of the frame counter that starts every multiplexed stream notification. */
+#define TGM_SERVICE_MUX_HEADER_SIZE sizeof(uint32_t)
+
+/** @brief Largest frame that fits a multiplexed stream notification at the default ATT MTU. */
+#define TGM_SERVICE_MUX_FRAME_MAX \
+    (CONFIG_BT_L2CAP_TX_MTU - 3 - TGM_SERVICE_MUX_HEADER_SIZE - sizeof(struct tgm_service_record_header_t))
+
+/** @brief Frame counters of the TX queue of a sensor stream. */
+struct tgm_service_tx_stats
+{
+    /** Frames queued for notification. */
+    uint32_t queued;
+    /** Notifications the stack reported as sent. */
+    uint32_t sent;
+    /** Frames dropped because the queue was full or the notification failed. */
+    uint32_t dropped;
+};
+
+/** @brief Callback type that fills a PPG notification, returns the number of samples written. */
+typedef uint8_t (*tgm_service_ppg_fill_t)(struct ppg_sample *ppg_data, uint8_t max_samples, void *user_data);
+
+/** @brief Callback type that fills an accelerometer notification, returns the number of samples written. */
+typedef uint8_t (*tgm_service_acc_fill_t)(struct acc_sample *acc_data, uint8_t max_samples, void *user_data);
+
 /** @brief Callback type for when PPG data is pulled. */
 typedef void (*tgm_service_ppg_cb_t)(struct tgm_service_ppg_data_t *ppg_data);
 
@@ -97,6 +512,12 @@ typedef void (*tgm_service_temp_cb_t)(struct tgm_service_temp_data_t *temp_data)
 /** @brief Callback type for when the battery value is pulled. */
 typedef int32_t (*tgm_service_bat_cb_t)(void);
 
+/** @brief Callback type for when the client subscribes to or unsubscribes from the sensor data streams. */
+typedef void (*tgm_service_streaming_cb_t)(bool streaming);
+
+/** @brief Callback type for when an offload of the flash log starts or ends. */
+typedef void (*tgm_service_bulk_transfer_cb_t)(bool active);
+
 /** @brief Callback struct used by the TGM Service. */
 struct tgm_service_cb
 {
@@ -108,6 +529,10 @@ struct tgm_service_cb
     tgm_service_temp_cb_t temp_cb;
     /** Battery value callback. */
     tgm_service_bat_cb_t bat_cb;
+    /** Called when the PPG, accelerometer or multiplexed stream subscriptions change the streaming state. */
+    tgm_service_streaming_cb_t streaming_cb;
+    /** Called when an offload of the flash log starts or ends. */
+    tgm_service_bulk_transfer_cb_t bulk_transfer_cb;
 };
 
 /** @brief Initialize the TGM Service.
@@ -127,26 +552,46 @@ int tgm_service_init(struct tgm_service_cb *callbacks);
 /** @brief Notify the client of a PPG data change.
  *
  * This function notifies the connected client device of an update to the PPG
- * data
+ * data. The samples are only decoded, by the fill callback, when notifications
+ * are enabled. The notification is queued and sent as soon as the stack has room.
  *
- * @param[in] ppg_data ppg_sample struct containing the PPG sensor data
- * @param[in] sample_cnt Number of samples to be sent
+ * @param[in] fill Callback that writes the samples into the notification
+ * @param[in] user_data Argument passed to the fill callback
+ * @param[in] time_ns Uptime of the first sample in ns
+ * @param[in] period_ns Sample period in ns
  * @retval 0 If the operation was successful.
+ * @retval -ENOBUFS If the TX queue is full and the frame was dropped.
  *           Otherwise, a (negative) error code is returned.
  */
-int tgm_service_send_ppg_notify(struct ppg_sample *ppg_data, uint8_t sample_cnt);
+int tgm_service_send_ppg_notify(tgm_service_ppg_fill_t fill, void *user_data, uint64_t time_ns, uint32_t period_ns);
+
+/** @brief Get the TX queue counters of the PPG data.
+ *
+ * @param[out] stats Counters since boot
+ */
+void tgm_service_get_ppg_tx_stats(struct tgm_service_tx_stats *stats);
+
+/** @brief Get the TX queue counters of the accelerometer data.
+ *
+ * @param[out] stats Counters since boot
+ */
+void tgm_service_get_acc_tx_stats(struct tgm_service_tx_stats *stats);
 
 /** @brief Notify the client of an accelerometer data change.
  *
  * This function notifies the connected client device of an update to the accelerometer
- * data
+ * data. The samples are only decoded, by the fill callback, when notifications
+ * are enabled. The notification is queued and sent as soon as the stack has room.
  *
- * @param[in] acc_data acc_sample struct containing the accelerometer sensor data
- * @param[in] sample_cnt Number of samples to be sent
+ * @param[in] fill Callback that writes the samples into the notification
+ * @param[in] user_data Argument passed to the fill callback
+ * @param[in] time_ns Uptime of the first sample in ns
+ * @param[in] period_ns Sample period in ns
  * @retval 0 If the operation was successful.
+ * @retval -ENOBUFS If the TX queue is full and the frame was dropped.
  *           Otherwise, a (negative) error code is returned.
  */
-int tgm_service_send_acc_notify(struct acc_sample *acc_data, uint8_t sample_cnt);
+int tgm_service_send_acc_notify(tgm_service_acc_fill_t fill, void *user_data, uint64_t time_ns, uint32_t period_ns);
 
 /** @brief Notify the client of a temperature data change.
  *
@@ -161,6 +606,71 @@ int tgm_service_send_acc_notify(struct acc_sample *acc_data, uint8_t sample_cnt)
  */
 int tgm_service_send_temp_notify(int16_t new_temp);
 
+/** @brief Notify the client of a heart rate summary.
+ *
+ * The summary is also sent as a record of the multiplexed stream, or over the L2CAP channel when that is connected.
+ * While no client listens, it goes to the flash log with CONFIG_APP_FLASH_LOG.
+ *
+ * @param[in,out] hr_data Summary, the frame counter is filled in
+ *
+ * @retval 0 If the operation was successful.
+ * @retval -EACCES If no client listens and it was not logged.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int tgm_service_send_hr_notify(struct tgm_service_hr_data_t *hr_data);
+
+/** @brief Notify the client of an SpO2 estimate.
+ *
+ * The estimate is also sent as a record of the multiplexed stream, or over the L2CAP channel when that is connected.
+ * While no client listens, it goes to the flash log with CONFIG_APP_FLASH_LOG.
+ *
+ * @param[in,out] spo2_data Estimate, the frame counter is filled in
+ *
+ * @retval 0 If the operation was successful.
+ * @retval -EACCES If no client listens and it was not logged.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int tgm_service_send_spo2_notify(struct tgm_service_spo2_data_t *spo2_data);
+
+/** @brief Notify the client of a batch of beat to beat intervals.
+ *
+ * The batch is also sent as a record of the multiplexed stream, or over the L2CAP channel when that is connected.
+ * While no client listens, it goes to the flash log with CONFIG_APP_FLASH_LOG.
+ *
+ * @param[in,out] hrv_data Batch, the frame counter is filled in
+ *
+ * @retval 0 If the operation was successful.
+ * @retval -EACCES If no client listens and it was not logged.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int tgm_service_send_hrv_notify(struct tgm_service_hrv_data_t *hrv_data);
+
+/** @brief Notify the client of the motion summary of a PPG frame.
+ *
+ * The summary is also sent as a record of the multiplexed stream, or over the L2CAP channel when that is connected.
+ * While no client listens, it goes to the flash log with CONFIG_APP_FLASH_LOG.
+ *
+ * @param[in,out] motion_data Summary, the frame counter is filled in
+ *
+ * @retval 0 If the operation was successful.
+ * @retval -EACCES If no client listens and it was not logged.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int tgm_service_send_motion_notify(struct tgm_service_motion_data_t *motion_data);
+
+/** @brief Notify the client of a bruxism episode.
+ *
+ * The episode is also sent as a record of the multiplexed stream, or over the L2CAP channel when that is connected.
+ * While no client listens, it goes to the flash log with CONFIG_APP_FLASH_LOG.
+ *
+ * @param[in,out] bruxism_data Episode, the frame counter is filled in
+ *
+ * @retval 0 If the operation was successful.
+ * @retval -EACCES If no client listens and it was not logged.
+ *           Otherwise, a (negative) error code is returned.
+ */
+int tgm_service_send_bruxism_notify(struct tgm_service_bruxism_data_t *bruxism_data);
+
 /** @brief Notify the client of a battery value change.
  *
  * This function notifies the connected client device of an update to the battery
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#define DT_DRV_COMPAT byteexplain_die_temp_emul
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/sensor.h>
+
+#include <app/drivers/die_temp_emul.h>
+
+struct die_temp_emul_config
+{
+	int16_t initial_centitemp;
+};
+
+struct die_temp_emul_data
+{
+	int16_t centitemp;
+	int16_t sample;
+};
+
+static int die_temp_emul_sample_fetch(const struct device *dev, enum sensor_channel chan)
+{
+	struct die_temp_emul_data *data = dev->data;
+
+	if (chan != SENSOR_CHAN_ALL && chan != SENSOR_CHAN_DIE_TEMP)
+	{
+		return -ENOTSUP;
+	}
+
+	data->sample = data->centitemp;
+
+	return 0;
+}
+
+static int die_temp_emul_channel_get(const struct device *dev, enum sensor_channel chan, struct sensor_value *val)
+{
+	struct die_temp_emul_data *data = dev->data;
+
+	if (chan != SENSOR_CHAN_DIE_TEMP)
+	{
+		return -ENOTSUP;
+	}
+
+	val->val1 = data->sample / 100;
+	val->val2 = (data->sample % 100) * 10000;
+
+	return 0;
+}
+
+void die_temp_emul_set(const struct device *dev, int16_t centitemp)
+{
+	struct die_temp_emul_data *data = dev->data;
+
+	data->centitemp = centitemp;
+}
+
+static const struct sensor_driver_api die_temp_emul_api = {
+	.sample_fetch = die_temp_emul_sample_fetch,
+	.channel_get = die_temp_emul_channel_get,
+};
+
+static int die_temp_emul_init(const struct device *dev)
+{
+	const struct die_temp_emul_config *config = dev->config;
+	struct die_temp_emul_data *data = dev->data;
+
+	data->centitemp = config->initial_centitemp;
+
+	return 0;
+}
+
+#define DIE_TEMP_EMUL_DEFINE(inst)                                                     \
+	static struct die_temp_emul_data die_temp_emul_data_##inst;                       \
+	static const struct die_temp_emul_config die_temp_emul_config_##inst = {          \
+		.initial_centitemp = DT_INST_PROP(inst, centi_celsius),                       \
+	};                                                                                \
+	SENSOR_DEVICE_DT_INST_DEFINE(inst, die_temp_emul_init, NULL,                      \
+				     &die_temp_emul_data_##inst, &die_temp_emul_config_##inst,                \
+				     POST_KERNEL, CONFIG_SENSOR_INIT_PRIORITY, &die_temp_emul_api);
+
+DT_INST_FOREACH_STATUS_OKAY(DIE_TEMP_EMUL_DEFINE)
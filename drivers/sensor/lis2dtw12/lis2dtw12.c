@@ -2,70 +2,67 @@
  * Copyright (c) 2024 WeeGee bv
  */
 
+#define DT_DRV_COMPAT st_lis2dtw12
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/rtio/rtio.h>
 #include <app/drivers/lis2dtw12.h>
+#include <app/drivers/sensor_drain.h>
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(lis2dtw12, CONFIG_LIS2DTW12_LOG_LEVEL);
 
-typedef enum
+// Sample period in ns for each ODR code, 0 = power-down
+static const uint32_t sample_period_ns[] = {0, 80000000, 80000000, 40000000, 20000000,
+                                            10000000, 5000000, 2500000, 1250000, 625000};
+
+// CTRL1 fields
+#define LIS2DTW12_ODR_SHIFT 4
+#define LIS2DTW12_MODE_HIGH_PERFORMANCE 0b0100
+// Fastest ODR code in the low power modes, 200Hz
+#define LIS2DTW12_ODR_LOW_POWER_MAX 6
+// First ODR code SENSOR_ATTR_SAMPLING_FREQUENCY accepts, 12.5Hz, code 1 is 1.6Hz in low power but 12.5Hz otherwise
+#define LIS2DTW12_ODR_MIN 2
+
+struct lis2dtw12_config
 {
-    // Temperature
-    LIS2DTW12_OUT_T_L = 0x0D,
-    LIS2DTW12_OUT_T_H = 0x0E,
-
-    // Part ID
-    LIS2DTW12_WHO_AM_I = 0x0F,
-
-    // Control registers
-    LIS2DTW12_CTRL1 = 0x20,
-    LIS2DTW12_CTRL2 = 0x21,
-    LIS2DTW12_CTRL3 = 0x22,
-    LIS2DTW12_CTRL4_INT1_PAD_CTRL = 0x23,
-    LIS2DTW12_CTRL5_INT2_PAD_CTRL = 0x24,
-    LIS2DTW12_CTRL_6 = 0x25,
-
-    // Status
-    LIS2DTW12_STATUS = 0x27,
-
-    // Acceleration data
-    LIS2DTW12_OUT_X_L = 0x28,
-    LIS2DTW12_OUT_X_H = 0x29,
-    LIS2DTW12_OUT_Y_L = 0x2A,
-    LIS2DTW12_OUT_Y_H = 0x2B,
-    LIS2DTW12_OUT_Z_L = 0x2C,
-    LIS2DTW12_OUT_Z_H = 0x2D,
-
-    // FIFO
-    LIS2DTW12_FIFO_CTRL = 0x2E,
-    LIS2DTW12_FIFO_SAMPLES = 0x2F,
-
-    // Interrupts
-    LIS2DTW12_TAP_THS_X = 0x30,
-    LIS2DTW12_TAP_THS_Y = 0x31,
-    LIS2DTW12_TAP_THS_Z = 0x32,
-    LIS2DTW12_INT_DUR = 0x33,
-    LIS2DTW12_WAKE_UP_THS = 0x34,
-    LIS2DTW12_WAKE_UP_DUR = 0x35,
-    LIS2DTW12_FREE_FALL = 0x36,
-    LIS2DTW12_STATUS_DUP = 0x37,
-    LIS2DTW12_WAKE_UP_SRC = 0x38,
-    LIS2DTW12_TAP_SRC = 0x39,
-    LIS2DTW12_SIXD_SRC = 0x3A,
-    LIS2DTW12_ALL_INT_SRC = 0x3B,
-    LIS2DTW12_X_OFS_USR = 0x3C,
-    LIS2DTW12_Y_OFS_USR = 0x3D,
-    LIS2DTW12_Z_OFS_USR = 0x3E,
-
-    LIS2DTW12_CTRL_7 = 0x3F,
-
-} LIS2DTW12_REG_map_t;
-
-int acc_sensor_start(const struct i2c_dt_spec *i2c)
+    struct i2c_dt_spec i2c;
+    struct gpio_dt_spec int_gpio;
+    struct rtio_iodev *iodev;
+    struct rtio *rtio;
+};
+
+struct lis2dtw12_data
 {
+    const struct device *dev;
+    struct gpio_callback int_cb;
+    struct k_work drain_work;
+
+    // Streaming request waiting for the next FIFO threshold interrupt
+    struct rtio_iodev_sqe *stream_sqe;
+    // Request the drain in flight reads into
+    struct rtio_iodev_sqe *drain_sqe;
+    uint64_t irq_timestamp;
+
+    uint32_t period_ns;
+
+    // Output data rate, power mode and frame size set through the attributes, applied by the next start
+    uint8_t odr;
+    uint8_t power_mode;
+    uint8_t frame_samples;
+};
+
+int acc_sensor_start(const struct device *dev)
+{
+    const struct lis2dtw12_config *config = dev->config;
+    struct lis2dtw12_data *data = dev->data;
+    const struct i2c_dt_spec *i2c = &config->i2c;
     int err = 0;
 
     // Set the FIFO threshold and FIFO mode (stop collecting when FIFO is full)
-    uint8_t fifo_ctrl = (0x20 | CONFIG_ACC_SAMPLES_PER_FRAME);
+    uint8_t fifo_ctrl = (0x20 | data->frame_samples);
     err = i2c_burst_write_dt(i2c, LIS2DTW12_FIFO_CTRL, &fifo_ctrl, 1);
     if (err)
     {
@@ -88,6 +85,14 @@ int acc_sensor_start(const struct i2c_dt_spec *i2c)
         LOG_ERR("Failed to route FIFO threshold interrupt to INT1");
     }
 
+    // Listen to the interrupt pin before the sensor can raise it
+    err = gpio_pin_interrupt_configure_dt(&config->int_gpio, GPIO_INT_EDGE_TO_ACTIVE);
+    if (err)
+    {
+        LOG_ERR("Failed to enable interrupt pin");
+        return err;
+    }
+
     // Enable the interrupts
     uint8_t ctrl7 = 0b00100000;
     err = i2c_burst_write_dt(i2c, LIS2DTW12_CTRL_7, &ctrl7, 1);
@@ -96,19 +101,31 @@ int acc_sensor_start(const struct i2c_dt_spec *i2c)
         LOG_ERR("Failed to enable the interrupts");
     }
 
-    // Enable the accelerometer sensor in low power mode 4 at 50Hz
-    uint8_t ctrl1 = 0b01000011;
+    // Enable the accelerometer sensor, in low power mode 4 at 50Hz unless changed through the attributes
+    uint8_t odr = data->odr;
+    uint8_t mode = (data->power_mode == LIS2DTW12_HIGH_PERFORMANCE) ? LIS2DTW12_MODE_HIGH_PERFORMANCE
+                                                                    : data->power_mode;
+    if (data->power_mode != LIS2DTW12_HIGH_PERFORMANCE && odr > LIS2DTW12_ODR_LOW_POWER_MAX)
+    {
+        LOG_WRN("Low power modes run at 200Hz at most");
+        odr = LIS2DTW12_ODR_LOW_POWER_MAX;
+    }
+
+    uint8_t ctrl1 = (odr << LIS2DTW12_ODR_SHIFT) | mode;
     err = i2c_burst_write_dt(i2c, LIS2DTW12_CTRL1, &ctrl1, 1);
     if (err)
     {
         LOG_ERR("Failed to enable accelerometer sensor");
     }
+    data->period_ns = sample_period_ns[odr];
 
     return 0;
 }
 
-int acc_sensor_stop(const struct i2c_dt_spec *i2c)
+int acc_sensor_stop(const struct device *dev)
 {
+    const struct lis2dtw12_config *config = dev->config;
+    const struct i2c_dt_spec *i2c = &config->i2c;
     int err = 0;
 
     // Disable the interrupts
@@ -127,54 +144,308 @@ int acc_sensor_stop(const struct i2c_dt_spec *i2c)
         LOG_ERR("Failed to disable accelerometer sensor");
     }
 
+    // A pending streaming request stays queued and is served again after the next start
+    err = gpio_pin_interrupt_configure_dt(&config->int_gpio, GPIO_INT_DISABLE);
+    if (err)
+    {
+        LOG_ERR("Failed to disable interrupt pin");
+    }
+
     return 0;
 }
 
-int acc_sensor_get_data(const struct i2c_dt_spec *i2c, struct acc_sample *acc_data, uint8_t *sample_count)
+/**
+ * @brief Completion callback, chained behind the FIFO reads
+ *
+ * Runs in the completion context of the bus driver, which may be an ISR.
+ */
+static void lis2dtw12_drain_done(struct rtio *r, const struct rtio_sqe *sqe, void *arg)
 {
-    int err;
+    const struct device *dev = arg;
+    struct lis2dtw12_data *data = dev->data;
+    struct rtio_iodev_sqe *iodev_sqe = data->drain_sqe;
 
-    // Check the FIFO state
-    uint8_t fifo_samples;
-    err = i2c_burst_read_dt(i2c, LIS2DTW12_FIFO_SAMPLES, &fifo_samples, 1);
-    if (err)
+    data->drain_sqe = NULL;
+    rtio_iodev_sqe_ok(iodev_sqe, 0);
+}
+
+/**
+ * @brief Release the completions of the internal RTIO context
+ *
+ * A failed transfer cancels the callback, so the failure completes the request here.
+ */
+static void lis2dtw12_drain_reap(const struct device *dev)
+{
+    const struct lis2dtw12_config *config = dev->config;
+    struct lis2dtw12_data *data = dev->data;
+    struct rtio_cqe *cqe;
+    int result = 0;
+
+    while ((cqe = rtio_cqe_consume(config->rtio)) != NULL)
     {
-        LOG_ERR("Failed to read FIFO samples");
+        result = MIN(result, cqe->result);
+        rtio_cqe_release(config->rtio, cqe);
     }
 
-    uint8_t fifo_data_count;
-    // Check for overflow
-    if (fifo_samples & 0x40)
+    if (result < 0 && data->drain_sqe != NULL)
     {
-        LOG_WRN("FIFO overflow detected, discarding data");
-        fifo_data_count = CONFIG_ACC_SAMPLES_PER_FRAME;
+        struct rtio_iodev_sqe *iodev_sqe = data->drain_sqe;
+
+        LOG_ERR("Failed to drain FIFO with error %d", result);
+        data->drain_sqe = NULL;
+        rtio_iodev_sqe_err(iodev_sqe, result);
     }
-    else
+}
+
+/**
+ * @brief Read one frame from the FIFO into the buffer of a request
+ */
+static void lis2dtw12_drain(const struct device *dev, struct rtio_iodev_sqe *iodev_sqe, uint64_t timestamp,
+                            bool fifo_watermark)
+{
+    const struct lis2dtw12_config *config = dev->config;
+    struct lis2dtw12_data *data = dev->data;
+    const uint8_t samples_reg = LIS2DTW12_FIFO_SAMPLES;
+    const uint8_t data_reg = LIS2DTW12_OUT_X_L;
+
+    if (data->drain_sqe != NULL)
     {
-        fifo_data_count = fifo_samples & 0x3F;
-        LOG_DBG("FIFO data count: %d", fifo_data_count);
+        rtio_iodev_sqe_err(iodev_sqe, -EBUSY);
+        return;
     }
 
-    // Read the FIFO data
-    uint8_t byte_count = fifo_data_count * 3 * 2; // 2 bytes per axis, 3 axes
-    uint8_t fifo_data[byte_count];
-    err = i2c_burst_read_dt(i2c, LIS2DTW12_OUT_X_L, fifo_data, byte_count);
+    // The FIFO threshold interrupt guarantees one frame is available
+    uint8_t sample_count = MIN(data->frame_samples, LIS2DTW12_FIFO_DEPTH);
+    uint32_t buf_len_min = sizeof(struct lis2dtw12_encoded_data) + sample_count * LIS2DTW12_SAMPLE_SIZE;
+    uint8_t *buf;
+    uint32_t buf_len;
+
+    int err = rtio_sqe_rx_buf(iodev_sqe, buf_len_min, buf_len_min, &buf, &buf_len);
     if (err)
     {
-        LOG_ERR("Failed to read FIFO data");
+        LOG_ERR("Failed to get a buffer of %u bytes", buf_len_min);
+        rtio_iodev_sqe_err(iodev_sqe, err);
+        return;
     }
 
-    *sample_count = fifo_data_count;
-    // Parse the data
-    for (int i = 0; i < *sample_count; i++)
+    struct lis2dtw12_encoded_data *edata = (struct lis2dtw12_encoded_data *)buf;
+    edata->timestamp = timestamp;
+    edata->period_ns = data->period_ns;
+    edata->fifo_watermark = fifo_watermark;
+    edata->sample_count = sample_count;
+
+    struct rtio_sqe *samples_write_sqe = rtio_sqe_acquire(config->rtio);
+    struct rtio_sqe *samples_read_sqe = rtio_sqe_acquire(config->rtio);
+    struct rtio_sqe *data_write_sqe = rtio_sqe_acquire(config->rtio);
+    struct rtio_sqe *data_read_sqe = rtio_sqe_acquire(config->rtio);
+    struct rtio_sqe *cb_sqe = rtio_sqe_acquire(config->rtio);
+    if (samples_write_sqe == NULL || samples_read_sqe == NULL || data_write_sqe == NULL || data_read_sqe == NULL ||
+        cb_sqe == NULL)
     {
-        // Combine bytes into 16-bit words in 2's complement
-        acc_data[i].x = ((fifo_data[i * 6 + 1] << 8) | fifo_data[i * 6]);
-        acc_data[i].y = ((fifo_data[i * 6 + 3] << 8) | fifo_data[i * 6 + 2]);
-        acc_data[i].z = ((fifo_data[i * 6 + 5] << 8) | fifo_data[i * 6 + 4]);
+        rtio_sqe_drop_all(config->rtio);
+        rtio_iodev_sqe_err(iodev_sqe, -ENOMEM);
+        return;
+    }
+
+    // FIFO_SAMPLES lies behind the output registers, so the state and the data are two chained transfers
+    rtio_sqe_prep_tiny_write(samples_write_sqe, config->iodev, RTIO_PRIO_NORM, &samples_reg, 1, edata);
+    samples_write_sqe->flags |= RTIO_SQE_TRANSACTION;
+    rtio_sqe_prep_read(samples_read_sqe, config->iodev, RTIO_PRIO_NORM, &edata->fifo_samples, 1, edata);
+    samples_read_sqe->iodev_flags |= RTIO_IODEV_I2C_STOP | RTIO_IODEV_I2C_RESTART;
+    samples_read_sqe->flags |= RTIO_SQE_CHAINED;
+
+    rtio_sqe_prep_tiny_write(data_write_sqe, config->iodev, RTIO_PRIO_NORM, &data_reg, 1, edata);
+    data_write_sqe->flags |= RTIO_SQE_TRANSACTION;
+    rtio_sqe_prep_read(data_read_sqe, config->iodev, RTIO_PRIO_NORM, edata->data, sample_count * LIS2DTW12_SAMPLE_SIZE,
+                       edata);
+    data_read_sqe->iodev_flags |= RTIO_IODEV_I2C_STOP | RTIO_IODEV_I2C_RESTART;
+    data_read_sqe->flags |= RTIO_SQE_CHAINED;
+
+    rtio_sqe_prep_callback(cb_sqe, lis2dtw12_drain_done, (void *)dev, edata);
 
-        LOG_DBG("ACC data: x = %d, y = %d, z = %d", acc_data[i].x, acc_data[i].y, acc_data[i].z);
+    data->drain_sqe = iodev_sqe;
+    rtio_submit(config->rtio, 0);
+
+    // Without native RTIO support in the bus driver the transfers have already completed, pick up failures right away
+    lis2dtw12_drain_reap(dev);
+}
+
+static void lis2dtw12_drain_work_handler(struct k_work *work)
+{
+    struct lis2dtw12_data *data = CONTAINER_OF(work, struct lis2dtw12_data, drain_work);
+    const struct device *dev = data->dev;
+    struct rtio_iodev_sqe *iodev_sqe = data->stream_sqe;
+
+    // Completions of an earlier drain that failed asynchronously
+    lis2dtw12_drain_reap(dev);
+
+    if (iodev_sqe == NULL)
+    {
+        // Nobody is streaming, leave the data in the FIFO
+        return;
+    }
+
+    // The request is resubmitted on completion, so it must be released first
+    data->stream_sqe = NULL;
+    lis2dtw12_drain(dev, iodev_sqe, data->irq_timestamp, true);
+}
+
+static void lis2dtw12_int_handler(const struct device *port, struct gpio_callback *cb, uint32_t pins)
+{
+    struct lis2dtw12_data *data = CONTAINER_OF(cb, struct lis2dtw12_data, int_cb);
+
+    data->irq_timestamp = k_ticks_to_ns_floor64(k_uptime_ticks());
+
+    // Queue the transfers outside of the ISR, the bus driver may not support submissions from an ISR
+    k_work_submit_to_queue(&sensor_drain_workq, &data->drain_work);
+}
+
+static void lis2dtw12_submit(const struct device *dev, struct rtio_iodev_sqe *iodev_sqe)
+{
+    const struct sensor_read_config *cfg = iodev_sqe->sqe.iodev->data;
+    struct lis2dtw12_data *data = dev->data;
+
+    if (!cfg->is_streaming)
+    {
+        // One-shot read of what the FIFO holds right now
+        lis2dtw12_drain(dev, iodev_sqe, k_ticks_to_ns_floor64(k_uptime_ticks()), false);
+        return;
+    }
+
+    for (size_t i = 0; i < cfg->count; i++)
+    {
+        if (cfg->triggers[i].trigger != SENSOR_TRIG_FIFO_WATERMARK)
+        {
+            LOG_ERR("Trigger %d not supported", cfg->triggers[i].trigger);
+            rtio_iodev_sqe_err(iodev_sqe, -ENOTSUP);
+            return;
+        }
+    }
+
+    // Served by the next FIFO threshold interrupt
+    data->stream_sqe = iodev_sqe;
+}
+
+// Everything is only stored, acc_sensor_start() programs it
+static int lis2dtw12_attr_set(const struct device *dev, enum sensor_channel chan, enum sensor_attribute attr,
+                              const struct sensor_value *val)
+{
+    struct lis2dtw12_data *data = dev->data;
+
+    if (chan != SENSOR_CHAN_ACCEL_XYZ && chan != SENSOR_CHAN_ALL)
+    {
+        return -ENOTSUP;
+    }
+
+    switch ((int)attr)
+    {
+    case SENSOR_ATTR_SAMPLING_FREQUENCY:
+    {
+        // 12.5Hz up to 1600Hz, each code doubles the rate
+        if (val->val1 < 0 || val->val2 < 0 || (val->val1 == 0 && val->val2 == 0))
+        {
+            return -EINVAL;
+        }
+
+        uint32_t period_ns = (uint32_t)(1000000000000ULL / (val->val1 * 1000000ULL + val->val2));
+
+        for (uint8_t odr = LIS2DTW12_ODR_MIN; odr < ARRAY_SIZE(sample_period_ns); odr++)
+        {
+            if (sample_period_ns[odr] == period_ns)
+            {
+                data->odr = odr;
+                return 0;
+            }
+        }
+        return -EINVAL;
+    }
+
+    case LIS2DTW12_ATTR_POWER_MODE:
+        if (val->val1 < LIS2DTW12_LOW_POWER_1 || val->val1 > LIS2DTW12_HIGH_PERFORMANCE)
+        {
+            return -EINVAL;
+        }
+        data->power_mode = val->val1;
+        return 0;
+
+    case LIS2DTW12_ATTR_FRAME_SAMPLES:
+        // The FIFO threshold has 5 bits
+        if (val->val1 < 1 || val->val1 > MIN(CONFIG_ACC_SAMPLES_PER_FRAME, LIS2DTW12_FIFO_DEPTH - 1))
+        {
+            return -EINVAL;
+        }
+        data->frame_samples = val->val1;
+        return 0;
+
+    default:
+        return -ENOTSUP;
+    }
+}
+
+static const struct sensor_driver_api lis2dtw12_api = {
+    .attr_set = lis2dtw12_attr_set,
+    .submit = lis2dtw12_submit,
+    .get_decoder = lis2dtw12_get_decoder,
+};
+
+static int lis2dtw12_init(const struct device *dev)
+{
+    const struct lis2dtw12_config *config = dev->config;
+    struct lis2dtw12_data *data = dev->data;
+
+    // The sensor is powered by the application through SENS_ENABLE, so only check the bus and pin here
+    if (!i2c_is_ready_dt(&config->i2c))
+    {
+        LOG_ERR("I2C bus %s not ready", config->i2c.bus->name);
+        return -ENODEV;
+    }
+
+    if (!gpio_is_ready_dt(&config->int_gpio))
+    {
+        LOG_ERR("Interrupt GPIO not ready");
+        return -ENODEV;
+    }
+
+    int err = gpio_pin_configure_dt(&config->int_gpio, GPIO_INPUT);
+    if (err)
+    {
+        LOG_ERR("Failed to configure interrupt pin");
+        return err;
+    }
+
+    data->dev = dev;
+    k_work_init(&data->drain_work, lis2dtw12_drain_work_handler);
+
+    // Low power mode 4 at 50Hz
+    data->odr = 4;
+    data->power_mode = LIS2DTW12_LOW_POWER_4;
+    data->frame_samples = MIN(CONFIG_ACC_SAMPLES_PER_FRAME, LIS2DTW12_FIFO_DEPTH - 1);
+
+    gpio_init_callback(&data->int_cb, lis2dtw12_int_handler, BIT(config->int_gpio.pin));
+    err = gpio_add_callback(config->int_gpio.port, &data->int_cb);
+    if (err)
+    {
+        LOG_ERR("Failed to add interrupt callback");
+        return err;
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+#define LIS2DTW12_DEFINE(inst)                                             \
+    I2C_DT_IODEV_DEFINE(lis2dtw12_iodev_##inst, DT_DRV_INST(inst));       \
+    RTIO_DEFINE(lis2dtw12_rtio_##inst, 8, 8);                             \
+    static struct lis2dtw12_data lis2dtw12_data_##inst;                   \
+    static const struct lis2dtw12_config lis2dtw12_config_##inst = {      \
+        .i2c = I2C_DT_SPEC_INST_GET(inst),                                \
+        .int_gpio = GPIO_DT_SPEC_INST_GET(inst, int_gpios),               \
+        .iodev = &lis2dtw12_iodev_##inst,                                 \
+        .rtio = &lis2dtw12_rtio_##inst,                                   \
+    };                                                                    \
+    SENSOR_DEVICE_DT_INST_DEFINE(inst, lis2dtw12_init, NULL,              \
+                                 &lis2dtw12_data_##inst,                  \
+                                 &lis2dtw12_config_##inst, POST_KERNEL,   \
+                                 CONFIG_SENSOR_INIT_PRIORITY,             \
+                                 &lis2dtw12_api);
+
+DT_INST_FOREACH_STATUS_OKAY(LIS2DTW12_DEFINE)
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#define DT_DRV_COMPAT st_lis2dtw12
+
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/sys/byteorder.h>
+#include <app/drivers/lis2dtw12.h>
+
+// 1 g is 16384 counts at 2g full scale, with a shift of 5 one count is 9.80665 / 16384 / 2^5 * 2^31
+#define LIS2DTW12_Q31_SHIFT 5
+#define LIS2DTW12_Q31_PER_COUNT 40167
+
+static inline uint8_t lis2dtw12_sample_count(const struct lis2dtw12_encoded_data *edata)
+{
+    // Never decode more than the FIFO held when the drain started
+    return MIN(edata->fifo_samples & 0x3F, edata->sample_count);
+}
+
+uint8_t lis2dtw12_decode_encoded(const uint8_t *buf, struct acc_sample *acc_data, uint8_t max_samples)
+{
+    const struct lis2dtw12_encoded_data *edata = (const struct lis2dtw12_encoded_data *)buf;
+    uint8_t count = MIN(lis2dtw12_sample_count(edata), max_samples);
+
+    for (uint8_t i = 0; i < count; i++)
+    {
+        const uint8_t *sample = &edata->data[i * LIS2DTW12_SAMPLE_SIZE];
+
+        acc_data[i].x = (int16_t)sys_get_le16(&sample[0]);
+        acc_data[i].y = (int16_t)sys_get_le16(&sample[2]);
+        acc_data[i].z = (int16_t)sys_get_le16(&sample[4]);
+    }
+
+    return count;
+}
+
+static bool lis2dtw12_is_accel_chan(enum sensor_channel chan)
+{
+    return chan == SENSOR_CHAN_ACCEL_X || chan == SENSOR_CHAN_ACCEL_Y || chan == SENSOR_CHAN_ACCEL_Z ||
+           chan == SENSOR_CHAN_ACCEL_XYZ;
+}
+
+static int lis2dtw12_decoder_get_frame_count(const uint8_t *buffer, struct sensor_chan_spec chan_spec,
+                                             uint16_t *frame_count)
+{
+    const struct lis2dtw12_encoded_data *edata = (const struct lis2dtw12_encoded_data *)buffer;
+
+    if (!lis2dtw12_is_accel_chan(chan_spec.chan_type) || chan_spec.chan_idx != 0)
+    {
+        return -ENOTSUP;
+    }
+
+    *frame_count = lis2dtw12_sample_count(edata);
+
+    return 0;
+}
+
+static int lis2dtw12_decoder_get_size_info(struct sensor_chan_spec chan_spec, size_t *base_size, size_t *frame_size)
+{
+    if (!lis2dtw12_is_accel_chan(chan_spec.chan_type))
+    {
+        return -ENOTSUP;
+    }
+
+    if (chan_spec.chan_type == SENSOR_CHAN_ACCEL_XYZ)
+    {
+        *base_size = sizeof(struct sensor_three_axis_data);
+        *frame_size = sizeof(struct sensor_three_axis_sample_data);
+    }
+    else
+    {
+        *base_size = sizeof(struct sensor_q31_data);
+        *frame_size = sizeof(struct sensor_q31_sample_data);
+    }
+
+    return 0;
+}
+
+static inline q31_t lis2dtw12_to_q31(const uint8_t *sample, uint8_t axis)
+{
+    return (int16_t)sys_get_le16(&sample[axis * 2]) * LIS2DTW12_Q31_PER_COUNT;
+}
+
+static int lis2dtw12_decoder_decode(const uint8_t *buffer, struct sensor_chan_spec chan_spec, uint32_t *fit,
+                                    uint16_t max_count, void *data_out)
+{
+    const struct lis2dtw12_encoded_data *edata = (const struct lis2dtw12_encoded_data *)buffer;
+    uint8_t sample_count = lis2dtw12_sample_count(edata);
+    uint16_t count = 0;
+
+    if (!lis2dtw12_is_accel_chan(chan_spec.chan_type) || chan_spec.chan_idx != 0)
+    {
+        return -ENOTSUP;
+    }
+
+    if (chan_spec.chan_type == SENSOR_CHAN_ACCEL_XYZ)
+    {
+        struct sensor_three_axis_data *out = data_out;
+
+        out->header.base_timestamp_ns = edata->timestamp;
+        out->shift = LIS2DTW12_Q31_SHIFT;
+
+        for (; *fit < sample_count && count < max_count; (*fit)++, count++)
+        {
+            const uint8_t *sample = &edata->data[*fit * LIS2DTW12_SAMPLE_SIZE];
+
+            out->readings[count].timestamp_delta = *fit * edata->period_ns;
+            out->readings[count].x = lis2dtw12_to_q31(sample, 0);
+            out->readings[count].y = lis2dtw12_to_q31(sample, 1);
+            out->readings[count].z = lis2dtw12_to_q31(sample, 2);
+        }
+
+        out->header.reading_count = count;
+    }
+    else
+    {
+        struct sensor_q31_data *out = data_out;
+        uint8_t axis = chan_spec.chan_type - SENSOR_CHAN_ACCEL_X;
+
+        out->header.base_timestamp_ns = edata->timestamp;
+        out->shift = LIS2DTW12_Q31_SHIFT;
+
+        for (; *fit < sample_count && count < max_count; (*fit)++, count++)
+        {
+            const uint8_t *sample = &edata->data[*fit * LIS2DTW12_SAMPLE_SIZE];
+
+            out->readings[count].timestamp_delta = *fit * edata->period_ns;
+            out->readings[count].value = lis2dtw12_to_q31(sample, axis);
+        }
+
+        out->header.reading_count = count;
+    }
+
+    return count;
+}
+
+static bool lis2dtw12_decoder_has_trigger(const uint8_t *buffer, enum sensor_trigger_type trigger)
+{
+    const struct lis2dtw12_encoded_data *edata = (const struct lis2dtw12_encoded_data *)buffer;
+
+    return trigger == SENSOR_TRIG_FIFO_WATERMARK && edata->fifo_watermark;
+}
+
+SENSOR_DECODER_API_DT_DEFINE() = {
+    .get_frame_count = lis2dtw12_decoder_get_frame_count,
+    .get_size_info = lis2dtw12_decoder_get_size_info,
+    .decode = lis2dtw12_decoder_decode,
+    .has_trigger = lis2dtw12_decoder_has_trigger,
+};
+
+int lis2dtw12_get_decoder(const struct device *dev, const struct sensor_decoder_api **decoder)
+{
+    ARG_UNUSED(dev);
+    *decoder = &SENSOR_DECODER_NAME();
+
+    return 0;
+}
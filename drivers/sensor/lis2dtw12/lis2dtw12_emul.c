@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#define DT_DRV_COMPAT st_lis2dtw12
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/i2c_emul.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+#include <stdlib.h>
+
+#include <app/drivers/lis2dtw12.h>
+#include <app/drivers/lis2dtw12_emul.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(lis2dtw12_emul, CONFIG_LIS2DTW12_LOG_LEVEL);
+
+#define LIS2DTW12_EMUL_REG_COUNT 0x40
+#define LIS2DTW12_EMUL_FIFO_DEPTH 32
+#define LIS2DTW12_EMUL_WHO_AM_I 0x44
+
+// 1 g in left aligned output counts at ±2 g full scale
+#define LIS2DTW12_EMUL_1G 16384
+
+// CTRL2 bits
+#define LIS2DTW12_EMUL_SOFT_RESET BIT(6)
+#define LIS2DTW12_EMUL_IF_ADD_INC BIT(2)
+
+// CTRL4_INT1_PAD_CTRL bits
+#define LIS2DTW12_EMUL_INT1_FTH BIT(1)
+
+// FIFO_SAMPLES bits
+#define LIS2DTW12_EMUL_FIFO_FTH BIT(7)
+#define LIS2DTW12_EMUL_FIFO_OVR BIT(6)
+
+// FIFO_CTRL modes
+#define LIS2DTW12_EMUL_FMODE_BYPASS 0x0
+#define LIS2DTW12_EMUL_FMODE_FIFO 0x1
+
+// Sample period in us for each ODR code, 0 = power-down
+static const uint32_t sample_period_us[] = {0, 80000, 80000, 40000, 20000, 10000, 5000, 2500, 1250, 625};
+
+struct lis2dtw12_emul_cfg
+{
+    struct gpio_dt_spec int_gpio;
+};
+
+struct lis2dtw12_emul_data
+{
+    const struct lis2dtw12_emul_cfg *cfg;
+    struct k_spinlock lock;
+    struct k_timer sample_timer;
+
+    uint8_t reg[LIS2DTW12_EMUL_REG_COUNT];
+
+    struct acc_sample fifo[LIS2DTW12_EMUL_FIFO_DEPTH];
+    uint8_t fifo_rd;
+    uint8_t fifo_count;
+    bool fifo_ovr;
+
+    // Latest sample, shown in the output registers in bypass mode
+    struct acc_sample latest;
+
+    // Synthetic signal state
+    struct acc_sample accel;
+    int16_t vibration_amplitude;
+    uint16_t vibration_hz;
+    uint32_t vibration_phase;
+    uint32_t noise_state;
+};
+
+static void lis2dtw12_emul_reset(struct lis2dtw12_emul_data *data)
+{
+    memset(data->reg, 0, sizeof(data->reg));
+    data->reg[LIS2DTW12_WHO_AM_I] = LIS2DTW12_EMUL_WHO_AM_I;
+    data->reg[LIS2DTW12_CTRL2] = LIS2DTW12_EMUL_IF_ADD_INC;
+
+    data->fifo_rd = 0;
+    data->fifo_count = 0;
+    data->fifo_ovr = false;
+}
+
+static uint8_t lis2dtw12_emul_fifo_mode(const struct lis2dtw12_emul_data *data)
+{
+    return data->reg[LIS2DTW12_FIFO_CTRL] >> 5;
+}
+
+static uint8_t lis2dtw12_emul_fifo_samples(const struct lis2dtw12_emul_data *data)
+{
+    uint8_t threshold = data->reg[LIS2DTW12_FIFO_CTRL] & 0x1f;
+    uint8_t value = data->fifo_count;
+
+    if (data->fifo_count >= threshold)
+    {
+        value |= LIS2DTW12_EMUL_FIFO_FTH;
+    }
+
+    if (data->fifo_ovr)
+    {
+        value |= LIS2DTW12_EMUL_FIFO_OVR;
+    }
+
+    return value;
+}
+
+static bool lis2dtw12_emul_int_asserted(const struct lis2dtw12_emul_data *data)
+{
+    // The threshold flag is not latched, so INT1 follows the FIFO level
+    return (data->reg[LIS2DTW12_CTRL4_INT1_PAD_CTRL] & LIS2DTW12_EMUL_INT1_FTH) &&
+           (lis2dtw12_emul_fifo_samples(data) & LIS2DTW12_EMUL_FIFO_FTH);
+}
+
+static void lis2dtw12_emul_update_int(const struct lis2dtw12_emul_data *data, bool asserted)
+{
+    const struct gpio_dt_spec *int_gpio = &data->cfg->int_gpio;
+
+    if (int_gpio->port == NULL)
+    {
+        return;
+    }
+
+    // INT1 is push-pull and active high by default (CTRL3 H_LACTIVE = 0)
+    (void)gpio_emul_input_set(int_gpio->port, int_gpio->pin, asserted ? 1 : 0);
+}
+
+static int16_t lis2dtw12_emul_noise(struct lis2dtw12_emul_data *data)
+{
+    data->noise_state = data->noise_state * 1664525u + 1013904223u;
+    return (int16_t)(data->noise_state >> 27) - 16;
+}
+
+static void lis2dtw12_emul_sample(struct k_timer *timer)
+{
+    struct lis2dtw12_emul_data *data = CONTAINER_OF(timer, struct lis2dtw12_emul_data, sample_timer);
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    uint8_t odr = data->reg[LIS2DTW12_CTRL1] >> 4;
+    int32_t vibration = 0;
+
+    if (data->vibration_amplitude)
+    {
+        // Triangle wave, good enough to exercise band-limited energy detection
+        data->vibration_phase += (uint32_t)(((uint64_t)data->vibration_hz * sample_period_us[odr] << 32) / 1000000u);
+        int32_t phase = (int32_t)(data->vibration_phase >> 16) - 0x8000;
+        vibration = ((int32_t)data->vibration_amplitude * (abs(phase) * 2 - 0x8000)) >> 15;
+    }
+
+    struct acc_sample sample = {
+        .x = data->accel.x + lis2dtw12_emul_noise(data),
+        .y = data->accel.y + lis2dtw12_emul_noise(data),
+        .z = data->accel.z + vibration + lis2dtw12_emul_noise(data),
+    };
+    data->latest = sample;
+
+    switch (lis2dtw12_emul_fifo_mode(data))
+    {
+    case LIS2DTW12_EMUL_FMODE_BYPASS:
+        break;
+
+    case LIS2DTW12_EMUL_FMODE_FIFO:
+        // FIFO mode stops collecting once full, until the FIFO is reset through bypass mode
+        if (data->fifo_count == LIS2DTW12_EMUL_FIFO_DEPTH)
+        {
+            data->fifo_ovr = true;
+            break;
+        }
+        data->fifo[(data->fifo_rd + data->fifo_count) % LIS2DTW12_EMUL_FIFO_DEPTH] = sample;
+        data->fifo_count++;
+        break;
+
+    default:
+        // Continuous modes overwrite the oldest sample
+        if (data->fifo_count == LIS2DTW12_EMUL_FIFO_DEPTH)
+        {
+            data->fifo_ovr = true;
+            data->fifo_rd = (data->fifo_rd + 1) % LIS2DTW12_EMUL_FIFO_DEPTH;
+            data->fifo_count--;
+        }
+        data->fifo[(data->fifo_rd + data->fifo_count) % LIS2DTW12_EMUL_FIFO_DEPTH] = sample;
+        data->fifo_count++;
+        break;
+    }
+
+    bool asserted = lis2dtw12_emul_int_asserted(data);
+    k_spin_unlock(&data->lock, key);
+
+    lis2dtw12_emul_update_int(data, asserted);
+}
+
+static void lis2dtw12_emul_update_clock(struct lis2dtw12_emul_data *data)
+{
+    uint8_t odr = data->reg[LIS2DTW12_CTRL1] >> 4;
+
+    if (odr == 0 || odr >= ARRAY_SIZE(sample_period_us))
+    {
+        k_timer_stop(&data->sample_timer);
+        return;
+    }
+
+    k_timeout_t period = K_USEC(sample_period_us[odr]);
+    k_timer_start(&data->sample_timer, period, period);
+}
+
+static const struct acc_sample *lis2dtw12_emul_output(const struct lis2dtw12_emul_data *data)
+{
+    if (lis2dtw12_emul_fifo_mode(data) != LIS2DTW12_EMUL_FMODE_BYPASS && data->fifo_count > 0)
+    {
+        return &data->fifo[data->fifo_rd];
+    }
+
+    return &data->latest;
+}
+
+static uint8_t lis2dtw12_emul_reg_read(struct lis2dtw12_emul_data *data, uint8_t reg)
+{
+    if (reg >= LIS2DTW12_OUT_X_L && reg <= LIS2DTW12_OUT_Z_H)
+    {
+        const int16_t *axes = (const int16_t *)lis2dtw12_emul_output(data);
+        uint16_t value = axes[(reg - LIS2DTW12_OUT_X_L) / 2];
+
+        return (reg & 1) ? (value >> 8) : (value & 0xff);
+    }
+
+    switch (reg)
+    {
+    case LIS2DTW12_FIFO_SAMPLES:
+        return lis2dtw12_emul_fifo_samples(data);
+
+    default:
+        return (reg < LIS2DTW12_EMUL_REG_COUNT) ? data->reg[reg] : 0;
+    }
+}
+
+static void lis2dtw12_emul_reg_write(struct lis2dtw12_emul_data *data, uint8_t reg, uint8_t value)
+{
+    if (reg >= LIS2DTW12_EMUL_REG_COUNT)
+    {
+        return;
+    }
+
+    switch (reg)
+    {
+    case LIS2DTW12_WHO_AM_I:
+    case LIS2DTW12_STATUS:
+    case LIS2DTW12_FIFO_SAMPLES:
+        // Read-only
+        break;
+
+    case LIS2DTW12_CTRL1:
+        data->reg[reg] = value;
+        lis2dtw12_emul_update_clock(data);
+        break;
+
+    case LIS2DTW12_CTRL2:
+        if (value & LIS2DTW12_EMUL_SOFT_RESET)
+        {
+            lis2dtw12_emul_reset(data);
+            lis2dtw12_emul_update_clock(data);
+            break;
+        }
+        data->reg[reg] = value;
+        break;
+
+    case LIS2DTW12_FIFO_CTRL:
+        if ((value >> 5) == LIS2DTW12_EMUL_FMODE_BYPASS || (value >> 5) != lis2dtw12_emul_fifo_mode(data))
+        {
+            // Changing the FIFO mode resets its content
+            data->fifo_rd = 0;
+            data->fifo_count = 0;
+            data->fifo_ovr = false;
+        }
+        data->reg[reg] = value;
+        break;
+
+    default:
+        data->reg[reg] = value;
+        break;
+    }
+}
+
+static uint8_t lis2dtw12_emul_next_reg(struct lis2dtw12_emul_data *data, uint8_t reg)
+{
+    if (!(data->reg[LIS2DTW12_CTRL2] & LIS2DTW12_EMUL_IF_ADD_INC))
+    {
+        return reg;
+    }
+
+    // With the FIFO enabled, reading past OUT_Z_H pops the FIFO and wraps back to OUT_X_L
+    if (reg == LIS2DTW12_OUT_Z_H && lis2dtw12_emul_fifo_mode(data) != LIS2DTW12_EMUL_FMODE_BYPASS)
+    {
+        if (data->fifo_count > 0)
+        {
+            data->fifo_rd = (data->fifo_rd + 1) % LIS2DTW12_EMUL_FIFO_DEPTH;
+            data->fifo_count--;
+        }
+
+        return LIS2DTW12_OUT_X_L;
+    }
+
+    return reg + 1;
+}
+
+static int lis2dtw12_emul_transfer(const struct emul *target, struct i2c_msg *msgs, int num_msgs, int addr)
+{
+    struct lis2dtw12_emul_data *data = target->data;
+
+    if (num_msgs < 1 || (msgs[0].flags & I2C_MSG_READ) || msgs[0].len < 1)
+    {
+        LOG_ERR("Transfer must start with a register address write");
+        return -EIO;
+    }
+
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    uint8_t reg = msgs[0].buf[0];
+    for (uint32_t i = 1; i < msgs[0].len; i++)
+    {
+        lis2dtw12_emul_reg_write(data, reg, msgs[0].buf[i]);
+        reg = lis2dtw12_emul_next_reg(data, reg);
+    }
+
+    for (int m = 1; m < num_msgs; m++)
+    {
+        bool read = msgs[m].flags & I2C_MSG_READ;
+
+        for (uint32_t i = 0; i < msgs[m].len; i++)
+        {
+            if (read)
+            {
+                msgs[m].buf[i] = lis2dtw12_emul_reg_read(data, reg);
+            }
+            else
+            {
+                lis2dtw12_emul_reg_write(data, reg, msgs[m].buf[i]);
+            }
+            reg = lis2dtw12_emul_next_reg(data, reg);
+        }
+    }
+
+    bool asserted = lis2dtw12_emul_int_asserted(data);
+    k_spin_unlock(&data->lock, key);
+
+    lis2dtw12_emul_update_int(data, asserted);
+
+    return 0;
+}
+
+void lis2dtw12_emul_set_accel(const struct emul *target, int16_t x, int16_t y, int16_t z)
+{
+    struct lis2dtw12_emul_data *data = target->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->accel.x = x;
+    data->accel.y = y;
+    data->accel.z = z;
+
+    k_spin_unlock(&data->lock, key);
+}
+
+void lis2dtw12_emul_set_vibration(const struct emul *target, int16_t amplitude, uint16_t frequency_hz)
+{
+    struct lis2dtw12_emul_data *data = target->data;
+    k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+    data->vibration_amplitude = amplitude;
+    data->vibration_hz = frequency_hz;
+
+    k_spin_unlock(&data->lock, key);
+}
+
+static const struct i2c_emul_api lis2dtw12_emul_api_i2c = {
+    .transfer = lis2dtw12_emul_transfer,
+};
+
+static int lis2dtw12_emul_init(const struct emul *target, const struct device *parent)
+{
+    struct lis2dtw12_emul_data *data = target->data;
+
+    ARG_UNUSED(parent);
+
+    data->cfg = target->cfg;
+    data->accel.z = LIS2DTW12_EMUL_1G;
+    data->noise_state = 1;
+
+    k_timer_init(&data->sample_timer, lis2dtw12_emul_sample, NULL);
+    lis2dtw12_emul_reset(data);
+
+    return 0;
+}
+
+#define LIS2DTW12_EMUL(n)                                                          \
+    static struct lis2dtw12_emul_data lis2dtw12_emul_data_##n;                    \
+    static const struct lis2dtw12_emul_cfg lis2dtw12_emul_cfg_##n = {             \
+        .int_gpio = GPIO_DT_SPEC_INST_GET_OR(n, int_gpios, {0}),                  \
+    };                                                                            \
+    EMUL_DT_INST_DEFINE(n, lis2dtw12_emul_init, &lis2dtw12_emul_data_##n,         \
+                        &lis2dtw12_emul_cfg_##n, &lis2dtw12_emul_api_i2c, NULL)
+
+DT_INST_FOREACH_STATUS_OKAY(LIS2DTW12_EMUL)
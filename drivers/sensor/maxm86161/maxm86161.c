@@ -2,26 +2,230 @@
  * Copyright (c) 2024 WeeGee bv
  */
 
+#define DT_DRV_COMPAT adi_maxm86161
+
+#include <string.h>
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/sensor.h>
+#include <zephyr/rtio/rtio.h>
+#include <zephyr/sys/atomic.h>
 #include <app/drivers/maxm86161.h>
+#include <app/drivers/sensor_drain.h>
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(maxm86161, CONFIG_MAXM86161_LOG_LEVEL);
 
-// Use R, IR and Green
-#define COLORS 3u
+#define MAXM86161_FIFO_CONFIG2_FLUSH_FIFO BIT(4)
+#define MAXM86161_INT_A_FULL BIT(7)
+#define MAXM86161_INT_PROX BIT(4)
 
-int ppg_sensor_start(const struct i2c_dt_spec *i2c)
+// Sample period in ns for each PPG_SR code, without averaging
+static const uint32_t sample_period_ns[] = {
+	40008002, 19989206, 11901786, 10009810, 5004880, 2502440, // 1 pulse per sample
+	40008002, 19989206, 11901786, 10009810,					  // 2 pulses per sample
+	125000000, 62500000, 31250000, 15625000, 7812500, 3906250, 1953125, 976563, 488281, 244141,
+};
+
+// PPG_SR codes with a single pulse per sample that SENSOR_ATTR_SAMPLING_FREQUENCY accepts, in Hz
+static const struct
 {
-	int err = 0;
+	uint16_t hz;
+	uint8_t code;
+} sample_rates[] = {
+	{8, 0x0A}, {16, 0x0B}, {25, 0x00}, {32, 0x0C}, {50, 0x01}, {64, 0x0D},
+	{84, 0x02}, {100, 0x03}, {128, 0x0E}, {200, 0x04}, {256, 0x0F}, {400, 0x05},
+};
+
+// Sample rate code and averaging of PPG_CONFIG2
+#define MAXM86161_PPG_SR_SHIFT 3
+#define MAXM86161_SMP_AVE_MASK 0x07
+
+struct maxm86161_config
+{
+	struct i2c_dt_spec i2c;
+	struct gpio_dt_spec int_gpio;
+	struct rtio_iodev *iodev;
+	struct rtio *rtio;
+};
+
+struct maxm86161_data
+{
+	const struct device *dev;
+	struct gpio_callback int_cb;
+	struct k_work drain_work;
+
+	// Streaming request waiting for the next FIFO interrupt
+	struct rtio_iodev_sqe *stream_sqe;
+	// Set by the interrupt until a drain reads the FIFO, the pin stays asserted and gives no new edge before that
+	atomic_t int_pending;
+	// Request the drain in flight reads into
+	struct rtio_iodev_sqe *drain_sqe;
+	uint64_t irq_timestamp;
+
+	// Tag table of the programmed LED sequence, used to find sample boundaries
+	struct maxm86161_decoder decoder;
+	uint8_t led_seq[3];
+	uint32_t period_ns;
+
+	// Sample rate, averaging and frame size set through the attributes, applied by the next start
+	uint8_t ppg_config2;
+	uint8_t frame_samples;
+
+	// Registers written by the next start after the defaults, in increasing order of address
+	struct maxm86161_reg_value start_regs[MAXM86161_MAX_START_REGS];
+	uint8_t start_reg_count;
+
+	// Words of a sample split over two drains
+	uint8_t carry[MAXM86161_MAX_CARRY_WORDS * MAXM86161_FIFO_WORD_SIZE];
+	uint8_t carry_count;
+
+	// Proximity trigger, only served while the sensor is in proximity mode
+	sensor_trigger_handler_t prox_handler;
+	const struct sensor_trigger *prox_trigger;
+	bool prox_armed;
+};
+
+static void maxm86161_set_led_seq(struct maxm86161_data *data, const uint8_t led_seq[3])
+{
+	memcpy(data->led_seq, led_seq, sizeof(data->led_seq));
+	maxm86161_decoder_init(&data->decoder, led_seq);
+	data->carry_count = 0;
+}
+
+static int maxm86161_flush_fifo(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	uint8_t fifo_config2;
+
+	int err = i2c_burst_read_dt(&config->i2c, MAXM86161_REG_FIFO_CONFIG2, &fifo_config2, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to read FIFO config 2");
+		return err;
+	}
+
+	fifo_config2 |= MAXM86161_FIFO_CONFIG2_FLUSH_FIFO;
+	err = i2c_burst_write_dt(&config->i2c, MAXM86161_REG_FIFO_CONFIG2, &fifo_config2, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to flush FIFO");
+	}
+
+	return err;
+}
+
+/**
+ * @brief Rebuild the tag table after a change of the LED sequence
+ *
+ * Words already in the FIFO were tagged for the old sequence, so they are flushed before the new table is used.
+ */
+static int maxm86161_update_led_seq(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+
+	uint8_t led_seq[3];
+	int err = i2c_burst_read_dt(&config->i2c, MAXM86161_REG_LED_SEQ_REG1, led_seq, sizeof(led_seq));
+	if (err)
+	{
+		LOG_ERR("Failed to read LED sequence");
+		return err;
+	}
+
+	err = maxm86161_flush_fifo(dev);
+	if (err)
+	{
+		return err;
+	}
+
+	maxm86161_set_led_seq(data, led_seq);
+	LOG_DBG("LED sequence %02x %02x %02x, %d slots", led_seq[0], led_seq[1], led_seq[2], data->decoder.slot_count);
+
+	return 0;
+}
+
+/**
+ * @brief Set the FIFO AFULL threshold to one frame of the programmed LED sequence
+ *
+ * Every sample takes a FIFO word per slot of the sequence, so the threshold follows the slot count.
+ */
+static int maxm86161_update_threshold(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+
+	uint8_t words = MIN(data->frame_samples * MAX(data->decoder.slot_count, 1), MAXM86161_FIFO_DEPTH);
+	uint8_t fifo_config1 = MAXM86161_FIFO_DEPTH - words;
 
-	// Set the FIFO AFULL threshold based on desired FIFO_SIZE
-	uint8_t fifo_config1 = (128 - (COLORS * CONFIG_PPG_SAMPLES_PER_FRAME));
-	err = i2c_burst_write_dt(i2c, MAXM86161_REG_FIFO_CONFIG1, &fifo_config1, 1);
+	int err = i2c_burst_write_dt(&config->i2c, MAXM86161_REG_FIFO_CONFIG1, &fifo_config1, 1);
 	if (err)
 	{
 		LOG_ERR("Failed to set FIFO AFULL threshold");
 	}
 
+	return err;
+}
+
+static void maxm86161_update_period(struct maxm86161_data *data, uint8_t ppg_config2)
+{
+	uint8_t rate = MIN(ppg_config2 >> 3, ARRAY_SIZE(sample_period_ns) - 1);
+	uint8_t average = ppg_config2 & 0x07;
+
+	data->period_ns = sample_period_ns[rate] << average;
+}
+
+// Write the start registers, one burst per run of consecutive addresses
+static int maxm86161_write_start_regs(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	bool led_seq_changed = false;
+	uint8_t next;
+
+	for (uint8_t i = 0; i < data->start_reg_count; i = next)
+	{
+		uint8_t first = data->start_regs[i].reg;
+		uint8_t run[MAXM86161_MAX_START_REGS];
+		uint8_t len = 0;
+
+		for (next = i; next < data->start_reg_count && data->start_regs[next].reg == first + len; next++)
+		{
+			run[len++] = data->start_regs[next].value;
+		}
+
+		int err = i2c_burst_write_dt(&config->i2c, first, run, len);
+		if (err)
+		{
+			LOG_ERR("Failed to write registers 0x%02x-0x%02x", first, first + len - 1);
+			return err;
+		}
+
+		if (first <= MAXM86161_REG_LED_SEQ_REG3 && first + len > MAXM86161_REG_LED_SEQ_REG1)
+		{
+			led_seq_changed = true;
+		}
+		if (first <= MAXM86161_REG_PPG_CONFIG2 && first + len > MAXM86161_REG_PPG_CONFIG2)
+		{
+			maxm86161_update_period(data, run[MAXM86161_REG_PPG_CONFIG2 - first]);
+		}
+	}
+
+	LOG_DBG("Wrote %u start registers", data->start_reg_count);
+
+	return led_seq_changed ? maxm86161_update_led_seq(dev) : 0;
+}
+
+int ppg_sensor_start(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	const struct i2c_dt_spec *i2c = &config->i2c;
+	int err = 0;
+
+	data->prox_armed = false;
+
 	// Set the LED sequence to have red first, IR second and Green last (green = LED1, ir = LED2, red = LED3)
 	uint8_t led_seq_reg[3] = {0x23, 0x01, 0x00};
 	err = i2c_burst_write_dt(i2c, MAXM86161_REG_LED_SEQ_REG1, led_seq_reg, 3);
@@ -30,6 +234,9 @@ int ppg_sensor_start(const struct i2c_dt_spec *i2c)
 		LOG_ERR("Failed to set LED sequence");
 	}
 
+	// The FIFO is flushed further down, so the tag table can switch to the new sequence right away
+	maxm86161_set_led_seq(data, led_seq_reg);
+
 	// Set the LED range to 31mA
 	uint8_t led_range[2] = {0x0, 0x0};
 	err = i2c_burst_write_dt(i2c, MAXM86161_REG_LED_RANGE1, led_range, 2);
@@ -46,16 +253,16 @@ int ppg_sensor_start(const struct i2c_dt_spec *i2c)
 		LOG_ERR("Failed to set PPG config 1");
 	}
 
-	// Set the sample rate to 50Hz without averaging
-	uint8_t ppg_config2 = 0b00001000;
-	err = i2c_burst_write_dt(i2c, MAXM86161_REG_PPG_CONFIG2, &ppg_config2, 1);
+	// Set the sample rate and averaging, 50Hz without averaging unless changed through the attributes
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_PPG_CONFIG2, &data->ppg_config2, 1);
 	if (err)
 	{
 		LOG_ERR("Failed to set PPG config 2");
 	}
+	maxm86161_update_period(data, data->ppg_config2);
 
-	// Set the drive strength of the LEDs (green = LED1, ir = LED2, red = LED3)
-	// TODO tune these values, each count = 0.12mA with LED range set to 31mA
+	// Start with the LEDs off (green = LED1, ir = LED2, red = LED3), the application sets the pulse amplitudes with
+	// MAXM86161_ATTR_LED_PA and MAXM86161_ATTR_LED_RANGE, each count = 0.12mA with LED range set to 31mA
 	uint8_t led_pa[3] = {0, 0, 0};
 	err = i2c_burst_write_dt(i2c, MAXM86161_REG_LED1_PA, led_pa, 3);
 	if (err)
@@ -63,9 +270,20 @@ int ppg_sensor_start(const struct i2c_dt_spec *i2c)
 		LOG_ERR("Failed to set LED pulse amplitude");
 	}
 
+	// Registers tuned by the application over the defaults above, before anything is sampled
+	err = maxm86161_write_start_regs(dev);
+	if (err)
+	{
+		LOG_ERR("Failed to write start registers");
+	}
+
+	// Interrupt once a frame is in the FIFO, for the sequence the start registers may have changed
+	err = maxm86161_update_threshold(dev);
+
 	// Reset the interrupt status registers by simply reading them
 	uint8_t dummy[2];
 	err = i2c_burst_read_dt(i2c, MAXM86161_REG_INT_STAT_1, dummy, 2);
+	atomic_clear(&data->int_pending);
 
 	// Flush the FIFO and configure the interrupt to be cleared when FIFO_DATA register is read
 	uint8_t fifo_config2 = 0b00011010;
@@ -75,8 +293,16 @@ int ppg_sensor_start(const struct i2c_dt_spec *i2c)
 		LOG_ERR("Failed to flush FIFO");
 	}
 
+	// Listen to the interrupt pin before the sensor can raise it
+	err = gpio_pin_interrupt_configure_dt(&config->int_gpio, GPIO_INT_EDGE_TO_ACTIVE);
+	if (err)
+	{
+		LOG_ERR("Failed to enable interrupt pin");
+		return err;
+	}
+
 	// Enable the FIFO interrupt
-	uint8_t int_en_1 = 0b10000000;
+	uint8_t int_en_1 = MAXM86161_INT_A_FULL;
 	err = i2c_burst_write_dt(i2c, MAXM86161_REG_INT_EN_1, &int_en_1, 1);
 	if (err)
 	{
@@ -94,10 +320,15 @@ int ppg_sensor_start(const struct i2c_dt_spec *i2c)
 	return 0;
 }
 
-int ppg_sensor_stop(const struct i2c_dt_spec *i2c)
+int ppg_sensor_stop(const struct device *dev)
 {
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	const struct i2c_dt_spec *i2c = &config->i2c;
 	int err = 0;
 
+	data->prox_armed = false;
+
 	// Disable the FIFO interrupt
 	uint8_t int_en_1 = 0;
 	err = i2c_burst_write_dt(i2c, MAXM86161_REG_INT_EN_1, &int_en_1, 1);
@@ -122,63 +353,167 @@ int ppg_sensor_stop(const struct i2c_dt_spec *i2c)
 		LOG_ERR("Failed to disable PPG sensor");
 	}
 
+	// A pending streaming request stays queued and is served again after the next start
+	err = gpio_pin_interrupt_configure_dt(&config->int_gpio, GPIO_INT_DISABLE);
+	if (err)
+	{
+		LOG_ERR("Failed to disable interrupt pin");
+	}
+
 	return 0;
 }
 
-int ppg_sensor_get_data(const struct i2c_dt_spec *i2c, struct ppg_sample *ppg_data, uint8_t *sample_count)
+int ppg_sensor_standby(const struct device *dev)
 {
-	int err;
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	const struct i2c_dt_spec *i2c = &config->i2c;
+	int err = 0;
 
-	// Check for overflow
-	uint8_t fifo_overflow;
-	err = i2c_burst_read_dt(i2c, MAXM86161_REG_FIFO_OVF_CNT, &fifo_overflow, 1);
+	// Nobody drains the FIFO in standby, so keep the interrupt off
+	data->prox_armed = false;
+	err = gpio_pin_interrupt_configure_dt(&config->int_gpio, GPIO_INT_DISABLE);
 	if (err)
 	{
-		LOG_ERR("Failed to read FIFO overflow count");
+		LOG_ERR("Failed to disable interrupt pin");
 	}
 
-	// Check for data count
-	uint8_t fifo_data_count;
-	err = i2c_burst_read_dt(i2c, MAXM86161_REG_FIFO_DATA_CNT, &fifo_data_count, 1);
+	uint8_t int_en_1 = 0;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_INT_EN_1, &int_en_1, 1);
 	if (err)
 	{
-		LOG_ERR("Failed to read FIFO data count");
+		LOG_ERR("Failed to disable FIFO interrupt");
 	}
-	else
+
+	// Only pulse the green LED (LED1)
+	uint8_t led_seq_reg[3] = {0x01, 0x00, 0x00};
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_LED_SEQ_REG1, led_seq_reg, 3);
+	if (err)
 	{
-		LOG_DBG("FIFO data count: %d", fifo_data_count);
+		LOG_ERR("Failed to set LED sequence");
+	}
+	maxm86161_set_led_seq(data, led_seq_reg);
 
-		if (fifo_data_count > CONFIG_PPG_SAMPLES_PER_FRAME * COLORS)
-		{
-			LOG_WRN("FIFO overflow detected, discarding data (samples = %d)", fifo_data_count);
-			fifo_data_count = CONFIG_PPG_SAMPLES_PER_FRAME * COLORS;
-		}
+	// Set the sample rate to 25Hz without averaging, the lowest rate with a single pulse per sample
+	uint8_t ppg_config2 = 0b00000000;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_PPG_CONFIG2, &ppg_config2, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to set PPG config 2");
+	}
+	maxm86161_update_period(data, ppg_config2);
+
+	// The FIFO rolls over, the next start flushes it
+	uint8_t system_control = 0b00001100;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_SYSTEM_CONTROL, &system_control, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to enable PPG sensor");
+	}
+
+	return 0;
+}
+
+int ppg_sensor_proximity(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	const struct i2c_dt_spec *i2c = &config->i2c;
+	int err = 0;
+
+	if (data->prox_handler == NULL)
+	{
+		LOG_ERR("No proximity trigger set");
+		return -EINVAL;
+	}
+
+	// Start from shutdown, the sensor enters proximity mode when it is enabled with PROX_INT_EN set
+	uint8_t system_control = 0b00000010;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_SYSTEM_CONTROL, &system_control, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to shut down PPG sensor");
+	}
+
+	// The sequence and amplitudes are used after the sensor switched to normal mode, until the application restarts it
+	uint8_t led_seq_reg[3] = {0x23, 0x01, 0x00};
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_LED_SEQ_REG1, led_seq_reg, 3);
+	if (err)
+	{
+		LOG_ERR("Failed to set LED sequence");
+	}
+	maxm86161_set_led_seq(data, led_seq_reg);
+
+	uint8_t led_pa[3] = {0, 0, 0};
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_LED1_PA, led_pa, 3);
+	if (err)
+	{
+		LOG_ERR("Failed to turn off LEDs");
+	}
+
+	// Same LED range, ADC range and pulse width as when streaming, the threshold is in ADC counts
+	uint8_t led_range[2] = {0x0, 0x0};
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_LED_RANGE1, led_range, 2);
+	if (err)
+	{
+		LOG_ERR("Failed to set LED range");
+	}
+
+	uint8_t ppg_config1 = 0b00010111;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_PPG_CONFIG1, &ppg_config1, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to set PPG config 1");
+	}
+
+	// Check for skin contact at 8Hz without averaging
+	uint8_t ppg_config2 = 0b01010000;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_PPG_CONFIG2, &ppg_config2, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to set PPG config 2");
+	}
+	maxm86161_update_period(data, ppg_config2);
+
+	err = maxm86161_flush_fifo(dev);
+
+	// Reset the interrupt status registers by simply reading them
+	uint8_t dummy[2];
+	err = i2c_burst_read_dt(i2c, MAXM86161_REG_INT_STAT_1, dummy, 2);
+	atomic_clear(&data->int_pending);
+
+	data->prox_armed = true;
+	err = gpio_pin_interrupt_configure_dt(&config->int_gpio, GPIO_INT_EDGE_TO_ACTIVE);
+	if (err)
+	{
+		LOG_ERR("Failed to enable interrupt pin");
+		data->prox_armed = false;
+		return err;
 	}
 
-	// Read the FIFO data
-	uint8_t fifo_data[fifo_data_count * 3]; // 3 bytes per sample
-	err = i2c_burst_read_dt(i2c, MAXM86161_REG_FIFO_DATA, fifo_data, fifo_data_count * 3);
+	// Only the proximity interrupt, the FIFO is not drained in proximity mode
+	uint8_t int_en_1 = MAXM86161_INT_PROX;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_INT_EN_1, &int_en_1, 1);
 	if (err)
 	{
-		LOG_ERR("Failed to read FIFO data");
+		LOG_ERR("Failed to enable proximity interrupt");
 	}
 
-	*sample_count = fifo_data_count / COLORS;
-	// Parse the data
-	for (int i = 0; i < *sample_count; i++)
+	system_control = 0b00001100;
+	err = i2c_burst_write_dt(i2c, MAXM86161_REG_SYSTEM_CONTROL, &system_control, 1);
+	if (err)
 	{
-		ppg_data[i].red = (((fifo_data[i * 6] << 16) | (fifo_data[i * 6 + 1] << 8) | fifo_data[i * 6 + 2]) & 0x7ffff);
-		ppg_data[i].ir = (((fifo_data[i * 6 + 3] << 16) | (fifo_data[i * 6 + 4] << 8) | fifo_data[i * 6 + 5]) & 0x7ffff);
-		ppg_data[i].green = (((fifo_data[i * 6 + 6] << 16) | (fifo_data[i * 6 + 7] << 8) | fifo_data[i * 6 + 8]) & 0x7ffff);
-		LOG_DBG("PPG data: red = %d, ir = %d, green = %d", ppg_data[i].red, ppg_data[i].ir, ppg_data[i].green);
+		LOG_ERR("Failed to enable PPG sensor");
 	}
 
 	return 0;
 }
 
-int ppg_sensor_read_reg(const struct i2c_dt_spec *i2c, uint8_t reg, uint8_t *data)
+int ppg_sensor_read_reg(const struct device *dev, uint8_t reg, uint8_t *data)
 {
-	int err = i2c_burst_read_dt(i2c, reg, data, 1);
+	const struct maxm86161_config *config = dev->config;
+
+	int err = i2c_burst_read_dt(&config->i2c, reg, data, 1);
 	if (err)
 	{
 		LOG_ERR("Failed to read register 0x%02x", reg);
@@ -187,13 +522,556 @@ int ppg_sensor_read_reg(const struct i2c_dt_spec *i2c, uint8_t reg, uint8_t *dat
 	return err;
 }
 
-int ppg_sensor_write_reg(const struct i2c_dt_spec *i2c, uint8_t reg, uint8_t data)
+int ppg_sensor_write_reg(const struct device *dev, uint8_t reg, uint8_t data)
 {
-	int err = i2c_burst_write_dt(i2c, reg, &data, 1);
+	const struct maxm86161_config *config = dev->config;
+
+	int err = i2c_burst_write_dt(&config->i2c, reg, &data, 1);
 	if (err)
 	{
 		LOG_ERR("Failed to write register 0x%02x", reg);
+		return err;
+	}
+
+	// Keep the tag table and the timestamps in sync when the sequencing is tuned over BLE
+	if (reg >= MAXM86161_REG_LED_SEQ_REG1 && reg <= MAXM86161_REG_LED_SEQ_REG3)
+	{
+		err = maxm86161_update_led_seq(dev);
+		if (!err)
+		{
+			err = maxm86161_update_threshold(dev);
+		}
+	}
+	else if (reg == MAXM86161_REG_PPG_CONFIG2)
+	{
+		maxm86161_update_period(dev->data, data);
 	}
 
 	return err;
-}
\ No newline at end of file
+}
+
+int ppg_sensor_set_start_regs(const struct device *dev, const struct maxm86161_reg_value *regs, uint8_t count)
+{
+	struct maxm86161_data *data = dev->data;
+
+	if (count > MAXM86161_MAX_START_REGS)
+	{
+		return -EINVAL;
+	}
+
+	for (uint8_t i = 1; i < count; i++)
+	{
+		if (regs[i].reg <= regs[i - 1].reg)
+		{
+			return -EINVAL;
+		}
+	}
+
+	memcpy(data->start_regs, regs, count * sizeof(regs[0]));
+	data->start_reg_count = count;
+
+	return 0;
+}
+
+// Update the 2-bit range of one LED in LED_RANGE1, LED1 in bits 1:0 up to LED3 in bits 5:4
+static int maxm86161_set_led_range(const struct device *dev, enum sensor_channel chan, const struct sensor_value *val)
+{
+	uint8_t shift;
+	uint8_t led_range;
+	int err;
+
+	switch (chan)
+	{
+	case SENSOR_CHAN_GREEN:
+		shift = 0;
+		break;
+	case SENSOR_CHAN_IR:
+		shift = 2;
+		break;
+	case SENSOR_CHAN_RED:
+		shift = 4;
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	if (val->val1 < 0 || val->val1 > 3)
+	{
+		return -EINVAL;
+	}
+
+	err = ppg_sensor_read_reg(dev, MAXM86161_REG_LED_RANGE1, &led_range);
+	if (err)
+	{
+		return err;
+	}
+
+	led_range = (led_range & ~(0x3 << shift)) | (val->val1 << shift);
+
+	return ppg_sensor_write_reg(dev, MAXM86161_REG_LED_RANGE1, led_range);
+}
+
+// Sample rate, averaging and frame size are only stored, ppg_sensor_start() programs them
+static int maxm86161_set_stream_attr(const struct device *dev, enum sensor_attribute attr,
+									 const struct sensor_value *val)
+{
+	struct maxm86161_data *data = dev->data;
+
+	switch ((int)attr)
+	{
+	case SENSOR_ATTR_SAMPLING_FREQUENCY:
+		for (size_t i = 0; i < ARRAY_SIZE(sample_rates); i++)
+		{
+			if (sample_rates[i].hz == val->val1)
+			{
+				data->ppg_config2 = (sample_rates[i].code << MAXM86161_PPG_SR_SHIFT) |
+									(data->ppg_config2 & MAXM86161_SMP_AVE_MASK);
+				return 0;
+			}
+		}
+		return -EINVAL;
+
+	case SENSOR_ATTR_OVERSAMPLING:
+		// 1 up to 128 samples averaged, in powers of two
+		if (val->val1 < 1 || val->val1 > 128 || !IS_POWER_OF_TWO(val->val1))
+		{
+			return -EINVAL;
+		}
+		data->ppg_config2 = (data->ppg_config2 & ~MAXM86161_SMP_AVE_MASK) | (find_lsb_set(val->val1) - 1);
+		return 0;
+
+	case MAXM86161_ATTR_FRAME_SAMPLES:
+		if (val->val1 < 1 || val->val1 > CONFIG_PPG_SAMPLES_PER_FRAME)
+		{
+			return -EINVAL;
+		}
+		data->frame_samples = val->val1;
+		return 0;
+
+	default:
+		return -ENOTSUP;
+	}
+}
+
+static int maxm86161_attr_set(const struct device *dev, enum sensor_channel chan, enum sensor_attribute attr,
+							  const struct sensor_value *val)
+{
+	uint8_t reg;
+
+	if (chan == SENSOR_CHAN_ALL)
+	{
+		return maxm86161_set_stream_attr(dev, attr, val);
+	}
+
+	if (chan == SENSOR_CHAN_PROX && attr == SENSOR_ATTR_UPPER_THRESH)
+	{
+		// Compared to the 8 most significant bits of the 19-bit proximity sample
+		if (val->val1 < 0 || val->val1 > UINT8_MAX)
+		{
+			return -EINVAL;
+		}
+
+		return ppg_sensor_write_reg(dev, MAXM86161_REG_PROX_INT_TH, val->val1);
+	}
+
+	if ((enum maxm86161_attribute)attr == MAXM86161_ATTR_LED_RANGE)
+	{
+		return maxm86161_set_led_range(dev, chan, val);
+	}
+
+	if ((enum maxm86161_attribute)attr != MAXM86161_ATTR_LED_PA)
+	{
+		return -ENOTSUP;
+	}
+
+	// Board wiring: green = LED1, IR = LED2, red = LED3, proximity uses LED1 at the pilot amplitude
+	switch (chan)
+	{
+	case SENSOR_CHAN_PROX:
+		reg = MAXM86161_REG_LED_PILOT_PA;
+		break;
+	case SENSOR_CHAN_GREEN:
+		reg = MAXM86161_REG_LED1_PA;
+		break;
+	case SENSOR_CHAN_IR:
+		reg = MAXM86161_REG_LED2_PA;
+		break;
+	case SENSOR_CHAN_RED:
+		reg = MAXM86161_REG_LED3_PA;
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	if (val->val1 < 0 || val->val1 > UINT8_MAX)
+	{
+		return -EINVAL;
+	}
+
+	return ppg_sensor_write_reg(dev, reg, val->val1);
+}
+
+static int maxm86161_trigger_set(const struct device *dev, const struct sensor_trigger *trig,
+								 sensor_trigger_handler_t handler)
+{
+	struct maxm86161_data *data = dev->data;
+
+	if (trig->type != SENSOR_TRIG_NEAR_FAR || trig->chan != SENSOR_CHAN_PROX)
+	{
+		return -ENOTSUP;
+	}
+
+	// Armed by ppg_sensor_proximity()
+	data->prox_armed = false;
+	data->prox_trigger = trig;
+	data->prox_handler = handler;
+
+	return 0;
+}
+
+/**
+ * @brief Completion callback, chained behind the FIFO burst read
+ *
+ * Runs in the completion context of the bus driver, which may be an ISR. Moves the partial sample of the previous
+ * buffer in front of the new words and holds back the words after the last complete sample, so every buffer can be
+ * decoded on its own.
+ */
+static void maxm86161_drain_done(struct rtio *r, const struct rtio_sqe *sqe, void *arg)
+{
+	const struct device *dev = arg;
+	struct maxm86161_data *data = dev->data;
+	struct rtio_iodev_sqe *iodev_sqe = data->drain_sqe;
+	struct maxm86161_encoded_data *edata = sqe->userdata;
+
+	data->drain_sqe = NULL;
+
+	edata->overflow_count = edata->raw[MAXM86161_CARRY_SIZE];
+	edata->data_count = edata->raw[MAXM86161_CARRY_SIZE + 1];
+
+	// Reads beyond the data count do not pop the FIFO, so only the counted words are valid
+	uint8_t read_count = MIN(edata->data_count, edata->word_count);
+
+	// The carried words overwrite the counters, which sit right in front of the new words
+	edata->word_offset = MAXM86161_CARRY_SIZE + 2 - data->carry_count * MAXM86161_FIFO_WORD_SIZE;
+	memcpy(&edata->raw[edata->word_offset], data->carry, data->carry_count * MAXM86161_FIFO_WORD_SIZE);
+	edata->word_count = data->carry_count + read_count;
+
+	// Everything after the last tag of the sequence belongs to the next sample
+	const uint8_t *words = &edata->raw[edata->word_offset];
+	uint8_t tail = 0;
+	while (tail < edata->word_count && tail + 1 < data->decoder.slot_count &&
+		   (words[(edata->word_count - 1 - tail) * MAXM86161_FIFO_WORD_SIZE] >> 3) != data->decoder.last_tag)
+	{
+		tail++;
+	}
+
+	edata->word_count -= tail;
+	memcpy(data->carry, &words[edata->word_count * MAXM86161_FIFO_WORD_SIZE], tail * MAXM86161_FIFO_WORD_SIZE);
+	data->carry_count = tail;
+
+	rtio_iodev_sqe_ok(iodev_sqe, 0);
+
+	// An interrupt that came in while this drain was in flight was left for it
+	if (atomic_get(&data->int_pending))
+	{
+		k_work_submit_to_queue(&sensor_drain_workq, &data->drain_work);
+	}
+}
+
+/**
+ * @brief Drop the FIFO contents after a drain that could not read them
+ *
+ * The interrupt pin stays asserted until the FIFO is read, so without a read no new edge ever comes. Flushing the FIFO
+ * and reading the status release the pin, the next frame raises the interrupt again. After a failed transfer it is
+ * also unknown which words were popped, the flush puts the decoder and the FIFO back in step.
+ */
+static void maxm86161_drain_abort(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	uint8_t int_stat[2];
+
+	data->carry_count = 0;
+	atomic_clear(&data->int_pending);
+
+	int err = maxm86161_flush_fifo(dev);
+	if (!err)
+	{
+		err = i2c_burst_read_dt(&config->i2c, MAXM86161_REG_INT_STAT_1, int_stat, sizeof(int_stat));
+	}
+
+	if (err)
+	{
+		LOG_ERR("Failed to release the FIFO interrupt");
+	}
+}
+
+/**
+ * @brief Release the completions of the internal RTIO context
+ *
+ * A failed transfer cancels the callback, so the failure completes the request here.
+ */
+static void maxm86161_drain_reap(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	struct rtio_cqe *cqe;
+	int result = 0;
+
+	while ((cqe = rtio_cqe_consume(config->rtio)) != NULL)
+	{
+		result = MIN(result, cqe->result);
+		rtio_cqe_release(config->rtio, cqe);
+	}
+
+	if (result < 0 && data->drain_sqe != NULL)
+	{
+		struct rtio_iodev_sqe *iodev_sqe = data->drain_sqe;
+
+		LOG_ERR("Failed to drain FIFO with error %d", result);
+		data->drain_sqe = NULL;
+		maxm86161_drain_abort(dev);
+		rtio_iodev_sqe_err(iodev_sqe, result);
+	}
+}
+
+/**
+ * @brief Read one frame from the FIFO into the buffer of a request
+ */
+static void maxm86161_drain(const struct device *dev, struct rtio_iodev_sqe *iodev_sqe, uint64_t timestamp,
+							bool fifo_watermark)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	const uint8_t reg = MAXM86161_REG_FIFO_OVF_CNT;
+
+	if (data->drain_sqe != NULL)
+	{
+		rtio_iodev_sqe_err(iodev_sqe, -EBUSY);
+		return;
+	}
+
+	// Read at most one frame, anything beyond stays in the FIFO for the next drain
+	uint8_t word_count = MIN(data->frame_samples * data->decoder.slot_count, MAXM86161_FIFO_DEPTH);
+	uint32_t buf_len_min = sizeof(struct maxm86161_encoded_data) + MAXM86161_CARRY_SIZE + 2 +
+						   word_count * MAXM86161_FIFO_WORD_SIZE;
+	uint8_t *buf;
+	uint32_t buf_len;
+
+	int err = rtio_sqe_rx_buf(iodev_sqe, buf_len_min, buf_len_min, &buf, &buf_len);
+	if (err)
+	{
+		LOG_ERR("Failed to get a buffer of %u bytes", buf_len_min);
+		if (fifo_watermark)
+		{
+			maxm86161_drain_abort(dev);
+		}
+		rtio_iodev_sqe_err(iodev_sqe, err);
+		return;
+	}
+
+	struct maxm86161_encoded_data *edata = (struct maxm86161_encoded_data *)buf;
+	edata->timestamp = timestamp;
+	edata->period_ns = data->period_ns;
+	memcpy(edata->led_seq, data->led_seq, sizeof(edata->led_seq));
+	edata->fifo_watermark = fifo_watermark;
+	edata->word_count = word_count;
+
+	struct rtio_sqe *write_sqe = rtio_sqe_acquire(config->rtio);
+	struct rtio_sqe *read_sqe = rtio_sqe_acquire(config->rtio);
+	struct rtio_sqe *cb_sqe = rtio_sqe_acquire(config->rtio);
+	if (write_sqe == NULL || read_sqe == NULL || cb_sqe == NULL)
+	{
+		rtio_sqe_drop_all(config->rtio);
+		if (fifo_watermark)
+		{
+			maxm86161_drain_abort(dev);
+		}
+		rtio_iodev_sqe_err(iodev_sqe, -ENOMEM);
+		return;
+	}
+
+	// Counters and FIFO words in one burst with a repeated start, the callback only runs when it succeeded
+	rtio_sqe_prep_tiny_write(write_sqe, config->iodev, RTIO_PRIO_NORM, &reg, 1, edata);
+	write_sqe->flags |= RTIO_SQE_TRANSACTION;
+	rtio_sqe_prep_read(read_sqe, config->iodev, RTIO_PRIO_NORM, &edata->raw[MAXM86161_CARRY_SIZE],
+					   2 + word_count * MAXM86161_FIFO_WORD_SIZE, edata);
+	read_sqe->iodev_flags |= RTIO_IODEV_I2C_STOP | RTIO_IODEV_I2C_RESTART;
+	read_sqe->flags |= RTIO_SQE_CHAINED;
+	rtio_sqe_prep_callback(cb_sqe, maxm86161_drain_done, (void *)dev, edata);
+
+	data->drain_sqe = iodev_sqe;
+	rtio_submit(config->rtio, 0);
+
+	// Without native RTIO support in the bus driver the transfer has already completed, pick up failures right away
+	maxm86161_drain_reap(dev);
+}
+
+/**
+ * @brief Serve an interrupt in proximity mode
+ *
+ * The sensor switches to normal mode by itself after the proximity interrupt, the FIFO is left alone until the
+ * application restarts the sensor.
+ */
+static void maxm86161_check_prox(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+	uint8_t int_stat_1;
+
+	int err = i2c_burst_read_dt(&config->i2c, MAXM86161_REG_INT_STAT_1, &int_stat_1, 1);
+	if (err)
+	{
+		LOG_ERR("Failed to read interrupt status");
+		return;
+	}
+
+	if (!(int_stat_1 & MAXM86161_INT_PROX))
+	{
+		return;
+	}
+
+	data->prox_armed = false;
+	LOG_DBG("Proximity detected");
+
+	if (data->prox_handler != NULL)
+	{
+		data->prox_handler(dev, data->prox_trigger);
+	}
+}
+
+static void maxm86161_drain_work_handler(struct k_work *work)
+{
+	struct maxm86161_data *data = CONTAINER_OF(work, struct maxm86161_data, drain_work);
+	const struct device *dev = data->dev;
+	struct rtio_iodev_sqe *iodev_sqe = data->stream_sqe;
+
+	// Completions of an earlier drain that failed asynchronously
+	maxm86161_drain_reap(dev);
+
+	if (data->prox_armed)
+	{
+		maxm86161_check_prox(dev);
+		return;
+	}
+
+	if (iodev_sqe == NULL || data->drain_sqe != NULL)
+	{
+		// Nobody is streaming or a drain is in flight, the interrupt stays pending until the next streaming request
+		// or the completion of that drain queues this work again
+		return;
+	}
+
+	// The request is resubmitted on completion, so it must be released first
+	atomic_clear(&data->int_pending);
+	data->stream_sqe = NULL;
+	maxm86161_drain(dev, iodev_sqe, data->irq_timestamp, true);
+}
+
+static void maxm86161_int_handler(const struct device *port, struct gpio_callback *cb, uint32_t pins)
+{
+	struct maxm86161_data *data = CONTAINER_OF(cb, struct maxm86161_data, int_cb);
+
+	data->irq_timestamp = k_ticks_to_ns_floor64(k_uptime_ticks());
+	atomic_set(&data->int_pending, 1);
+
+	// Queue the transfers outside of the ISR, the bus driver may not support submissions from an ISR
+	k_work_submit_to_queue(&sensor_drain_workq, &data->drain_work);
+}
+
+static void maxm86161_submit(const struct device *dev, struct rtio_iodev_sqe *iodev_sqe)
+{
+	const struct sensor_read_config *cfg = iodev_sqe->sqe.iodev->data;
+	struct maxm86161_data *data = dev->data;
+
+	if (!cfg->is_streaming)
+	{
+		// One-shot read of what the FIFO holds right now
+		maxm86161_drain(dev, iodev_sqe, k_ticks_to_ns_floor64(k_uptime_ticks()), false);
+		return;
+	}
+
+	for (size_t i = 0; i < cfg->count; i++)
+	{
+		if (cfg->triggers[i].trigger != SENSOR_TRIG_FIFO_WATERMARK)
+		{
+			LOG_ERR("Trigger %d not supported", cfg->triggers[i].trigger);
+			rtio_iodev_sqe_err(iodev_sqe, -ENOTSUP);
+			return;
+		}
+	}
+
+	// Served by the next FIFO interrupt, or right away by one that found no request
+	data->stream_sqe = iodev_sqe;
+	if (atomic_get(&data->int_pending))
+	{
+		k_work_submit_to_queue(&sensor_drain_workq, &data->drain_work);
+	}
+}
+
+static const struct sensor_driver_api maxm86161_api = {
+	.attr_set = maxm86161_attr_set,
+	.trigger_set = maxm86161_trigger_set,
+	.submit = maxm86161_submit,
+	.get_decoder = maxm86161_get_decoder,
+};
+
+static int maxm86161_init(const struct device *dev)
+{
+	const struct maxm86161_config *config = dev->config;
+	struct maxm86161_data *data = dev->data;
+
+	// The sensor is powered by the application through SENS_ENABLE, so only check the bus and pin here
+	if (!i2c_is_ready_dt(&config->i2c))
+	{
+		LOG_ERR("I2C bus %s not ready", config->i2c.bus->name);
+		return -ENODEV;
+	}
+
+	if (!gpio_is_ready_dt(&config->int_gpio))
+	{
+		LOG_ERR("Interrupt GPIO not ready");
+		return -ENODEV;
+	}
+
+	int err = gpio_pin_configure_dt(&config->int_gpio, GPIO_INPUT);
+	if (err)
+	{
+		LOG_ERR("Failed to configure interrupt pin");
+		return err;
+	}
+
+	data->dev = dev;
+	k_work_init(&data->drain_work, maxm86161_drain_work_handler);
+
+	// 50Hz without averaging
+	data->ppg_config2 = 0x01 << MAXM86161_PPG_SR_SHIFT;
+	data->frame_samples = CONFIG_PPG_SAMPLES_PER_FRAME;
+
+	gpio_init_callback(&data->int_cb, maxm86161_int_handler, BIT(config->int_gpio.pin));
+	err = gpio_add_callback(config->int_gpio.port, &data->int_cb);
+	if (err)
+	{
+		LOG_ERR("Failed to add interrupt callback");
+		return err;
+	}
+
+	return 0;
+}
+
+#define MAXM86161_DEFINE(inst)                                                \
+	I2C_DT_IODEV_DEFINE(maxm86161_iodev_##inst, DT_DRV_INST(inst));          \
+	RTIO_DEFINE(maxm86161_rtio_##inst, 4, 8);                                \
+	static struct maxm86161_data maxm86161_data_##inst;                      \
+	static const struct maxm86161_config maxm86161_config_##inst = {        \
+		.i2c = I2C_DT_SPEC_INST_GET(inst),                                  \
+		.int_gpio = GPIO_DT_SPEC_INST_GET(inst, int_gpios),                 \
+		.iodev = &maxm86161_iodev_##inst,                                   \
+		.rtio = &maxm86161_rtio_##inst,                                     \
+	};                                                                      \
+	SENSOR_DEVICE_DT_INST_DEFINE(inst, maxm86161_init, NULL,                \
+				     &maxm86161_data_##inst, &maxm86161_config_##inst,          \
+				     POST_KERNEL, CONFIG_SENSOR_INIT_PRIORITY,                  \
+				     &maxm86161_api);
+
+DT_INST_FOREACH_STATUS_OKAY(MAXM86161_DEFINE)
@@ -0,0 +1,318 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#define DT_DRV_COMPAT adi_maxm86161
+
+#include <string.h>
+
+#include <zephyr/drivers/sensor.h>
+#include <app/drivers/maxm86161.h>
+
+// Index of every channel in the decoder row, matches the field order of struct ppg_sample
+#define FIELD_RED 0
+#define FIELD_IR 1
+#define FIELD_GREEN 2
+#define FIELD_SCRATCH 3
+
+// Tags are 5 bits wide, so this never matches a FIFO word
+#define NO_TAG 0xff
+
+/**
+ * @brief Map an LEDC code to the PPG channel it produces
+ *
+ * Board wiring: green = LED1, IR = LED2, red = LED3. Combined, pilot, ambient and external LED exposures are not
+ * streamed and end up in the scratch entry.
+ */
+static uint8_t maxm86161_ledc_field(uint8_t ledc)
+{
+	switch (ledc)
+	{
+	case MAXM86161_LEDC_LED1:
+		return FIELD_GREEN;
+	case MAXM86161_LEDC_LED2:
+		return FIELD_IR;
+	case MAXM86161_LEDC_LED3:
+		return FIELD_RED;
+	default:
+		return FIELD_SCRATCH;
+	}
+}
+
+void maxm86161_decoder_init(struct maxm86161_decoder *decoder, const uint8_t led_seq[3])
+{
+	memset(decoder, 0, sizeof(*decoder));
+	memset(decoder->tag_field, FIELD_SCRATCH, sizeof(decoder->tag_field));
+	decoder->last_tag = NO_TAG;
+
+	for (uint8_t slot = 0; slot < 6; slot++)
+	{
+		uint8_t ledc = (slot & 1) ? (led_seq[slot / 2] >> 4) : (led_seq[slot / 2] & 0x0f);
+
+		if (ledc == MAXM86161_LEDC_NONE)
+		{
+			// The sequence ends at the first empty slot
+			break;
+		}
+
+		uint8_t tag = MAXM86161_TAG_LEDC1 + slot;
+		uint8_t field = maxm86161_ledc_field(ledc);
+
+		decoder->tag_field[tag] = field;
+		if (field != FIELD_SCRATCH)
+		{
+			decoder->tag_mask[tag] = BIT(field);
+			decoder->full_mask |= BIT(field);
+		}
+
+		decoder->last_tag = tag;
+		decoder->slot_count++;
+	}
+}
+
+static inline uint8_t maxm86161_decode_word(struct maxm86161_decoder *decoder, const uint8_t *word)
+{
+	uint8_t tag = word[0] >> 3;
+
+	// Every word is stored, words that carry no streamed channel land in the scratch entry
+	decoder->row[decoder->tag_field[tag]] = ((uint32_t)(word[0] & 0x07) << 16) | ((uint32_t)word[1] << 8) | word[2];
+	decoder->row_mask |= decoder->tag_mask[tag];
+	decoder->invalid_count += (tag == MAXM86161_TAG_INVALID);
+
+	return tag;
+}
+
+static inline void maxm86161_decode_complete(struct maxm86161_decoder *decoder, struct ppg_sample *ppg_data,
+											 uint8_t max_samples, uint8_t *sample_count)
+{
+	// A sample is only valid when every channel was seen since the previous one
+	if (decoder->full_mask && decoder->row_mask == decoder->full_mask && *sample_count < max_samples)
+	{
+		ppg_data[*sample_count].red = decoder->row[FIELD_RED];
+		ppg_data[*sample_count].ir = decoder->row[FIELD_IR];
+		ppg_data[*sample_count].green = decoder->row[FIELD_GREEN];
+		(*sample_count)++;
+	}
+	else
+	{
+		decoder->dropped_count++;
+	}
+
+	decoder->row_mask = 0;
+}
+
+uint8_t maxm86161_decode(struct maxm86161_decoder *decoder, const uint8_t *fifo, size_t word_count,
+						 struct ppg_sample *ppg_data, uint8_t max_samples)
+{
+	const uint8_t last_tag = decoder->last_tag;
+	uint8_t sample_count = 0;
+	size_t i = 0;
+
+	// Four words per iteration, the only branch per word is the rarely taken end-of-sample check
+	for (; i + 4 <= word_count; i += 4, fifo += 4 * MAXM86161_FIFO_WORD_SIZE)
+	{
+		if (maxm86161_decode_word(decoder, &fifo[0]) == last_tag)
+		{
+			maxm86161_decode_complete(decoder, ppg_data, max_samples, &sample_count);
+		}
+		if (maxm86161_decode_word(decoder, &fifo[3]) == last_tag)
+		{
+			maxm86161_decode_complete(decoder, ppg_data, max_samples, &sample_count);
+		}
+		if (maxm86161_decode_word(decoder, &fifo[6]) == last_tag)
+		{
+			maxm86161_decode_complete(decoder, ppg_data, max_samples, &sample_count);
+		}
+		if (maxm86161_decode_word(decoder, &fifo[9]) == last_tag)
+		{
+			maxm86161_decode_complete(decoder, ppg_data, max_samples, &sample_count);
+		}
+	}
+
+	for (; i < word_count; i++, fifo += MAXM86161_FIFO_WORD_SIZE)
+	{
+		if (maxm86161_decode_word(decoder, fifo) == last_tag)
+		{
+			maxm86161_decode_complete(decoder, ppg_data, max_samples, &sample_count);
+		}
+	}
+
+	return sample_count;
+}
+
+uint8_t maxm86161_decode_encoded(const uint8_t *buf, struct ppg_sample *ppg_data, uint8_t max_samples)
+{
+	const struct maxm86161_encoded_data *edata = (const struct maxm86161_encoded_data *)buf;
+	struct maxm86161_decoder decoder;
+
+	// Buffers only hold whole samples, so every buffer decodes on its own
+	maxm86161_decoder_init(&decoder, edata->led_seq);
+
+	return maxm86161_decode(&decoder, &edata->raw[edata->word_offset], edata->word_count, ppg_data, max_samples);
+}
+
+static int maxm86161_chan_field(enum sensor_channel chan)
+{
+	switch (chan)
+	{
+	case SENSOR_CHAN_RED:
+		return FIELD_RED;
+	case SENSOR_CHAN_IR:
+		return FIELD_IR;
+	case SENSOR_CHAN_GREEN:
+		return FIELD_GREEN;
+	default:
+		return -ENOTSUP;
+	}
+}
+
+/**
+ * @brief Walk the complete samples of an encoded buffer
+ *
+ * @param[in] edata Encoded buffer
+ * @param[in] field Field to extract, or FIELD_SCRATCH to only count samples
+ * @param[in] first Index of the first sample to extract
+ * @param[in] max_count Maximum number of samples to extract
+ * @param[out] values Extracted values, may be NULL when max_count is 0
+ * @return uint16_t Number of complete samples up to the last one extracted, or in total when max_count is 0
+ */
+static uint16_t maxm86161_walk(const struct maxm86161_encoded_data *edata, uint8_t field, uint32_t first,
+							   uint16_t max_count, uint32_t *values)
+{
+	struct maxm86161_decoder decoder;
+	const uint8_t *word = &edata->raw[edata->word_offset];
+	uint16_t sample = 0;
+	uint16_t count = 0;
+
+	maxm86161_decoder_init(&decoder, edata->led_seq);
+
+	for (uint8_t i = 0; i < edata->word_count; i++, word += MAXM86161_FIFO_WORD_SIZE)
+	{
+		if (maxm86161_decode_word(&decoder, word) != decoder.last_tag)
+		{
+			continue;
+		}
+
+		if (decoder.full_mask && decoder.row_mask == decoder.full_mask)
+		{
+			if (sample >= first && count < max_count)
+			{
+				values[count++] = decoder.row[field];
+			}
+			sample++;
+
+			if (max_count && count == max_count)
+			{
+				break;
+			}
+		}
+
+		decoder.row_mask = 0;
+	}
+
+	return sample;
+}
+
+static int maxm86161_decoder_get_frame_count(const uint8_t *buffer, struct sensor_chan_spec chan_spec,
+											 uint16_t *frame_count)
+{
+	const struct maxm86161_encoded_data *edata = (const struct maxm86161_encoded_data *)buffer;
+	struct maxm86161_decoder decoder;
+
+	int field = maxm86161_chan_field(chan_spec.chan_type);
+	if (field < 0 || chan_spec.chan_idx != 0)
+	{
+		return -ENOTSUP;
+	}
+
+	maxm86161_decoder_init(&decoder, edata->led_seq);
+	if (!(decoder.full_mask & BIT(field)))
+	{
+		// The LED is not in the sequence
+		return -ENODATA;
+	}
+
+	*frame_count = maxm86161_walk(edata, FIELD_SCRATCH, 0, 0, NULL);
+
+	return 0;
+}
+
+static int maxm86161_decoder_get_size_info(struct sensor_chan_spec chan_spec, size_t *base_size, size_t *frame_size)
+{
+	if (maxm86161_chan_field(chan_spec.chan_type) < 0)
+	{
+		return -ENOTSUP;
+	}
+
+	*base_size = sizeof(struct sensor_q31_data);
+	*frame_size = sizeof(struct sensor_q31_sample_data);
+
+	return 0;
+}
+
+static int maxm86161_decoder_decode(const uint8_t *buffer, struct sensor_chan_spec chan_spec, uint32_t *fit,
+									uint16_t max_count, void *data_out)
+{
+	const struct maxm86161_encoded_data *edata = (const struct maxm86161_encoded_data *)buffer;
+	struct sensor_q31_data *out = data_out;
+	uint32_t values[16];
+	uint16_t decoded = 0;
+
+	int field = maxm86161_chan_field(chan_spec.chan_type);
+	if (field < 0 || chan_spec.chan_idx != 0)
+	{
+		return -ENOTSUP;
+	}
+
+	out->header.base_timestamp_ns = edata->timestamp;
+	out->header.reading_count = 0;
+	// 19-bit ADC counts
+	out->shift = 19;
+
+	// Decode in chunks to keep the stack small, the walk restarts at the buffer head for every chunk
+	while (decoded < max_count)
+	{
+		uint16_t chunk = MIN(max_count - decoded, ARRAY_SIZE(values));
+		uint16_t end = maxm86161_walk(edata, field, *fit, chunk, values);
+		uint16_t count = (end > *fit) ? end - *fit : 0;
+
+		for (uint16_t i = 0; i < count; i++)
+		{
+			out->readings[decoded + i].timestamp_delta = (*fit + i) * edata->period_ns;
+			out->readings[decoded + i].value = (q31_t)(values[i] << (31 - 19));
+		}
+
+		decoded += count;
+		*fit += count;
+		out->header.reading_count = decoded;
+
+		if (count < chunk)
+		{
+			break;
+		}
+	}
+
+	return decoded;
+}
+
+static bool maxm86161_decoder_has_trigger(const uint8_t *buffer, enum sensor_trigger_type trigger)
+{
+	const struct maxm86161_encoded_data *edata = (const struct maxm86161_encoded_data *)buffer;
+
+	return trigger == SENSOR_TRIG_FIFO_WATERMARK && edata->fifo_watermark;
+}
+
+SENSOR_DECODER_API_DT_DEFINE() = {
+	.get_frame_count = maxm86161_decoder_get_frame_count,
+	.get_size_info = maxm86161_decoder_get_size_info,
+	.decode = maxm86161_decoder_decode,
+	.has_trigger = maxm86161_decoder_has_trigger,
+};
+
+int maxm86161_get_decoder(const struct device *dev, const struct sensor_decoder_api **decoder)
+{
+	ARG_UNUSED(dev);
+	*decoder = &SENSOR_DECODER_NAME();
+
+	return 0;
+}
@@ -0,0 +1,501 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#define DT_DRV_COMPAT adi_maxm86161
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/i2c_emul.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/util.h>
+
+#include <app/drivers/maxm86161.h>
+#include <app/drivers/maxm86161_emul.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(maxm86161_emul, CONFIG_MAXM86161_LOG_LEVEL);
+
+#define MAXM86161_EMUL_REG_COUNT 0x100
+#define MAXM86161_EMUL_FIFO_DEPTH 128
+#define MAXM86161_EMUL_LED_SLOTS 6
+
+#define MAXM86161_EMUL_PART_ID 0x36
+#define MAXM86161_EMUL_DATA_MASK 0x7ffff
+#define MAXM86161_EMUL_TAG_INVALID 0x1e
+
+// INT_STAT_1 / INT_EN_1 bits
+#define MAXM86161_EMUL_INT_A_FULL BIT(7)
+#define MAXM86161_EMUL_INT_DATA_RDY BIT(6)
+#define MAXM86161_EMUL_INT_PROX BIT(4)
+#define MAXM86161_EMUL_INT_PWR_RDY BIT(0)
+
+// FIFO_CONFIG2 bits
+#define MAXM86161_EMUL_FLUSH_FIFO BIT(4)
+#define MAXM86161_EMUL_FIFO_STAT_CLR BIT(3)
+#define MAXM86161_EMUL_A_FULL_TYPE BIT(2)
+#define MAXM86161_EMUL_FIFO_RO BIT(1)
+
+// SYSTEM_CONTROL bits
+#define MAXM86161_EMUL_SHDN BIT(1)
+#define MAXM86161_EMUL_RESET BIT(0)
+
+// LEDCx sequence codes
+#define MAXM86161_EMUL_LEDC_NONE 0x0
+#define MAXM86161_EMUL_LEDC_PILOT_LED1 0x8
+#define MAXM86161_EMUL_LEDC_AMBIENT 0x9
+
+// Photodiode current per PA count for LED1 (green), LED2 (IR) and LED3 (red) on skin, in nA
+static const uint16_t led_coupling_na[3] = {20, 40, 25};
+
+// Pulsatile depth per LED as a shift of the pulse waveform, about 1.5 % for green and IR. Red is absorbed half as much
+// by the arterial blood, a red/IR ratio of 0.5 is an SpO2 of about 99 %.
+static const uint8_t led_pulse_shift[3] = {22, 22, 23};
+
+// Ambient light seen by the photodiode, in nA
+#define MAXM86161_EMUL_AMBIENT_NA 40
+
+// Sample period in us for each PPG_SR code, without averaging
+static const uint32_t sample_period_us[] = {
+	40008, 19989, 11902, 10010, 5005, 2502, // 1 pulse per sample
+	40008, 19989, 11902, 10010,				// 2 pulses per sample
+	125000, 62500, 31250, 15625, 7813, 3906, 1953, 977, 488, 244,
+};
+
+struct maxm86161_emul_cfg
+{
+	struct gpio_dt_spec int_gpio;
+};
+
+struct maxm86161_emul_data
+{
+	const struct maxm86161_emul_cfg *cfg;
+	struct k_spinlock lock;
+	struct k_timer sample_timer;
+
+	uint8_t reg[MAXM86161_EMUL_REG_COUNT];
+
+	// FIFO storage, one 24-bit word per entry
+	uint32_t fifo[MAXM86161_EMUL_FIFO_DEPTH];
+	uint8_t fifo_rd;
+	uint8_t fifo_count;
+	uint8_t fifo_ovf;
+	// Byte position within the FIFO word currently being read
+	uint8_t fifo_byte;
+
+	// Set while the sensor checks for proximity instead of running the LED sequence
+	bool prox_mode;
+
+	// Synthetic signal state
+	bool skin_contact;
+	uint16_t heart_rate_bpm;
+	uint32_t pulse_phase;
+	uint32_t noise_state;
+};
+
+static void maxm86161_emul_reset(struct maxm86161_emul_data *data)
+{
+	memset(data->reg, 0, sizeof(data->reg));
+	data->reg[MAXM86161_REG_INT_STAT_1] = MAXM86161_EMUL_INT_PWR_RDY;
+	data->reg[MAXM86161_REG_SYSTEM_CONTROL] = MAXM86161_EMUL_SHDN;
+	data->reg[MAXM86161_REG_PART_ID] = MAXM86161_EMUL_PART_ID;
+
+	data->fifo_rd = 0;
+	data->fifo_count = 0;
+	data->fifo_ovf = 0;
+	data->fifo_byte = 0;
+	data->prox_mode = false;
+}
+
+static uint32_t maxm86161_emul_period_us(const struct maxm86161_emul_data *data)
+{
+	uint8_t ppg_config2 = data->reg[MAXM86161_REG_PPG_CONFIG2];
+	uint8_t rate = ppg_config2 >> 3;
+	uint8_t average = ppg_config2 & 0x07;
+
+	if (rate >= ARRAY_SIZE(sample_period_us))
+	{
+		rate = 0;
+	}
+
+	return sample_period_us[rate] << average;
+}
+
+static bool maxm86161_emul_int_asserted(const struct maxm86161_emul_data *data)
+{
+	return (data->reg[MAXM86161_REG_INT_STAT_1] & data->reg[MAXM86161_REG_INT_EN_1]) ||
+		   (data->reg[MAXM86161_REG_INT_STAT_2] & data->reg[MAXM86161_REG_INT_EN_2]);
+}
+
+static void maxm86161_emul_update_int(const struct maxm86161_emul_data *data, bool asserted)
+{
+	const struct gpio_dt_spec *int_gpio = &data->cfg->int_gpio;
+
+	if (int_gpio->port == NULL)
+	{
+		return;
+	}
+
+	// The INT pin is open drain and active low
+	(void)gpio_emul_input_set(int_gpio->port, int_gpio->pin, asserted ? 0 : 1);
+}
+
+static uint32_t maxm86161_emul_noise(struct maxm86161_emul_data *data)
+{
+	data->noise_state = data->noise_state * 1664525u + 1013904223u;
+	return data->noise_state >> 24;
+}
+
+/**
+ * @brief Generate the ADC count for one LED exposure
+ *
+ * A steep systolic upstroke followed by a slow diastolic decay gives a waveform that is close enough to a real PPG
+ * pulse to exercise the data path.
+ */
+static uint32_t maxm86161_emul_exposure(struct maxm86161_emul_data *data, uint8_t ledc)
+{
+	uint32_t current_na = MAXM86161_EMUL_AMBIENT_NA;
+
+	// Direct ambient and the external LED4..LED6 exposures only see ambient light
+	if (ledc < MAXM86161_EMUL_LEDC_AMBIENT && data->skin_contact)
+	{
+		// LEDC codes 1-7 are combinations of LED1..LED3, the pilot exposure uses LED1 at the pilot amplitude
+		static const uint8_t ledc_mask[9] = {0x0, 0x1, 0x2, 0x4, 0x3, 0x5, 0x6, 0x7, 0x1};
+		uint8_t mask = ledc_mask[ledc];
+		uint16_t led_range = data->reg[MAXM86161_REG_LED_RANGE1];
+
+		// Blood volume pulse, the extra blood in systole absorbs light
+		uint32_t phase = data->pulse_phase >> 16;
+		uint32_t pulse = (phase < 0x4000) ? (phase * 4) : (0xffff - ((phase - 0x4000) * 4) / 3);
+
+		for (int led = 0; led < 3; led++)
+		{
+			if (!(mask & BIT(led)))
+			{
+				continue;
+			}
+
+			uint8_t pa = (ledc == MAXM86161_EMUL_LEDC_PILOT_LED1) ? data->reg[MAXM86161_REG_LED_PILOT_PA]
+																   : data->reg[MAXM86161_REG_LED1_PA + led];
+			uint8_t range = (led_range >> (2 * led)) & 0x3;
+			uint32_t led_na = pa * (range + 1) * led_coupling_na[led];
+
+			current_na += led_na - ((led_na * pulse) >> led_pulse_shift[led]);
+		}
+	}
+
+	// Convert the photodiode current into counts for the configured ADC full scale
+	uint8_t adc_range = (data->reg[MAXM86161_REG_PPG_CONFIG1] >> 2) & 0x3;
+	uint64_t counts = ((uint64_t)current_na << 19) / (4096u << adc_range);
+	counts += maxm86161_emul_noise(data) & 0x1f;
+
+	return MIN(counts, MAXM86161_EMUL_DATA_MASK);
+}
+
+static void maxm86161_emul_fifo_push(struct maxm86161_emul_data *data, uint32_t word)
+{
+	if (data->fifo_count == MAXM86161_EMUL_FIFO_DEPTH)
+	{
+		if (data->fifo_ovf < 0x7f)
+		{
+			data->fifo_ovf++;
+		}
+
+		if (!(data->reg[MAXM86161_REG_FIFO_CONFIG2] & MAXM86161_EMUL_FIFO_RO))
+		{
+			// Without rollover new samples are lost
+			return;
+		}
+
+		// Rollover drops the oldest sample
+		data->fifo_rd = (data->fifo_rd + 1) % MAXM86161_EMUL_FIFO_DEPTH;
+		data->fifo_count--;
+		data->fifo_byte = 0;
+	}
+
+	data->fifo[(data->fifo_rd + data->fifo_count) % MAXM86161_EMUL_FIFO_DEPTH] = word;
+	data->fifo_count++;
+}
+
+static void maxm86161_emul_sample(struct k_timer *timer)
+{
+	struct maxm86161_emul_data *data = CONTAINER_OF(timer, struct maxm86161_emul_data, sample_timer);
+	k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+	uint8_t a_full_level = MAXM86161_EMUL_FIFO_DEPTH - (data->reg[MAXM86161_REG_FIFO_CONFIG1] & 0x7f);
+	bool was_above = data->fifo_count >= a_full_level;
+
+	bool prox_mode = data->prox_mode;
+
+	if (prox_mode)
+	{
+		// A single pilot exposure of LED1, the sensor switches to normal mode once it exceeds the threshold
+		uint32_t value = maxm86161_emul_exposure(data, MAXM86161_EMUL_LEDC_PILOT_LED1);
+		maxm86161_emul_fifo_push(data, ((uint32_t)MAXM86161_TAG_PROX << 19) | value);
+
+		if ((value >> 11) > data->reg[MAXM86161_REG_PROX_INT_TH])
+		{
+			data->reg[MAXM86161_REG_INT_STAT_1] |= MAXM86161_EMUL_INT_PROX;
+			data->prox_mode = false;
+		}
+	}
+
+	// Push one word per enabled LED sequence slot, tagged with the slot number
+	for (int slot = 0; !prox_mode && slot < MAXM86161_EMUL_LED_SLOTS; slot++)
+	{
+		uint8_t seq = data->reg[MAXM86161_REG_LED_SEQ_REG1 + slot / 2];
+		uint8_t ledc = (slot & 1) ? (seq >> 4) : (seq & 0x0f);
+
+		if (ledc == MAXM86161_EMUL_LEDC_NONE)
+		{
+			// The sequence stops at the first empty slot
+			break;
+		}
+
+		uint32_t value = maxm86161_emul_exposure(data, ledc);
+		maxm86161_emul_fifo_push(data, ((uint32_t)(slot + 1) << 19) | value);
+	}
+
+	data->reg[MAXM86161_REG_INT_STAT_1] |= MAXM86161_EMUL_INT_DATA_RDY;
+
+	bool is_above = data->fifo_count >= a_full_level;
+	bool a_full_type = data->reg[MAXM86161_REG_FIFO_CONFIG2] & MAXM86161_EMUL_A_FULL_TYPE;
+	if (is_above && (!was_above || a_full_type))
+	{
+		data->reg[MAXM86161_REG_INT_STAT_1] |= MAXM86161_EMUL_INT_A_FULL;
+	}
+
+	// Advance the pulse waveform by one sample period
+	data->pulse_phase += (uint32_t)(((uint64_t)data->heart_rate_bpm * maxm86161_emul_period_us(data) << 32) /
+									60000000u);
+
+	bool asserted = maxm86161_emul_int_asserted(data);
+	k_spin_unlock(&data->lock, key);
+
+	maxm86161_emul_update_int(data, asserted);
+}
+
+static void maxm86161_emul_update_clock(struct maxm86161_emul_data *data)
+{
+	if (data->reg[MAXM86161_REG_SYSTEM_CONTROL] & MAXM86161_EMUL_SHDN)
+	{
+		k_timer_stop(&data->sample_timer);
+		return;
+	}
+
+	k_timeout_t period = K_USEC(maxm86161_emul_period_us(data));
+	k_timer_start(&data->sample_timer, period, period);
+}
+
+static uint8_t maxm86161_emul_reg_read(struct maxm86161_emul_data *data, uint8_t reg)
+{
+	uint8_t value;
+
+	switch (reg)
+	{
+	case MAXM86161_REG_INT_STAT_1:
+	case MAXM86161_REG_INT_STAT_2:
+		// Status registers are cleared on read
+		value = data->reg[reg];
+		data->reg[reg] = 0;
+		return value;
+
+	case MAXM86161_REG_FIFO_W_PTR:
+		return (data->fifo_rd + data->fifo_count) % MAXM86161_EMUL_FIFO_DEPTH;
+
+	case MAXM86161_REG_FIFO_R_PTR:
+		return data->fifo_rd;
+
+	case MAXM86161_REG_FIFO_OVF_CNT:
+		return data->fifo_ovf;
+
+	case MAXM86161_REG_FIFO_DATA_CNT:
+		return data->fifo_count;
+
+	case MAXM86161_REG_FIFO_DATA:
+	{
+		uint32_t word = (data->fifo_count > 0) ? data->fifo[data->fifo_rd] : (MAXM86161_EMUL_TAG_INVALID << 19);
+
+		value = word >> (8 * (2 - data->fifo_byte));
+		if (++data->fifo_byte == 3)
+		{
+			data->fifo_byte = 0;
+			if (data->fifo_count > 0)
+			{
+				data->fifo_rd = (data->fifo_rd + 1) % MAXM86161_EMUL_FIFO_DEPTH;
+				data->fifo_count--;
+				data->fifo_ovf = 0;
+			}
+		}
+
+		if (data->reg[MAXM86161_REG_FIFO_CONFIG2] & MAXM86161_EMUL_FIFO_STAT_CLR)
+		{
+			data->reg[MAXM86161_REG_INT_STAT_1] &= ~MAXM86161_EMUL_INT_A_FULL;
+		}
+
+		return value;
+	}
+
+	default:
+		return data->reg[reg];
+	}
+}
+
+static void maxm86161_emul_reg_write(struct maxm86161_emul_data *data, uint8_t reg, uint8_t value)
+{
+	switch (reg)
+	{
+	case MAXM86161_REG_INT_STAT_1:
+	case MAXM86161_REG_INT_STAT_2:
+	case MAXM86161_REG_FIFO_OVF_CNT:
+	case MAXM86161_REG_FIFO_DATA_CNT:
+	case MAXM86161_REG_FIFO_DATA:
+	case MAXM86161_REG_REV_ID:
+	case MAXM86161_REG_PART_ID:
+		// Read-only
+		break;
+
+	case MAXM86161_REG_FIFO_CONFIG2:
+		if (value & MAXM86161_EMUL_FLUSH_FIFO)
+		{
+			data->fifo_rd = 0;
+			data->fifo_count = 0;
+			data->fifo_ovf = 0;
+			data->fifo_byte = 0;
+		}
+		// FLUSH_FIFO is self clearing
+		data->reg[reg] = value & ~MAXM86161_EMUL_FLUSH_FIFO;
+		break;
+
+	case MAXM86161_REG_SYSTEM_CONTROL:
+		if (value & MAXM86161_EMUL_RESET)
+		{
+			maxm86161_emul_reset(data);
+		}
+		else
+		{
+			// Leaving shutdown with PROX_INT_EN set starts in proximity mode
+			if ((data->reg[reg] & MAXM86161_EMUL_SHDN) && !(value & MAXM86161_EMUL_SHDN))
+			{
+				data->prox_mode = data->reg[MAXM86161_REG_INT_EN_1] & MAXM86161_EMUL_INT_PROX;
+			}
+			data->reg[reg] = value;
+		}
+		maxm86161_emul_update_clock(data);
+		break;
+
+	case MAXM86161_REG_PPG_CONFIG2:
+		data->reg[reg] = value;
+		maxm86161_emul_update_clock(data);
+		break;
+
+	default:
+		data->reg[reg] = value;
+		break;
+	}
+}
+
+static uint8_t maxm86161_emul_next_reg(uint8_t reg)
+{
+	// Burst reads of FIFO_DATA keep popping the FIFO instead of advancing the address
+	return (reg == MAXM86161_REG_FIFO_DATA) ? reg : reg + 1;
+}
+
+static int maxm86161_emul_transfer(const struct emul *target, struct i2c_msg *msgs, int num_msgs, int addr)
+{
+	struct maxm86161_emul_data *data = target->data;
+
+	if (num_msgs < 1 || (msgs[0].flags & I2C_MSG_READ) || msgs[0].len < 1)
+	{
+		LOG_ERR("Transfer must start with a register address write");
+		return -EIO;
+	}
+
+	k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+	uint8_t reg = msgs[0].buf[0];
+	for (uint32_t i = 1; i < msgs[0].len; i++)
+	{
+		maxm86161_emul_reg_write(data, reg, msgs[0].buf[i]);
+		reg = maxm86161_emul_next_reg(reg);
+	}
+
+	for (int m = 1; m < num_msgs; m++)
+	{
+		bool read = msgs[m].flags & I2C_MSG_READ;
+
+		for (uint32_t i = 0; i < msgs[m].len; i++)
+		{
+			if (read)
+			{
+				msgs[m].buf[i] = maxm86161_emul_reg_read(data, reg);
+			}
+			else
+			{
+				maxm86161_emul_reg_write(data, reg, msgs[m].buf[i]);
+			}
+			reg = maxm86161_emul_next_reg(reg);
+		}
+	}
+
+	bool asserted = maxm86161_emul_int_asserted(data);
+	k_spin_unlock(&data->lock, key);
+
+	maxm86161_emul_update_int(data, asserted);
+
+	return 0;
+}
+
+void maxm86161_emul_set_skin_contact(const struct emul *target, bool skin_contact)
+{
+	struct maxm86161_emul_data *data = target->data;
+	k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+	data->skin_contact = skin_contact;
+
+	k_spin_unlock(&data->lock, key);
+}
+
+void maxm86161_emul_set_heart_rate(const struct emul *target, uint16_t bpm)
+{
+	struct maxm86161_emul_data *data = target->data;
+	k_spinlock_key_t key = k_spin_lock(&data->lock);
+
+	data->heart_rate_bpm = bpm;
+
+	k_spin_unlock(&data->lock, key);
+}
+
+static const struct i2c_emul_api maxm86161_emul_api_i2c = {
+	.transfer = maxm86161_emul_transfer,
+};
+
+static int maxm86161_emul_init(const struct emul *target, const struct device *parent)
+{
+	struct maxm86161_emul_data *data = target->data;
+
+	ARG_UNUSED(parent);
+
+	data->cfg = target->cfg;
+	data->skin_contact = true;
+	data->heart_rate_bpm = 60;
+	data->noise_state = 1;
+
+	k_timer_init(&data->sample_timer, maxm86161_emul_sample, NULL);
+	maxm86161_emul_reset(data);
+
+	return 0;
+}
+
+#define MAXM86161_EMUL(n)                                                          \
+	static struct maxm86161_emul_data maxm86161_emul_data_##n;                    \
+	static const struct maxm86161_emul_cfg maxm86161_emul_cfg_##n = {             \
+		.int_gpio = GPIO_DT_SPEC_INST_GET_OR(n, int_gpios, {0}),                  \
+	};                                                                            \
+	EMUL_DT_INST_DEFINE(n, maxm86161_emul_init, &maxm86161_emul_data_##n,         \
+						&maxm86161_emul_cfg_##n, &maxm86161_emul_api_i2c, NULL)
+
+DT_INST_FOREACH_STATUS_OKAY(MAXM86161_EMUL)
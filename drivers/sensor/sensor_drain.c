@@ -0,0 +1,25 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <zephyr/init.h>
+#include <zephyr/kernel.h>
+#include <app/drivers/sensor_drain.h>
+
+K_THREAD_STACK_DEFINE(sensor_drain_workq_stack, CONFIG_SENSOR_DRAIN_WORKQ_STACK_SIZE);
+struct k_work_q sensor_drain_workq;
+
+static int sensor_drain_workq_init(void)
+{
+	const struct k_work_queue_config cfg = {
+		.name = "sensor_drain",
+	};
+
+	k_work_queue_start(&sensor_drain_workq, sensor_drain_workq_stack,
+					   K_THREAD_STACK_SIZEOF(sensor_drain_workq_stack), CONFIG_SENSOR_DRAIN_WORKQ_PRIORITY, &cfg);
+
+	return 0;
+}
+
+// Started before the sensor drivers, nothing is submitted before a sensor is started by the application
+SYS_INIT(sensor_drain_workq_init, POST_KERNEL, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
@@ -0,0 +1,28 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef DIE_TEMP_EMUL_H
+#define DIE_TEMP_EMUL_H
+
+#include <zephyr/device.h>
+
+/**@file
+ * @defgroup die_temp_emul Emulated die temperature sensor
+ * @{
+ * @brief Stand-in for the nRF TEMP peripheral when running on native_sim.
+ */
+
+/**
+ * @brief Set the temperature reported by the emulated sensor
+ *
+ * @param[in] dev Pointer to the emulated sensor device
+ * @param[in] centitemp Temperature in centi-degrees Celsius
+ */
+void die_temp_emul_set(const struct device *dev, int16_t centitemp);
+
+/**
+ * @}
+ */
+
+#endif // DIE_TEMP_EMUL_H
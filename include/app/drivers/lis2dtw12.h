@@ -6,6 +6,60 @@
 #define LIS2DTW12_H
 
 #include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
+
+typedef enum
+{
+    // Temperature
+    LIS2DTW12_OUT_T_L = 0x0D,
+    LIS2DTW12_OUT_T_H = 0x0E,
+
+    // Part ID
+    LIS2DTW12_WHO_AM_I = 0x0F,
+
+    // Control registers
+    LIS2DTW12_CTRL1 = 0x20,
+    LIS2DTW12_CTRL2 = 0x21,
+    LIS2DTW12_CTRL3 = 0x22,
+    LIS2DTW12_CTRL4_INT1_PAD_CTRL = 0x23,
+    LIS2DTW12_CTRL5_INT2_PAD_CTRL = 0x24,
+    LIS2DTW12_CTRL_6 = 0x25,
+
+    // Status
+    LIS2DTW12_STATUS = 0x27,
+
+    // Acceleration data
+    LIS2DTW12_OUT_X_L = 0x28,
+    LIS2DTW12_OUT_X_H = 0x29,
+    LIS2DTW12_OUT_Y_L = 0x2A,
+    LIS2DTW12_OUT_Y_H = 0x2B,
+    LIS2DTW12_OUT_Z_L = 0x2C,
+    LIS2DTW12_OUT_Z_H = 0x2D,
+
+    // FIFO
+    LIS2DTW12_FIFO_CTRL = 0x2E,
+    LIS2DTW12_FIFO_SAMPLES = 0x2F,
+
+    // Interrupts
+    LIS2DTW12_TAP_THS_X = 0x30,
+    LIS2DTW12_TAP_THS_Y = 0x31,
+    LIS2DTW12_TAP_THS_Z = 0x32,
+    LIS2DTW12_INT_DUR = 0x33,
+    LIS2DTW12_WAKE_UP_THS = 0x34,
+    LIS2DTW12_WAKE_UP_DUR = 0x35,
+    LIS2DTW12_FREE_FALL = 0x36,
+    LIS2DTW12_STATUS_DUP = 0x37,
+    LIS2DTW12_WAKE_UP_SRC = 0x38,
+    LIS2DTW12_TAP_SRC = 0x39,
+    LIS2DTW12_SIXD_SRC = 0x3A,
+    LIS2DTW12_ALL_INT_SRC = 0x3B,
+    LIS2DTW12_X_OFS_USR = 0x3C,
+    LIS2DTW12_Y_OFS_USR = 0x3D,
+    LIS2DTW12_Z_OFS_USR = 0x3E,
+
+    LIS2DTW12_CTRL_7 = 0x3F,
+
+} LIS2DTW12_REG_map_t;
 
 struct acc_sample
 {
@@ -14,36 +68,96 @@ struct acc_sample
     int16_t z;
 };
 
+// The FIFO holds up to 32 samples of 3 axes
+#define LIS2DTW12_FIFO_DEPTH 32u
+#define LIS2DTW12_SAMPLE_SIZE 6u
+
+/** @brief Power modes, the low power modes trade noise for current. */
+enum lis2dtw12_power_mode
+{
+    LIS2DTW12_LOW_POWER_1 = 0,
+    LIS2DTW12_LOW_POWER_2 = 1,
+    LIS2DTW12_LOW_POWER_3 = 2,
+    LIS2DTW12_LOW_POWER_4 = 3,
+    LIS2DTW12_HIGH_PERFORMANCE = 4,
+};
+
+/** @brief Custom sensor attributes, on SENSOR_CHAN_ACCEL_XYZ or SENSOR_CHAN_ALL */
+enum lis2dtw12_attribute
+{
+    /** One of lis2dtw12_power_mode. The low power modes cap SENSOR_ATTR_SAMPLING_FREQUENCY (12.5 up to 1600Hz) at
+     * 200Hz. */
+    LIS2DTW12_ATTR_POWER_MODE = SENSOR_ATTR_PRIV_START,
+    /** Samples per streamed frame, 1 up to CONFIG_ACC_SAMPLES_PER_FRAME or 31. It sets the FIFO threshold. */
+    LIS2DTW12_ATTR_FRAME_SAMPLES,
+};
+
+/**
+ * @brief Encoded FIFO data as produced by the streaming and one-shot read paths
+ *
+ * The samples are decoded lazily, either through the sensor decoder API or lis2dtw12_decode_encoded().
+ */
+struct lis2dtw12_encoded_data
+{
+    /** Time of the FIFO interrupt in ns. */
+    uint64_t timestamp;
+    /** Nominal sample period in ns. */
+    uint32_t period_ns;
+    /** Set when the buffer was filled for a FIFO threshold interrupt. */
+    uint8_t fifo_watermark;
+    /** FIFO_SAMPLES as read at the start of the drain. */
+    uint8_t fifo_samples;
+    /** Number of samples read. */
+    uint8_t sample_count;
+    /** Raw FIFO data, x, y and z in little endian. */
+    uint8_t data[];
+};
+
 /**@file
  * @defgroup lis2dtw12 LIS2DTW12 Driver implementation
  * @{
- * @brief Driver for using the LIS2DTW12. Since this sensor is used in the context of accelerometer, the API is named acc_sensor.
+ * @brief Sensor API driver for the LIS2DTW12. Data is read with sensor_read() or streamed on the FIFO threshold
+ * interrupt with sensor_stream(). Since this sensor is used in the context of accelerometer, the extension API is named
+ * acc_sensor.
  */
 
 /**
  * @brief Start the LIS2DTW12 sensor
  *
- * @param[in] i2c Pointer to the I2C device
+ * The attributes set since the last start are programmed here.
+ *
+ * @param[in] dev Pointer to the sensor device
  * @return int 0 on success, negative error code on failure
  */
-int acc_sensor_start(const struct i2c_dt_spec *i2c);
+int acc_sensor_start(const struct device *dev);
 
 /**
  * @brief Stop the LIS2DTW12 sensor
  *
- * @param[in] i2c Pointer to the I2C device
+ * A pending streaming request is kept and served again after the next start.
+ *
+ * @param[in] dev Pointer to the sensor device
  * @return int 0 on success, negative error code on failure
  */
-int acc_sensor_stop(const struct i2c_dt_spec *i2c);
+int acc_sensor_stop(const struct device *dev);
 
 /**
- * @brief Get the latest accelerometer data
+ * @brief Get the decoder for the encoded FIFO data
  *
- * @param[in] i2c Pointer to the I2C device
- * @param[out] acc_data Pointer to the accelerometer data struct
- * @param[out] sample_count Number of samples read
+ * @param[in] dev Pointer to the sensor device
+ * @param[out] decoder Pointer to the decoder API
  * @return int 0 on success, negative error code on failure
  */
-int acc_sensor_get_data(const struct i2c_dt_spec *i2c, struct acc_sample *acc_data, uint8_t *sample_count);
+int lis2dtw12_get_decoder(const struct device *dev, const struct sensor_decoder_api **decoder);
+
+/**
+ * @brief Decode all samples of an encoded buffer at once
+ *
+ * @param[in] buf Encoded buffer
+ * @param[out] acc_data Pointer to the decoded samples
+ * @param[in] max_samples Capacity of acc_data
+ * @return uint8_t Number of samples written to acc_data
+ */
+uint8_t lis2dtw12_decode_encoded(const uint8_t *buf, struct acc_sample *acc_data, uint8_t max_samples);
 
 #endif // LIS2DTW12_H
\ No newline at end of file
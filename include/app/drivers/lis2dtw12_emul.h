@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef LIS2DTW12_EMUL_H
+#define LIS2DTW12_EMUL_H
+
+#include <zephyr/drivers/emul.h>
+
+/**@file
+ * @defgroup lis2dtw12_emul LIS2DTW12 Emulator
+ * @{
+ * @brief Backend API to steer the emulated LIS2DTW12 from the native_sim application or tests.
+ */
+
+/**
+ * @brief Set the static acceleration seen by the emulated sensor
+ *
+ * Values are raw output register counts (left aligned, ±2 g full scale: 1 g = 16384).
+ *
+ * @param[in] target Pointer to the emulator instance
+ * @param[in] x Acceleration on the x axis
+ * @param[in] y Acceleration on the y axis
+ * @param[in] z Acceleration on the z axis
+ */
+void lis2dtw12_emul_set_accel(const struct emul *target, int16_t x, int16_t y, int16_t z);
+
+/**
+ * @brief Superimpose a vibration on the static acceleration
+ *
+ * Used to mimic jaw activity. An amplitude of 0 disables the vibration.
+ *
+ * @param[in] target Pointer to the emulator instance
+ * @param[in] amplitude Peak amplitude in raw output register counts
+ * @param[in] frequency_hz Vibration frequency in Hz
+ */
+void lis2dtw12_emul_set_vibration(const struct emul *target, int16_t amplitude, uint16_t frequency_hz);
+
+/**
+ * @}
+ */
+
+#endif // LIS2DTW12_EMUL_H
@@ -6,6 +6,7 @@
 #define MAXM86161_H
 
 #include <zephyr/drivers/i2c.h>
+#include <zephyr/drivers/sensor.h>
 
 typedef enum
 {
@@ -65,6 +66,49 @@ typedef enum
 
 } MAXM86161_REG_map_t;
 
+// Size of one FIFO word: 5-bit tag followed by 19 bits of data
+#define MAXM86161_FIFO_WORD_SIZE 3u
+#define MAXM86161_FIFO_DEPTH 128u
+#define MAXM86161_FIFO_DATA_MASK 0x7ffff
+// A sample spans at most 6 words, so up to 5 words of a partial sample are carried to the next buffer
+#define MAXM86161_MAX_CARRY_WORDS 5u
+#define MAXM86161_CARRY_SIZE (MAXM86161_MAX_CARRY_WORDS * MAXM86161_FIFO_WORD_SIZE)
+
+/** @brief Tags found in the upper 5 bits of every FIFO word. */
+typedef enum
+{
+	// Exposure of LED sequence slot 1..6, the LED that was used follows from LED_SEQ_REG1..3
+	MAXM86161_TAG_LEDC1 = 0x01,
+	MAXM86161_TAG_LEDC2 = 0x02,
+	MAXM86161_TAG_LEDC3 = 0x03,
+	MAXM86161_TAG_LEDC4 = 0x04,
+	MAXM86161_TAG_LEDC5 = 0x05,
+	MAXM86161_TAG_LEDC6 = 0x06,
+	// Proximity mode sample
+	MAXM86161_TAG_PROX = 0x19,
+	// Read from an empty FIFO
+	MAXM86161_TAG_INVALID = 0x1e,
+	MAXM86161_TAG_TIME_STAMP = 0x1f,
+} MAXM86161_TAG_t;
+
+/** @brief LEDCx codes of the LED sequence registers. */
+typedef enum
+{
+	MAXM86161_LEDC_NONE = 0x0,
+	MAXM86161_LEDC_LED1 = 0x1,
+	MAXM86161_LEDC_LED2 = 0x2,
+	MAXM86161_LEDC_LED3 = 0x3,
+	MAXM86161_LEDC_LED1_LED2 = 0x4,
+	MAXM86161_LEDC_LED1_LED3 = 0x5,
+	MAXM86161_LEDC_LED2_LED3 = 0x6,
+	MAXM86161_LEDC_LED1_LED2_LED3 = 0x7,
+	MAXM86161_LEDC_PILOT_LED1 = 0x8,
+	MAXM86161_LEDC_AMBIENT = 0x9,
+	MAXM86161_LEDC_LED4 = 0xa,
+	MAXM86161_LEDC_LED5 = 0xb,
+	MAXM86161_LEDC_LED6 = 0xc,
+} MAXM86161_LEDC_t;
+
 struct ppg_sample
 {
     uint32_t red;
@@ -72,56 +116,215 @@ struct ppg_sample
     uint32_t green;
 };
 
+/** @brief Custom sensor attributes */
+enum maxm86161_attribute
+{
+	/** LED pulse amplitude register value, on SENSOR_CHAN_GREEN, SENSOR_CHAN_IR, SENSOR_CHAN_RED or SENSOR_CHAN_PROX
+	 * for the pilot amplitude of proximity mode. */
+	MAXM86161_ATTR_LED_PA = SENSOR_ATTR_PRIV_START,
+	/** LED current range, 0 for 31mA up to 3 for 124mA full scale, on SENSOR_CHAN_GREEN, SENSOR_CHAN_IR or
+	 * SENSOR_CHAN_RED. A pulse amplitude count is 0.12mA times the range plus one. */
+	MAXM86161_ATTR_LED_RANGE,
+	/** Samples per streamed frame on SENSOR_CHAN_ALL, 1 up to CONFIG_PPG_SAMPLES_PER_FRAME. It sets the FIFO
+	 * watermark, taken on the next ppg_sensor_start() like SENSOR_ATTR_SAMPLING_FREQUENCY (8 up to 400Hz) and
+	 * SENSOR_ATTR_OVERSAMPLING (1 up to 128 samples averaged) on SENSOR_CHAN_ALL. */
+	MAXM86161_ATTR_FRAME_SAMPLES,
+};
+
+/**
+ * @brief Encoded FIFO data as produced by the streaming and one-shot read paths
+ *
+ * The buffer holds whole samples only, a sample that was split over two drains is completed in the buffer of the
+ * second drain. The words are decoded lazily, either through the sensor decoder API or maxm86161_decode_encoded().
+ */
+struct maxm86161_encoded_data
+{
+	/** Time of the FIFO interrupt in ns. */
+	uint64_t timestamp;
+	/** Nominal sample period in ns. */
+	uint32_t period_ns;
+	/** LED sequence the words were tagged with. */
+	uint8_t led_seq[3];
+	/** Set when the buffer was filled for a FIFO watermark interrupt. */
+	uint8_t fifo_watermark;
+	/** FIFO_OVF_CNT at the time of the drain. */
+	uint8_t overflow_count;
+	/** FIFO_DATA_CNT at the time of the drain. */
+	uint8_t data_count;
+	/** Offset of the first word in raw. */
+	uint8_t word_offset;
+	/** Number of words starting at raw[word_offset]. */
+	uint8_t word_count;
+	/** Carry area followed by the counters and the FIFO words, as read in a single burst. */
+	uint8_t raw[];
+};
+
 /**@file
  * @defgroup maxm86161 MAXM86161 Driver implementation
  * @{
- * @brief Driver for using the MAXM86161. Since this sensor is used in the context of PPG, the API is named ppg_sensor.
+ * @brief Sensor API driver for the MAXM86161. Data is read with sensor_read() or streamed on the FIFO watermark
+ * interrupt with sensor_stream(). Since this sensor is used in the context of PPG, the extension API is named
+ * ppg_sensor.
  */
 
 /**
  * @brief Start the MAXM86161 sensor
  *
- * @param[in] i2c Pointer to the I2C device
+ * The sample rate, averaging and frame size set since the last start are programmed here.
+ *
+ * @param[in] dev Pointer to the sensor device
  * @return int 0 on success, negative error code on failure
  */
-int ppg_sensor_start(const struct i2c_dt_spec *i2c);
+int ppg_sensor_start(const struct device *dev);
 
 /**
  * @brief Stop the MAXM86161 sensor
  *
- * @param[in] i2c Pointer to the I2C device
+ * A pending streaming request is kept and served again after the next start.
+ *
+ * @param[in] dev Pointer to the sensor device
  * @return int 0 on success, negative error code on failure
  */
-int ppg_sensor_stop(const struct i2c_dt_spec *i2c);
+int ppg_sensor_stop(const struct device *dev);
 
 /**
- * @brief Get the latest PPG data
+ * @brief Put the MAXM86161 sensor in standby
+ *
+ * Only LED1 is pulsed, at 25Hz and without the FIFO interrupt, so the green LED can be used as an indicator at a
+ * fraction of the streaming current. The LED pulse amplitudes are kept, ppg_sensor_start() leaves standby.
  *
- * @param[in] i2c Pointer to the I2C device
- * @param[out] ppg_data Pointer to the PPG data struct
- * @param[out] sample_count Number of samples read
+ * @param[in] dev Pointer to the sensor device
  * @return int 0 on success, negative error code on failure
  */
-int ppg_sensor_get_data(const struct i2c_dt_spec *i2c, struct ppg_sample *ppg_data, uint8_t *sample_count);
+int ppg_sensor_standby(const struct device *dev);
+
+/**
+ * @brief Put the MAXM86161 sensor in proximity mode
+ *
+ * LED1 is pulsed at the pilot amplitude at 8Hz, until a sample exceeds the threshold set with SENSOR_ATTR_UPPER_THRESH
+ * on SENSOR_CHAN_PROX. The SENSOR_TRIG_NEAR_FAR handler is then called once from the sensor drain work queue, and the
+ * sensor has to be started again to stream. The pilot amplitude is MAXM86161_ATTR_LED_PA on SENSOR_CHAN_PROX.
+ *
+ * @param[in] dev Pointer to the sensor device
+ * @return int 0 on success, -EINVAL without a SENSOR_TRIG_NEAR_FAR trigger, negative error code on failure
+ */
+int ppg_sensor_proximity(const struct device *dev);
 
 /**
  * @brief Read a register from the PPG sensor
  *
- * @param[in] i2c Pointer to the I2C device
+ * @param[in] dev Pointer to the sensor device
  * @param[in] reg Register address
  * @param[out] data Pointer to the data read
  * @return int 0 on success, negative error code on failure
  */
-int ppg_sensor_read_reg(const struct i2c_dt_spec *i2c, uint8_t reg, uint8_t *data);
+int ppg_sensor_read_reg(const struct device *dev, uint8_t reg, uint8_t *data);
 
 /**
  * @brief Write a register to the PPG sensor
  *
- * @param[in] i2c Pointer to the I2C device
+ * @param[in] dev Pointer to the sensor device
  * @param[in] reg Register address
  * @param[in] data Data to write
  * @return int 0 on success, negative error code on failure
  */
-int ppg_sensor_write_reg(const struct i2c_dt_spec *i2c, uint8_t reg, uint8_t data);
+int ppg_sensor_write_reg(const struct device *dev, uint8_t reg, uint8_t data);
+
+/** @brief Most registers ppg_sensor_set_start_regs() takes. */
+#define MAXM86161_MAX_START_REGS 24
+
+/** @brief Register and the value to write to it. */
+struct maxm86161_reg_value
+{
+	uint8_t reg;
+	uint8_t value;
+};
+
+/**
+ * @brief Set the registers every ppg_sensor_start() writes after its defaults
+ *
+ * The registers go out before the FIFO interrupt and the sensor are enabled, as one burst per run of consecutive
+ * addresses, so the first sample is taken with them. A change of the LED sequence or of PPG_CONFIG2 is tracked like
+ * with ppg_sensor_write_reg().
+ *
+ * @param[in] dev Pointer to the sensor device
+ * @param[in] regs Registers in increasing order of address, copied
+ * @param[in] count Number of registers, up to MAXM86161_MAX_START_REGS, 0 writes the defaults only
+ * @return int 0 on success, -EINVAL if the registers are out of order or too many
+ */
+int ppg_sensor_set_start_regs(const struct device *dev, const struct maxm86161_reg_value *regs, uint8_t count);
+
+/**
+ * @brief Get the decoder for the encoded FIFO data
+ *
+ * @param[in] dev Pointer to the sensor device
+ * @param[out] decoder Pointer to the decoder API
+ * @return int 0 on success, negative error code on failure
+ */
+int maxm86161_get_decoder(const struct device *dev, const struct sensor_decoder_api **decoder);
+
+/**
+ * @brief Decode all samples of an encoded buffer at once
+ *
+ * Faster than going through the sensor decoder API channel by channel when all channels are needed.
+ *
+ * @param[in] buf Encoded buffer
+ * @param[out] ppg_data Pointer to the decoded samples
+ * @param[in] max_samples Capacity of ppg_data
+ * @return uint8_t Number of samples written to ppg_data
+ */
+uint8_t maxm86161_decode_encoded(const uint8_t *buf, struct ppg_sample *ppg_data, uint8_t max_samples);
+
+/**
+ * @brief FIFO decoder state
+ *
+ * The decoder demultiplexes FIFO words by tag through a lookup table that is built from the LED sequence registers,
+ * so channels stay correctly assigned whatever order the LEDs are sequenced in. Words of a sample that is split over
+ * two FIFO drains are kept in the decoder until the sample is complete.
+ */
+struct maxm86161_decoder
+{
+	/** Index into the sample row for every tag, non-sample tags point at a scratch entry. */
+	uint8_t tag_field[32];
+	/** Field bit set for every tag, 0 for tags that do not carry a red, IR or green exposure. */
+	uint8_t tag_mask[32];
+	/** Tag of the last slot in the LED sequence, it completes a sample. */
+	uint8_t last_tag;
+	/** Number of active slots in the LED sequence. */
+	uint8_t slot_count;
+	/** Fields that must be present for a sample to be complete. */
+	uint8_t full_mask;
+	/** Fields of the sample in progress that have been filled. */
+	uint8_t row_mask;
+	/** Sample in progress: red, IR, green and a scratch entry for words that are dropped. */
+	uint32_t row[4];
+	/** Number of words read from an empty FIFO. */
+	uint32_t invalid_count;
+	/** Number of samples dropped because words were missing, e.g. after a FIFO overflow. */
+	uint32_t dropped_count;
+};
+
+/**
+ * @brief Initialize the FIFO decoder for an LED sequence
+ *
+ * Any partial sample is discarded, so the FIFO must be flushed together with a change of the LED sequence.
+ *
+ * @param[out] decoder Pointer to the decoder state
+ * @param[in] led_seq Contents of LED_SEQ_REG1..3
+ */
+void maxm86161_decoder_init(struct maxm86161_decoder *decoder, const uint8_t led_seq[3]);
+
+/**
+ * @brief Decode raw FIFO words into PPG samples
+ *
+ * @param[in,out] decoder Pointer to the decoder state
+ * @param[in] fifo Raw FIFO data, 3 bytes per word
+ * @param[in] word_count Number of words in fifo
+ * @param[out] ppg_data Pointer to the decoded samples
+ * @param[in] max_samples Capacity of ppg_data, complete samples beyond it are counted as dropped
+ * @return uint8_t Number of samples written to ppg_data
+ */
+uint8_t maxm86161_decode(struct maxm86161_decoder *decoder, const uint8_t *fifo, size_t word_count,
+						 struct ppg_sample *ppg_data, uint8_t max_samples);
 
 #endif // MAXM86161_H
\ No newline at end of file
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef MAXM86161_EMUL_H
+#define MAXM86161_EMUL_H
+
+#include <zephyr/drivers/emul.h>
+
+/**@file
+ * @defgroup maxm86161_emul MAXM86161 Emulator
+ * @{
+ * @brief Backend API to steer the emulated MAXM86161 from the native_sim application or tests.
+ */
+
+/**
+ * @brief Place or remove the emulated sensor on skin
+ *
+ * Without skin contact the photodiode only sees ambient light, so all LED exposures read close to zero.
+ *
+ * @param[in] target Pointer to the emulator instance
+ * @param[in] skin_contact True when the sensor touches skin
+ */
+void maxm86161_emul_set_skin_contact(const struct emul *target, bool skin_contact);
+
+/**
+ * @brief Set the pulse rate of the synthetic PPG waveform
+ *
+ * @param[in] target Pointer to the emulator instance
+ * @param[in] bpm Pulse rate in beats per minute
+ */
+void maxm86161_emul_set_heart_rate(const struct emul *target, uint16_t bpm);
+
+/**
+ * @}
+ */
+
+#endif // MAXM86161_EMUL_H
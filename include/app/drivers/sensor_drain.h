@@ -0,0 +1,18 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#ifndef SENSOR_DRAIN_H
+#define SENSOR_DRAIN_H
+
+#include <zephyr/kernel.h>
+
+/**
+ * @brief Work queue the FIFO drivers submit their drains on
+ *
+ * The drains start the FIFO reads and serve the failures and the proximity interrupt with blocking I2C transfers, so
+ * they run on their own queue instead of the system work queue that Bluetooth and the application share.
+ */
+extern struct k_work_q sensor_drain_workq;
+
+#endif /* SENSOR_DRAIN_H */
@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "clock_sync.h"
+
+// One request every 5 s, 60 of them span more than the CLOCK_SYNC_POINTS points of the fit
+#define SYNC_INTERVAL_US (5 * USEC_PER_SEC)
+#define SYNC_REQUESTS 60
+// One way delay of the link, and the spread of each direction around it
+#define SYNC_DELAY_US 20000
+#define SYNC_JITTER_US 1000
+// The device crystal runs 100 ppm slow against the host
+#define SYNC_SKEW_PPB 100000
+// Largest errors of the estimate, the asymmetry of the link is at most half the jitter
+#define SYNC_SKEW_TOLERANCE_PPB 5000
+#define SYNC_WALL_TOLERANCE_US 1000
+// Before the slope is fitted the line may lack the whole skew, over the few intervals from the oldest point
+#define SYNC_OFFSET_TOLERANCE_US \
+    (SYNC_WALL_TOLERANCE_US + 4 * (int64_t)SYNC_INTERVAL_US * SYNC_SKEW_PPB / NSEC_PER_SEC)
+
+// Wall clock at device uptime 0, 2024-01-01
+static const uint64_t sync_epoch_us = 1704067200ull * USEC_PER_SEC;
+
+static uint64_t device_us = USEC_PER_SEC;
+static uint64_t wall0_us;
+static uint32_t rtt_us;
+static uint8_t seq;
+static uint32_t noise = 1;
+
+static uint32_t sync_jitter(void)
+{
+    noise = noise * 1664525 + 1013904223;
+    return (noise >> 8) % SYNC_JITTER_US;
+}
+
+// Host clock at a device uptime
+static uint64_t sync_wall(uint64_t at_us)
+{
+    return wall0_us + at_us + (uint64_t)llround(at_us * (SYNC_SKEW_PPB * 1e-9));
+}
+
+// The host writes its clock, the request reaches the device one delay later and the response takes another back
+static void sync_request(void)
+{
+    uint32_t up_us = SYNC_DELAY_US + sync_jitter();
+    uint32_t down_us = SYNC_DELAY_US + sync_jitter();
+
+    clock_sync_request(seq++, sync_wall(device_us) - up_us, rtt_us, device_us);
+
+    rtt_us = up_us + down_us;
+    device_us += SYNC_INTERVAL_US;
+}
+
+static int64_t sync_error(uint64_t at_us)
+{
+    uint64_t wall_us;
+
+    zassert_ok(clock_sync_to_wall(at_us, &wall_us));
+
+    return (int64_t)(wall_us - sync_wall(at_us));
+}
+
+static void sync_before(void *fixture)
+{
+    ARG_UNUSED(fixture);
+
+    // Every test starts on a host clock hours away from the last one, which starts the line over
+    wall0_us = wall0_us ? wall0_us + (uint64_t)6 * 3600 * USEC_PER_SEC : sync_epoch_us;
+}
+
+ZTEST(clock_sync, test_drift)
+{
+    struct clock_sync_status status;
+
+    for (int i = 0; i < SYNC_REQUESTS; i++)
+    {
+        sync_request();
+    }
+
+    clock_sync_get_status(device_us, &status);
+
+    int64_t error = sync_error(device_us);
+    // A minute without requests, the slope carries the mapping
+    int64_t ahead_error = sync_error(device_us + 60 * USEC_PER_SEC);
+
+    TC_PRINT("clock sync: %u points, skew %d ppb, rms %u us, error %lld us, %lld us a minute later\n", status.points,
+             status.skew_ppb, status.rms_us, (long long)error, (long long)ahead_error);
+
+    zassert_equal(status.points, CLOCK_SYNC_POINTS);
+    zassert_within(status.skew_ppb, SYNC_SKEW_PPB, SYNC_SKEW_TOLERANCE_PPB, "skew %d ppb", status.skew_ppb);
+    zassert_true(status.rms_us <= SYNC_JITTER_US, "rms %u us", status.rms_us);
+    zassert_within(error, 0, SYNC_WALL_TOLERANCE_US, "wall clock %lld us off", (long long)error);
+    zassert_within(ahead_error, 0, SYNC_WALL_TOLERANCE_US, "wall clock %lld us off a minute later",
+                   (long long)ahead_error);
+}
+
+ZTEST(clock_sync, test_offset)
+{
+    struct clock_sync_status status;
+
+    // The span is too short for the slope, the offset alone follows the new clock
+    for (int i = 0; i < 4; i++)
+    {
+        sync_request();
+    }
+
+    clock_sync_get_status(device_us, &status);
+
+    int64_t error = sync_error(device_us);
+
+    TC_PRINT("clock sync: %u points, error %lld us\n", status.points, (long long)error);
+
+    zassert_equal(status.points, 3);
+    zassert_within(error, 0, SYNC_OFFSET_TOLERANCE_US, "wall clock %lld us off", (long long)error);
+}
+
+ZTEST(clock_sync, test_rejected)
+{
+    struct clock_sync_status before;
+    struct clock_sync_status after;
+
+    for (int i = 0; i < 4; i++)
+    {
+        sync_request();
+    }
+    clock_sync_get_status(device_us, &before);
+
+    // A round trip over the limit
+    rtt_us = CONFIG_APP_CLOCK_SYNC_MAX_RTT_MS * USEC_PER_MSEC + 1;
+    sync_request();
+
+    // A lost request, the round trip belongs to another one
+    seq++;
+    sync_request();
+
+    clock_sync_get_status(device_us, &after);
+    zassert_equal(after.points, before.points, "%u points after the rejected requests, %u before", after.points,
+                  before.points);
+}
+
+ZTEST_SUITE(clock_sync, NULL, NULL, sync_before, NULL, NULL);
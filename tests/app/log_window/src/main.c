@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "flash_log.h"
+#include "log_window.h"
+
+#define WINDOW_PAGES 200
+// A page with its length and CRC in notifications at the maximum ATT MTU, less the seq and offset of every chunk
+#define WINDOW_PAGE_SIZE (6 + FLASH_LOG_PAGE_SIZE)
+#define WINDOW_CHUNK_SIZE (244 - 6)
+#define WINDOW_PAGE_CHUNKS DIV_ROUND_UP(WINDOW_PAGE_SIZE, WINDOW_CHUNK_SIZE)
+// Connection events of the bulk connection parameters, and the events an acknowledgement takes back to the device
+#define WINDOW_EVENT_US 7500
+#define WINDOW_ACK_EVENTS 3
+// The default window keeps the link busy, a single page does not
+#define WINDOW_DEFAULT 16
+#define WINDOW_MIN_LINK_SHARE 90
+
+static struct log_window window;
+
+// Pages the client acknowledges, by the event the acknowledgement arrives in
+static uint32_t acks[WINDOW_PAGES];
+static uint32_t ack_events[WINDOW_PAGES];
+
+/**
+ * @brief Offload the pages over a link that sends the notifications in flight once per connection event
+ *
+ * @return uint32_t Connection events until the client acknowledged the last page
+ */
+static uint32_t window_transfer(uint8_t size)
+{
+    uint32_t ack_head = 0;
+    uint32_t ack_tail = 0;
+    uint32_t next_seq = 0;
+    uint8_t chunks_left = 0;
+    uint32_t event = 0;
+
+    window = (struct log_window){0};
+    log_window_start(&window, 0, size);
+
+    while (window.acked_seq != WINDOW_PAGES)
+    {
+        zassert_true(event < WINDOW_PAGES * WINDOW_PAGE_CHUNKS * (WINDOW_ACK_EVENTS + 1), "window %u: stalled", size);
+
+        while (ack_tail < ack_head && ack_events[ack_tail] <= event)
+        {
+            zassert_ok(log_window_ack(&window, acks[ack_tail]), "window %u: page %u acknowledged", size,
+                       acks[ack_tail]);
+            ack_tail++;
+        }
+
+        for (uint8_t in_flight = 0; in_flight < CONFIG_APP_NOTIFY_MAX_IN_FLIGHT; in_flight++)
+        {
+            if (chunks_left == 0)
+            {
+                if (next_seq == WINDOW_PAGES || !log_window_open(&window))
+                {
+                    break;
+                }
+                chunks_left = WINDOW_PAGE_CHUNKS;
+            }
+
+            if (--chunks_left == 0)
+            {
+                // The client has the page after this event and acknowledges it
+                log_window_sent(&window, next_seq);
+                acks[ack_head] = next_seq++;
+                ack_events[ack_head++] = event + WINDOW_ACK_EVENTS;
+            }
+        }
+
+        zassert_true((int32_t)(window.next_seq - window.base_seq) <= size, "window %u: %u pages out", size,
+                     window.next_seq - window.base_seq);
+        event++;
+    }
+
+    return event;
+}
+
+// Throughput in bytes per second over a number of connection events
+static uint32_t window_rate(uint32_t events)
+{
+    return (uint32_t)((uint64_t)WINDOW_PAGES * FLASH_LOG_PAGE_SIZE * USEC_PER_SEC / (events * WINDOW_EVENT_US));
+}
+
+ZTEST(log_window, test_throughput)
+{
+    // Every event takes the notifications in flight, the last acknowledgement comes back after the last page
+    const uint32_t link_events =
+        DIV_ROUND_UP(WINDOW_PAGES * WINDOW_PAGE_CHUNKS, CONFIG_APP_NOTIFY_MAX_IN_FLIGHT) + WINDOW_ACK_EVENTS;
+    const uint32_t link_rate = window_rate(link_events);
+    uint32_t rates[2];
+    const uint8_t sizes[] = {1, WINDOW_DEFAULT};
+
+    for (uint8_t i = 0; i < ARRAY_SIZE(sizes); i++)
+    {
+        uint32_t events = window_transfer(sizes[i]);
+
+        rates[i] = window_rate(events);
+        TC_PRINT("log window %u: %u pages in %u ms, %u B/s, %u%% of the link\n", sizes[i], WINDOW_PAGES,
+                 events * WINDOW_EVENT_US / USEC_PER_MSEC, rates[i], rates[i] * 100 / link_rate);
+    }
+
+    zassert_true(rates[1] * 100 >= link_rate * WINDOW_MIN_LINK_SHARE, "window %u: %u B/s of %u B/s", WINDOW_DEFAULT,
+                 rates[1], link_rate);
+    zassert_true(rates[0] * 2 < link_rate, "window 1: %u B/s of %u B/s, the acknowledgements do not hold it up",
+                 rates[0], link_rate);
+}
+
+ZTEST(log_window, test_window)
+{
+    window = (struct log_window){0};
+    log_window_start(&window, 10, 4);
+
+    for (uint32_t seq = 10; seq < 14; seq++)
+    {
+        zassert_true(log_window_open(&window), "page %u held back", seq);
+        log_window_sent(&window, seq);
+    }
+    zassert_false(log_window_open(&window));
+
+    zassert_ok(log_window_ack(&window, 11));
+    zassert_true(log_window_open(&window));
+    zassert_equal(window.acked_seq, 12);
+
+    // Pages gone from the log are skipped, they count as out until the client acknowledges the one after them
+    log_window_sent(&window, 20);
+    zassert_false(log_window_open(&window));
+    zassert_ok(log_window_ack(&window, 20));
+    zassert_true(log_window_open(&window));
+}
+
+ZTEST(log_window, test_ack_range)
+{
+    window = (struct log_window){0};
+
+    // Nothing went out before the first transfer
+    zassert_equal(log_window_ack(&window, 0), -ERANGE);
+    zassert_equal(window.acked_seq, 0);
+
+    log_window_start(&window, 5, 4);
+    zassert_equal(log_window_ack(&window, 5), -ERANGE);
+
+    log_window_sent(&window, 5);
+    log_window_sent(&window, 6);
+    zassert_equal(log_window_ack(&window, 7), -ERANGE);
+    zassert_equal(log_window_ack(&window, 1000), -ERANGE);
+    zassert_ok(log_window_ack(&window, 6));
+    zassert_equal(window.acked_seq, 7);
+
+    // A late acknowledgement does not move the window back
+    zassert_ok(log_window_ack(&window, 5));
+    zassert_equal(window.base_seq, 7);
+    zassert_equal(window.acked_seq, 7);
+}
+
+ZTEST(log_window, test_start)
+{
+    window = (struct log_window){0};
+
+    // The client resumes at a page, the pages before it stay in the log
+    log_window_start(&window, 100, 4);
+    zassert_equal(window.acked_seq, 0);
+    log_window_sent(&window, 100);
+    zassert_ok(log_window_ack(&window, 100));
+    zassert_equal(window.acked_seq, 101);
+
+    // Reading an older page again keeps the acknowledged ones
+    log_window_start(&window, 40, 4);
+    zassert_equal(window.acked_seq, 101);
+    log_window_sent(&window, 40);
+    zassert_ok(log_window_ack(&window, 40));
+    zassert_equal(window.acked_seq, 101);
+    zassert_equal(window.base_seq, 41);
+
+    // The page numbers wrap
+    log_window_start(&window, UINT32_MAX - 1, 2);
+    log_window_sent(&window, UINT32_MAX - 1);
+    log_window_sent(&window, UINT32_MAX);
+    zassert_false(log_window_open(&window));
+    zassert_ok(log_window_ack(&window, UINT32_MAX));
+    zassert_true(log_window_open(&window));
+    zassert_equal(window.next_seq, 0);
+}
+
+ZTEST_SUITE(log_window, NULL, NULL, NULL, NULL, NULL);
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/timing/timing.h>
+#include <zephyr/ztest.h>
+
+#include "motion.h"
+
+#define MOTION_SECONDS 60
+#define MOTION_FRAME_SAMPLES 20
+#define MOTION_ACC_FRAME_MAX 25
+// Motion in the second half of every 10s, the first burst is left out of the result while the filters converge
+#define MOTION_PERIOD_S 10
+// Smallest artifact power reduction in dB
+#define MOTION_MIN_REDUCTION 10
+// Time per PPG frame the canceller may take, only meaningful on the hardware
+#define MOTION_BUDGET_US 1000
+
+struct motion_rates
+{
+    uint16_t ppg_hz;
+    uint32_t acc_mhz;
+    uint8_t acc_frame;
+};
+
+static const double pi = 3.14159265358979323846;
+
+static struct motion_canceller mc;
+
+static bool motion_moving(double t)
+{
+    return fmod(t, MOTION_PERIOD_S) >= MOTION_PERIOD_S / 2;
+}
+
+// Jaw and head movement of about 0.2g between 0.8 and 3Hz on top of gravity, fading in and out over half a second.
+// The frequencies drift against the pulse, so the two do not correlate over the bursts.
+static double motion_acc(uint8_t axis, double t)
+{
+    static const double gravity[3] = {0, 0.3, 0.95};
+    double burst = fmod(t, MOTION_PERIOD_S) - MOTION_PERIOD_S / 2;
+
+    if (burst < 0)
+    {
+        return gravity[axis];
+    }
+
+    double envelope = MIN(MIN(burst, MOTION_PERIOD_S / 2 - burst) / 0.5, 1.0);
+
+    return gravity[axis] + envelope * (0.1 * sin(2 * pi * (0.83 + 0.61 * axis) * t + axis) +
+                                       0.08 * sin(2 * pi * 2.71 * t + 2 * axis));
+}
+
+// Light taken away by the movement, in ADC counts, from the acceleration 20ms earlier
+static double motion_artifact(double t)
+{
+    static const double coupling[3] = {6000, -3500, 9000};
+    double artifact = 0;
+
+    for (uint8_t axis = 0; axis < 3; axis++)
+    {
+        artifact += coupling[axis] * (motion_acc(axis, t - 0.02) - motion_acc(axis, 0));
+    }
+
+    return artifact;
+}
+
+// Pulse at 66bpm, 0.6% of the DC level
+static double motion_pulse(double t)
+{
+    double phase = fmod(1.1 * t, 1.0);
+
+    return 100000 - 600 * (phase < 0.2 ? phase * 5 : (1 - phase) / 0.8);
+}
+
+/**
+ * @brief Run the synthetic signal through the canceller and check the artifact reduction and the time per frame
+ */
+static void motion_rate(const struct motion_rates *rates)
+{
+    struct ppg_sample samples[MOTION_FRAME_SAMPLES];
+    struct acc_sample ref[MOTION_FRAME_SAMPLES];
+    const uint32_t ppg_period_ns = NSEC_PER_SEC / rates->ppg_hz;
+    const uint32_t acc_period_ns = (uint32_t)(1000ull * NSEC_PER_SEC / rates->acc_mhz);
+    const uint32_t frames = MOTION_SECONDS * rates->ppg_hz / MOTION_FRAME_SAMPLES;
+    uint64_t acc_next_ns = 0;
+    uint64_t cycles = 0;
+    uint64_t max_cycles = 0;
+    double before = 0;
+    double after = 0;
+
+    motion_reference_reset();
+    motion_init(&mc, rates->ppg_hz);
+
+    timing_init();
+    timing_start();
+
+    for (uint32_t frame = 0; frame < frames; frame++)
+    {
+        // Time of the last sample of the frame, one sample period in
+        uint64_t timestamp = (uint64_t)(frame + 1) * MOTION_FRAME_SAMPLES * ppg_period_ns;
+
+        // The PPG stream holds a frame until the accelerometer frames cover it
+        while (acc_next_ns <= timestamp)
+        {
+            struct acc_sample acc[MOTION_ACC_FRAME_MAX];
+
+            for (uint8_t i = 0; i < rates->acc_frame; i++)
+            {
+                double t = (double)(acc_next_ns + i * (uint64_t)acc_period_ns) / NSEC_PER_SEC;
+
+                acc[i].x = (int16_t)lround(motion_acc(0, t) * MOTION_COUNTS_PER_G);
+                acc[i].y = (int16_t)lround(motion_acc(1, t) * MOTION_COUNTS_PER_G);
+                acc[i].z = (int16_t)lround(motion_acc(2, t) * MOTION_COUNTS_PER_G);
+            }
+            acc_next_ns += rates->acc_frame * (uint64_t)acc_period_ns;
+            motion_reference_put(acc, rates->acc_frame, acc_next_ns - acc_period_ns, acc_period_ns);
+        }
+
+        for (uint8_t i = 0; i < MOTION_FRAME_SAMPLES; i++)
+        {
+            double t = (double)(timestamp - (MOTION_FRAME_SAMPLES - 1 - i) * (uint64_t)ppg_period_ns) / NSEC_PER_SEC;
+            uint32_t value = (uint32_t)lround(motion_pulse(t) - motion_artifact(t));
+
+            samples[i].red = value;
+            samples[i].ir = value;
+            samples[i].green = value;
+        }
+
+        struct motion_frame result;
+        timing_t start = timing_counter_get();
+        int covered = motion_reference_resample(timestamp, ppg_period_ns, MOTION_FRAME_SAMPLES, ref);
+        motion_process(&mc, samples, covered > 0 ? ref : NULL, MOTION_FRAME_SAMPLES, &result);
+        timing_t end = timing_counter_get();
+        uint64_t frame_cycles = timing_cycles_get(&start, &end);
+
+        zassert_true(covered > 0, "motion %u Hz: frame %u not covered by the accelerometer", rates->ppg_hz, frame);
+
+        cycles += frame_cycles;
+        max_cycles = MAX(max_cycles, frame_cycles);
+
+        for (uint8_t i = 0; i < MOTION_FRAME_SAMPLES; i++)
+        {
+            double t = (double)(timestamp - (MOTION_FRAME_SAMPLES - 1 - i) * (uint64_t)ppg_period_ns) / NSEC_PER_SEC;
+
+            if (t >= MOTION_PERIOD_S && motion_moving(t))
+            {
+                double artifact = motion_artifact(t);
+                double residual = samples[i].ir - motion_pulse(t);
+
+                before += artifact * artifact;
+                after += residual * residual;
+            }
+        }
+    }
+
+    timing_stop();
+
+    double reduction = 10 * log10(before / MAX(after, 1.0));
+    uint32_t max_us = (uint32_t)(timing_cycles_to_ns(max_cycles) / NSEC_PER_USEC);
+
+    TC_PRINT("motion %u Hz, acc %u mHz: %u cycles per frame, at most %u us, artifact power %d.%u dB down\n",
+             rates->ppg_hz, rates->acc_mhz, (uint32_t)(cycles / frames), max_us, (int)reduction,
+             (unsigned int)(fabs(reduction) * 10) % 10);
+
+    zassert_true(reduction >= MOTION_MIN_REDUCTION, "motion %u Hz: artifact power only %d dB down", rates->ppg_hz,
+                 (int)reduction);
+    zassert_true(max_us <= MOTION_BUDGET_US, "motion %u Hz: %u us per frame, over the budget of %u us", rates->ppg_hz,
+                 max_us, MOTION_BUDGET_US);
+}
+
+static void motion_after(void *fixture)
+{
+    ARG_UNUSED(fixture);
+    motion_reference_reset();
+}
+
+// Rates of the sensor profiles
+ZTEST(motion, test_50hz)
+{
+    motion_rate(&(const struct motion_rates){50, 50000, 25});
+}
+
+ZTEST(motion, test_100hz)
+{
+    motion_rate(&(const struct motion_rates){100, 100000, 20});
+}
+
+ZTEST(motion, test_25hz)
+{
+    motion_rate(&(const struct motion_rates){25, 12500, 10});
+}
+
+ZTEST(motion, test_still)
+{
+    struct ppg_sample samples[MOTION_FRAME_SAMPLES];
+    struct acc_sample ref[MOTION_FRAME_SAMPLES];
+    struct motion_frame result;
+
+    motion_reference_reset();
+    motion_init(&mc, 100);
+
+    // Without a reference the samples pass unchanged
+    for (uint8_t i = 0; i < MOTION_FRAME_SAMPLES; i++)
+    {
+        samples[i].red = samples[i].ir = samples[i].green = 100000 + i;
+    }
+
+    zassert_true(motion_reference_resample(MOTION_FRAME_SAMPLES * 10000000ull, 10000000, MOTION_FRAME_SAMPLES, ref) <=
+                 0);
+    motion_process(&mc, samples, NULL, MOTION_FRAME_SAMPLES, &result);
+
+    for (uint8_t i = 0; i < MOTION_FRAME_SAMPLES; i++)
+    {
+        zassert_equal(samples[i].ir, 100000 + i);
+    }
+}
+
+ZTEST_SUITE(motion, NULL, NULL, NULL, motion_after, NULL);
@@ -0,0 +1,182 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/timing/timing.h>
+#include <zephyr/ztest.h>
+
+#include "ppg_filter.h"
+
+#define FILTER_SECONDS 10
+#define FILTER_FRAME_SAMPLES 20
+// Largest difference with the double precision filter, in ADC counts
+#define FILTER_TOLERANCE 2
+
+// DC level of every channel, red, IR and green
+static const uint32_t filter_dc[] = {150000, 220000, 90000};
+
+static const double pi = 3.14159265358979323846;
+
+struct filter_reference
+{
+    double ideal[5 * PPG_FILTER_STAGES];
+    double state[3][4 * PPG_FILTER_STAGES];
+};
+
+static struct ppg_filter filter;
+static struct filter_reference ref;
+
+// Pulse at 72bpm with a harmonic, breathing baseline wander and a little noise
+static uint32_t filter_signal(uint8_t channel, uint32_t n, uint16_t rate_hz, uint32_t *noise)
+{
+    double t = (double)n / rate_hz;
+    double value = filter_dc[channel] + 2000 * sin(2 * pi * 1.2 * t) + 600 * sin(2 * pi * 2.4 * t + 0.5) +
+                   3000 * sin(2 * pi * 0.25 * t + channel);
+
+    *noise = *noise * 1664525 + 1013904223;
+
+    return (uint32_t)lround(value) + (*noise >> 24);
+}
+
+// The same cascade as ppg_filter_process(), in double precision with the unquantized coefficients
+static double filter_reference_run(uint8_t channel, double x)
+{
+    for (int stage = 0; stage < PPG_FILTER_STAGES; stage++)
+    {
+        const double *c = &ref.ideal[stage * 5];
+        double *s = &ref.state[channel][stage * 4];
+        double y = c[0] * x + c[1] * s[0] + c[2] * s[1] + c[3] * s[2] + c[4] * s[3];
+
+        s[1] = s[0];
+        s[0] = x;
+        s[3] = s[2];
+        s[2] = y;
+        x = y;
+    }
+
+    return x;
+}
+
+/**
+ * @brief Filter the synthetic signal and compare it with the double precision filter
+ *
+ * @return uint32_t Largest difference in ADC counts
+ */
+static uint32_t filter_rate(uint16_t rate_hz)
+{
+    struct ppg_filter_coeffs coeffs;
+    struct ppg_sample samples[FILTER_FRAME_SAMPLES];
+    const uint32_t count = FILTER_SECONDS * rate_hz;
+    uint64_t cycles = 0;
+    uint32_t max_error = 0;
+    uint32_t noise = rate_hz;
+
+    ppg_filter_design(&coeffs, rate_hz, CONFIG_APP_PPG_FILTER_LOW_CUTOFF, CONFIG_APP_PPG_FILTER_HIGH_CUTOFF,
+                      ref.ideal);
+    ppg_filter_init(&filter, &coeffs);
+    memset(ref.state, 0, sizeof(ref.state));
+
+    timing_init();
+    timing_start();
+
+    for (uint32_t n = 0; n < count; n += FILTER_FRAME_SAMPLES)
+    {
+        uint32_t input[FILTER_FRAME_SAMPLES][3];
+
+        for (uint8_t i = 0; i < FILTER_FRAME_SAMPLES; i++)
+        {
+            for (uint8_t channel = 0; channel < 3; channel++)
+            {
+                input[i][channel] = filter_signal(channel, n + i, rate_hz, &noise);
+            }
+            samples[i].red = input[i][0];
+            samples[i].ir = input[i][1];
+            samples[i].green = input[i][2];
+        }
+
+        timing_t start = timing_counter_get();
+        ppg_filter_process(&filter, samples, FILTER_FRAME_SAMPLES);
+        timing_t end = timing_counter_get();
+        cycles += timing_cycles_get(&start, &end);
+
+        for (uint8_t i = 0; i < FILTER_FRAME_SAMPLES; i++)
+        {
+            const uint32_t output[3] = {samples[i].red, samples[i].ir, samples[i].green};
+
+            for (uint8_t channel = 0; channel < 3; channel++)
+            {
+                if (n + i == 0)
+                {
+                    // Primed like the fixed point filter
+                    ref.state[channel][0] = ref.state[channel][1] = input[i][channel];
+                }
+
+                double expected = filter_reference_run(channel, input[i][channel]) + PPG_FILTER_OFFSET;
+                uint32_t error = (uint32_t)lround(fabs(output[channel] - expected));
+
+                max_error = MAX(max_error, error);
+            }
+        }
+    }
+
+    timing_stop();
+
+    // Three channels per sample, load in 0.01% of the CPU
+    uint32_t channel_ns = (uint32_t)(timing_cycles_to_ns(cycles) / (count * 3));
+    uint32_t load = channel_ns * 3 * rate_hz / 100000;
+
+    TC_PRINT("ppg filter %u Hz: %u cycles, %u ns per channel sample, %u.%02u%% CPU for 3 channels, max error %u\n",
+             rate_hz, (uint32_t)(cycles / (count * 3)), channel_ns, load / 100, load % 100, max_error);
+
+    return max_error;
+}
+
+ZTEST(ppg_filter, test_50hz)
+{
+    zassert_true(filter_rate(50) <= FILTER_TOLERANCE, "50 Hz output differs from the double precision filter");
+}
+
+ZTEST(ppg_filter, test_100hz)
+{
+    zassert_true(filter_rate(100) <= FILTER_TOLERANCE, "100 Hz output differs from the double precision filter");
+}
+
+ZTEST(ppg_filter, test_200hz)
+{
+    zassert_true(filter_rate(200) <= FILTER_TOLERANCE, "200 Hz output differs from the double precision filter");
+}
+
+ZTEST(ppg_filter, test_dc)
+{
+    struct ppg_filter_coeffs coeffs;
+    struct ppg_sample samples[FILTER_FRAME_SAMPLES];
+
+    ppg_filter_design(&coeffs, 100, CONFIG_APP_PPG_FILTER_LOW_CUTOFF, CONFIG_APP_PPG_FILTER_HIGH_CUTOFF, ref.ideal);
+    ppg_filter_init(&filter, &coeffs);
+
+    // The filter is primed on the first sample, a constant level gives the offset from the start
+    for (uint8_t frame = 0; frame < 5; frame++)
+    {
+        for (uint8_t i = 0; i < FILTER_FRAME_SAMPLES; i++)
+        {
+            samples[i].red = filter_dc[0];
+            samples[i].ir = filter_dc[1];
+            samples[i].green = filter_dc[2];
+        }
+
+        ppg_filter_process(&filter, samples, FILTER_FRAME_SAMPLES);
+
+        for (uint8_t i = 0; i < FILTER_FRAME_SAMPLES; i++)
+        {
+            zassert_within(samples[i].red, PPG_FILTER_OFFSET, FILTER_TOLERANCE);
+            zassert_within(samples[i].ir, PPG_FILTER_OFFSET, FILTER_TOLERANCE);
+            zassert_within(samples[i].green, PPG_FILTER_OFFSET, FILTER_TOLERANCE);
+        }
+    }
+}
+
+ZTEST_SUITE(ppg_filter, NULL, NULL, NULL, NULL, NULL);
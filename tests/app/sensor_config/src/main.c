@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/settings/settings.h>
+#include <zephyr/ztest.h>
+
+#include "sensor_config.h"
+
+// Time the system work queue gets to save a change
+#define CONFIG_SAVE_MS 100
+
+/** @brief Keys under "tgm/" as they are on the flash. */
+struct config_stored
+{
+    bool has_profile;
+    uint8_t profile;
+    uint8_t reg_count;
+    struct maxm86161_reg_value regs[SENSOR_CONFIG_MAX_PPG_REGS];
+    bool has_agc;
+    struct sensor_config_led agc[3];
+};
+
+// Configuration the previous boot left, the sleep profile, tuned LED amplitudes and the AGC drives
+static const struct config_stored boot_config = {
+    .has_profile = true,
+    .profile = 1,
+    .reg_count = 3,
+    .regs = {{0x23, 0x40}, {0x24, 0x20}, {0x25, 0x30}},
+    .has_agc = true,
+    .agc = {{0x30, 1}, {0x28, 2}, {0, 0}},
+};
+
+// Configuration sensor_config_init() loaded from it
+static struct config_stored loaded;
+
+static int config_read_key(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg, void *param)
+{
+    struct config_stored *stored = param;
+    const char *next;
+
+    if (settings_name_steq(key, "profile", &next) && !next && len == sizeof(stored->profile))
+    {
+        stored->has_profile = read_cb(cb_arg, &stored->profile, len) == (ssize_t)len;
+    }
+    else if (settings_name_steq(key, "ppg_regs", &next) && !next && len <= sizeof(stored->regs))
+    {
+        stored->reg_count = read_cb(cb_arg, stored->regs, len) == (ssize_t)len ? len / sizeof(stored->regs[0]) : 0;
+    }
+    else if (settings_name_steq(key, "agc", &next) && !next && len == sizeof(stored->agc))
+    {
+        stored->has_agc = read_cb(cb_arg, stored->agc, len) == (ssize_t)len;
+    }
+
+    return 0;
+}
+
+// Read the keys from the flash, as the next boot finds them
+static void config_read_flash(struct config_stored *stored)
+{
+    memset(stored, 0, sizeof(*stored));
+    zassert_ok(settings_load_subtree_direct("tgm", config_read_key, stored));
+}
+
+static void *config_setup(void)
+{
+    // The previous boot, its values must come back before any client connects
+    zassert_ok(settings_subsys_init());
+    zassert_ok(settings_save_one("tgm/profile", &boot_config.profile, sizeof(boot_config.profile)));
+    zassert_ok(
+        settings_save_one("tgm/ppg_regs", boot_config.regs, boot_config.reg_count * sizeof(boot_config.regs[0])));
+    zassert_ok(settings_save_one("tgm/agc", boot_config.agc, sizeof(boot_config.agc)));
+
+    zassert_ok(sensor_config_init());
+
+    loaded.has_profile = sensor_config_get_profile(&loaded.profile) == 0;
+    loaded.reg_count = sensor_config_get_ppg_regs(loaded.regs, ARRAY_SIZE(loaded.regs));
+    loaded.has_agc = sensor_config_get_agc(loaded.agc) == 0;
+
+    return NULL;
+}
+
+ZTEST(sensor_config, test_boot)
+{
+    zassert_true(loaded.has_profile, "no profile after the reboot");
+    zassert_equal(loaded.profile, boot_config.profile);
+    zassert_equal(loaded.reg_count, boot_config.reg_count, "%u PPG registers after the reboot", loaded.reg_count);
+    zassert_mem_equal(loaded.regs, boot_config.regs, boot_config.reg_count * sizeof(boot_config.regs[0]));
+    zassert_true(loaded.has_agc, "no AGC drives after the reboot");
+    zassert_mem_equal(loaded.agc, boot_config.agc, sizeof(boot_config.agc));
+}
+
+ZTEST(sensor_config, test_save)
+{
+    const struct sensor_config_led agc[3] = {{0x18, 0}, {0x40, 3}, {0x10, 1}};
+    const struct maxm86161_reg_value regs[] = {{0x0e, 0x02}, {0x23, 0x50}};
+    struct config_stored stored;
+
+    sensor_config_set_profile(2);
+    // Out of order, the registers are kept in increasing order of address
+    for (int i = ARRAY_SIZE(regs) - 1; i >= 0; i--)
+    {
+        zassert_ok(sensor_config_set_ppg_reg(regs[i].reg, regs[i].value));
+    }
+    sensor_config_set_agc(agc, true);
+    k_msleep(CONFIG_SAVE_MS);
+
+    config_read_flash(&stored);
+
+    zassert_true(stored.has_profile);
+    zassert_equal(stored.profile, 2);
+    zassert_true(stored.reg_count >= ARRAY_SIZE(regs), "%u PPG registers saved", stored.reg_count);
+    for (uint8_t i = 1; i < stored.reg_count; i++)
+    {
+        zassert_true(stored.regs[i - 1].reg < stored.regs[i].reg, "PPG registers saved out of order");
+    }
+    for (size_t i = 0; i < ARRAY_SIZE(regs); i++)
+    {
+        uint8_t j = 0;
+
+        while (j < stored.reg_count && stored.regs[j].reg != regs[i].reg)
+        {
+            j++;
+        }
+        zassert_true(j < stored.reg_count, "PPG register 0x%02x not saved", regs[i].reg);
+        zassert_equal(stored.regs[j].value, regs[i].value, "PPG register 0x%02x saved as 0x%02x", regs[i].reg,
+                      stored.regs[j].value);
+    }
+    zassert_true(stored.has_agc);
+    zassert_mem_equal(stored.agc, agc, sizeof(agc));
+}
+
+ZTEST(sensor_config, test_clear)
+{
+    const struct sensor_config_led agc[3] = {{0x20, 1}, {0x20, 1}, {0x20, 1}};
+    struct config_stored stored;
+    uint8_t profile;
+
+    sensor_config_set_profile(3);
+    zassert_ok(sensor_config_set_ppg_reg(0x24, 0x10));
+    sensor_config_set_agc(agc, true);
+    k_msleep(CONFIG_SAVE_MS);
+
+    // The registers and drives are gone from the flash too, the profile stays
+    sensor_config_clear_ppg();
+    k_msleep(CONFIG_SAVE_MS);
+
+    config_read_flash(&stored);
+
+    zassert_true(stored.has_profile);
+    zassert_equal(stored.profile, 3);
+    zassert_equal(stored.reg_count, 0, "%u PPG registers left", stored.reg_count);
+    zassert_false(stored.has_agc);
+
+    zassert_ok(sensor_config_get_profile(&profile));
+    zassert_equal(profile, 3);
+    zassert_equal(sensor_config_get_agc((struct sensor_config_led[3]){0}), -ENODATA);
+}
+
+ZTEST_SUITE(sensor_config, NULL, config_setup, NULL, NULL, NULL);
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/timing/timing.h>
+#include <zephyr/ztest.h>
+
+#include "stream_codec.h"
+
+#define CODEC_SAMPLES 500
+// A notification at the maximum ATT MTU, less the header of the compressed frame without the frame time
+#define CODEC_HEADER_SIZE 6
+#define CODEC_BLOCK_SIZE (244 - CODEC_HEADER_SIZE)
+// Bytes per sample of the legacy frames, struct ppg_sample and struct acc_sample
+#define CODEC_PPG_LEGACY_SIZE 12
+#define CODEC_ACC_LEGACY_SIZE 6
+
+static const struct stream_codec_layout ppg_layout = {.channels = 3, .bits = 19};
+static const struct stream_codec_layout acc_layout = {.channels = 3, .bits = 16, .is_signed = true};
+
+static const double pi = 3.14159265358979323846;
+
+static int32_t recording[CODEC_SAMPLES * 3];
+static int32_t decoded[UINT8_MAX * 3];
+static uint8_t block[CODEC_BLOCK_SIZE];
+static uint32_t noise;
+
+static uint32_t codec_noise(void)
+{
+    noise = noise * 1664525 + 1013904223;
+    return noise;
+}
+
+// Pulse at 72bpm on the DC level of every channel at 100Hz, with a little noise
+static void codec_record_ppg(void)
+{
+    static const uint32_t dc[] = {150000, 220000, 90000};
+
+    for (uint16_t n = 0; n < CODEC_SAMPLES; n++)
+    {
+        double t = n / 100.0;
+
+        for (uint8_t channel = 0; channel < 3; channel++)
+        {
+            recording[n * 3 + channel] = (int32_t)lround(dc[channel] + 2000 * sin(2 * pi * 1.2 * t)) +
+                                         (codec_noise() >> 24);
+        }
+    }
+}
+
+// Gravity and some jaw movement at 100Hz, 16384 counts per g
+static void codec_record_acc(void)
+{
+    static const int32_t gravity[] = {0, 4915, 15565};
+
+    for (uint16_t n = 0; n < CODEC_SAMPLES; n++)
+    {
+        double t = n / 100.0;
+
+        for (uint8_t axis = 0; axis < 3; axis++)
+        {
+            recording[n * 3 + axis] = gravity[axis] + (int32_t)lround(1600 * sin(2 * pi * (0.8 + 0.6 * axis) * t)) +
+                                      (int32_t)(codec_noise() >> 26) - 32;
+        }
+    }
+}
+
+/**
+ * @brief Encode the recording block by block, as the notification path does, and decode every block again
+ *
+ * @return uint32_t Compression ratio against the legacy frames in 0.01
+ */
+static uint32_t codec_stream(const char *name, const struct stream_codec_layout *layout, uint16_t count,
+                             size_t legacy_size)
+{
+    const uint8_t channels = layout->channels;
+    uint64_t encode_cycles = 0;
+    uint64_t decode_cycles = 0;
+    size_t encoded_size = 0;
+    uint16_t blocks = 0;
+
+    timing_init();
+    timing_start();
+
+    for (uint16_t i = 0; i < count;)
+    {
+        const int32_t *samples = &recording[i * channels];
+        size_t len;
+        uint8_t format;
+
+        timing_t start = timing_counter_get();
+        uint16_t n = stream_codec_encode(layout, samples, MIN(count - i, UINT8_MAX), block, sizeof(block), &len,
+                                         &format);
+        timing_t end = timing_counter_get();
+        encode_cycles += timing_cycles_get(&start, &end);
+
+        zassert_not_equal(n, 0, "%s: no sample fits a %zu byte block", name, sizeof(block));
+        zassert_true(len <= sizeof(block), "%s: block %u overflows", name, blocks);
+
+        start = timing_counter_get();
+        int err = stream_codec_decode(layout, format, block, len, n, decoded);
+        end = timing_counter_get();
+        decode_cycles += timing_cycles_get(&start, &end);
+
+        zassert_ok(err, "%s: block %u (format %u, %u samples) does not decode", name, blocks, format, n);
+        zassert_mem_equal(decoded, samples, n * channels * sizeof(int32_t),
+                          "%s: block %u (format %u, %u samples) does not decode to the recording", name, blocks,
+                          format, n);
+
+        encoded_size += CODEC_HEADER_SIZE + len;
+        blocks++;
+        i += n;
+    }
+
+    timing_stop();
+
+    uint32_t ratio = (uint32_t)(count * legacy_size * 100 / encoded_size);
+
+    TC_PRINT("%s: %u samples in %u blocks, %zu -> %zu bytes, ratio %u.%02u, %u/%u encode/decode cycles per sample\n",
+             name, count, blocks, count * legacy_size, encoded_size, ratio / 100, ratio % 100,
+             (uint32_t)(encode_cycles / count), (uint32_t)(decode_cycles / count));
+
+    return ratio;
+}
+
+// Samples a packed block of CODEC_BLOCK_SIZE holds
+static uint16_t codec_packed_samples(const struct stream_codec_layout *layout)
+{
+    return CODEC_BLOCK_SIZE * 8 / (layout->channels * layout->bits);
+}
+
+// Ratio of the recording in full packed blocks, in 0.01
+static uint32_t codec_packed_ratio(const struct stream_codec_layout *layout, size_t legacy_size)
+{
+    uint16_t blocks = DIV_ROUND_UP(CODEC_SAMPLES, codec_packed_samples(layout));
+
+    return (uint32_t)(CODEC_SAMPLES * legacy_size * 100 / (blocks * (CODEC_HEADER_SIZE + CODEC_BLOCK_SIZE)));
+}
+
+static void codec_before(void *fixture)
+{
+    ARG_UNUSED(fixture);
+    noise = 1;
+}
+
+ZTEST(stream_codec, test_ppg)
+{
+    codec_record_ppg();
+    uint32_t ratio = codec_stream("ppg codec", &ppg_layout, CODEC_SAMPLES, CODEC_PPG_LEGACY_SIZE);
+
+    // The differences of a pulse compress better than the packed values
+    zassert_true(ratio > codec_packed_ratio(&ppg_layout, CODEC_PPG_LEGACY_SIZE),
+                 "ppg codec: ratio %u.%02u not above the packed format", ratio / 100, ratio % 100);
+}
+
+ZTEST(stream_codec, test_acc)
+{
+    codec_record_acc();
+    uint32_t ratio = codec_stream("acc codec", &acc_layout, CODEC_SAMPLES, CODEC_ACC_LEGACY_SIZE);
+
+    zassert_true(ratio > codec_packed_ratio(&acc_layout, CODEC_ACC_LEGACY_SIZE),
+                 "acc codec: ratio %u.%02u not above the packed format", ratio / 100, ratio % 100);
+}
+
+ZTEST(stream_codec, test_packed_fallback)
+{
+    size_t len;
+    uint8_t format;
+
+    // Full scale noise does not compress, the block holds as many samples as a packed one
+    for (uint16_t i = 0; i < CODEC_SAMPLES * 3; i++)
+    {
+        recording[i] = codec_noise() >> (32 - ppg_layout.bits);
+    }
+
+    uint16_t n = stream_codec_encode(&ppg_layout, recording, CODEC_SAMPLES, block, sizeof(block), &len, &format);
+
+    zassert_equal(format, STREAM_CODEC_FORMAT_PACKED);
+    zassert_equal(n, codec_packed_samples(&ppg_layout));
+    codec_stream("ppg noise", &ppg_layout, CODEC_SAMPLES, CODEC_PPG_LEGACY_SIZE);
+}
+
+ZTEST(stream_codec, test_escape)
+{
+    // Steps over the full signed range take the escape of the Rice code, next to small differences
+    for (uint16_t n = 0; n < CODEC_SAMPLES; n++)
+    {
+        recording[n * 3] = (n & 1) ? INT16_MAX : INT16_MIN;
+        recording[n * 3 + 1] = (n % 16 == 0) ? INT16_MIN : (int32_t)n;
+        recording[n * 3 + 2] = -(int32_t)n;
+    }
+
+    codec_stream("acc escape", &acc_layout, CODEC_SAMPLES, CODEC_ACC_LEGACY_SIZE);
+}
+
+ZTEST(stream_codec, test_small_block)
+{
+    size_t len;
+    uint8_t format;
+
+    codec_record_ppg();
+
+    // One packed sample takes 57 bits
+    zassert_equal(stream_codec_encode(&ppg_layout, recording, CODEC_SAMPLES, block, 7, &len, &format), 0);
+    zassert_equal(stream_codec_encode(&ppg_layout, recording, CODEC_SAMPLES, block, 8, &len, &format), 1);
+    zassert_ok(stream_codec_decode(&ppg_layout, format, block, len, 1, decoded));
+    zassert_mem_equal(decoded, recording, 3 * sizeof(int32_t));
+
+    // A block shorter than the sample count is rejected
+    zassert_equal(stream_codec_decode(&ppg_layout, format, block, len, 2, decoded), -EINVAL);
+}
+
+ZTEST_SUITE(stream_codec, NULL, NULL, codec_before, NULL, NULL);
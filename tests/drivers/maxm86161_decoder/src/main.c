@@ -0,0 +1,148 @@
+/*
+ * Copyright (c) 2024 WeeGee bv
+ */
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/timing/timing.h>
+#include <zephyr/ztest.h>
+
+#include <app/drivers/maxm86161.h>
+
+#define DECODER_ITERATIONS 16
+// Cycles a full FIFO may take to decode for any of the LED sequences, only meaningful on the hardware
+#define DECODER_BUDGET_CYCLES 4000
+// Split point for the partial sample check, deliberately not a multiple of any sequence length
+#define DECODER_SPLIT_WORDS 37
+
+// LED sequences to check, the expected LEDC code per channel is encoded in every word
+static const uint8_t decoder_sequences[][3] = {
+	{0x23, 0x01, 0x00}, // red, IR, green (application default)
+	{0x21, 0x03, 0x00}, // green, IR, red
+	{0x93, 0x12, 0x00}, // red, ambient, IR, green
+	{0x32, 0x00, 0x00}, // IR, red
+	{0x71, 0x2c, 0x03}, // green, all LEDs, LED6, IR, red
+};
+
+static uint8_t fifo[MAXM86161_FIFO_DEPTH * MAXM86161_FIFO_WORD_SIZE];
+static struct ppg_sample samples[MAXM86161_FIFO_DEPTH];
+static struct ppg_sample split_samples[MAXM86161_FIFO_DEPTH];
+
+/**
+ * @brief Fill the FIFO with words whose value encodes the LEDC code and the word index
+ */
+static void decoder_fill_fifo(const uint8_t led_seq[3], uint8_t slots)
+{
+	for (uint32_t i = 0; i < MAXM86161_FIFO_DEPTH; i++)
+	{
+		uint8_t slot = i % slots;
+		uint8_t ledc = (slot & 1) ? (led_seq[slot / 2] >> 4) : (led_seq[slot / 2] & 0x0f);
+		uint32_t word = ((uint32_t)(MAXM86161_TAG_LEDC1 + slot) << 19) | ((uint32_t)ledc << 15) | (i & 0x7fff);
+
+		fifo[i * 3] = word >> 16;
+		fifo[i * 3 + 1] = word >> 8;
+		fifo[i * 3 + 2] = word;
+	}
+}
+
+static void decoder_check_channel(const uint8_t led_seq[3], uint8_t i, uint32_t value, uint8_t expected_ledc,
+								  bool present)
+{
+	zassert_true(!present || (value >> 15) == expected_ledc,
+				 "Sequence %02x %02x %02x: channel mix-up in sample %u", led_seq[0], led_seq[1], led_seq[2], i);
+}
+
+ZTEST(maxm86161_decoder, test_channels)
+{
+	struct maxm86161_decoder decoder;
+
+	for (size_t s = 0; s < ARRAY_SIZE(decoder_sequences); s++)
+	{
+		const uint8_t *led_seq = decoder_sequences[s];
+
+		maxm86161_decoder_init(&decoder, led_seq);
+		zassert_not_equal(decoder.slot_count, 0, "Sequence %02x %02x %02x: no slots", led_seq[0], led_seq[1],
+						  led_seq[2]);
+
+		decoder_fill_fifo(led_seq, decoder.slot_count);
+		uint8_t count = maxm86161_decode(&decoder, fifo, MAXM86161_FIFO_DEPTH, samples, ARRAY_SIZE(samples));
+
+		zassert_equal(count, MAXM86161_FIFO_DEPTH / decoder.slot_count, "Sequence %02x %02x %02x: %u samples decoded",
+					  led_seq[0], led_seq[1], led_seq[2], count);
+
+		for (uint8_t i = 0; i < count; i++)
+		{
+			decoder_check_channel(led_seq, i, samples[i].red, MAXM86161_LEDC_LED3, decoder.full_mask & BIT(0));
+			decoder_check_channel(led_seq, i, samples[i].ir, MAXM86161_LEDC_LED2, decoder.full_mask & BIT(1));
+			decoder_check_channel(led_seq, i, samples[i].green, MAXM86161_LEDC_LED1, decoder.full_mask & BIT(2));
+		}
+	}
+}
+
+ZTEST(maxm86161_decoder, test_split_sample)
+{
+	struct maxm86161_decoder decoder;
+
+	for (size_t s = 0; s < ARRAY_SIZE(decoder_sequences); s++)
+	{
+		const uint8_t *led_seq = decoder_sequences[s];
+
+		maxm86161_decoder_init(&decoder, led_seq);
+		decoder_fill_fifo(led_seq, decoder.slot_count);
+		uint8_t count = maxm86161_decode(&decoder, fifo, MAXM86161_FIFO_DEPTH, samples, ARRAY_SIZE(samples));
+
+		// Decoding in two drains that split a sample must give the same result
+		maxm86161_decoder_init(&decoder, led_seq);
+		uint8_t split_count =
+			maxm86161_decode(&decoder, fifo, DECODER_SPLIT_WORDS, split_samples, ARRAY_SIZE(split_samples));
+		split_count += maxm86161_decode(&decoder, &fifo[DECODER_SPLIT_WORDS * MAXM86161_FIFO_WORD_SIZE],
+										MAXM86161_FIFO_DEPTH - DECODER_SPLIT_WORDS, &split_samples[split_count],
+										ARRAY_SIZE(split_samples) - split_count);
+
+		zassert_equal(split_count, count, "Sequence %02x %02x %02x: %u samples over two drains", led_seq[0],
+					  led_seq[1], led_seq[2], split_count);
+		zassert_mem_equal(split_samples, samples, count * sizeof(struct ppg_sample),
+						  "Sequence %02x %02x %02x: partial sample not carried over", led_seq[0], led_seq[1],
+						  led_seq[2]);
+	}
+}
+
+ZTEST(maxm86161_decoder, test_budget)
+{
+	struct maxm86161_decoder decoder;
+
+	timing_init();
+	timing_start();
+
+	for (size_t s = 0; s < ARRAY_SIZE(decoder_sequences); s++)
+	{
+		const uint8_t *led_seq = decoder_sequences[s];
+		uint32_t best_cycles = UINT32_MAX;
+
+		maxm86161_decoder_init(&decoder, led_seq);
+		decoder_fill_fifo(led_seq, decoder.slot_count);
+
+		for (int i = 0; i < DECODER_ITERATIONS; i++)
+		{
+			maxm86161_decoder_init(&decoder, led_seq);
+
+			timing_t start = timing_counter_get();
+			maxm86161_decode(&decoder, fifo, MAXM86161_FIFO_DEPTH, samples, ARRAY_SIZE(samples));
+			timing_t end = timing_counter_get();
+
+			best_cycles = MIN(best_cycles, (uint32_t)timing_cycles_get(&start, &end));
+		}
+
+		TC_PRINT("Sequence %02x %02x %02x: %u cycles per %u-word FIFO\n", led_seq[0], led_seq[1], led_seq[2],
+				 best_cycles, MAXM86161_FIFO_DEPTH);
+
+		// The budget applies to the slowest sequence
+		zassert_true(best_cycles <= DECODER_BUDGET_CYCLES, "Sequence %02x %02x %02x: %u cycles, budget %u",
+					 led_seq[0], led_seq[1], led_seq[2], best_cycles, DECODER_BUDGET_CYCLES);
+	}
+
+	timing_stop();
+}
+
+ZTEST_SUITE(maxm86161_decoder, NULL, NULL, NULL, NULL, NULL);